@@ -21,6 +21,7 @@
 // out of Kudu into a fork known as kuduraft.
 // ********************************************************************
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
@@ -41,6 +42,7 @@
 #include "kudu/consensus/log.h"
 #include "kudu/consensus/opid_util.h"
 #include "kudu/consensus/raft_consensus.h"
+#include "kudu/consensus/snapshot_provider.h"
 #include "kudu/gutil/map-util.h"
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/rpc/messenger.h"
@@ -699,6 +701,61 @@ class TestDriver {
   log::Log* log_;
 };
 
+// A snapshot provider for tests which keeps the snapshots a follower
+// receives in memory, and records the last one installed.
+class TestSnapshotProvider : public SnapshotProvider {
+ public:
+  Status OpenSnapshot(std::shared_ptr<SnapshotSource>* /*source*/) override {
+    return Status::NotSupported("test provider only receives snapshots");
+  }
+
+  Status OpenSink(const OpId& last_included,
+                  uint64_t /*size*/,
+                  std::shared_ptr<SnapshotSink>* sink) override {
+    sink->reset(new Sink(this, last_included));
+    return Status::OK();
+  }
+
+  // The id of the last op covered by the last installed snapshot, or
+  // MinimumOpId() if none was installed.
+  OpId installed_opid() const {
+    std::lock_guard<simple_spinlock> l(lock_);
+    return installed_opid_;
+  }
+
+ private:
+  class Sink : public SnapshotSink {
+   public:
+    Sink(TestSnapshotProvider* provider, OpId last_included)
+        : provider_(provider),
+          last_included_(std::move(last_included)) {
+    }
+
+    uint64_t size() const override {
+      return data_.size();
+    }
+
+    Status Append(const Slice& data) override {
+      data_.append(data.ToString());
+      return Status::OK();
+    }
+
+    Status Install() override {
+      std::lock_guard<simple_spinlock> l(provider_->lock_);
+      provider_->installed_opid_ = last_included_;
+      return Status::OK();
+    }
+
+   private:
+    TestSnapshotProvider* const provider_;
+    const OpId last_included_;
+    std::string data_;
+  };
+
+  mutable simple_spinlock lock_;
+  OpId installed_opid_ = MinimumOpId();
+};
+
 // A transaction factory for tests, usually this is implemented by TabletReplica.
 class TestTransactionFactory : public ConsensusRoundHandler {
  public:
@@ -713,7 +770,25 @@ class TestTransactionFactory : public ConsensusRoundHandler {
     consensus_ = consensus;
   }
 
+  // Sets a function called whenever a follower transaction is started, e.g.
+  // to change the replica's state meanwhile.
+  void SetStartFollowerTransactionHook(std::function<void()> hook) {
+    start_follower_transaction_hook_ = std::move(hook);
+  }
+
+  void SetSnapshotProvider(SnapshotProvider* snapshot_provider) {
+    snapshot_provider_ = snapshot_provider;
+  }
+
+  SnapshotProvider* snapshot_provider() override {
+    return snapshot_provider_;
+  }
+
   Status StartFollowerTransaction(const scoped_refptr<ConsensusRound>& round) override {
+    num_follower_transactions_started_++;
+    if (start_follower_transaction_hook_) {
+      start_follower_transaction_hook_();
+    }
     auto txn = new TestDriver(pool_.get(), log_, round);
     txn->round_->SetConsensusReplicatedCallback(std::bind(
         &TestDriver::ReplicationFinished,
@@ -736,6 +811,10 @@ class TestTransactionFactory : public ConsensusRoundHandler {
     pool_->Wait();
   }
 
+  int num_follower_transactions_started() const {
+    return num_follower_transactions_started_;
+  }
+
   void ShutDown() {
     WaitDone();
     pool_->Shutdown();
@@ -749,6 +828,9 @@ class TestTransactionFactory : public ConsensusRoundHandler {
   gscoped_ptr<ThreadPool> pool_;
   RaftConsensus* consensus_;
   log::Log* log_;
+  SnapshotProvider* snapshot_provider_ = nullptr;
+  std::atomic<int> num_follower_transactions_started_{0};
+  std::function<void()> start_follower_transaction_hook_;
 };
 
 }  // namespace consensus
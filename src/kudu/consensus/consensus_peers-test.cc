@@ -21,11 +21,13 @@
 // out of Kudu into a fork known as kuduraft.
 // ********************************************************************
 
+#include <atomic>
 #include <cstddef>
 #include <memory>
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -45,6 +47,7 @@
 #include "kudu/consensus/metadata.pb.h"
 #include "kudu/consensus/opid.pb.h"
 #include "kudu/consensus/opid_util.h"
+#include "kudu/consensus/ref_counted_replicate.h"
 #include "kudu/consensus/time_manager.h"
 #include "kudu/fs/fs_manager.h"
 #include "kudu/gutil/gscoped_ptr.h"
@@ -72,11 +75,75 @@ using rpc::MessengerBuilder;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+using std::weak_ptr;
 
 const char* kTabletId = "test-peers-tablet";
 const char* kLeaderUuid = "peer-0";
 const char* kFollowerUuid = "peer-1";
 
+// Stands in for the relay of a peer's region: fills in the ops of the requests
+// relayed through it from the leader's queue, as the relay would from its own
+// log, and forwards them to the peer.
+class RelayTestPeerProxy : public TestPeerProxy {
+ public:
+  RelayTestPeerProxy(ThreadPool* pool, PeerMessageQueue* queue, RaftPeerPB dest_pb)
+    : TestPeerProxy(pool),
+      queue_(queue),
+      dest_(pool, std::move(dest_pb)),
+      relayed_requests_(0) {
+  }
+
+  void UpdateAsync(const ConsensusRequestPB* request,
+                   ConsensusResponsePB* response,
+                   rpc::RpcController* controller,
+                   const rpc::ResponseCallback& callback) override {
+    CHECK(request->has_relay_dest_uuid());
+    CHECK_EQ(0, request->ops_size());
+    vector<ReplicateRefPtr> ops;
+    CHECK_OK(queue_->ReadOpsForRelay(request->preceding_id(),
+                                     request->relay_last_op_id(),
+                                     &ops));
+    ConsensusRequestPB relayed(*request);
+    relayed.set_dest_uuid(request->relay_dest_uuid());
+    relayed.clear_relay_dest_uuid();
+    relayed.clear_relay_last_op_id();
+    for (const auto& op : ops) {
+      relayed.add_ops()->CopyFrom(*op->get());
+    }
+    relayed_requests_++;
+    // The peer responds before this returns, so 'relayed' needn't outlive it.
+    dest_.UpdateAsync(&relayed, response, controller, callback);
+  }
+
+  Status StartElection(const RunLeaderElectionRequestPB* /*request*/,
+                       RunLeaderElectionResponsePB* /*response*/,
+                       rpc::RpcController* /*controller*/) override {
+    return Status::OK();
+  }
+
+  void RequestConsensusVoteAsync(const VoteRequestPB* request,
+                                 VoteResponsePB* response,
+                                 rpc::RpcController* controller,
+                                 const rpc::ResponseCallback& callback) override {
+    dest_.RequestConsensusVoteAsync(request, response, controller, callback);
+  }
+
+  // The last op the peer received.
+  OpId dest_last_received() {
+    return dest_.last_received();
+  }
+
+  int relayed_requests() const {
+    return relayed_requests_;
+  }
+
+ private:
+  PeerMessageQueue* const queue_;
+  NoOpTestPeerProxy dest_;
+  std::atomic<int> relayed_requests_;
+};
+
 class ConsensusPeersTest : public KuduTest {
  public:
   ConsensusPeersTest()
@@ -148,6 +215,8 @@ class ConsensusPeersTest : public KuduTest {
                                  raft_pool_token_.get(),
                                  std::move(proxy),
                                  messenger_,
+                                 nullptr,
+                                 nullptr,
                                  peer));
     return proxy_ptr;
   }
@@ -287,6 +356,8 @@ TEST_F(ConsensusPeersTest, TestCloseWhenRemotePeerDoesntMakeProgress) {
                                 raft_pool_token_.get(),
                                 gscoped_ptr<PeerProxy>(mock_proxy),
                                 messenger_,
+                                nullptr,
+                                nullptr,
                                 &peer));
 
   // Make the peer respond without making any progress -- it always returns
@@ -325,6 +396,8 @@ TEST_F(ConsensusPeersTest, TestDontSendOneRpcPerWriteWhenPeerIsDown) {
                                 raft_pool_token_.get(),
                                 gscoped_ptr<PeerProxy>(mock_proxy),
                                 messenger_,
+                                nullptr,
+                                nullptr,
                                 &peer));
 
   // Initial response has to be successful -- otherwise we'll consider the peer
@@ -369,6 +442,72 @@ TEST_F(ConsensusPeersTest, TestDontSendOneRpcPerWriteWhenPeerIsDown) {
   ASSERT_LT(mock_proxy->update_count(), 5);
 }
 
+// Test that the ops of a peer with a relay are sent through the relay, once
+// the relay has them.
+TEST_F(ConsensusPeersTest, TestRelayedPeer) {
+  message_queue_->SetLeaderMode(kMinimumOpIdIndex,
+                                kMinimumTerm,
+                                BuildRaftConfigPBForTests(3));
+
+  shared_ptr<Peer> relay;
+  DelayablePeerProxy<NoOpTestPeerProxy>* relay_proxy = NewRemotePeer("peer-1", &relay);
+  AppendReplicateMessagesToQueue(message_queue_.get(), clock_, 1, 20);
+  const OpId last = message_queue_->GetLastOpIdInLog();
+  relay->SignalRequest();
+  WaitForCommitIndex(last.index());
+  CheckLastRemoteEntry(relay_proxy, last.term(), last.index());
+
+  // Hold the response to the first request to the peer, so that the relay is
+  // in place before any ops are sent to it.
+  RaftPeerPB peer_pb = FakeRaftPeerPB("peer-2");
+  auto direct_proxy = new DelayablePeerProxy<NoOpTestPeerProxy>(
+      raft_pool_.get(), new NoOpTestPeerProxy(raft_pool_.get(), peer_pb));
+  direct_proxy->DelayResponse();
+  shared_ptr<Peer> peer;
+  ASSERT_OK(Peer::NewRemotePeer(peer_pb,
+                                kTabletId,
+                                kLeaderUuid,
+                                message_queue_.get(),
+                                raft_pool_token_.get(),
+                                gscoped_ptr<PeerProxy>(direct_proxy),
+                                messenger_,
+                                nullptr,
+                                nullptr,
+                                &peer));
+  auto relaying_proxy = new RelayTestPeerProxy(raft_pool_.get(), message_queue_.get(), peer_pb);
+  peer->SetRelay("peer-1", gscoped_ptr<PeerProxy>(relaying_proxy));
+  relay->SetRelayedPeers(vector<weak_ptr<Peer>>{ peer });
+  direct_proxy->Respond(TestPeerProxy::kUpdate);
+
+  peer->SignalRequest();
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_OPID_EQ(last, relaying_proxy->dest_last_received());
+  });
+  ASSERT_GT(relaying_proxy->relayed_requests(), 0);
+  // None of the ops were sent directly.
+  ASSERT_OPID_EQ(MinimumOpId(), direct_proxy->proxy()->last_received());
+
+  peer->Close();
+  relay->Close();
+}
+
+// Snapshot chunks are capped so that they fit the rate limit.
+TEST(SnapshotThrottlerTest, TestChunksFitTheRate) {
+  SnapshotThrottler unlimited(0);
+  ASSERT_EQ(1024 * 1024, unlimited.MaxChunkSize(1024 * 1024));
+  ASSERT_TRUE(unlimited.Take(1024 * 1024));
+
+  SnapshotThrottler throttler(10000);
+  ASSERT_EQ(10000, throttler.MaxChunkSize(1024 * 1024));
+  ASSERT_EQ(100, throttler.MaxChunkSize(100));
+  // A full chunk is let through once a second's worth has accumulated, and
+  // the next one has to wait.
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_TRUE(throttler.Take(10000));
+  });
+  ASSERT_FALSE(throttler.Take(10000));
+}
+
 }  // namespace consensus
 }  // namespace kudu
 
@@ -44,17 +44,27 @@
 #include "kudu/consensus/consensus_queue.h"
 #include "kudu/consensus/metadata.pb.h"
 #include "kudu/consensus/opid_util.h"
+#include "kudu/consensus/ops_compression.h"
+#include "kudu/consensus/replication_trace.h"
+#include "kudu/consensus/snapshot_provider.h"
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/macros.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/strings/substitute.h"
+#include "kudu/rpc/messenger.h"
 #include "kudu/rpc/periodic.h"
 #include "kudu/rpc/response_callback.h"
 #include "kudu/rpc/rpc_controller.h"
+#include "kudu/rpc/rpc_header.pb.h"
+#include "kudu/rpc/rpc_sidecar.h"
 #ifdef FB_DO_NOT_REMOVE
 #include "kudu/tserver/tserver.pb.h"
 #endif
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/crc.h"
 #include "kudu/util/fault_injection.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/flag_tags.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/monotime.h"
@@ -63,6 +73,7 @@
 #include "kudu/util/pb_util.h"
 #include "kudu/util/status.h"
 #include "kudu/util/threadpool.h"
+#include "kudu/util/throttler.h"
 
 DEFINE_int32(consensus_rpc_timeout_ms, 30000,
              "Timeout used for all consensus internal RPC communications.");
@@ -91,15 +102,46 @@ DEFINE_bool(enable_tablet_copy, true,
             "replica. For testing purposes only.");
 TAG_FLAG(enable_tablet_copy, unsafe);
 
+DEFINE_string(consensus_ops_compression_codec, "LZ4",
+              "Codec used to compress the ops sent to peers which support it. "
+              "'none' sends them uncompressed.");
+TAG_FLAG(consensus_ops_compression_codec, experimental);
+
+DEFINE_int32(consensus_ops_compression_min_bytes, 4096,
+             "Requests whose ops take less than this many bytes are sent "
+             "uncompressed.");
+TAG_FLAG(consensus_ops_compression_min_bytes, experimental);
+
+DEFINE_int32(raft_snapshot_chunk_size_bytes, 1024 * 1024,
+             "Size of the chunks in which snapshots are sent to followers which "
+             "can't be caught up from the leader's log.");
+TAG_FLAG(raft_snapshot_chunk_size_bytes, advanced);
+
+DEFINE_int64(raft_snapshot_transfer_rate_limit_bytes, 64 * 1024 * 1024,
+             "Maximum number of bytes per second sent in snapshots to followers "
+             "by the leader of a tablet, so that snapshot transfers don't starve "
+             "replication. 0 disables the limit. Read when the replica becomes "
+             "leader.");
+TAG_FLAG(raft_snapshot_transfer_rate_limit_bytes, advanced);
+TAG_FLAG(raft_snapshot_transfer_rate_limit_bytes, runtime);
+
+DEFINE_int32(raft_relay_retry_interval_ms, 10000,
+             "After ops sent to a peer through a relay in its region fail to "
+             "reach it, the number of milliseconds during which ops are sent to "
+             "the peer directly before trying the relay again.");
+TAG_FLAG(raft_relay_retry_interval_ms, advanced);
+
 DECLARE_int32(raft_heartbeat_interval_ms);
 
 using kudu::pb_util::SecureShortDebugString;
 using kudu::rpc::Messenger;
 using kudu::rpc::PeriodicTimer;
 using kudu::rpc::RpcController;
+using kudu::rpc::RpcSidecar;
 //using kudu::tserver::TabletServerErrorPB;
 using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 using std::weak_ptr;
 using strings::Substitute;
@@ -108,6 +150,19 @@ using strings::Substitute;
 namespace kudu {
 namespace consensus {
 
+SnapshotThrottler::SnapshotThrottler(uint64_t bytes_per_sec)
+    : bytes_per_sec_(bytes_per_sec),
+      throttler_(MonoTime::Now(), 0, bytes_per_sec, 10.0) {
+}
+
+uint64_t SnapshotThrottler::MaxChunkSize(uint64_t chunk_size) const {
+  return bytes_per_sec_ > 0 ? std::min(chunk_size, bytes_per_sec_) : chunk_size;
+}
+
+bool SnapshotThrottler::Take(uint64_t bytes) {
+  return throttler_.Take(MonoTime::Now(), 0, bytes);
+}
+
 Status Peer::NewRemotePeer(RaftPeerPB peer_pb,
                            string tablet_id,
                            string leader_uuid,
@@ -115,6 +170,8 @@ Status Peer::NewRemotePeer(RaftPeerPB peer_pb,
                            ThreadPoolToken* raft_pool_token,
                            gscoped_ptr<PeerProxy> proxy,
                            shared_ptr<Messenger> messenger,
+                           SnapshotProvider* snapshot_provider,
+                           shared_ptr<SnapshotThrottler> snapshot_throttler,
                            shared_ptr<Peer>* peer) {
 
   shared_ptr<Peer> new_peer(new Peer(std::move(peer_pb),
@@ -123,7 +180,9 @@ Status Peer::NewRemotePeer(RaftPeerPB peer_pb,
                                      queue,
                                      raft_pool_token,
                                      std::move(proxy),
-                                     std::move(messenger)));
+                                     std::move(messenger),
+                                     snapshot_provider,
+                                     std::move(snapshot_throttler)));
   RETURN_NOT_OK(new_peer->Init());
   *peer = std::move(new_peer);
   return Status::OK();
@@ -135,18 +194,30 @@ Peer::Peer(RaftPeerPB peer_pb,
            PeerMessageQueue* queue,
            ThreadPoolToken* raft_pool_token,
            gscoped_ptr<PeerProxy> proxy,
-           shared_ptr<Messenger> messenger)
+           shared_ptr<Messenger> messenger,
+           SnapshotProvider* snapshot_provider,
+           shared_ptr<SnapshotThrottler> snapshot_throttler)
     : tablet_id_(std::move(tablet_id)),
       leader_uuid_(std::move(leader_uuid)),
       peer_pb_(std::move(peer_pb)),
       proxy_(std::move(proxy)),
       queue_(queue),
       failed_attempts_(0),
+      snapshot_provider_(snapshot_provider),
+      snapshot_throttler_(std::move(snapshot_throttler)),
       messenger_(std::move(messenger)),
       raft_pool_token_(raft_pool_token) {
 }
 
 Status Peer::Init() {
+  if (proxy_->SupportsCompressedOps()) {
+    auto codec_type = GetCompressionCodecType(FLAGS_consensus_ops_compression_codec);
+    if (codec_type != NO_COMPRESSION) {
+      RETURN_NOT_OK_PREPEND(GetCompressionCodec(codec_type, &ops_codec_),
+                            "could not instantiate compression codec");
+    }
+  }
+
   {
     std::lock_guard<simple_spinlock> l(peer_lock_);
     queue_->TrackPeer(peer_pb_);
@@ -224,6 +295,17 @@ void Peer::SendNextRequest(bool even_if_queue_empty) {
     return;
   }
 
+  // Nothing else is sent to the peer until the snapshot it is being sent is
+  // installed.
+  if (snapshot_source_) {
+    SendNextSnapshotChunk(std::move(l));
+    return;
+  }
+
+  // The queue releases the ops of the last request, so they must be back in
+  // place.
+  RestoreRequestOpsUnlocked();
+
   // The peer has no pending request nor is sending: send the request.
   bool needs_tablet_copy = false;
   int64_t commit_index_before = request_.has_committed_index() ?
@@ -235,6 +317,12 @@ void Peer::SendNextRequest(bool even_if_queue_empty) {
 
   if (PREDICT_FALSE(!s.ok())) {
     VLOG_WITH_PREFIX_UNLOCKED(1) << s.ToString();
+    // If the ops the peer needs were garbage collected, it can only be caught
+    // up with a snapshot.
+    if (s.IsNotFound() && snapshot_provider_ != nullptr &&
+        queue_->GetSnapshotRequestForPeer(peer_pb_.permanent_uuid(), &snapshot_request_).ok()) {
+      SendNextSnapshotChunk(std::move(l));
+    }
     return;
   }
 
@@ -264,6 +352,13 @@ void Peer::SendNextRequest(bool even_if_queue_empty) {
   request_.set_caller_uuid(leader_uuid_);
   request_.set_dest_uuid(peer_pb_.permanent_uuid());
 
+  bool relay;
+  if (!MaybeTrimOpsForRelayUnlocked(even_if_queue_empty,
+                                    commit_index_after > commit_index_before,
+                                    &relay)) {
+    return;
+  }
+
   bool req_has_ops = request_.ops_size() > 0 || (commit_index_after > commit_index_before);
   // If the queue is empty, check if we were told to send a status-only
   // message, if not just return.
@@ -274,24 +369,340 @@ void Peer::SendNextRequest(bool even_if_queue_empty) {
   if (req_has_ops) {
     // If we're actually sending ops there's no need to heartbeat for a while.
     heartbeater_->Snooze();
+
+    ReplicationTrace* trace = ReplicationTrace::GetSingleton();
+    for (const auto& op : request_.ops()) {
+      trace->Record(ReplicationStage::kPeerSend, op.id());
+    }
   }
 
   MAYBE_FAULT(FLAGS_fault_crash_on_leader_request_fraction);
 
+  shared_ptr<PeerProxy> relay_proxy;
+  if (relay) {
+    // The relay fills in the ops from its own log.
+    DCHECK_EQ(0, uncompressed_ops_.size());
+    *request_.mutable_relay_last_op_id() = request_.ops(request_.ops_size() - 1).id();
+    request_.set_relay_dest_uuid(peer_pb_.permanent_uuid());
+    request_.set_dest_uuid(relay_uuid_);
+    uncompressed_ops_.Swap(request_.mutable_ops());
+    relay_proxy = relay_proxy_;
+  } else {
+    MaybeCompressOpsUnlocked();
+  }
 
   VLOG_WITH_PREFIX_UNLOCKED(2) << "Sending to peer " << peer_pb().permanent_uuid() << ": "
       << SecureShortDebugString(request_);
   controller_.Reset();
+  if (request_.has_compressed_ops()) {
+    // A peer which doesn't know about compressed ops would otherwise take
+    // the request for a heartbeat.
+    controller_.RequireServerFeature(COMPRESSED_OPS);
+  }
+  if (relay) {
+    // Likewise, a relay which doesn't know about relaying would take the
+    // request for its own.
+    controller_.RequireServerFeature(RELAY_UPDATES);
+  }
+
+  request_pending_ = true;
+  l.unlock();
+  // Capture a shared_ptr reference into the RPC callback so that we're guaranteed
+  // that this object outlives the RPC.
+  shared_ptr<Peer> s_this = shared_from_this();
+  PeerProxy* proxy = relay ? relay_proxy.get() : proxy_.get();
+  proxy->UpdateAsync(&request_, &response_, &controller_,
+                     [s_this, relay_proxy]() {
+                       s_this->ProcessResponse();
+                     });
+}
+
+void Peer::SetRelay(string relay_uuid, gscoped_ptr<PeerProxy> relay_proxy) {
+  std::lock_guard<simple_spinlock> l(peer_lock_);
+  if (relay_proxy) {
+    if (relay_uuid != relay_uuid_) {
+      LOG_WITH_PREFIX_UNLOCKED(INFO) << "Sending ops through relay " << relay_uuid;
+    }
+    relay_uuid_ = std::move(relay_uuid);
+    relay_proxy_.reset(relay_proxy.release());
+  } else {
+    relay_uuid_.clear();
+    relay_proxy_.reset();
+  }
+}
+
+void Peer::SetRelayedPeers(vector<weak_ptr<Peer>> relayed_peers) {
+  std::lock_guard<simple_spinlock> l(peer_lock_);
+  relayed_peers_ = std::move(relayed_peers);
+}
+
+bool Peer::MaybeTrimOpsForRelayUnlocked(bool even_if_queue_empty,
+                                        bool commit_index_changed,
+                                        bool* relay) {
+  DCHECK(peer_lock_.is_locked());
+  *relay = false;
+  if (!relay_proxy_ || request_.ops_size() == 0 || MonoTime::Now() < relay_retry_time_) {
+    return true;
+  }
+  OpId relay_last_received;
+  if (!queue_->GetPeerLastReceived(relay_uuid_, &relay_last_received).ok()) {
+    // Send the ops directly while the relay is unavailable.
+    return true;
+  }
+
+  // Only the ops which the relay has received can be relayed. The others
+  // are sent once it acks them, since that signals this peer.
+  int num_relayable = 0;
+  while (num_relayable < request_.ops_size() &&
+         request_.ops(num_relayable).id().index() <= relay_last_received.index()) {
+    num_relayable++;
+  }
+  if (num_relayable < request_.ops_size()) {
+    // The ops are not owned by the request, and are still referenced by
+    // 'replicate_msg_refs_'.
+    request_.mutable_ops()->ExtractSubrange(num_relayable,
+                                            request_.ops_size() - num_relayable,
+                                            nullptr);
+  }
+  if (num_relayable == 0) {
+    return even_if_queue_empty || commit_index_changed;
+  }
+  *relay = true;
+  return true;
+}
 
+bool Peer::HandleRelayFailureUnlocked() {
+  DCHECK(peer_lock_.is_locked());
+  if (!request_.has_relay_dest_uuid()) {
+    return false;
+  }
+  // The relay returns the peer's response as is, so a server-level error may
+  // come from either. Both are retried directly.
+  Status s = controller_.status();
+  if (s.ok() && response_.has_error()) {
+    s = StatusFromPB(response_.error().status());
+  }
+  if (s.ok()) {
+    return false;
+  }
+  relay_retry_time_ = MonoTime::Now() +
+      MonoDelta::FromMilliseconds(FLAGS_raft_relay_retry_interval_ms);
+  KLOG_EVERY_N_SECS_THROTTLER(WARNING, 60, relay_log_throttler_, "relay_failed")
+      << LogPrefixUnlocked()
+      << Substitute("Unable to send ops through relay $0, sending them directly: $1",
+                    relay_uuid_, s.ToString())
+      << THROTTLE_MSG;
+  return true;
+}
+
+void Peer::SendNextSnapshotChunk(std::unique_lock<simple_spinlock> l) {
+  DCHECK(l.owns_lock());
+  DCHECK(snapshot_provider_);
+  DCHECK(snapshot_throttler_);
+
+  // Opening and reading the snapshot may do IO, so the lock is released while
+  // the request is marked pending.
   request_pending_ = true;
   l.unlock();
+  unique_ptr<faststring> chunk(new faststring());
+  bool throttled = false;
+  Status s = ReadNextSnapshotChunk(chunk.get(), &throttled);
+  l.lock();
+  if (PREDICT_FALSE(closed_)) {
+    return;
+  }
+  if (PREDICT_FALSE(!s.ok())) {
+    // Start over with a new snapshot on the next attempt.
+    snapshot_source_.reset();
+    ProcessResponseError(s);
+    return;
+  }
+  if (throttled) {
+    // Try again once the throttler is refilled.
+    request_pending_ = false;
+    weak_ptr<Peer> w_this = shared_from_this();
+    messenger_->ScheduleOnReactor([w_this](const Status& s) {
+        if (!s.ok()) {
+          return;
+        }
+        if (auto p = w_this.lock()) {
+          p->SignalRequest(true);
+        }
+      }, MonoDelta::FromMicroseconds(Throttler::kRefillPeriodMicros));
+    return;
+  }
+
+  controller_.Reset();
+  int idx;
+  s = controller_.AddOutboundSidecar(RpcSidecar::FromFaststring(std::move(chunk)), &idx);
+  if (PREDICT_FALSE(!s.ok())) {
+    ProcessResponseError(s);
+    return;
+  }
+  snapshot_request_.set_chunk_sidecar(idx);
+  snapshot_response_.Clear();
+  l.unlock();
+
   // Capture a shared_ptr reference into the RPC callback so that we're guaranteed
   // that this object outlives the RPC.
   shared_ptr<Peer> s_this = shared_from_this();
-  proxy_->UpdateAsync(&request_, &response_, &controller_,
-                      [s_this]() {
-                        s_this->ProcessResponse();
-                      });
+  proxy_->InstallSnapshotAsync(&snapshot_request_, &snapshot_response_, &controller_,
+                               [s_this]() {
+                                 s_this->ProcessSnapshotResponse();
+                               });
+}
+
+Status Peer::ReadNextSnapshotChunk(faststring* chunk, bool* throttled) {
+  *throttled = false;
+  if (!snapshot_source_) {
+    shared_ptr<SnapshotSource> source;
+    RETURN_NOT_OK_PREPEND(snapshot_provider_->OpenSnapshot(&source),
+                          "unable to open snapshot");
+    *snapshot_request_.mutable_last_included_opid() = source->last_included_opid();
+    snapshot_request_.set_snapshot_size(source->size());
+    snapshot_request_.set_offset(0);
+    snapshot_source_ = std::move(source);
+    LOG_WITH_PREFIX_UNLOCKED(INFO)
+        << Substitute("Sending snapshot through op $0 ($1 bytes) to peer, whose log "
+                      "was garbage collected",
+                      OpIdToString(snapshot_request_.last_included_opid()),
+                      snapshot_request_.snapshot_size());
+  }
+
+  const uint64_t offset = snapshot_request_.offset();
+  const uint64_t size = snapshot_request_.snapshot_size();
+  DCHECK_LE(offset, size);
+  const uint64_t max_length = snapshot_throttler_->MaxChunkSize(
+      FLAGS_raft_snapshot_chunk_size_bytes);
+  const size_t length = std::min(max_length, size - offset);
+  if (!snapshot_throttler_->Take(length)) {
+    *throttled = true;
+    return Status::OK();
+  }
+
+  chunk->clear();
+  RETURN_NOT_OK_PREPEND(snapshot_source_->Read(offset, length, chunk),
+                        "unable to read snapshot");
+  if (PREDICT_FALSE(chunk->size() != length)) {
+    return Status::Corruption(Substitute("read $0 bytes of snapshot at offset $1, expected $2",
+                                         chunk->size(), offset, length));
+  }
+  snapshot_request_.set_chunk_crc32c(crc::Crc32c(chunk->data(), chunk->size()));
+  return Status::OK();
+}
+
+void Peer::ProcessSnapshotResponse() {
+  // Note: This method runs on the reactor thread.
+  std::unique_lock<simple_spinlock> lock(peer_lock_);
+  if (closed_) {
+    return;
+  }
+  CHECK(request_pending_);
+
+  // Failed chunks are sent again on the next attempt. The follower keeps what
+  // it received, so the transfer resumes from where it stopped.
+  const auto controller_status = controller_.status();
+  if (!controller_status.ok()) {
+    auto ps = controller_status.IsRemoteError() ?
+        PeerStatus::REMOTE_ERROR : PeerStatus::RPC_LAYER_ERROR;
+    queue_->UpdatePeerStatus(peer_pb_.permanent_uuid(), ps, controller_status);
+    ProcessResponseError(controller_status);
+    return;
+  }
+  if (snapshot_response_.has_error()) {
+    Status response_status = StatusFromPB(snapshot_response_.error().status());
+    queue_->UpdatePeerStatus(peer_pb_.permanent_uuid(), PeerStatus::REMOTE_ERROR,
+                             response_status);
+    ProcessResponseError(response_status);
+    return;
+  }
+
+  // A follower which has moved on to a later term won't take the snapshot.
+  const bool stale_term = snapshot_response_.has_consensus_error();
+  const uint64_t size = snapshot_request_.snapshot_size();
+  const bool installed = !stale_term && snapshot_response_.next_offset() >= size;
+  queue_->SnapshotResponseFromPeer(peer_pb_.permanent_uuid(), snapshot_response_, installed);
+  if (stale_term || installed) {
+    if (installed) {
+      LOG_WITH_PREFIX_UNLOCKED(INFO)
+          << "Peer installed snapshot through op "
+          << OpIdToString(snapshot_request_.last_included_opid());
+    }
+    snapshot_source_.reset();
+  } else {
+    snapshot_request_.set_offset(snapshot_response_.next_offset());
+  }
+  failed_attempts_ = 0;
+  request_pending_ = false;
+  lock.unlock();
+
+  if (!stale_term) {
+    WARN_NOT_OK(SignalRequest(true), LogPrefixUnlocked() + "Unable to send next request");
+  }
+}
+
+void Peer::MaybeCompressOpsUnlocked() {
+  DCHECK(peer_lock_.is_locked());
+  if (ops_codec_ == nullptr || !compress_ops_ || request_.ops_size() == 0) {
+    return;
+  }
+  size_t ops_bytes = 0;
+  for (const auto& op : request_.ops()) {
+    ops_bytes += op.ByteSizeLong();
+  }
+  if (ops_bytes < FLAGS_consensus_ops_compression_min_bytes) {
+    return;
+  }
+
+  bool compressed;
+  size_t uncompressed_size;
+  size_t compressed_size;
+  Status s = queue_->compressed_ops_cache()->CompressOps(ops_codec_, &request_, &compressed,
+                                                         &uncompressed_size, &compressed_size);
+  if (PREDICT_FALSE(!s.ok())) {
+    KLOG_EVERY_N_SECS_THROTTLER(WARNING, 60, compression_log_throttler_, "compress_failed")
+        << LogPrefixUnlocked() << "Unable to compress ops: " << s.ToString() << THROTTLE_MSG;
+    return;
+  }
+  if (!compressed) {
+    return;
+  }
+  ops_bytes_uncompressed_ += uncompressed_size;
+  ops_bytes_compressed_ += compressed_size;
+  KLOG_EVERY_N_SECS_THROTTLER(INFO, 60, compression_log_throttler_, "ratio")
+      << LogPrefixUnlocked()
+      << Substitute("Ops sent compressed with $0: $1 bytes down to $2 ($3x)",
+                    CompressionType_Name(ops_codec_->type()),
+                    ops_bytes_uncompressed_, ops_bytes_compressed_,
+                    static_cast<double>(ops_bytes_uncompressed_) / ops_bytes_compressed_)
+      << THROTTLE_MSG;
+
+  // The ops are not owned by the request, so they are moved aside rather
+  // than cleared.
+  DCHECK_EQ(0, uncompressed_ops_.size());
+  uncompressed_ops_.Swap(request_.mutable_ops());
+}
+
+void Peer::RestoreRequestOpsUnlocked() {
+  DCHECK(peer_lock_.is_locked());
+  if (request_.has_relay_dest_uuid()) {
+    request_.clear_relay_dest_uuid();
+    request_.clear_relay_last_op_id();
+  } else if (request_.has_compressed_ops()) {
+    request_.clear_compressed_ops();
+    request_.clear_ops_compression_codec();
+    request_.clear_ops_uncompressed_size();
+  } else {
+    return;
+  }
+  DCHECK_EQ(0, request_.ops_size());
+  request_.mutable_ops()->Swap(&uncompressed_ops_);
+}
+
+void Peer::GetOpsCompressionStats(int64_t* uncompressed_bytes, int64_t* compressed_bytes) const {
+  std::lock_guard<simple_spinlock> l(peer_lock_);
+  *uncompressed_bytes = ops_bytes_uncompressed_;
+  *compressed_bytes = ops_bytes_compressed_;
 }
 
 Status Peer::StartElection() {
@@ -320,6 +731,20 @@ void Peer::ProcessResponse() {
 
   // Process RpcController errors.
   const auto controller_status = controller_.status();
+  if (PREDICT_FALSE(HandleUnsupportedCompressedOpsUnlocked())) {
+    // Resend the ops uncompressed right away, this isn't a failure of the peer.
+    request_pending_ = false;
+    lock.unlock();
+    WARN_NOT_OK(SignalRequest(true), LogPrefixUnlocked() + "Unable to resend request");
+    return;
+  }
+  if (PREDICT_FALSE(HandleRelayFailureUnlocked())) {
+    // Likewise, resend the ops directly right away.
+    request_pending_ = false;
+    lock.unlock();
+    WARN_NOT_OK(SignalRequest(true), LogPrefixUnlocked() + "Unable to resend request");
+    return;
+  }
   if (!controller_status.ok()) {
     auto ps = controller_status.IsRemoteError() ?
         PeerStatus::REMOTE_ERROR : PeerStatus::RPC_LAYER_ERROR;
@@ -395,11 +820,19 @@ void Peer::DoProcessResponse() {
 
   bool send_more_immediately = queue_->ResponseFromPeer(peer_pb_.permanent_uuid(), response_);
 
+  vector<weak_ptr<Peer>> relayed_peers;
   {
     std::unique_lock<simple_spinlock> lock(peer_lock_);
     CHECK(request_pending_);
     failed_attempts_ = 0;
     request_pending_ = false;
+    relayed_peers = relayed_peers_;
+  }
+  // The ops this peer acked can now be relayed through it.
+  for (const auto& w : relayed_peers) {
+    if (auto p = w.lock()) {
+      ignore_result(p->SignalRequest());
+    }
   }
   // We're OK to read the state_ without a lock here -- if we get a race,
   // the worst thing that could happen is that we'll make one more request before
@@ -452,6 +885,25 @@ void Peer::ProcessTabletCopyResponse() {
 }
 #endif
 
+bool Peer::HandleUnsupportedCompressedOpsUnlocked() {
+  if (!request_.has_compressed_ops() || !controller_.status().IsRemoteError()) {
+    return false;
+  }
+  const rpc::ErrorStatusPB* err = controller_.error_response();
+  if (err == nullptr) {
+    return false;
+  }
+  for (uint32_t feature : err->unsupported_feature_flags()) {
+    if (feature == COMPRESSED_OPS) {
+      LOG_WITH_PREFIX_UNLOCKED(INFO) << "Peer does not support compressed ops, "
+                                     << "sending them uncompressed from now on";
+      compress_ops_ = false;
+      return true;
+    }
+  }
+  return false;
+}
+
 void Peer::ProcessResponseError(const Status& status) {
   failed_attempts_++;
   string resp_err_info;
@@ -499,6 +951,7 @@ Peer::~Peer() {
 
   // We don't own the ops (the queue does).
   request_.mutable_ops()->ExtractSubrange(0, request_.ops_size(), nullptr);
+  uncompressed_ops_.ExtractSubrange(0, uncompressed_ops_.size(), nullptr);
 }
 
 RpcPeerProxy::RpcPeerProxy(gscoped_ptr<HostPort> hostport,
@@ -531,6 +984,14 @@ void RpcPeerProxy::RequestConsensusVoteAsync(const VoteRequestPB* request,
   consensus_proxy_->RequestConsensusVoteAsync(*request, response, controller, callback);
 }
 
+void RpcPeerProxy::InstallSnapshotAsync(const InstallSnapshotRequestPB* request,
+                                        InstallSnapshotResponsePB* response,
+                                        rpc::RpcController* controller,
+                                        const rpc::ResponseCallback& callback) {
+  controller->set_timeout(MonoDelta::FromMilliseconds(FLAGS_consensus_rpc_timeout_ms));
+  consensus_proxy_->InstallSnapshotAsync(*request, response, controller, callback);
+}
+
 #ifdef FB_DO_NOT_REMOVE
 void RpcPeerProxy::StartTabletCopyAsync(const StartTabletCopyRequestPB* request,
                                         StartTabletCopyResponsePB* response,
@@ -26,11 +26,13 @@
 
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <vector>
 
 #include <glog/logging.h>
+#include <google/protobuf/repeated_field.h>
 
 #include "kudu/consensus/consensus.pb.h"
 #include "kudu/consensus/consensus.proxy.h"
@@ -40,10 +42,15 @@
 #include "kudu/rpc/response_callback.h"
 #include "kudu/rpc/rpc_controller.h"
 #include "kudu/util/locks.h"
+#include "kudu/util/logging.h"
+#include "kudu/util/monotime.h"
 #include "kudu/util/net/net_util.h"
 #include "kudu/util/status.h"
+#include "kudu/util/throttler.h"
 
 namespace kudu {
+class CompressionCodec;
+class faststring;
 class ThreadPoolToken;
 
 namespace rpc {
@@ -53,8 +60,31 @@ class PeriodicTimer;
 
 namespace consensus {
 class PeerMessageQueue;
+class SnapshotProvider;
+class SnapshotSource;
 class PeerProxy;
 
+// Limits the rate at which the peers of a tablet send snapshots, with
+// bursts of up to a second's worth. Thread-safe.
+class SnapshotThrottler {
+ public:
+  // A 'bytes_per_sec' of 0 disables the limit.
+  explicit SnapshotThrottler(uint64_t bytes_per_sec);
+
+  // The size of the largest chunk which can be let through, at most
+  // 'chunk_size'. Larger chunks would never be.
+  uint64_t MaxChunkSize(uint64_t chunk_size) const;
+
+  // Returns true if a chunk of 'bytes' may be sent now.
+  bool Take(uint64_t bytes);
+
+ private:
+  const uint64_t bytes_per_sec_;
+  Throttler throttler_;
+
+  DISALLOW_COPY_AND_ASSIGN(SnapshotThrottler);
+};
+
 // A remote peer in consensus.
 //
 // Leaders use peers to update the remote replicas. Each peer
@@ -106,12 +136,30 @@ class Peer : public std::enable_shared_from_this<Peer> {
 
   ~Peer();
 
+  // Returns the total size of the serialized ops sent to this peer in
+  // compressed requests, before and after compression.
+  void GetOpsCompressionStats(int64_t* uncompressed_bytes, int64_t* compressed_bytes) const;
+
+  // Sends the ops for this peer through the peer with uuid 'relay_uuid',
+  // using 'relay_proxy', which forwards them from its own log. Ops are sent
+  // directly again if 'relay_proxy' is null.
+  void SetRelay(std::string relay_uuid, gscoped_ptr<PeerProxy> relay_proxy);
+
+  // Sets the peers whose ops are relayed through this peer. They are
+  // signaled whenever this peer acks, since only ops which the relay has
+  // received can be relayed.
+  void SetRelayedPeers(std::vector<std::weak_ptr<Peer>> relayed_peers);
+
   // Creates a new remote peer and makes the queue track it.'
   //
   // Requests to this peer (which may end up doing IO to read non-cached
   // log entries) are assembled on 'raft_pool_token'.
   // Response handling may also involve IO related to log-entry lookups and is
   // also done on 'raft_pool_token'.
+  //
+  // If the peer falls behind the leader's log, it is sent a snapshot from
+  // 'snapshot_provider', unless null, at the rate allowed by
+  // 'snapshot_throttler', which must then be set too.
   static Status NewRemotePeer(RaftPeerPB peer_pb,
                               std::string tablet_id,
                               std::string leader_uuid,
@@ -119,6 +167,8 @@ class Peer : public std::enable_shared_from_this<Peer> {
                               ThreadPoolToken* raft_pool_token,
                               gscoped_ptr<PeerProxy> proxy,
                               std::shared_ptr<rpc::Messenger> messenger,
+                              SnapshotProvider* snapshot_provider,
+                              std::shared_ptr<SnapshotThrottler> snapshot_throttler,
                               std::shared_ptr<Peer>* peer);
 
  private:
@@ -128,10 +178,44 @@ class Peer : public std::enable_shared_from_this<Peer> {
        PeerMessageQueue* queue,
        ThreadPoolToken* raft_pool_token,
        gscoped_ptr<PeerProxy> proxy,
-       std::shared_ptr<rpc::Messenger> messenger);
+       std::shared_ptr<rpc::Messenger> messenger,
+       SnapshotProvider* snapshot_provider,
+       std::shared_ptr<SnapshotThrottler> snapshot_throttler);
 
   void SendNextRequest(bool even_if_queue_empty);
 
+  // Sends the next chunk of the snapshot being sent to the peer, opening a
+  // snapshot first if none is. Takes ownership of 'l', a lock on 'peer_lock_'.
+  void SendNextSnapshotChunk(std::unique_lock<simple_spinlock> l);
+
+  // Reads the next chunk of the snapshot into 'chunk', unless sending it now
+  // would exceed the rate allowed by 'snapshot_throttler_', in which case
+  // 'throttled' is set. Called with a request pending but without the lock.
+  Status ReadNextSnapshotChunk(faststring* chunk, bool* throttled);
+
+  // Handles the response to an InstallSnapshot RPC, on the reactor thread.
+  void ProcessSnapshotResponse();
+
+  // Replaces the ops of request_ with their compressed form, if the peer
+  // supports it and they shrink. Requires 'peer_lock_' to be held.
+  void MaybeCompressOpsUnlocked();
+
+  // Sets 'relay' if the ops of request_ are to be sent through the relay,
+  // dropping those which the relay hasn't received yet. Returns false if
+  // nothing is left to send until the relay receives them. Requires
+  // 'peer_lock_' to be held.
+  bool MaybeTrimOpsForRelayUnlocked(bool even_if_queue_empty,
+                                    bool commit_index_changed,
+                                    bool* relay);
+
+  // Puts back the ops removed from request_ by MaybeCompressOpsUnlocked() or
+  // to send it through the relay. Requires 'peer_lock_' to be held.
+  void RestoreRequestOpsUnlocked();
+
+  // Returns true if the request sent through the relay failed, after which
+  // requests are sent directly for --raft_relay_retry_interval_ms.
+  bool HandleRelayFailureUnlocked();
+
   // Signals that a response was received from the peer.
   //
   // This method is called from the reactor thread and calls
@@ -157,6 +241,10 @@ class Peer : public std::enable_shared_from_this<Peer> {
   // Signals there was an error sending the request to the peer.
   void ProcessResponseError(const Status& status);
 
+  // Returns true if the RPC failed because the peer doesn't support
+  // compressed ops, after which they are no longer sent to it.
+  bool HandleUnsupportedCompressedOpsUnlocked();
+
   std::string LogPrefixUnlocked() const;
 
   const std::string& tablet_id() const { return tablet_id_; }
@@ -187,6 +275,42 @@ class Peer : public std::enable_shared_from_this<Peer> {
   // reference counts, this holds them.
   std::vector<ReplicateRefPtr> replicate_msg_refs_;
 
+  // The ops of request_ while it is sent compressed or through the relay.
+  // Like the ops of request_, these are not owned.
+  google::protobuf::RepeatedPtrField<ReplicateMsg> uncompressed_ops_;
+
+  // The relay through which ops are sent to the peer, if any. The proxy is
+  // shared with the RPC in flight, if any, since it may be replaced meanwhile.
+  std::string relay_uuid_;
+  std::shared_ptr<PeerProxy> relay_proxy_;
+
+  // Ops aren't sent through the relay again before this time, after a
+  // request sent through it failed.
+  MonoTime relay_retry_time_;
+
+  // The peers whose ops are relayed through this peer.
+  std::vector<std::weak_ptr<Peer>> relayed_peers_;
+  logging::LogThrottler relay_log_throttler_;
+
+  // The snapshot being sent to the peer, if any, along with the request for
+  // its next chunk and the response. Only used while a request is pending,
+  // or under 'peer_lock_'.
+  SnapshotProvider* const snapshot_provider_;
+  const std::shared_ptr<SnapshotThrottler> snapshot_throttler_;
+  std::shared_ptr<SnapshotSource> snapshot_source_;
+  InstallSnapshotRequestPB snapshot_request_;
+  InstallSnapshotResponsePB snapshot_response_;
+
+  // Codec used to compress ops sent to the peer, or null if disabled.
+  const CompressionCodec* ops_codec_ = nullptr;
+
+  // Cleared if the peer turns out not to support compressed ops.
+  bool compress_ops_ = true;
+
+  int64_t ops_bytes_uncompressed_ = 0;
+  int64_t ops_bytes_compressed_ = 0;
+  logging::LogThrottler compression_log_throttler_;
+
   rpc::RpcController controller_;
 
   std::shared_ptr<rpc::Messenger> messenger_;
@@ -229,6 +353,14 @@ class PeerProxy {
                                RunLeaderElectionResponsePB* response,
                                rpc::RpcController* controller) = 0;
 
+  // Sends a chunk of a snapshot to a remote peer.
+  virtual void InstallSnapshotAsync(const InstallSnapshotRequestPB* /*request*/,
+                                    InstallSnapshotResponsePB* /*response*/,
+                                    rpc::RpcController* /*controller*/,
+                                    const rpc::ResponseCallback& /*callback*/) {
+    LOG(DFATAL) << "Not implemented";
+  }
+
 #ifdef FB_DO_NOT_REMOVE
   // Instructs a peer to begin a tablet copy session.
   virtual void StartTabletCopyAsync(const StartTabletCopyRequestPB* /*request*/,
@@ -241,6 +373,11 @@ class PeerProxy {
 
   // Remote endpoint or description of the peer.
   virtual std::string PeerName() const = 0;
+
+  // Whether requests sent through this proxy may carry compressed ops.
+  // Proxies which look into the ops of a request, as those used in tests do,
+  // must not allow it.
+  virtual bool SupportsCompressedOps() const { return false; }
 };
 
 // A peer proxy factory. Usually just obtains peers through the rpc implementation
@@ -276,6 +413,11 @@ class RpcPeerProxy : public PeerProxy {
                        RunLeaderElectionResponsePB* response,
                        rpc::RpcController* controller) override;
 
+  void InstallSnapshotAsync(const InstallSnapshotRequestPB* request,
+                            InstallSnapshotResponsePB* response,
+                            rpc::RpcController* controller,
+                            const rpc::ResponseCallback& callback) override;
+
 #ifdef FB_DO_NOT_REMOVE
   void StartTabletCopyAsync(const StartTabletCopyRequestPB* request,
                             StartTabletCopyResponsePB* response,
@@ -285,6 +427,8 @@ class RpcPeerProxy : public PeerProxy {
 
   std::string PeerName() const override;
 
+  bool SupportsCompressedOps() const override { return true; }
+
  private:
   gscoped_ptr<HostPort> hostport_;
   gscoped_ptr<ConsensusServiceProxy> consensus_proxy_;
@@ -34,12 +34,12 @@
 #include "kudu/clock/clock.h"
 #include "kudu/clock/hybrid_clock.h"
 #include "kudu/common/common.pb.h"
-#include "kudu/common/schema.h"
+//#include "kudu/common/schema.h"
 #include "kudu/common/timestamp.h"
 #ifdef FB_DO_NOT_REMOVE
 #include "kudu/common/wire_protocol-test-util.h"
-#include "kudu/consensus/log-test-base.h"
 #endif
+#include "kudu/consensus/log-test-base.h"
 #include "kudu/common/wire_protocol.h"
 #include "kudu/consensus/consensus-test-util.h"
 #include "kudu/consensus/consensus.pb.h"
@@ -56,12 +56,14 @@
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/strings/substitute.h"
 #include "kudu/util/async_util.h"
 #include "kudu/util/metrics.h"
 //METRIC_DEFINE_entity(tablet);
 #include "kudu/util/monotime.h"
 #include "kudu/util/pb_util.h"
 #include "kudu/util/status.h"
+#include "kudu/util/stopwatch.h"
 #include "kudu/util/test_macros.h"
 #include "kudu/util/test_util.h"
 #include "kudu/util/threadpool.h"
@@ -71,6 +73,7 @@ DECLARE_int32(follower_unavailable_considered_failed_sec);
 
 using kudu::consensus::HealthReportPB;
 using std::vector;
+using strings::Substitute;
 
 namespace kudu {
 namespace consensus {
@@ -290,6 +293,58 @@ TEST_F(ConsensusQueueTest, TestStartTrackingAfterStart) {
   request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
 }
 
+// Tests the heartbeats sent to a peer which has all the ops, which take a
+// shortcut through the queue, and that the peer gets ops again once there are
+// new ones.
+TEST_F(ConsensusQueueTest, TestHeartbeatsToCaughtUpPeer) {
+  queue_->SetLeaderMode(kMinimumOpIdIndex, kMinimumTerm, BuildRaftConfigPBForTests(2));
+  AppendReplicateMessagesToQueue(queue_.get(), clock_, 1, 10);
+
+  ConsensusRequestPB request;
+  ConsensusResponsePB response;
+  response.set_responder_uuid(kPeerUuid);
+  bool send_more_immediately = false;
+  UpdatePeerWatermarkToOp(&request, &response, MinimumOpId(), MinimumOpId(),
+                          &send_more_immediately);
+
+  // Catch the peer up.
+  vector<ReplicateRefPtr> refs;
+  bool needs_tablet_copy;
+  ASSERT_OK(queue_->RequestForPeer(kPeerUuid, &request, &refs, &needs_tablet_copy));
+  ASSERT_EQ(10, request.ops_size());
+  const OpId last_op = request.ops(9).id();
+  SetLastReceivedAndLastCommitted(&response, last_op);
+  queue_->ResponseFromPeer(response.responder_uuid(), response);
+  request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
+
+  const int kNumHeartbeats = AllowSlowTests() ? 1000000 : 10000;
+  LOG_TIMING(INFO, Substitute("preparing $0 heartbeats", kNumHeartbeats)) {
+    for (int i = 0; i < kNumHeartbeats; i++) {
+      ASSERT_OK(queue_->RequestForPeer(kPeerUuid, &request, &refs, &needs_tablet_copy));
+    }
+  }
+  ASSERT_FALSE(needs_tablet_copy);
+  ASSERT_EQ(0, request.ops_size());
+  ASSERT_OPID_EQ(last_op, request.preceding_id());
+  ASSERT_EQ(last_op.index(), request.last_idx_appended_to_leader());
+
+  // The peer gets the next op, and the shortcut is taken again once it's
+  // acked.
+  AppendReplicateMessagesToQueue(queue_.get(), clock_, 11, 1);
+  ASSERT_OK(queue_->RequestForPeer(kPeerUuid, &request, &refs, &needs_tablet_copy));
+  ASSERT_EQ(1, request.ops_size());
+  ASSERT_OPID_EQ(last_op, request.preceding_id());
+  const OpId next_op = request.ops(0).id();
+  ASSERT_EQ(11, next_op.index());
+  SetLastReceivedAndLastCommitted(&response, next_op);
+  queue_->ResponseFromPeer(response.responder_uuid(), response);
+  request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
+
+  ASSERT_OK(queue_->RequestForPeer(kPeerUuid, &request, &refs, &needs_tablet_copy));
+  ASSERT_EQ(0, request.ops_size());
+  ASSERT_OPID_EQ(next_op, request.preceding_id());
+}
+
 // Tests that the peers gets the messages pages, with the size of a page
 // being 'consensus_max_batch_size_bytes'
 TEST_F(ConsensusQueueTest, TestGetPagedMessages) {
@@ -564,6 +619,92 @@ TEST_F(ConsensusQueueTest, TestNonVoterAcksDontCountTowardMajority) {
   ASSERT_FALSE(send_more_immediately);
 }
 
+// Witnesses get the headers of the ops only, and their acks count towards
+// the majority.
+TEST_F(ConsensusQueueTest, TestWitnessGetsOpHeadersAndCountsTowardMajority) {
+  const auto kWitnessPeer = "witness-peer";
+  RaftConfigPB config = BuildRaftConfigPBForTests(/*num_voters=*/ 2);
+  RaftPeerPB* witness_pb = config.add_peers();
+  *witness_pb = FakeRaftPeerPB(kWitnessPeer);
+  witness_pb->set_member_type(RaftPeerPB::WITNESS);
+  queue_->SetLeaderMode(kMinimumOpIdIndex, kMinimumTerm, config);
+  queue_->TrackPeer(MakePeer(kPeerUuid, RaftPeerPB::VOTER));
+  queue_->TrackPeer(MakePeer(kWitnessPeer, RaftPeerPB::WITNESS));
+
+  const int kNumMessages = 10;
+  for (int i = 1; i <= kNumMessages; i++) {
+    gscoped_ptr<ReplicateMsg> msg = CreateDummyReplicate(i / 7, i, clock_->Now(), 100);
+    msg->set_op_type(WRITE_OP_EXT);
+    ASSERT_OK(queue_->AppendOperation(make_scoped_refptr_replicate(msg.release())));
+  }
+  WaitForLocalPeerToAckIndex(kNumMessages);
+  ASSERT_EQ(0, queue_->GetCommittedIndex());
+
+  // The first request to the witness finds out where its log ends.
+  ConsensusRequestPB request;
+  ConsensusResponsePB response;
+  vector<ReplicateRefPtr> refs;
+  bool needs_tablet_copy;
+  ASSERT_OK(queue_->RequestForPeer(kWitnessPeer, &request, &refs, &needs_tablet_copy));
+  ASSERT_EQ(0, request.ops_size());
+  response.set_responder_uuid(kWitnessPeer);
+  RefuseWithLogPropertyMismatch(&response, MinimumOpId(), MinimumOpId());
+  ASSERT_TRUE(queue_->ResponseFromPeer(response.responder_uuid(), response));
+
+  ASSERT_OK(queue_->RequestForPeer(kWitnessPeer, &request, &refs, &needs_tablet_copy));
+  ASSERT_EQ(kNumMessages, request.ops_size());
+  for (int i = 0; i < kNumMessages; i++) {
+    ASSERT_OPID_EQ(MakeOpId((i + 1) / 7, i + 1), request.ops(i).id());
+    ASSERT_EQ(WRITE_OP_EXT, request.ops(i).op_type());
+    ASSERT_FALSE(request.ops(i).has_noop_request());
+  }
+  request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
+
+  // The leader and the witness make a majority of the three voting members.
+  response.Clear();
+  response.set_responder_uuid(kWitnessPeer);
+  response.set_responder_term(1);
+  SetLastReceivedAndLastCommitted(&response,
+                                  /*last_received=*/ MakeOpId(1, kNumMessages),
+                                  /*last_committed_idx=*/ 0);
+  ASSERT_TRUE(queue_->ResponseFromPeer(response.responder_uuid(), response));
+  ASSERT_EQ(kNumMessages, queue_->GetCommittedIndex());
+}
+
+// With quorums by region, a peer which fails its exchange drops out of the
+// quorums, but the majority replicated index it helped advance stays put.
+TEST_F(ConsensusQueueTest, TestRegionQuorumWatermarkDoesntMoveBackward) {
+  RaftConfigPB config = BuildRaftConfigPBForTests(/*num_voters=*/ 6);
+  config.set_quorum_policy(RaftConfigPB::REGION_MAJORITIES);
+  for (int i = 0; i < config.peers_size(); i++) {
+    config.mutable_peers(i)->mutable_attrs()->set_region(i < 3 ? "east" : "west");
+  }
+  queue_->SetLeaderMode(kMinimumOpIdIndex, kMinimumTerm, config);
+  for (int i = 1; i < config.peers_size(); i++) {
+    queue_->TrackPeer(MakePeer(Substitute("peer-$0", i), RaftPeerPB::VOTER));
+  }
+  AppendReplicateMessagesToQueue(queue_.get(), clock_, 1, 10);
+  WaitForLocalPeerToAckIndex(10);
+
+  ConsensusResponsePB response;
+  response.set_responder_term(1);
+  SetLastReceivedAndLastCommitted(&response, MakeOpId(1, 10), MinimumOpId().index());
+  for (const char* uuid : { "peer-1", "peer-2", "peer-3", "peer-4" }) {
+    response.set_responder_uuid(uuid);
+    queue_->ResponseFromPeer(response.responder_uuid(), response);
+  }
+  // Majorities of both regions have replicated all the ops.
+  ASSERT_EQ(10, queue_->GetMajorityReplicatedIndexForTests());
+
+  // Without 'peer-3', the west region's majority is at index 5.
+  queue_->UpdatePeerStatus("peer-3", PeerStatus::RPC_LAYER_ERROR,
+                           Status::NetworkError("connection refused"));
+  response.set_responder_uuid("peer-5");
+  SetLastReceivedAndLastCommitted(&response, MakeOpId(0, 5), MinimumOpId().index());
+  queue_->ResponseFromPeer(response.responder_uuid(), response);
+  ASSERT_EQ(10, queue_->GetMajorityReplicatedIndexForTests());
+}
+
 // In this test we append a sequence of operations to a log
 // and then start tracking a peer whose first required operation
 // is before the first operation in the queue.
@@ -900,6 +1041,7 @@ TEST_F(ConsensusQueueTest, TestOnlyAdvancesWatermarkWhenPeerHasAPrefixOfOurLog)
 }
 
 // Test that Tablet Copy is triggered when a "tablet not found" error occurs.
+#ifdef FB_DO_NOT_REMOVE
 TEST_F(ConsensusQueueTest, TestTriggerTabletCopyIfTabletNotFound) {
   queue_->SetLeaderMode(kMinimumOpIdIndex, kMinimumTerm, BuildRaftConfigPBForTests(3));
   AppendReplicateMessagesToQueue(queue_.get(), clock_, 1, 100);
@@ -933,6 +1075,7 @@ TEST_F(ConsensusQueueTest, TestTriggerTabletCopyIfTabletNotFound) {
   ASSERT_EQ(pb_util::SecureShortDebugString(FakeRaftPeerPB(kLeaderUuid).last_known_addr()),
             pb_util::SecureShortDebugString(tc_req.copy_peer_addr()));
 }
+#endif
 
 TEST_F(ConsensusQueueTest, TestFollowerCommittedIndexAndMetrics) {
   queue_->SetNonLeaderMode(BuildRaftConfigPBForTests(3));
@@ -962,6 +1105,31 @@ TEST_F(ConsensusQueueTest, TestFollowerCommittedIndexAndMetrics) {
   ASSERT_EQ(5, queue_->metrics_.num_ops_behind_leader->value());
 }
 
+// Test that a relay only fills in ops which are the leader's.
+TEST_F(ConsensusQueueTest, TestReadOpsForRelay) {
+  queue_->SetNonLeaderMode(BuildRaftConfigPBForTests(3));
+  AppendReplicateMessagesToQueue(queue_.get(), clock_, 1, 10);
+  WaitForLocalPeerToAckIndex(10);
+
+  vector<ReplicateRefPtr> ops;
+  ASSERT_OK(queue_->ReadOpsForRelay(MakeOpId(0, 3), MakeOpId(1, 8), &ops));
+  ASSERT_EQ(5, ops.size());
+  ASSERT_OPID_EQ(MakeOpId(0, 4), ops.front()->get()->id());
+  ASSERT_OPID_EQ(MakeOpId(1, 8), ops.back()->get()->id());
+
+  // The leader's ops differ from ours.
+  ops.clear();
+  Status s = queue_->ReadOpsForRelay(MakeOpId(0, 3), MakeOpId(2, 8), &ops);
+  ASSERT_TRUE(s.IsIllegalState()) << s.ToString();
+  s = queue_->ReadOpsForRelay(MakeOpId(2, 3), MakeOpId(1, 8), &ops);
+  ASSERT_TRUE(s.IsIllegalState()) << s.ToString();
+
+  // We don't have all of the ops yet.
+  s = queue_->ReadOpsForRelay(MakeOpId(1, 8), MakeOpId(1, 12), &ops);
+  ASSERT_TRUE(s.IsIncomplete()) << s.ToString();
+  ASSERT_TRUE(ops.empty());
+}
+
 // Unit test for the PeerMessageQueue::PeerHealthStatus() method.
 TEST(ConsensusQueueUnitTest, PeerHealthStatus) {
   static constexpr PeerStatus kPeerStatusesForUnknown[] = {
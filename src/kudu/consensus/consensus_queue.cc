@@ -27,6 +27,7 @@
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -44,6 +45,7 @@
 #include "kudu/consensus/log.h"
 #include "kudu/consensus/opid_util.h"
 #include "kudu/consensus/quorum_util.h"
+#include "kudu/consensus/replication_trace.h"
 #include "kudu/consensus/time_manager.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/bind_helpers.h"
@@ -55,6 +57,7 @@
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/util/fault_injection.h"
 #include "kudu/util/flag_tags.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/pb_util.h"
@@ -88,6 +91,8 @@ DECLARE_bool(raft_attempt_to_replace_replica_without_majority);
 using kudu::log::Log;
 using kudu::pb_util::SecureDebugString;
 using kudu::pb_util::SecureShortDebugString;
+using std::map;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::unordered_map;
@@ -157,6 +162,8 @@ PeerMessageQueue::Metrics::Metrics(const scoped_refptr<MetricEntity>& metric_ent
 }
 #undef INSTANTIATE_METRIC
 
+static LockSite g_queue_lock_site("PeerMessageQueue::queue_lock_");
+
 PeerMessageQueue::PeerMessageQueue(const scoped_refptr<MetricEntity>& metric_entity,
                                    scoped_refptr<log::Log> log,
                                    scoped_refptr<TimeManager> time_manager,
@@ -168,6 +175,7 @@ PeerMessageQueue::PeerMessageQueue(const scoped_refptr<MetricEntity>& metric_ent
     : raft_pool_observers_token_(std::move(raft_pool_observers_token)),
       local_peer_pb_(std::move(local_peer_pb)),
       tablet_id_(std::move(tablet_id)),
+      queue_lock_(&g_queue_lock_site),
       successor_watch_in_progress_(false),
       log_cache_(metric_entity, std::move(log), local_peer_pb_.permanent_uuid(), tablet_id_),
       metrics_(metric_entity),
@@ -194,7 +202,7 @@ PeerMessageQueue::PeerMessageQueue(const scoped_refptr<MetricEntity>& metric_ent
 void PeerMessageQueue::SetLeaderMode(int64_t committed_index,
                                      int64_t current_term,
                                      const RaftConfigPB& active_config) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   if (current_term != queue_state_.current_term) {
     CHECK_GT(current_term, queue_state_.current_term) << "Terms should only increase";
     queue_state_.first_index_in_current_term = boost::none;
@@ -204,7 +212,7 @@ void PeerMessageQueue::SetLeaderMode(int64_t committed_index,
   queue_state_.committed_index = committed_index;
   queue_state_.majority_replicated_index = committed_index;
   queue_state_.active_config.reset(new RaftConfigPB(active_config));
-  queue_state_.majority_size_ = MajoritySize(CountVoters(*queue_state_.active_config));
+  queue_state_.majority_size_ = MajoritySize(CountVotingMembers(*queue_state_.active_config));
   queue_state_.mode = LEADER;
 
   TrackLocalPeerUnlocked();
@@ -223,7 +231,7 @@ void PeerMessageQueue::SetLeaderMode(int64_t committed_index,
 }
 
 void PeerMessageQueue::SetNonLeaderMode(const RaftConfigPB& active_config) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   queue_state_.active_config.reset(new RaftConfigPB(active_config));
   queue_state_.mode = NON_LEADER;
   queue_state_.majority_size_ = -1;
@@ -240,7 +248,7 @@ void PeerMessageQueue::SetNonLeaderMode(const RaftConfigPB& active_config) {
 }
 
 void PeerMessageQueue::TrackPeer(const RaftPeerPB& peer_pb) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   TrackPeerUnlocked(peer_pb);
 }
 
@@ -270,7 +278,7 @@ void PeerMessageQueue::TrackPeerUnlocked(const RaftPeerPB& peer_pb) {
 }
 
 void PeerMessageQueue::UntrackPeer(const string& uuid) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   UntrackPeerUnlocked(uuid);
 }
 
@@ -308,7 +316,7 @@ void PeerMessageQueue::TrackLocalPeerUnlocked() {
 
 unordered_map<string, HealthReportPB> PeerMessageQueue::ReportHealthOfPeers() const {
   unordered_map<string, HealthReportPB> reports;
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   for (const auto& entry : peers_map_) {
     const string& peer_uuid = entry.first;
     const TrackedPeer* peer = entry.second;
@@ -356,7 +364,7 @@ void PeerMessageQueue::LocalPeerAppendFinished(const OpId& id,
   *fake_response.mutable_status()->mutable_last_received() = id;
   *fake_response.mutable_status()->mutable_last_received_current_leader() = id;
   {
-    std::lock_guard<simple_spinlock> lock(queue_lock_);
+    std::lock_guard<profiled_spinlock> lock(queue_lock_);
     fake_response.mutable_status()->set_last_committed_idx(queue_state_.committed_index);
   }
   ResponseFromPeer(local_peer_pb_.permanent_uuid(), fake_response);
@@ -373,7 +381,7 @@ Status PeerMessageQueue::AppendOperations(const vector<ReplicateRefPtr>& msgs,
                                           const StatusCallback& log_append_callback) {
 
   DFAKE_SCOPED_LOCK(append_fake_lock_);
-  std::unique_lock<simple_spinlock> lock(queue_lock_);
+  std::unique_lock<profiled_spinlock> lock(queue_lock_);
 
   OpId last_id = msgs.back()->get()->id();
 
@@ -429,21 +437,32 @@ void PeerMessageQueue::TruncateOpsAfter(int64_t index) {
                               LogPrefixUnlocked(),
                               index));
   {
-    std::unique_lock<simple_spinlock> lock(queue_lock_);
+    std::unique_lock<profiled_spinlock> lock(queue_lock_);
     DCHECK(op.IsInitialized());
     queue_state_.last_appended = op;
   }
   log_cache_.TruncateOpsAfter(op.index());
 }
 
+void PeerMessageQueue::ResetToSnapshot(const OpId& last_included) {
+  DFAKE_SCOPED_LOCK(append_fake_lock_); // should not race with append.
+  {
+    std::unique_lock<profiled_spinlock> lock(queue_lock_);
+    queue_state_.last_appended = last_included;
+    queue_state_.committed_index = std::max(queue_state_.committed_index,
+                                            last_included.index());
+  }
+  log_cache_.ResetToSnapshot(last_included);
+}
+
 OpId PeerMessageQueue::GetLastOpIdInLog() const {
-  std::unique_lock<simple_spinlock> lock(queue_lock_);
+  std::unique_lock<profiled_spinlock> lock(queue_lock_);
   DCHECK(queue_state_.last_appended.IsInitialized());
   return queue_state_.last_appended;
 }
 
 OpId PeerMessageQueue::GetNextOpId() const {
-  std::unique_lock<simple_spinlock> lock(queue_lock_);
+  std::unique_lock<profiled_spinlock> lock(queue_lock_);
   DCHECK(queue_state_.last_appended.IsInitialized());
   return MakeOpId(queue_state_.current_term,
                   queue_state_.last_appended.index() + 1);
@@ -463,7 +482,7 @@ bool PeerMessageQueue::SafeToEvictUnlocked(const string& evict_uuid) const {
     if (uuid == evict_uuid) {
       continue;
     }
-    if (!IsRaftConfigVoter(uuid, *queue_state_.active_config)) {
+    if (!IsVotingMember(peer->peer_pb)) {
       continue;
     }
     remaining_voters++;
@@ -615,17 +634,43 @@ HealthReportPB::HealthStatus PeerMessageQueue::PeerHealthStatus(const TrackedPee
   return HealthReportPB::UNKNOWN;
 }
 
+namespace {
+
+// Replaces the ops in 'messages' with their headers: their ids, timestamps and
+// types. Config changes and no-ops are kept whole, since witnesses track the
+// config and leadership like other followers.
+void StripOpsForWitness(vector<ReplicateRefPtr>* messages) {
+  for (ReplicateRefPtr& msg : *messages) {
+    const ReplicateMsg& op = *msg->get();
+    if (op.op_type() == CHANGE_CONFIG_OP || op.op_type() == NO_OP) {
+      continue;
+    }
+    ReplicateMsg* header = new ReplicateMsg;
+    *header->mutable_id() = op.id();
+    header->set_timestamp(op.timestamp());
+    header->set_op_type(op.op_type());
+    msg = make_scoped_refptr_replicate(header);
+  }
+}
+
+} // anonymous namespace
+
 Status PeerMessageQueue::RequestForPeer(const string& uuid,
                                         ConsensusRequestPB* request,
                                         vector<ReplicateRefPtr>* msg_refs,
                                         bool* needs_tablet_copy) {
-  // Maintain a thread-safe copy of necessary members.
+  // Maintain a thread-safe copy of the members of the peer which are needed
+  // below. Copying the whole TrackedPeer would copy its RaftPeerPB, which
+  // costs more than the rest of a heartbeat.
   OpId preceding_id;
   int64_t current_term;
-  TrackedPeer peer_copy;
-  MonoDelta unreachable_time;
+  int64_t next_index;
+  PeerStatus last_exchange_status;
+  bool is_witness = false;
+  shared_ptr<logging::LogThrottler> status_log_throttler;
+  bool caught_up;
   {
-    std::lock_guard<simple_spinlock> lock(queue_lock_);
+    std::lock_guard<profiled_spinlock> lock(queue_lock_);
     DCHECK_EQ(queue_state_.state, kQueueOpen);
     DCHECK_NE(uuid, local_peer_pb_.permanent_uuid());
 
@@ -634,7 +679,8 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
       return Status::NotFound(Substitute("peer $0 is no longer tracked or "
                                          "queue is not in leader mode", uuid));
     }
-    peer_copy = *peer;
+    next_index = peer->next_index;
+    last_exchange_status = peer->last_exchange_status;
 
     // Clear the requests without deleting the entries, as they may be in use by other peers.
     request->mutable_ops()->ExtractSubrange(0, request->ops_size(), nullptr);
@@ -648,14 +694,31 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
     request->set_all_replicated_index(queue_state_.all_replicated_index);
     request->set_last_idx_appended_to_leader(queue_state_.last_appended.index());
     request->set_caller_term(current_term);
-    unreachable_time = MonoTime::Now() - peer_copy.last_communication_time;
+
+    // The heartbeat fast path: a peer which already has every op gets none,
+    // so there's nothing to look up in the log cache, and the ops it needs are
+    // known to be there. Its health is updated right away, rather than taking
+    // the lock again once done.
+    caught_up = last_exchange_status == PeerStatus::OK &&
+        next_index == queue_state_.last_appended.index() + 1;
+    if (caught_up) {
+      peer->wal_catchup_possible = true;
+      UpdatePeerHealthUnlocked(peer);
+    } else {
+      is_witness = peer->peer_pb.member_type() == RaftPeerPB::WITNESS;
+      status_log_throttler = peer->status_log_throttler;
+    }
   }
 
-  // Always trigger a health status update check at the end of this function.
+  // Unless on the fast path, always trigger a health status update check at
+  // the end of this function.
   bool wal_catchup_progress = false;
   bool wal_catchup_failure = false;
   SCOPED_CLEANUP({
-      std::lock_guard<simple_spinlock> lock(queue_lock_);
+      if (caught_up) {
+        return;
+      }
+      std::lock_guard<profiled_spinlock> lock(queue_lock_);
       TrackedPeer* peer = FindPtrOrNull(peers_map_, uuid);
       if (PREDICT_FALSE(peer == nullptr || queue_state_.mode == NON_LEADER)) {
         VLOG(1) << LogPrefixUnlocked() << "peer " << uuid
@@ -667,7 +730,7 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
       UpdatePeerHealthUnlocked(peer);
     });
 
-  if (peer_copy.last_exchange_status == PeerStatus::TABLET_NOT_FOUND) {
+  if (last_exchange_status == PeerStatus::TABLET_NOT_FOUND) {
     VLOG(3) << LogPrefixUnlocked() << "Peer " << uuid << " needs tablet copy" << THROTTLE_MSG;
     *needs_tablet_copy = true;
     return Status::OK();
@@ -677,14 +740,14 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
   // If we've never communicated with the peer, we don't know what messages to
   // send, so we'll send a status-only request. Otherwise, we grab requests
   // from the log starting at the last_received point.
-  if (peer_copy.last_exchange_status != PeerStatus::NEW) {
+  if (!caught_up && last_exchange_status != PeerStatus::NEW) {
 
     // The batch of messages to send to the peer.
     vector<ReplicateRefPtr> messages;
     int max_batch_size = FLAGS_consensus_max_batch_size_bytes - request->ByteSize();
 
     // We try to get the follower's next_index from our log.
-    Status s = log_cache_.ReadOps(peer_copy.next_index - 1,
+    Status s = log_cache_.ReadOps(next_index - 1,
                                   max_batch_size,
                                   &messages,
                                   &preceding_id);
@@ -693,7 +756,7 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
       // the leader has GCed its logs. The follower replica will hang around
       // for a while until it's evicted.
       if (PREDICT_TRUE(s.IsNotFound())) {
-        KLOG_EVERY_N_SECS_THROTTLER(INFO, 60, *peer_copy.status_log_throttler, "logs_gced")
+        KLOG_EVERY_N_SECS_THROTTLER(INFO, 60, *status_log_throttler, "logs_gced")
             << LogPrefixUnlocked()
             << Substitute("The logs necessary to catch up peer $0 have been "
                           "garbage collected. The follower will never be able "
@@ -707,12 +770,12 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
         LOG_WITH_PREFIX_UNLOCKED(ERROR) << "Error trying to read ahead of the log "
                                         << "while preparing peer request: "
                                         << s.ToString() << ". Destination peer: "
-                                        << peer_copy.ToString();
+                                        << uuid;
         return s;
       }
       LOG_WITH_PREFIX_UNLOCKED(FATAL) << "Error reading the log while preparing peer request: "
                                       << s.ToString() << ". Destination peer: "
-                                      << peer_copy.ToString();
+                                      << uuid;
     }
 
     // Since we were able to read ops through the log cache, we know that
@@ -723,8 +786,14 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
     // "all replicated" point. At some point we may want to allow partially loading
     // (and not pinning) earlier messages. At that point we'll need to do something
     // smarter here, like copy or ref-count.
+    //
+    // The "unsafe" variant keeps AddAllocated() from copying messages which
+    // were allocated on an arena.
+    if (is_witness) {
+      StripOpsForWitness(&messages);
+    }
     for (const ReplicateRefPtr& msg : messages) {
-      request->mutable_ops()->AddAllocated(msg->get());
+      request->mutable_ops()->UnsafeArenaAddAllocated(msg->get());
     }
     msg_refs->swap(messages);
   }
@@ -738,7 +807,7 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
   if (request->ops_size() > 0) {
     int64_t last_op_sent = request->ops(request->ops_size() - 1).id().index();
     if (last_op_sent < request->committed_index()) {
-      KLOG_EVERY_N_SECS_THROTTLER(INFO, 3, *peer_copy.status_log_throttler, "lagging")
+      KLOG_EVERY_N_SECS_THROTTLER(INFO, 3, *status_log_throttler, "lagging")
           << LogPrefixUnlocked() << "Peer " << uuid << " is lagging by at least "
           << (request->committed_index() - last_op_sent)
           << " ops behind the committed index " << THROTTLE_MSG;
@@ -769,6 +838,97 @@ Status PeerMessageQueue::RequestForPeer(const string& uuid,
   return Status::OK();
 }
 
+Status PeerMessageQueue::GetSnapshotRequestForPeer(const string& uuid,
+                                                   InstallSnapshotRequestPB* req) {
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
+  DCHECK_EQ(queue_state_.state, kQueueOpen);
+  DCHECK_NE(uuid, local_peer_pb_.permanent_uuid());
+  TrackedPeer* peer = FindPtrOrNull(peers_map_, uuid);
+  if (PREDICT_FALSE(peer == nullptr || queue_state_.mode == NON_LEADER)) {
+    return Status::NotFound("Peer not tracked or queue not in leader mode.");
+  }
+  if (PREDICT_FALSE(peer->wal_catchup_possible)) {
+    return Status::IllegalState("Peer does not need a snapshot", uuid);
+  }
+  req->Clear();
+  req->set_dest_uuid(uuid);
+  req->set_tablet_id(tablet_id_);
+  req->set_caller_uuid(local_peer_pb_.permanent_uuid());
+  req->set_caller_term(queue_state_.current_term);
+  *req->mutable_config() = *queue_state_.active_config;
+  return Status::OK();
+}
+
+void PeerMessageQueue::SnapshotResponseFromPeer(const string& uuid,
+                                                const InstallSnapshotResponsePB& response,
+                                                bool installed) {
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
+  TrackedPeer* peer = FindPtrOrNull(peers_map_, uuid);
+  if (PREDICT_FALSE(peer == nullptr || queue_state_.mode == NON_LEADER)) {
+    return;
+  }
+  peer->last_communication_time = MonoTime::Now();
+
+  if (response.has_consensus_error() &&
+      response.consensus_error().code() == ConsensusErrorPB::INVALID_TERM) {
+    peer->last_exchange_status = PeerStatus::INVALID_TERM;
+    CHECK(response.has_responder_term());
+    LOG_WITH_PREFIX_UNLOCKED(INFO) << "Peer responded invalid term: " << peer->ToString();
+    NotifyObserversOfTermChange(response.responder_term());
+    return;
+  }
+
+  if (installed) {
+    // Start over as with a new peer: the next exchange finds out from where
+    // the log picks up after the snapshot.
+    LOG_WITH_PREFIX_UNLOCKED(INFO) << "Peer installed snapshot: " << peer->ToString();
+    peer->last_exchange_status = PeerStatus::NEW;
+    peer->wal_catchup_possible = true;
+    UpdatePeerHealthUnlocked(peer);
+  }
+}
+
+Status PeerMessageQueue::GetPeerLastReceived(const string& uuid, OpId* last_received) const {
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
+  TrackedPeer* peer = FindPtrOrNull(peers_map_, uuid);
+  if (PREDICT_FALSE(peer == nullptr || queue_state_.mode == NON_LEADER)) {
+    return Status::NotFound("Peer not tracked or queue not in leader mode.");
+  }
+  if (PREDICT_FALSE(peer->last_exchange_status != PeerStatus::OK)) {
+    return Status::IllegalState("Last exchange with peer failed", uuid);
+  }
+  *last_received = peer->last_received;
+  return Status::OK();
+}
+
+Status PeerMessageQueue::ReadOpsForRelay(const OpId& preceding,
+                                         const OpId& last,
+                                         vector<ReplicateRefPtr>* ops) {
+  DCHECK_GT(last.index(), preceding.index());
+  vector<ReplicateRefPtr> messages;
+  OpId preceding_id;
+  RETURN_NOT_OK(log_cache_.ReadOps(preceding.index(),
+                                   FLAGS_consensus_max_batch_size_bytes,
+                                   &messages,
+                                   &preceding_id));
+  while (!messages.empty() && messages.back()->get()->id().index() > last.index()) {
+    messages.pop_back();
+  }
+  if (messages.empty() || messages.back()->get()->id().index() != last.index()) {
+    return Status::Incomplete(Substitute("ops through $0 are not all in the log",
+                                         OpIdToString(last)));
+  }
+  // By the log matching property, the ops are the leader's if the last of
+  // them is.
+  if (!OpIdEquals(messages.back()->get()->id(), last) ||
+      !OpIdEquals(preceding_id, preceding)) {
+    return Status::IllegalState(Substitute("ops after $0 through $1 differ from the leader's",
+                                           OpIdToString(preceding), OpIdToString(last)));
+  }
+  ops->swap(messages);
+  return Status::OK();
+}
+
 #ifdef FB_DO_NOT_REMOVE
 
 Status PeerMessageQueue::GetTabletCopyRequestForPeer(const string& uuid,
@@ -776,7 +936,7 @@ Status PeerMessageQueue::GetTabletCopyRequestForPeer(const string& uuid,
   TrackedPeer* peer = nullptr;
   int64_t current_term;
   {
-    std::lock_guard<simple_spinlock> lock(queue_lock_);
+    std::lock_guard<profiled_spinlock> lock(queue_lock_);
     DCHECK_EQ(queue_state_.state, kQueueOpen);
     DCHECK_NE(uuid, local_peer_pb_.permanent_uuid());
     peer = FindPtrOrNull(peers_map_, uuid);
@@ -822,8 +982,7 @@ void PeerMessageQueue::AdvanceQueueWatermark(const char* type,
   //   will be the new 'watermark'.
   vector<int64_t> watermarks;
   for (const PeersMap::value_type& peer : peers_map_) {
-    if (replica_types == VOTER_REPLICAS &&
-        peer.second->peer_pb.member_type() != RaftPeerPB::VOTER) {
+    if (replica_types == VOTER_REPLICAS && !IsVotingMember(peer.second->peer_pb)) {
       continue;
     }
     // TODO(todd): The fact that we only consider peers whose last exchange was
@@ -878,21 +1037,48 @@ void PeerMessageQueue::AdvanceQueueWatermark(const char* type,
   }
 }
 
+void PeerMessageQueue::AdvanceCommitQuorumWatermark(const TrackedPeer* who_caused) {
+  // As in AdvanceQueueWatermark(), only peers whose last exchange succeeded
+  // count towards the quorum.
+  map<string, int64_t> replicated_indexes;
+  for (const PeersMap::value_type& peer : peers_map_) {
+    if (IsVotingMember(peer.second->peer_pb) &&
+        peer.second->last_exchange_status == PeerStatus::OK) {
+      replicated_indexes[peer.first] = peer.second->last_received.index();
+    }
+  }
+  int64_t new_watermark = GetCommitQuorumIndex(*queue_state_.active_config,
+                                               local_peer_pb_.permanent_uuid(),
+                                               replicated_indexes);
+  if (new_watermark < 0) {
+    VLOG_WITH_PREFIX_UNLOCKED(3) << "No commit quorum among peers: "
+                                 << replicated_indexes.size() << " voters replicating";
+    return;
+  }
+  VLOG_WITH_PREFIX_UNLOCKED(1) << "Updated majority_replicated watermark "
+      << "from " << queue_state_.majority_replicated_index << " to " << new_watermark
+      << " after response from peer (" << who_caused->ToString() << ")";
+  // A later response may form a quorum at a lower index, e.g. if a peer which
+  // was ahead failed its last exchange; the watermark never moves back.
+  queue_state_.majority_replicated_index =
+      std::max(queue_state_.majority_replicated_index, new_watermark);
+}
+
 void PeerMessageQueue::BeginWatchForSuccessor(
     const boost::optional<string>& successor_uuid) {
-  std::lock_guard<simple_spinlock> l(queue_lock_);
+  std::lock_guard<profiled_spinlock> l(queue_lock_);
   successor_watch_in_progress_ = true;
   designated_successor_uuid_ = successor_uuid;
 }
 
 void PeerMessageQueue::EndWatchForSuccessor() {
-  std::lock_guard<simple_spinlock> l(queue_lock_);
+  std::lock_guard<profiled_spinlock> l(queue_lock_);
   successor_watch_in_progress_ = false;
 }
 
 void PeerMessageQueue::UpdateFollowerWatermarks(int64_t committed_index,
                                                 int64_t all_replicated_index) {
-  std::lock_guard<simple_spinlock> l(queue_lock_);
+  std::lock_guard<profiled_spinlock> l(queue_lock_);
   DCHECK_EQ(queue_state_.mode, NON_LEADER);
   queue_state_.committed_index = committed_index;
   queue_state_.all_replicated_index = all_replicated_index;
@@ -900,7 +1086,7 @@ void PeerMessageQueue::UpdateFollowerWatermarks(int64_t committed_index,
 }
 
 void PeerMessageQueue::UpdateLastIndexAppendedToLeader(int64_t last_idx_appended_to_leader) {
-  std::lock_guard<simple_spinlock> l(queue_lock_);
+  std::lock_guard<profiled_spinlock> l(queue_lock_);
   DCHECK_EQ(queue_state_.mode, NON_LEADER);
   queue_state_.last_idx_appended_to_leader = last_idx_appended_to_leader;
   UpdateLagMetricsUnlocked();
@@ -909,7 +1095,7 @@ void PeerMessageQueue::UpdateLastIndexAppendedToLeader(int64_t last_idx_appended
 void PeerMessageQueue::UpdatePeerStatus(const string& peer_uuid,
                                         PeerStatus ps,
                                         const Status& status) {
-  std::unique_lock<simple_spinlock> l(queue_lock_);
+  std::unique_lock<profiled_spinlock> l(queue_lock_);
   TrackedPeer* peer = FindPtrOrNull(peers_map_, peer_uuid);
   if (PREDICT_FALSE(peer == nullptr || queue_state_.mode == NON_LEADER)) {
     VLOG(1) << LogPrefixUnlocked() << "peer " << peer_uuid
@@ -1096,7 +1282,7 @@ bool PeerMessageQueue::ResponseFromPeer(const std::string& peer_uuid,
   boost::optional<int64_t> updated_commit_index;
   Mode mode_copy;
   {
-    std::lock_guard<simple_spinlock> scoped_lock(queue_lock_);
+    std::lock_guard<profiled_spinlock> scoped_lock(queue_lock_);
 
     TrackedPeer* peer = FindPtrOrNull(peers_map_, peer_uuid);
     if (PREDICT_FALSE(queue_state_.state != kQueueOpen || peer == nullptr)) {
@@ -1203,14 +1389,29 @@ bool PeerMessageQueue::ResponseFromPeer(const std::string& peer_uuid,
     // is just pending behind the lock we're holding), but any future leader will observe
     // the same watermarks and make the same advancement, so this is safe.
     if (mode_copy == LEADER) {
+      ReplicationTrace* trace = ReplicationTrace::GetSingleton();
+      if (peer_uuid != local_peer_pb_.permanent_uuid()) {
+        trace->RecordRange(ReplicationStage::kFollowerAppend, queue_state_.current_term,
+                           prev_peer_state.last_received.index(),
+                           peer->last_received.index());
+      }
+
       // Advance the majority replicated index.
-      AdvanceQueueWatermark("majority_replicated",
-                            &queue_state_.majority_replicated_index,
-                            /*replicated_before=*/ prev_peer_state.last_received,
-                            /*replicated_after=*/ peer->last_received,
-                            /*num_peers_required=*/ queue_state_.majority_size_,
-                            VOTER_REPLICAS,
-                            peer);
+      int64_t majority_replicated_before = queue_state_.majority_replicated_index;
+      if (queue_state_.active_config->quorum_policy() != RaftConfigPB::MAJORITY) {
+        AdvanceCommitQuorumWatermark(peer);
+      } else {
+        AdvanceQueueWatermark("majority_replicated",
+                              &queue_state_.majority_replicated_index,
+                              /*replicated_before=*/ prev_peer_state.last_received,
+                              /*replicated_after=*/ peer->last_received,
+                              /*num_peers_required=*/ queue_state_.majority_size_,
+                              VOTER_REPLICAS,
+                              peer);
+      }
+      trace->RecordRange(ReplicationStage::kMajorityAck, queue_state_.current_term,
+                         majority_replicated_before,
+                         queue_state_.majority_replicated_index);
 
       // Advance the all replicated index.
       AdvanceQueueWatermark("all_replicated",
@@ -1274,34 +1475,34 @@ bool PeerMessageQueue::ResponseFromPeer(const std::string& peer_uuid,
 }
 
 PeerMessageQueue::TrackedPeer PeerMessageQueue::GetTrackedPeerForTests(const string& uuid) {
-  std::lock_guard<simple_spinlock> scoped_lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> scoped_lock(queue_lock_);
   TrackedPeer* tracked = FindOrDie(peers_map_, uuid);
   return *tracked;
 }
 
 int64_t PeerMessageQueue::GetAllReplicatedIndex() const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return queue_state_.all_replicated_index;
 }
 
 int64_t PeerMessageQueue::GetCommittedIndex() const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return queue_state_.committed_index;
 }
 
 bool PeerMessageQueue::IsCommittedIndexInCurrentTerm() const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return queue_state_.first_index_in_current_term != boost::none &&
       queue_state_.committed_index >= *queue_state_.first_index_in_current_term;
 }
 
 bool PeerMessageQueue::IsInLeaderMode() const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return queue_state_.mode == Mode::LEADER;
 }
 
 int64_t PeerMessageQueue::GetMajorityReplicatedIndexForTests() const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return queue_state_.majority_replicated_index;
 }
 
@@ -1328,7 +1529,7 @@ void PeerMessageQueue::UpdateLagMetricsUnlocked() {
 }
 
 void PeerMessageQueue::DumpToStrings(vector<string>* lines) const {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   DumpToStringsUnlocked(lines);
 }
 
@@ -1346,7 +1547,7 @@ void PeerMessageQueue::DumpToStringsUnlocked(vector<string>* lines) const {
 void PeerMessageQueue::DumpToHtml(std::ostream& out) const {
   using std::endl;
 
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   out << "<h3>Watermarks</h3>" << endl;
   out << "<table>" << endl;;
   out << "  <tr><th>Peer</th><th>Watermark</th></tr>" << endl;
@@ -1370,7 +1571,7 @@ void PeerMessageQueue::ClearUnlocked() {
 void PeerMessageQueue::Close() {
   raft_pool_observers_token_->Shutdown();
 
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   ClearUnlocked();
 }
 
@@ -1381,7 +1582,7 @@ int64_t PeerMessageQueue::GetQueuedOperationsSizeBytesForTests() const {
 string PeerMessageQueue::ToString() const {
   // Even though metrics are thread-safe obtain the lock so that we get
   // a "consistent" snapshot of the metrics.
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   return ToStringUnlocked();
 }
 
@@ -1394,7 +1595,7 @@ string PeerMessageQueue::ToStringUnlocked() const {
 }
 
 void PeerMessageQueue::RegisterObserver(PeerMessageQueueObserver* observer) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   auto iter = std::find(observers_.begin(), observers_.end(), observer);
   if (iter == observers_.end()) {
     observers_.push_back(observer);
@@ -1402,7 +1603,7 @@ void PeerMessageQueue::RegisterObserver(PeerMessageQueueObserver* observer) {
 }
 
 Status PeerMessageQueue::UnRegisterObserver(PeerMessageQueueObserver* observer) {
-  std::lock_guard<simple_spinlock> lock(queue_lock_);
+  std::lock_guard<profiled_spinlock> lock(queue_lock_);
   auto iter = std::find(observers_.begin(), observers_.end(), observer);
   if (iter == observers_.end()) {
     return Status::NotFound("Can't find observer.");
@@ -1486,7 +1687,7 @@ void PeerMessageQueue::NotifyObserversTask(
   MAYBE_INJECT_RANDOM_LATENCY(FLAGS_consensus_inject_latency_ms_in_notifications);
   std::vector<PeerMessageQueueObserver*> observers_copy;
   {
-    std::lock_guard<simple_spinlock> lock(queue_lock_);
+    std::lock_guard<profiled_spinlock> lock(queue_lock_);
     observers_copy = observers_;
   }
   for (PeerMessageQueueObserver* observer : observers_copy) {
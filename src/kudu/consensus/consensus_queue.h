@@ -39,10 +39,12 @@
 #include "kudu/consensus/log_cache.h"
 #include "kudu/consensus/metadata.pb.h"
 #include "kudu/consensus/opid.pb.h"
+#include "kudu/consensus/ops_compression.h"
 #include "kudu/consensus/ref_counted_replicate.h"
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/gutil/threading/thread_collision_warner.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
@@ -50,6 +52,7 @@
 #include "kudu/util/status_callback.h"
 
 namespace kudu {
+class MemTracker;
 class ThreadPoolToken;
 
 namespace log {
@@ -64,6 +67,8 @@ namespace consensus {
 class ConsensusRequestPB;
 class ConsensusResponsePB;
 class ConsensusStatusPB;
+class InstallSnapshotRequestPB;
+class InstallSnapshotResponsePB;
 class PeerMessageQueueObserver;
 class TimeManager;
 #ifdef FB_DO_NOT_REMOVE
@@ -254,6 +259,12 @@ class PeerMessageQueue {
   // accordingly.
   void TruncateOpsAfter(int64_t index);
 
+  // Drop all operations and reset the 'last_appended' and committed
+  // operations to 'last_included', the last op covered by a snapshot
+  // installed in place of the ops up to it. Like TruncateOpsAfter(), not
+  // thread-safe with concurrent Append calls.
+  void ResetToSnapshot(const OpId& last_included);
+
   // Return the last OpId in the log.
   // Note that this can move backwards after a truncation (TruncateOpsAfter).
   OpId GetLastOpIdInLog() const;
@@ -289,6 +300,32 @@ class PeerMessageQueue {
                                      StartTabletCopyRequestPB* req);
 #endif
 
+  // Fill in an InstallSnapshotRequest for the specified peer, but for the
+  // snapshot itself. Returns IllegalState if the peer can still be caught up
+  // from the log.
+  Status GetSnapshotRequestForPeer(const std::string& uuid,
+                                   InstallSnapshotRequestPB* req);
+
+  // Updates the queue with a successful response to an InstallSnapshot
+  // request. Once 'installed' is true, the peer is caught up from the log
+  // again, starting after the snapshot.
+  void SnapshotResponseFromPeer(const std::string& uuid,
+                                const InstallSnapshotResponsePB& response,
+                                bool installed);
+
+  // Sets 'last_received' to the last op the peer is known to have in common
+  // with the leader's log. Returns NotFound if the peer isn't tracked or the
+  // queue isn't in leader mode, and IllegalState if the last exchange with
+  // the peer failed.
+  Status GetPeerLastReceived(const std::string& uuid, OpId* last_received) const;
+
+  // Reads the ops after 'preceding' through 'last' for a leader which relays
+  // them through this replica. Returns Incomplete if they aren't all in the
+  // log yet, and IllegalState if the ops in the log differ from the leader's.
+  Status ReadOpsForRelay(const OpId& preceding,
+                         const OpId& last,
+                         std::vector<ReplicateRefPtr>* ops);
+
   // Inform the queue of a new status known for one of its peers.
   // 'ps' indicates an interpretation of the status, while 'status'
   // may contain a more specific error message in the case of one of
@@ -322,6 +359,11 @@ class PeerMessageQueue {
 
   int64_t GetQueuedOperationsSizeBytesForTests() const;
 
+  // See LogCache::arena_mem_tracker().
+  const std::shared_ptr<MemTracker>& replicate_arena_mem_tracker() const {
+    return log_cache_.arena_mem_tracker();
+  }
+
   // Returns the last message replicated by all peers.
   int64_t GetAllReplicatedIndex() const;
 
@@ -375,6 +417,9 @@ class PeerMessageQueue {
   void BeginWatchForSuccessor(const boost::optional<std::string>& successor_uuid);
   void EndWatchForSuccessor();
 
+  // Compressed runs of ops, shared by the peers which send the same ops.
+  CompressedOpsCache* compressed_ops_cache() { return &compressed_ops_cache_; }
+
  private:
   FRIEND_TEST(ConsensusQueueTest, TestQueueAdvancesCommittedIndex);
   FRIEND_TEST(ConsensusQueueTest, TestQueueMovesWatermarksBackward);
@@ -400,6 +445,7 @@ class PeerMessageQueue {
   // Types of replicas to count when advancing a queue watermark.
   enum ReplicaTypes {
     ALL_REPLICAS,
+    // Voters and witnesses.
     VOTER_REPLICAS,
   };
 
@@ -552,6 +598,11 @@ class PeerMessageQueue {
                              ReplicaTypes replica_types,
                              const TrackedPeer* who_caused);
 
+  // Advances the majority-replicated watermark to the highest op held by a
+  // commit quorum of voters, for configs whose quorum policy isn't a plain
+  // majority. See IsCommitQuorum().
+  void AdvanceCommitQuorumWatermark(const TrackedPeer* who_caused);
+
   std::vector<PeerMessageQueueObserver*> observers_;
 
   // The pool token which executes observer notifications.
@@ -567,7 +618,7 @@ class PeerMessageQueue {
 
   // The currently tracked peers.
   PeersMap peers_map_;
-  mutable simple_spinlock queue_lock_; // TODO(todd): rename
+  mutable profiled_spinlock queue_lock_; // TODO(todd): rename
 
   bool successor_watch_in_progress_;
   boost::optional<std::string> designated_successor_uuid_;
@@ -579,6 +630,8 @@ class PeerMessageQueue {
 
   LogCache log_cache_;
 
+  CompressedOpsCache compressed_ops_cache_;
+
   Metrics metrics_;
 
   scoped_refptr<TimeManager> time_manager_;
@@ -26,7 +26,9 @@
 #include <algorithm>
 #include <mutex>
 #include <ostream>
+#include <set>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <boost/bind.hpp> // IWYU pragma: keep
@@ -35,6 +37,7 @@
 #include "kudu/common/wire_protocol.h"
 #include "kudu/consensus/consensus_peers.h"
 #include "kudu/consensus/metadata.pb.h"
+#include "kudu/consensus/quorum_util.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/callback.h"
 #include "kudu/gutil/map-util.h"
@@ -51,6 +54,7 @@
 namespace kudu {
 namespace consensus {
 
+using std::set;
 using std::string;
 using std::vector;
 using strings::Substitute;
@@ -69,6 +73,38 @@ VoteCounter::VoteCounter(int num_voters, int majority_size)
   CHECK_GT(majority_size_, 0);
 }
 
+VoteCounter::VoteCounter(RaftConfigPB config)
+  : num_voters_(CountVotingMembers(config)),
+    majority_size_(MajoritySize(num_voters_)),
+    config_(std::move(config)),
+    yes_votes_(0),
+    no_votes_(0) {
+  CHECK_GT(num_voters_, 0);
+}
+
+bool VoteCounter::HasQuorumOf(ElectionVote vote) const {
+  set<string> voters;
+  for (const auto& entry : votes_) {
+    if (entry.second == vote) {
+      voters.insert(entry.first);
+    }
+  }
+  return IsElectionQuorum(*config_, voters);
+}
+
+bool VoteCounter::CanStillWinWithout(ElectionVote vote) const {
+  set<string> voters;
+  for (const RaftPeerPB& peer : config_->peers()) {
+    if (IsVotingMember(peer)) {
+      const ElectionVote* v = FindOrNull(votes_, peer.permanent_uuid());
+      if (v == nullptr || *v != vote) {
+        voters.insert(peer.permanent_uuid());
+      }
+    }
+  }
+  return IsElectionQuorum(*config_, voters);
+}
+
 Status VoteCounter::RegisterVote(const std::string& voter_uuid, ElectionVote vote,
                                  bool* is_duplicate) {
   // Handle repeated votes.
@@ -114,11 +150,25 @@ Status VoteCounter::RegisterVote(const std::string& voter_uuid, ElectionVote vot
 }
 
 bool VoteCounter::IsDecided() const {
+  if (config_) {
+    return HasQuorumOf(VOTE_GRANTED) || !CanStillWinWithout(VOTE_DENIED);
+  }
   return yes_votes_ >= majority_size_ ||
          no_votes_ > num_voters_ - majority_size_;
 }
 
 Status VoteCounter::GetDecision(ElectionVote* decision) const {
+  if (config_) {
+    if (HasQuorumOf(VOTE_GRANTED)) {
+      *decision = VOTE_GRANTED;
+      return Status::OK();
+    }
+    if (!CanStillWinWithout(VOTE_DENIED)) {
+      *decision = VOTE_DENIED;
+      return Status::OK();
+    }
+    return Status::IllegalState("Vote not yet decided");
+  }
   if (yes_votes_ >= majority_size_) {
     *decision = VOTE_GRANTED;
     return Status::OK();
@@ -204,7 +254,8 @@ void LeaderElection::Run() {
                         pb_util::SecureShortDebugString(config_));
       continue;
     }
-    if (peer.member_type() != RaftPeerPB::VOTER) {
+    // Witnesses vote too, though they can't be candidates.
+    if (!IsVotingMember(peer)) {
       continue;
     }
     other_voter_uuids.emplace_back(peer.permanent_uuid());
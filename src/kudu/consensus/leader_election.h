@@ -24,6 +24,8 @@
 #include <string>
 #include <unordered_map>
 
+#include <boost/optional/optional.hpp>
+
 #include "kudu/consensus/consensus.pb.h"
 #include "kudu/consensus/consensus_peers.h"
 #include "kudu/consensus/metadata.pb.h"
@@ -52,6 +54,10 @@ class VoteCounter {
   // Create new VoteCounter with the given majority size.
   VoteCounter(int num_voters, int majority_size);
 
+  // Create new VoteCounter for the voters of 'config', which is decided by
+  // its quorum policy rather than by a plain majority. See IsElectionQuorum().
+  explicit VoteCounter(RaftConfigPB config);
+
   // Register a peer's vote.
   //
   // If the voter already has a vote recorded, but it has a different value than
@@ -83,8 +89,17 @@ class VoteCounter {
 
   typedef std::map<std::string, ElectionVote> VoteMap;
 
+  // Returns true if the voters of 'config_' which didn't vote 'vote' may
+  // still form an election quorum.
+  bool CanStillWinWithout(ElectionVote vote) const;
+
+  // Returns true if the voters which voted 'vote' form an election quorum.
+  bool HasQuorumOf(ElectionVote vote) const;
+
   const int num_voters_;
   const int majority_size_;
+  // Set if the vote is decided by the quorum policy of the config.
+  const boost::optional<RaftConfigPB> config_;
   VoteMap votes_; // Voting record.
   int yes_votes_; // Accumulated yes votes, for quick counting.
   int no_votes_;  // Accumulated no votes.
@@ -154,7 +154,10 @@ class LogTestBase : public KuduTest {
   typedef std::pair<int, int> DeltaId;
 
   LogTestBase()
-      : schema_(GetSimpleTestSchema()),
+      :
+#ifdef FB_DO_NOT_REMOVE
+        schema_(GetSimpleTestSchema()),
+#endif
         log_anchor_registry_(new LogAnchorRegistry) {
   }
 
@@ -176,12 +179,16 @@ class LogTestBase : public KuduTest {
   }
 
   Status BuildLog() {
+#ifdef FB_DO_NOT_REMOVE
     Schema schema_with_ids = SchemaBuilder(schema_).Build();
+#endif
     return Log::Open(options_,
                      fs_manager_.get(),
                      kTestTablet,
+#ifdef FB_DO_NOT_REMOVE
                      schema_with_ids,
                      0, // schema_version
+#endif
                      metric_entity_.get(),
                      &log_);
   }
@@ -221,9 +228,10 @@ class LogTestBase : public KuduTest {
                               bool sync = APPEND_SYNC) {
     consensus::ReplicateRefPtr replicate =
         make_scoped_refptr_replicate(new consensus::ReplicateMsg());
-    replicate->get()->set_op_type(consensus::WRITE_OP);
     replicate->get()->mutable_id()->CopyFrom(opid);
     replicate->get()->set_timestamp(clock_->Now().ToUint64());
+#ifdef FB_DO_NOT_REMOVE
+    replicate->get()->set_op_type(consensus::WRITE_OP);
     tserver::WriteRequestPB* batch_request = replicate->get()->mutable_write_request();
     RETURN_NOT_OK(SchemaToPB(schema_, batch_request->mutable_schema()));
     AddTestRowToPB(RowOperationsPB::INSERT, schema_,
@@ -237,6 +245,12 @@ class LogTestBase : public KuduTest {
                    "this is a test mutate",
                    batch_request->mutable_row_operations());
     batch_request->set_tablet_id(kTestTablet);
+#else
+    replicate->get()->set_op_type(consensus::WRITE_OP_EXT);
+    replicate->get()->mutable_write_payload()->set_payload(
+        strings::Substitute("this is a test insert $0, this is a test mutate $1",
+                            opid.index(), opid.index() + 1));
+#endif
     return AppendReplicateBatch(replicate, sync);
   }
 
@@ -278,10 +292,11 @@ class LogTestBase : public KuduTest {
                       int dms_id,
                       bool sync = APPEND_SYNC) {
     gscoped_ptr<consensus::CommitMsg> commit(new consensus::CommitMsg);
-    commit->set_op_type(consensus::WRITE_OP);
+    commit->set_op_type(consensus::WRITE_OP_EXT);
 
     commit->mutable_commited_op_id()->CopyFrom(original_opid);
 
+#ifdef FB_DO_NOT_REMOVE
     tablet::TxResultPB* result = commit->mutable_result();
 
     tablet::OperationResultPB* insert = result->add_ops();
@@ -291,6 +306,7 @@ class LogTestBase : public KuduTest {
     tablet::MemStoreTargetPB* target = mutate->add_mutated_stores();
     target->set_dms_id(dms_id);
     target->set_rs_id(rs_id);
+#endif
     return AppendCommit(std::move(commit), sync);
   }
 
@@ -299,15 +315,17 @@ class LogTestBase : public KuduTest {
   // "NotFound" errors.
   Status AppendCommitWithNotFoundOpResults(const consensus::OpId& original_opid) {
     gscoped_ptr<consensus::CommitMsg> commit(new consensus::CommitMsg);
-    commit->set_op_type(consensus::WRITE_OP);
+    commit->set_op_type(consensus::WRITE_OP_EXT);
     commit->mutable_commited_op_id()->CopyFrom(original_opid);
 
+#ifdef FB_DO_NOT_REMOVE
     tablet::TxResultPB* result = commit->mutable_result();
 
     tablet::OperationResultPB* insert = result->add_ops();
     StatusToPB(Status::NotFound("fake failed write"), insert->mutable_failed_status());
     tablet::OperationResultPB* mutate = result->add_ops();
     StatusToPB(Status::NotFound("fake failed write"), mutate->mutable_failed_status());
+#endif
 
     return AppendCommit(std::move(commit));
   }
@@ -381,7 +399,9 @@ class LogTestBase : public KuduTest {
     kStartIndex = 1
   };
 
+#ifdef FB_DO_NOT_REMOVE
   const Schema schema_;
+#endif
   gscoped_ptr<FsManager> fs_manager_;
   gscoped_ptr<MetricRegistry> metric_registry_;
   scoped_refptr<MetricEntity> metric_entity_;
@@ -50,6 +50,7 @@
 #include "kudu/consensus/log_util.h"
 #include "kudu/consensus/opid.pb.h"
 #include "kudu/consensus/opid_util.h"
+#include "kudu/fs/data_dirs.h"
 #include "kudu/fs/fs_manager.h"
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/ref_counted.h"
@@ -59,7 +60,9 @@
 #include "kudu/util/compression/compression.pb.h"
 #include "kudu/util/env.h"
 #include "kudu/util/metrics.h"
+#include "kudu/util/path_util.h"
 #include "kudu/util/random.h"
+#include "kudu/util/random_util.h"
 #include "kudu/util/status.h"
 #include "kudu/util/stopwatch.h"
 #include "kudu/util/test_macros.h"
@@ -68,10 +71,16 @@
 DEFINE_int32(num_batches, 10000,
              "Number of batches to write to/read from the Log in TestWriteManyBatches");
 
+DECLARE_bool(log_mmap_sealed_segments);
+DECLARE_int32(log_compression_dictionary_bytes);
+DECLARE_int32(log_compression_dictionary_sample_bytes);
+DECLARE_int32(log_gc_delete_step_bytes);
+DECLARE_int32(log_max_recycled_segments);
 DECLARE_int32(log_min_segments_to_retain);
 DECLARE_int32(log_max_segments_to_retain);
 DECLARE_double(log_inject_io_error_on_preallocate_fraction);
 DECLARE_int64(fs_wal_dir_reserved_bytes);
+DECLARE_int64(log_gc_delete_rate_bytes_per_sec);
 DECLARE_int64(disk_reserved_bytes_free_for_testing);
 DECLARE_string(log_compression_codec);
 
@@ -87,7 +96,7 @@ using consensus::MakeOpId;
 using consensus::NO_OP;
 using consensus::OpId;
 using consensus::ReplicateMsg;
-using consensus::WRITE_OP;
+using consensus::WRITE_OP_EXT;
 using strings::Substitute;
 
 struct TestLogSequenceElem {
@@ -183,7 +192,7 @@ class LogTestOptionalCompression : public LogTest,
     FLAGS_log_compression_codec = name;
   }
 };
-INSTANTIATE_TEST_CASE_P(Codecs, LogTestOptionalCompression, ::testing::Values(NO_COMPRESSION, LZ4));
+INSTANTIATE_TEST_CASE_P(Codecs, LogTestOptionalCompression, ::testing::Values(NO_COMPRESSION, LZ4, ZSTD));
 
 // If we write more than one entry in a batch, we should be able to
 // read all of those entries back.
@@ -428,6 +437,159 @@ TEST_P(LogTestOptionalCompression, TestSegmentRollover) {
   ASSERT_EQ(num_entries, entries_.size());
 }
 
+// Test rolling over a log striped across two WAL directories, where each
+// segment is synced and closed while the next one is set up.
+TEST_F(LogTest, TestStripedSegmentRollover) {
+  FsManagerOpts opts;
+  opts.wal_root = GetTestPath("wal0");
+  opts.extra_wal_roots = { GetTestPath("wal1") };
+  opts.data_roots = { GetTestPath("data") };
+  opts.wal_placement = fs::WalPlacementMode::STRIPE;
+  fs_manager_.reset(new FsManager(env_, opts));
+  ASSERT_OK(fs_manager_->CreateInitialFileSystemLayout());
+  ASSERT_OK(fs_manager_->Open());
+  options_.force_fsync_all = true;
+  ASSERT_OK(BuildLog());
+  log_->SetMaxSegmentSizeForTests(990);
+  const int kNumEntriesPerBatch = 100;
+
+  OpId op_id = MakeOpId(1, 1);
+  int num_entries = 0;
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  while (segments.size() < 4) {
+    ASSERT_OK(AppendNoOps(&op_id, kNumEntriesPerBatch));
+    num_entries += kNumEntriesPerBatch;
+    ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  }
+  ASSERT_OK(log_->Close());
+
+  shared_ptr<LogReader> reader;
+  ASSERT_OK(LogReader::Open(fs_manager_.get(), nullptr, kTestTablet, nullptr, &reader));
+  ASSERT_OK(reader->GetSegmentsSnapshot(&segments));
+  for (int i = 0; i < segments.size(); i++) {
+    ASSERT_TRUE(segments[i]->HasFooter()) << segments[i]->path();
+    if (i > 0) {
+      ASSERT_NE(DirName(segments[i - 1]->path()), DirName(segments[i]->path()));
+    }
+    ASSERT_OK(segments[i]->ReadEntries(&entries_));
+  }
+  ASSERT_EQ(num_entries, entries_.size());
+}
+
+// Test that sealed segments are memory-mapped when enabled, and that their
+// entries read back the same as through the regular read path.
+TEST_P(LogTestOptionalCompression, TestReadFromMappedSealedSegments) {
+  FLAGS_log_mmap_sealed_segments = true;
+  ASSERT_OK(BuildLog());
+  log_->SetMaxSegmentSizeForTests(990);
+  const int kNumEntriesPerBatch = 50;
+
+  OpId op_id = MakeOpId(1, 1);
+  int num_entries = 0;
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  while (segments.size() < 4) {
+    ASSERT_OK(AppendNoOps(&op_id, kNumEntriesPerBatch));
+    num_entries += kNumEntriesPerBatch;
+    ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  }
+
+  // Segments are mapped as soon as they are sealed, but the segment currently
+  // being written to is not.
+  for (int i = 0; i < segments.size() - 1; i++) {
+    EXPECT_TRUE(segments[i]->IsMapped()) << segments[i]->path();
+  }
+  EXPECT_FALSE(segments.back()->IsMapped());
+
+  // Random reads go through the mapping for the sealed segments.
+  int64_t last_index = op_id.index() - 1;
+  vector<ReplicateMsg*> repls;
+  ElementDeleter d(&repls);
+  ASSERT_OK(log_->reader()->ReadReplicatesInRange(
+      1, last_index, LogReader::kNoSizeLimit, &repls));
+  ASSERT_EQ(last_index, repls.size());
+  for (int i = 0; i < repls.size(); i++) {
+    ASSERT_EQ(i + 1, repls[i]->id().index());
+  }
+  ASSERT_OK(log_->Close());
+
+  // After a restart, every segment has a footer and is mapped.
+  shared_ptr<LogReader> reader;
+  ASSERT_OK(LogReader::Open(fs_manager_.get(), nullptr, kTestTablet, nullptr, &reader));
+  ASSERT_OK(reader->GetSegmentsSnapshot(&segments));
+  for (const scoped_refptr<ReadableLogSegment>& segment : segments) {
+    ASSERT_TRUE(segment->IsMapped()) << segment->path();
+    ASSERT_OK(segment->ReadEntries(&entries_));
+  }
+  ASSERT_EQ(num_entries, entries_.size());
+}
+
+// With ZSTD, each new segment is compressed with a dictionary trained from
+// recently appended write payloads, and batches which don't compress are
+// written as-is.
+TEST_F(LogTest, TestCompressionDictionaryAndIncompressibleBatches) {
+  FLAGS_log_compression_codec = "zstd";
+  FLAGS_log_compression_dictionary_bytes = 1024;
+  FLAGS_log_compression_dictionary_sample_bytes = 64 * 1024;
+  ASSERT_OK(BuildLog());
+
+  Random rng(SeedRandom());
+  vector<string> payloads;
+  OpId op_id = MakeOpId(1, 1);
+  auto append_payload = [&](const string& payload) {
+    consensus::ReplicateRefPtr replicate = consensus::make_scoped_refptr_replicate(new ReplicateMsg());
+    replicate->get()->mutable_id()->CopyFrom(op_id);
+    replicate->get()->set_op_type(consensus::WRITE_OP_EXT);
+    replicate->get()->set_timestamp(clock_->Now().ToUint64());
+    replicate->get()->mutable_write_payload()->set_payload(payload);
+    op_id.set_index(op_id.index() + 1);
+    payloads.push_back(payload);
+    Synchronizer s;
+    RETURN_NOT_OK(log_->AsyncAppendReplicates({ replicate }, s.AsStatusCallback()));
+    return s.Wait();
+  };
+
+  // Append enough similar payloads to train a dictionary, and roll over so
+  // the next segment uses it.
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(append_payload(Substitute(
+        "{\"table\":\"orders\",\"order_id\":$0,\"customer\":\"customer-$1\","
+        "\"amount_cents\":$2}", rng.Next64(), rng.Uniform(100000), rng.Uniform(1000000))));
+  }
+  ASSERT_OK(log_->AllocateSegmentAndRollOver());
+
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(2, segments.size());
+  ASSERT_FALSE(segments[0]->header().has_compression_dictionary());
+  // Without a dictionary, the segment stays readable by older versions.
+  ASSERT_EQ(0, segments[0]->header().incompatible_features_size());
+  const LogSegmentHeaderPB& header = segments[1]->header();
+  ASSERT_EQ(ZSTD, header.compression_codec());
+  ASSERT_TRUE(header.has_compression_dictionary());
+  ASSERT_LE(header.compression_dictionary().size(), 1024);
+
+  // Random payloads don't shrink when compressed and are stored uncompressed.
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(append_payload(RandomString(512, &rng)));
+  }
+  ASSERT_OK(log_->Close());
+
+  // Everything reads back, whether compressed with or without a dictionary
+  // or not compressed at all.
+  shared_ptr<LogReader> reader;
+  ASSERT_OK(LogReader::Open(fs_manager_.get(), nullptr, kTestTablet, nullptr, &reader));
+  ASSERT_OK(reader->GetSegmentsSnapshot(&segments));
+  for (const scoped_refptr<ReadableLogSegment>& segment : segments) {
+    ASSERT_OK(segment->ReadEntries(&entries_));
+  }
+  ASSERT_EQ(payloads.size(), entries_.size());
+  for (int i = 0; i < entries_.size(); i++) {
+    ASSERT_EQ(payloads[i], entries_[i]->replicate().write_payload().payload());
+  }
+}
+
 TEST_F(LogTest, TestWriteAndReadToAndFromInProgressSegment) {
   FLAGS_log_compression_codec = "none";
 
@@ -599,6 +761,175 @@ TEST_P(LogTestOptionalCompression, TestGCWithLogRunning) {
   }
 }
 
+// Test that GC hands the files of the segments it removes over to the
+// background deleter, and that they count towards the size of the log until
+// they're gone.
+TEST_P(LogTestOptionalCompression, TestGCDeletesSegmentsInBackground) {
+  FLAGS_log_max_recycled_segments = 0;
+  FLAGS_log_gc_delete_step_bytes = 1024;
+  // Slow enough that no file is fully deleted until the rate is lifted.
+  FLAGS_log_gc_delete_rate_bytes_per_sec = 1;
+  ASSERT_OK(BuildLog());
+
+  vector<LogAnchor*> anchors;
+  ElementDeleter deleter(&anchors);
+  const int kNumTotalSegments = 3;
+  OpId op_id = MakeOpId(1, 1);
+  ASSERT_OK(AppendMultiSegmentSequence(kNumTotalSegments, 2, &op_id, &anchors));
+  ASSERT_EQ(kNumTotalSegments, anchors.size());
+  const int64_t size_before_gc = log_->OnDiskSize();
+
+  auto count_files_being_deleted = [&]() {
+    vector<string> files;
+    CHECK_OK(env_->GetChildren(JoinPathSegments(fs_manager_->GetWalsRootDir(), kTestTablet),
+                               &files));
+    return std::count_if(files.begin(), files.end(), [](const string& f) {
+      return f.find(".deleting-") != string::npos;
+    });
+  };
+
+  RetentionIndexes retention;
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[0]));
+  ASSERT_OK(log_anchor_registry_->GetEarliestRegisteredLogIndex(&retention.for_durability));
+  int num_gced_segments;
+  ASSERT_OK(log_->GC(retention, &num_gced_segments));
+  ASSERT_EQ(1, num_gced_segments);
+
+  // The segment is gone from the log, but its file is still there.
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(2, segments.size()) << DumpSegmentsToString(segments);
+  NO_FATALS(CheckRightNumberOfSegmentFiles(2));
+  ASSERT_EQ(1, count_files_being_deleted());
+  // At most one step may have been freed since.
+  ASSERT_GE(log_->OnDiskSize(), size_before_gc - FLAGS_log_gc_delete_step_bytes);
+
+  // Once the rate is lifted, the file is deleted.
+  FLAGS_log_gc_delete_rate_bytes_per_sec = 0;
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_EQ(0, count_files_being_deleted());
+    ASSERT_LT(log_->OnDiskSize(), size_before_gc);
+  });
+
+  ASSERT_OK(log_->Close());
+  for (int i = 1; i < kNumTotalSegments; i++) {
+    ASSERT_OK(log_anchor_registry_->Unregister(anchors[i]));
+  }
+}
+
+// Closing the log deletes the files still waiting on the throttle right away.
+TEST_F(LogTest, TestCloseFinishesThrottledDeletions) {
+  FLAGS_log_max_recycled_segments = 0;
+  FLAGS_log_gc_delete_step_bytes = 1024;
+  FLAGS_log_gc_delete_rate_bytes_per_sec = 1;
+  ASSERT_OK(BuildLog());
+
+  vector<LogAnchor*> anchors;
+  ElementDeleter deleter(&anchors);
+  OpId op_id = MakeOpId(1, 1);
+  ASSERT_OK(AppendMultiSegmentSequence(3, 2, &op_id, &anchors));
+  RetentionIndexes retention;
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[0]));
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[1]));
+  ASSERT_OK(log_anchor_registry_->GetEarliestRegisteredLogIndex(&retention.for_durability));
+  int num_gced_segments;
+  ASSERT_OK(log_->GC(retention, &num_gced_segments));
+  ASSERT_EQ(2, num_gced_segments);
+
+  LOG_TIMING(INFO, "closing the log") {
+    ASSERT_OK(log_->Close());
+  }
+  vector<string> files;
+  ASSERT_OK(env_->GetChildren(JoinPathSegments(fs_manager_->GetWalsRootDir(), kTestTablet),
+                              &files));
+  for (const string& f : files) {
+    ASSERT_EQ(string::npos, f.find(".deleting-")) << f;
+  }
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[2]));
+}
+
+// Test that replaying a segment written to a recycled file stops at the
+// segment's last entry, rather than reading on into the entries the file still
+// holds from the segment it was used for before.
+TEST_F(LogTest, TestReplayRecycledSegment) {
+  FLAGS_log_max_recycled_segments = 1;
+  ASSERT_OK(BuildLog());
+
+  vector<LogAnchor*> anchors;
+  ElementDeleter deleter(&anchors);
+  OpId op_id = MakeOpId(1, 1);
+  // Enough entries that some are left past the blocks zeroed on recycling.
+  ASSERT_OK(AppendMultiSegmentSequence(2, 500, &op_id, &anchors));
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_GT(segments[0]->file_size(), 4 * 4096);
+  const string gced_path = segments[0]->path();
+  segments.clear();
+
+  // GC the first segment, whose file is then recycled by the next one.
+  RetentionIndexes retention;
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[0]));
+  ASSERT_OK(log_anchor_registry_->GetEarliestRegisteredLogIndex(&retention.for_durability));
+  int num_gced_segments;
+  ASSERT_OK(log_->GC(retention, &num_gced_segments));
+  ASSERT_EQ(1, num_gced_segments);
+  ASSERT_FALSE(env_->FileExists(gced_path));
+  ASSERT_OK(RollLog());
+  const int kNumNewEntries = 2;
+  ASSERT_OK(AppendNoOps(&op_id, kNumNewEntries));
+
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(2, segments.size()) << DumpSegmentsToString(segments);
+  const LogSegmentHeaderPB& header = segments[1]->header();
+  ASSERT_NE(header.incompatible_features().end(),
+            std::find(header.incompatible_features().begin(),
+                      header.incompatible_features().end(),
+                      LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS));
+
+  // Read the new segment as it would be replayed had the server crashed now,
+  // without a footer and with the old entries still following the new ones.
+  scoped_refptr<ReadableLogSegment> replayed;
+  ASSERT_OK(ReadableLogSegment::Open(env_, segments[1]->path(), &replayed));
+  ASSERT_FALSE(replayed->HasFooter());
+  LogEntries entries;
+  ASSERT_OK(replayed->ReadEntries(&entries));
+  ASSERT_EQ(kNumNewEntries, entries.size());
+
+  ASSERT_OK(log_->Close());
+  ASSERT_OK(log_anchor_registry_->Unregister(anchors[1]));
+}
+
+// Resetting the log after a snapshot install drops all the segments before
+// it, and the ops after the snapshot are appended to a new segment.
+TEST_P(LogTestOptionalCompression, TestResetToSnapshot) {
+  ASSERT_OK(BuildLog());
+  OpId op_id = MakeOpId(1, 1);
+  ASSERT_OK(AppendMultiSegmentSequence(3, 5, &op_id, nullptr));
+  ASSERT_OK(AppendNoOps(&op_id, 2));
+  SegmentSequence segments;
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(4, segments.size()) << DumpSegmentsToString(segments);
+  const int64_t active_seqno = segments.back()->header().sequence_number();
+  segments.clear();
+
+  ASSERT_OK(log_->ResetToSnapshot(MakeOpId(2, 30)));
+  ASSERT_OK(log_->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(1, segments.size()) << DumpSegmentsToString(segments);
+  ASSERT_GT(segments[0]->header().sequence_number(), active_seqno);
+  vector<ReplicateMsg*> repls;
+  ElementDeleter deleter(&repls);
+  Status s = log_->reader()->ReadReplicatesInRange(5, 5, LogReader::kNoSizeLimit, &repls);
+  ASSERT_TRUE(s.IsNotFound()) << "unexpected status: " << s.ToString();
+
+  // The op after the snapshot is readable from the new segment.
+  op_id = MakeOpId(2, 31);
+  ASSERT_OK(AppendNoOp(&op_id));
+  ASSERT_OK(log_->reader()->ReadReplicatesInRange(31, 31, LogReader::kNoSizeLimit, &repls));
+  ASSERT_EQ(1, repls.size());
+  ASSERT_EQ("2.31", OpIdToString(repls[0]->id()));
+  ASSERT_OK(log_->Close());
+}
+
 // Test that, when we are set to retain a given number of log segments,
 // we also retain any relevant log index chunks, even if those operations
 // are not necessary for recovery.
@@ -661,7 +992,7 @@ TEST_P(LogTestOptionalCompression, TestWaitUntilAllFlushed) {
       ASSERT_TRUE(entries_[i]->has_replicate());
     } else {
       ASSERT_TRUE(entries_[i]->has_commit());
-      ASSERT_EQ(WRITE_OP, entries_[i]->commit().op_type());
+      ASSERT_EQ(WRITE_OP_EXT, entries_[i]->commit().op_type());
     }
   }
 }
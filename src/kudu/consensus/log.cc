@@ -23,11 +23,14 @@
 
 #include "kudu/consensus/log.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <tuple>
 #include <utility>
 
 #include <boost/range/adaptor/reversed.hpp>
@@ -39,6 +42,7 @@
 #include "kudu/consensus/log_metrics.h"
 #include "kudu/consensus/log_reader.h"
 #include "kudu/consensus/log_util.h"
+#include "kudu/consensus/opid_util.h"
 #include "kudu/fs/fs_manager.h"
 #include "kudu/gutil/atomicops.h"
 #include "kudu/gutil/bind.h"
@@ -46,6 +50,7 @@
 #include "kudu/gutil/dynamic_annotations.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/strings/join.h"
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/gutil/walltime.h"
 #include "kudu/util/async_util.h"
@@ -57,6 +62,7 @@
 #include "kudu/util/fault_injection.h"
 #include "kudu/util/flag_tags.h"
 #include "kudu/util/kernel_stack_watchdog.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
@@ -84,6 +90,28 @@ TAG_FLAG(log_max_segments_to_retain, runtime);
 TAG_FLAG(log_max_segments_to_retain, advanced);
 TAG_FLAG(log_max_segments_to_retain, experimental);
 
+DEFINE_int32(log_max_recycled_segments, 2,
+             "The maximum number of garbage-collected log segments whose files are "
+             "kept to be reused by new segments, rather than deleting them and "
+             "allocating new files. 0 disables recycling.");
+TAG_FLAG(log_max_recycled_segments, runtime);
+TAG_FLAG(log_max_recycled_segments, advanced);
+TAG_FLAG(log_max_recycled_segments, experimental);
+
+DEFINE_int64(log_gc_delete_rate_bytes_per_sec, 256 * 1024 * 1024,
+             "The rate at which the files of garbage-collected log segments are "
+             "freed, across all the logs of the server. Files are deleted in the "
+             "background, truncating them a step at a time, so that freeing their "
+             "blocks doesn't stall appends. 0 or less frees them as fast as possible.");
+TAG_FLAG(log_gc_delete_rate_bytes_per_sec, runtime);
+TAG_FLAG(log_gc_delete_rate_bytes_per_sec, advanced);
+
+DEFINE_int32(log_gc_delete_step_bytes, 8 * 1024 * 1024,
+             "The number of bytes by which the file of a garbage-collected log "
+             "segment is truncated at a time when it's deleted.");
+DEFINE_validator(log_gc_delete_step_bytes, [](const char* /*n*/, int32_t v) { return v > 0; });
+TAG_FLAG(log_gc_delete_step_bytes, runtime);
+TAG_FLAG(log_gc_delete_step_bytes, advanced);
 
 // Group commit configuration.
 // -----------------------------
@@ -104,6 +132,18 @@ DEFINE_string(log_compression_codec, "LZ4",
               "Codec to use for compressing WAL segments.");
 TAG_FLAG(log_compression_codec, experimental);
 
+DEFINE_int32(log_compression_dictionary_bytes, 16 * 1024,
+             "Maximum size of the compression dictionary trained from recent write "
+             "payloads when a new WAL segment is created. Only used with codecs which "
+             "support dictionaries (ZSTD). 0 disables dictionaries.");
+TAG_FLAG(log_compression_dictionary_bytes, experimental);
+
+DEFINE_int32(log_compression_dictionary_sample_bytes, 1024 * 1024,
+             "Amount of the write payloads appended to a WAL segment which are kept "
+             "as samples for training the compression dictionary of the next one. "
+             "Payloads appended once enough were sampled aren't copied.");
+TAG_FLAG(log_compression_dictionary_sample_bytes, experimental);
+
 // Fault/latency injection flags.
 // -----------------------------
 DEFINE_bool(log_inject_latency, false,
@@ -186,6 +226,7 @@ using consensus::CommitMsg;
 using consensus::OpId;
 using consensus::ReplicateRefPtr;
 using env_util::OpenFileForRandom;
+using std::pair;
 using std::shared_ptr;
 using std::string;
 using std::vector;
@@ -456,9 +497,8 @@ Status Log::Open(const LogOptions &options,
                  const scoped_refptr<MetricEntity>& metric_entity,
                  scoped_refptr<Log>* log) {
 
+  RETURN_NOT_OK(fs_manager->CreateTabletWalDirs(tablet_id));
   string tablet_wal_path = fs_manager->GetTabletWalDir(tablet_id);
-  RETURN_NOT_OK(env_util::CreateDirIfMissing(
-      fs_manager->env(), tablet_wal_path));
 
   scoped_refptr<Log> new_log;
   if (options.log_factory) {
@@ -480,6 +520,8 @@ Status Log::Open(const LogOptions &options,
   return Status::OK();
 }
 
+static LockSite g_log_state_lock_site("Log::state_lock_");
+
 Log::Log(LogOptions options, FsManager* fs_manager, string log_path,
          string tablet_id,
 #ifdef FB_DO_NOT_REMOVE
@@ -495,6 +537,8 @@ Log::Log(LogOptions options, FsManager* fs_manager, string log_path,
       schema_version_(schema_version),
 #endif
       active_segment_sequence_number_(0),
+      next_segment_recycled_(false),
+      state_lock_(&g_log_state_lock_site),
       log_state_(kLogInitialized),
       max_segment_size_(options_.segment_size_mb * 1024 * 1024),
       entry_batch_queue_(FLAGS_group_commit_queue_size_bytes),
@@ -502,10 +546,17 @@ Log::Log(LogOptions options, FsManager* fs_manager, string log_path,
       force_sync_all_(options_.force_fsync_all),
       sync_disabled_(false),
       allocation_state_(kAllocationNotStarted),
+      configured_codec_(nullptr),
       codec_(nullptr),
+      sample_for_dictionary_(false),
+      dict_samples_bytes_(0),
       metric_entity_(std::move(metric_entity)),
-      on_disk_size_(0) {
+      on_disk_size_(0),
+      recycled_bytes_(0),
+      pending_delete_bytes_(0),
+      deletion_unthrottled_(false) {
   CHECK_OK(ThreadPoolBuilder("log-alloc").set_max_threads(1).Build(&allocation_pool_));
+  CHECK_OK(ThreadPoolBuilder("log-delete").set_max_threads(1).Build(&deletion_pool_));
   if (metric_entity_) {
     metrics_.reset(new LogMetrics(metric_entity_));
   }
@@ -522,7 +573,7 @@ Status LogFactory::createLog(LogOptions options,
 }
 
 Status Log::Init() {
-  std::lock_guard<percpu_rwlock> write_lock(state_lock_);
+  std::lock_guard<profiled_percpu_rwlock> write_lock(state_lock_);
   CHECK_EQ(kLogInitialized, log_state_);
   CHECK(!FLAGS_raft_derived_log_mode);
 
@@ -530,8 +581,9 @@ Status Log::Init() {
   if (!FLAGS_log_compression_codec.empty()) {
     auto codec_type = GetCompressionCodecType(FLAGS_log_compression_codec);
     if (codec_type != NO_COMPRESSION) {
-      RETURN_NOT_OK_PREPEND(GetCompressionCodec(codec_type, &codec_),
+      RETURN_NOT_OK_PREPEND(GetCompressionCodec(codec_type, &configured_codec_),
                             "could not instantiate compression codec");
+      sample_for_dictionary_ = codec_type == ZSTD && FLAGS_log_compression_dictionary_bytes > 0;
     }
   }
 
@@ -578,8 +630,16 @@ Status Log::AsyncAllocateSegment() {
   CHECK(!FLAGS_raft_derived_log_mode);
   std::lock_guard<RWMutex> l(allocation_lock_);
   CHECK_EQ(allocation_state_, kAllocationNotStarted);
+  return AsyncAllocateSegmentUnlocked();
+}
+
+Status Log::AsyncAllocateSegmentUnlocked() {
+  CHECK(!FLAGS_raft_derived_log_mode);
+  DCHECK_EQ(allocation_state_, kAllocationNotStarted);
   allocation_status_.Reset();
   allocation_state_ = kAllocationInProgress;
+  next_segment_dir_ = DirName(fs_manager_->GetWalSegmentFileName(
+      tablet_id_, active_segment_sequence_number_ + 1));
   RETURN_NOT_OK(allocation_pool_->SubmitClosure(
                   Bind(&Log::SegmentAllocationTask, Unretained(this))));
   return Status::OK();
@@ -609,10 +669,30 @@ Status Log::RollOver() {
 
   DCHECK_EQ(allocation_state(), kAllocationFinished);
 
-  RETURN_NOT_OK(Sync());
-  RETURN_NOT_OK(CloseCurrentSegment());
-
-  RETURN_NOT_OK(SwitchToAllocatedSegment());
+  if (!force_sync_all_ || next_segment_dir_ == DirName(active_segment_->path())) {
+    RETURN_NOT_OK(Sync());
+    RETURN_NOT_OK(CloseCurrentSegment());
+    RETURN_NOT_OK(SwitchToAllocatedSegment());
+  } else {
+    // The log is striped, so the next segment is on another device. Sync and
+    // close the current segment on the allocation thread, idle until the next
+    // allocation, while the next segment's directory entry and header are
+    // synced here, so that the group commit which fills a segment waits for
+    // the two devices at once rather than one after the other.
+    Synchronizer closed;
+    RETURN_NOT_OK(allocation_pool_->SubmitFunc([this, &closed]() {
+      Status s = Sync();
+      if (s.ok()) {
+        s = CloseCurrentSegment();
+      }
+      closed.StatusCB(s);
+    }));
+    gscoped_ptr<WritableLogSegment> new_segment;
+    Status s = OpenAllocatedSegment(&new_segment);
+    RETURN_NOT_OK(closed.Wait());
+    RETURN_NOT_OK(s);
+    RETURN_NOT_OK(SwitchToOpenedSegment(std::move(new_segment)));
+  }
 
   LOG_WITH_PREFIX(INFO) << "Rolled over to a new log segment at " << active_segment_->path();
   return Status::OK();
@@ -684,14 +764,13 @@ Status Log::DoAppend(LogEntryBatch* entry_batch) {
 
   Slice entry_batch_data = entry_batch->data();
   uint32_t entry_batch_bytes = entry_batch->total_size_bytes();
-  // If there is no data to write return OK.
-  if (PREDICT_FALSE(entry_batch_bytes == 0)) {
-    return Status::OK();
-  }
 
-  // if the size of this entry overflows the current segment, get a new one
+  // if the size of this entry overflows the current segment, get a new one.
+  // A segment which finished allocating is switched to even if there's no
+  // data to write, so that a FLUSH_MARKER completes the roll.
   if (allocation_state() == kAllocationNotStarted) {
-    if ((active_segment_->Size() + entry_batch_bytes + 4) > max_segment_size_) {
+    if (entry_batch_bytes > 0 &&
+        (active_segment_->Size() + entry_batch_bytes + 4) > max_segment_size_) {
       LOG_WITH_PREFIX(INFO) << "Max segment size reached. Starting new segment allocation";
       RETURN_NOT_OK(AsyncAllocateSegment());
       if (!options_.async_preallocate_segments) {
@@ -708,6 +787,11 @@ Status Log::DoAppend(LogEntryBatch* entry_batch) {
     VLOG_WITH_PREFIX(1) << "Segment allocation already in progress...";
   }
 
+  // If there is no data to write return OK.
+  if (PREDICT_FALSE(entry_batch_bytes == 0)) {
+    return Status::OK();
+  }
+
   int64_t start_offset = active_segment_->written_offset();
 
   LOG_SLOW_EXECUTION(WARNING, 50, Substitute("$0Append to log took a long time", LogPrefix())) {
@@ -730,6 +814,9 @@ Status Log::DoAppend(LogEntryBatch* entry_batch) {
 
   CHECK_OK(UpdateIndexForBatch(*entry_batch, start_offset));
   UpdateFooterForBatch(entry_batch);
+  if (sample_for_dictionary_) {
+    SampleForCompressionDictionary(*entry_batch);
+  }
 
   return Status::OK();
 }
@@ -768,6 +855,87 @@ void Log::UpdateFooterForBatch(LogEntryBatch* batch) {
   }
 }
 
+void Log::SampleForCompressionDictionary(const LogEntryBatch& batch) {
+  const size_t max_sample_bytes = FLAGS_log_compression_dictionary_sample_bytes;
+  if (batch.type_ != REPLICATE) {
+    return;
+  }
+  std::lock_guard<simple_spinlock> l(dict_samples_lock_);
+  if (dict_samples_bytes_ >= max_sample_bytes) {
+    return;
+  }
+  for (const LogEntryPB& entry_pb : batch.entry_batch_pb_->entry()) {
+    const string& payload = entry_pb.replicate().write_payload().payload();
+    if (payload.empty() || payload.size() > max_sample_bytes - dict_samples_bytes_) {
+      continue;
+    }
+    dict_samples_.push_back(payload);
+    dict_samples_bytes_ += payload.size();
+  }
+}
+
+void Log::TrainNextCompressionDictionary() {
+  next_dict_.clear();
+  next_dict_codec_.reset();
+  if (!sample_for_dictionary_) {
+    return;
+  }
+
+  // Training needs a good number of samples relative to the size of the
+  // dictionary to be of any use. Otherwise the samples are kept for the next
+  // segment.
+  const size_t dict_bytes = FLAGS_log_compression_dictionary_bytes;
+  vector<string> samples;
+  {
+    std::lock_guard<simple_spinlock> l(dict_samples_lock_);
+    if (dict_samples_bytes_ < dict_bytes * 8) {
+      return;
+    }
+    // The next dictionary is trained from the payloads appended from now on.
+    samples.swap(dict_samples_);
+    dict_samples_bytes_ = 0;
+  }
+  vector<Slice> sample_slices(samples.begin(), samples.end());
+  string dict;
+  MonoTime start = MonoTime::Now();
+  Status s = TrainCompressionDictionary(configured_codec_->type(), sample_slices, dict_bytes,
+                                        &dict);
+  if (s.ok()) {
+    s = NewCompressionCodecWithDictionary(configured_codec_->type(), dict, &next_dict_codec_);
+  }
+  if (!s.ok()) {
+    KLOG_EVERY_N_SECS(WARNING, 60) << LogPrefix()
+        << "Unable to train WAL compression dictionary: " << s.ToString();
+    next_dict_codec_.reset();
+    return;
+  }
+  VLOG_WITH_PREFIX(1) << Substitute("Trained $0-byte compression dictionary from $1 samples in $2",
+                                    dict.size(), samples.size(),
+                                    (MonoTime::Now() - start).ToString());
+  next_dict_ = std::move(dict);
+}
+
+void Log::InitSegmentCompression(LogSegmentHeaderPB* header) {
+  codec_ = configured_codec_;
+  dict_codec_.reset();
+  if (!configured_codec_) {
+    return;
+  }
+  header->set_compression_codec(configured_codec_->type());
+  if (!next_dict_codec_) {
+    return;
+  }
+  dict_codec_ = std::move(next_dict_codec_);
+  header->set_compression_dictionary(next_dict_);
+  next_dict_.clear();
+  header->add_incompatible_features(LogSegmentHeaderPB::COMPRESSION_DICTIONARY);
+  // Batches which don't shrink when compressed are written as-is. Only done
+  // in segments with a dictionary, which older readers can't read anyway, so
+  // that the other segments stay readable by them.
+  header->add_incompatible_features(LogSegmentHeaderPB::MIXED_COMPRESSION);
+  codec_ = dict_codec_.get();
+}
+
 Status Log::AllocateSegmentAndRollOver() {
   CHECK(!FLAGS_raft_derived_log_mode);
   RETURN_NOT_OK(AsyncAllocateSegment());
@@ -882,6 +1050,44 @@ Status Log::TruncateOpsAfter(int64_t index) {
   return Status::OK();
 }
 
+Status Log::ResetToSnapshot(const consensus::OpId& last_included) {
+  CHECK(!FLAGS_raft_derived_log_mode);
+  LOG_WITH_PREFIX(INFO) << "Resetting the log to start after snapshot through op "
+                        << consensus::OpIdToString(last_included);
+
+  // Have the append thread roll over to a new segment: the FLUSH_MARKER
+  // appended by WaitUntilAllFlushed() switches to it once it's allocated.
+  {
+    std::lock_guard<RWMutex> l(allocation_lock_);
+    if (allocation_state_ == kAllocationNotStarted) {
+      RETURN_NOT_OK(AsyncAllocateSegmentUnlocked());
+    }
+  }
+  RETURN_NOT_OK(allocation_status_.Get());
+  RETURN_NOT_OK(WaitUntilAllFlushed());
+
+  // Everything before the new active segment is covered by the snapshot.
+  SegmentSequence segments_to_delete;
+  {
+    std::lock_guard<profiled_percpu_rwlock> l(state_lock_);
+    CHECK_EQ(kLogWriting, log_state_);
+    RETURN_NOT_OK(reader_->GetSegmentsSnapshot(&segments_to_delete));
+    while (!segments_to_delete.empty() &&
+           segments_to_delete.back()->header().sequence_number() >=
+               active_segment_sequence_number_) {
+      segments_to_delete.pop_back();
+    }
+    if (!segments_to_delete.empty()) {
+      RETURN_NOT_OK(reader_->TrimSegmentsUpToAndIncluding(
+          segments_to_delete.back()->header().sequence_number()));
+    }
+  }
+  int32_t num_deleted;
+  RETURN_NOT_OK(DeleteTrimmedSegments(&segments_to_delete, &num_deleted));
+  log_index_->GC(last_included.index() + 1);
+  return Status::OK();
+}
+
 Status Log::GC(RetentionIndexes retention_indexes, int32_t* num_gced) {
   CHECK_GE(retention_indexes.for_durability, 0);
   CHECK(!FLAGS_raft_derived_log_mode);
@@ -893,7 +1099,7 @@ Status Log::GC(RetentionIndexes retention_indexes, int32_t* num_gced) {
     SegmentSequence segments_to_delete;
 
     {
-      std::lock_guard<percpu_rwlock> l(state_lock_);
+      std::lock_guard<profiled_percpu_rwlock> l(state_lock_);
       CHECK_EQ(kLogWriting, log_state_);
 
       RETURN_NOT_OK(GetSegmentsToGCUnlocked(retention_indexes, &segments_to_delete));
@@ -910,19 +1116,7 @@ Status Log::GC(RetentionIndexes retention_indexes, int32_t* num_gced) {
     }
 
     // Now that they are no longer referenced by the Log, delete the files.
-    *num_gced = 0;
-    for (const scoped_refptr<ReadableLogSegment>& segment : segments_to_delete) {
-      string ops_str;
-      if (segment->HasFooter() && segment->footer().has_min_replicate_index()) {
-        DCHECK(segment->footer().has_max_replicate_index());
-        ops_str = Substitute(" (ops $0-$1)",
-                             segment->footer().min_replicate_index(),
-                             segment->footer().max_replicate_index());
-      }
-      LOG_WITH_PREFIX(INFO) << "Deleting log segment in path: " << segment->path() << ops_str;
-      RETURN_NOT_OK(fs_manager_->env()->DeleteFile(segment->path()));
-      (*num_gced)++;
-    }
+    RETURN_NOT_OK(DeleteTrimmedSegments(&segments_to_delete, num_gced));
 
     // Determine the minimum remaining replicate index in order to properly GC
     // the index chunks.
@@ -934,6 +1128,38 @@ Status Log::GC(RetentionIndexes retention_indexes, int32_t* num_gced) {
   return Status::OK();
 }
 
+Status Log::DeleteTrimmedSegments(SegmentSequence* segments, int32_t* num_deleted) {
+  *num_deleted = 0;
+  for (scoped_refptr<ReadableLogSegment>& segment : *segments) {
+    string ops_str;
+    if (segment->HasFooter() && segment->footer().has_min_replicate_index()) {
+      DCHECK(segment->footer().has_max_replicate_index());
+      ops_str = Substitute(" (ops $0-$1)",
+                           segment->footer().min_replicate_index(),
+                           segment->footer().max_replicate_index());
+    }
+    const string path = segment->path();
+
+    // A recycled file gets overwritten, and a file being deleted gets
+    // truncated, so only do either if nothing else is still reading the
+    // segment. Otherwise the file is just unlinked.
+    bool recycled = false;
+    const bool unreferenced = segment->HasOneRef();
+    if (unreferenced) {
+      segment.reset();
+      RETURN_NOT_OK(MaybeRecycleSegment(path, &recycled));
+    }
+    if (recycled) {
+      LOG_WITH_PREFIX(INFO) << "Recycled log segment in path: " << path << ops_str;
+    } else {
+      LOG_WITH_PREFIX(INFO) << "Deleting log segment in path: " << path << ops_str;
+      RETURN_NOT_OK(ScheduleSegmentDeletion(path, unreferenced));
+    }
+    (*num_deleted)++;
+  }
+  return Status::OK();
+}
+
 int64_t Log::GetGCableDataSize(RetentionIndexes retention_indexes) const {
   CHECK(!FLAGS_raft_derived_log_mode);
   CHECK_GE(retention_indexes.for_durability, 0);
@@ -988,6 +1214,11 @@ int64_t Log::OnDiskSize() {
   for (const auto& segment : segments) {
     ret += segment->file_size();
   }
+  {
+    std::lock_guard<simple_spinlock> l(recycle_lock_);
+    ret += recycled_bytes_;
+  }
+  ret += pending_delete_bytes_.load();
 
   on_disk_size_.store(ret, std::memory_order_relaxed);
   return ret;
@@ -1018,10 +1249,15 @@ Status Log::LookupOpId(int64_t op_index, OpId* op_id) const {
 
 Status Log::Close() {
   CHECK(!FLAGS_raft_derived_log_mode);
+  // Don't leave files of GC'd segments behind, but don't hold up closing
+  // either.
+  deletion_unthrottled_ = true;
+  deletion_pool_->Wait();
+  deletion_pool_->Shutdown();
   allocation_pool_->Shutdown();
   append_thread_->Shutdown();
 
-  std::lock_guard<percpu_rwlock> l(state_lock_);
+  std::lock_guard<profiled_percpu_rwlock> l(state_lock_);
   switch (log_state_) {
     case kLogWriting:
       if (log_hooks_) {
@@ -1065,10 +1301,11 @@ Status Log::DeleteOnDiskData(FsManager* fs_manager, const string& tablet_id) {
   if (!env->FileExists(wal_dir)) {
     return Status::OK();
   }
-  LOG(INFO) << Substitute("T $0 P $1: Deleting WAL directory at $2",
-                          tablet_id, fs_manager->uuid(), wal_dir);
-  RETURN_NOT_OK_PREPEND(env->DeleteRecursively(wal_dir),
-                        "Unable to recursively delete WAL dir for tablet " + tablet_id);
+  LOG(INFO) << Substitute("T $0 P $1: Deleting WAL directories at $2",
+                          tablet_id, fs_manager->uuid(),
+                          JoinStrings(fs_manager->GetTabletWalDirs(tablet_id), ", "));
+  RETURN_NOT_OK_PREPEND(fs_manager->DeleteTabletWalDirs(tablet_id),
+                        "Unable to recursively delete WAL dirs for tablet " + tablet_id);
   return Status::OK();
 }
 
@@ -1114,28 +1351,52 @@ Status Log::PreAllocateNewSegment() {
     allocation_state_ = kAllocationFinished;
   });
 
+  // Training can take a while, so it's done here rather than on the append
+  // thread when it switches to the new segment.
+  TrainNextCompressionDictionary();
+
   WritableFileOptions opts;
   opts.sync_on_close = force_sync_all_;
-  RETURN_NOT_OK(CreatePlaceholderSegment(opts, &next_segment_path_, &next_segment_file_));
+  Status s = ReuseRecycledSegment(opts, &next_segment_path_, &next_segment_file_);
+  if (!s.ok()) {
+    KLOG_EVERY_N_SECS(WARNING, 60) << LogPrefix() << "Unable to reuse recycled log segment, "
+                                   << "allocating a new one: " << s.ToString();
+    next_segment_file_.reset();
+  }
+  next_segment_recycled_ = next_segment_file_ != nullptr;
+  if (!next_segment_file_) {
+    RETURN_NOT_OK(CreatePlaceholderSegment(opts, &next_segment_path_, &next_segment_file_));
+  }
 
   MAYBE_RETURN_FAILURE(FLAGS_log_inject_io_error_on_preallocate_fraction,
                        Status::IOError("Injected IOError in Log::PreAllocateNewSegment()"));
 
-  if (options_.preallocate_segments) {
-    TRACE("Preallocating $0 byte segment in $1", max_segment_size_, next_segment_path_);
+  // A recycled file already holds the space it used to, so only what's
+  // missing of it needs to be allocated.
+  uint64_t reused_size = 0;
+  RETURN_NOT_OK(fs_manager_->env()->GetFileSize(next_segment_path_, &reused_size));
+  if (options_.preallocate_segments && reused_size < max_segment_size_) {
+    const uint64_t size = max_segment_size_ - reused_size;
+    TRACE("Preallocating $0 byte segment in $1", size, next_segment_path_);
     RETURN_NOT_OK(env_util::VerifySufficientDiskSpace(fs_manager_->env(),
                                                       next_segment_path_,
-                                                      max_segment_size_,
+                                                      size,
                                                       FLAGS_fs_wal_dir_reserved_bytes));
     // TODO (perf) zero the new segments -- this could result in
     // additional performance improvements.
-    RETURN_NOT_OK(next_segment_file_->PreAllocate(max_segment_size_));
+    RETURN_NOT_OK(next_segment_file_->PreAllocate(size));
   }
 
   return Status::OK();
 }
 
 Status Log::SwitchToAllocatedSegment() {
+  gscoped_ptr<WritableLogSegment> new_segment;
+  RETURN_NOT_OK(OpenAllocatedSegment(&new_segment));
+  return SwitchToOpenedSegment(std::move(new_segment));
+}
+
+Status Log::OpenAllocatedSegment(gscoped_ptr<WritableLogSegment>* new_segment) {
   CHECK(!FLAGS_raft_derived_log_mode);
   CHECK_EQ(allocation_state(), kAllocationFinished);
 
@@ -1145,29 +1406,26 @@ Status Log::SwitchToAllocatedSegment() {
   string new_segment_path = fs_manager_->GetWalSegmentFileName(tablet_id_,
                                                                active_segment_sequence_number_);
 
+  DCHECK_EQ(next_segment_dir_, DirName(new_segment_path));
   RETURN_NOT_OK(fs_manager_->env()->RenameFile(next_segment_path_, new_segment_path));
   if (force_sync_all_) {
-    RETURN_NOT_OK(fs_manager_->env()->SyncDir(log_dir_));
+    RETURN_NOT_OK(fs_manager_->env()->SyncDir(next_segment_dir_));
   }
 
   // Create a new segment.
-  gscoped_ptr<WritableLogSegment> new_segment(
-      new WritableLogSegment(new_segment_path, next_segment_file_));
+  new_segment->reset(new WritableLogSegment(new_segment_path, next_segment_file_));
 
-  // Set up the new header and footer.
+  // Set up the new header.
   LogSegmentHeaderPB header;
   header.set_sequence_number(active_segment_sequence_number_);
   header.set_tablet_id(tablet_id_);
 
-  if (codec_) {
-    header.set_compression_codec(codec_->type());
+  InitSegmentCompression(&header);
+  if (next_segment_recycled_) {
+    // The file still holds the entries of the segment it was used for before.
+    header.add_incompatible_features(LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS);
   }
 
-  // Set up the new footer. This will be maintained as the segment is written.
-  footer_builder_.Clear();
-  footer_builder_.set_num_entries(0);
-
-
 #ifdef FB_DO_NOT_REMOVE
   // Set the new segment's schema.
   {
@@ -1177,13 +1435,21 @@ Status Log::SwitchToAllocatedSegment() {
   }
 #endif
 
-  RETURN_NOT_OK(new_segment->WriteHeaderAndOpen(header));
+  return (*new_segment)->WriteHeaderAndOpen(header);
+}
+
+Status Log::SwitchToOpenedSegment(gscoped_ptr<WritableLogSegment> new_segment) {
+  CHECK(!FLAGS_raft_derived_log_mode);
+
+  // Set up the new footer. This will be maintained as the segment is written.
+  footer_builder_.Clear();
+  footer_builder_.set_num_entries(0);
 
   // Transform the currently-active segment into a readable one, since we
   // need to be able to replay the segments for other peers.
   {
     if (active_segment_.get() != nullptr) {
-      std::lock_guard<percpu_rwlock> l(state_lock_);
+      std::lock_guard<profiled_percpu_rwlock> l(state_lock_);
       CHECK_OK(ReplaceSegmentInReaderUnlocked());
     }
   }
@@ -1194,11 +1460,12 @@ Status Log::SwitchToAllocatedSegment() {
   unique_ptr<RandomAccessFile> readable_file;
 
   RandomAccessFileOptions opts;
-  RETURN_NOT_OK(fs_manager_->env()->NewRandomAccessFile(opts, new_segment_path, &readable_file));
+  RETURN_NOT_OK(fs_manager_->env()->NewRandomAccessFile(opts, new_segment->path(),
+                                                        &readable_file));
   scoped_refptr<ReadableLogSegment> readable_segment(
-    new ReadableLogSegment(new_segment_path,
+    new ReadableLogSegment(new_segment->path(),
                            shared_ptr<RandomAccessFile>(readable_file.release())));
-  RETURN_NOT_OK(readable_segment->Init(header, new_segment->first_entry_offset()));
+  RETURN_NOT_OK(readable_segment->Init(new_segment->header(), new_segment->first_entry_offset()));
   RETURN_NOT_OK(reader_->AppendEmptySegment(readable_segment));
 
   // Now set 'active_segment_' to the new segment.
@@ -1232,7 +1499,7 @@ Status Log::CreatePlaceholderSegment(const WritableFileOptions& opts,
                                      shared_ptr<WritableFile>* out) {
   CHECK(!FLAGS_raft_derived_log_mode);
   string tmp_suffix = strings::Substitute("$0$1", kTmpInfix, ".newsegmentXXXXXX");
-  string path_tmpl = JoinPathSegments(log_dir_, tmp_suffix);
+  string path_tmpl = JoinPathSegments(next_segment_dir_, tmp_suffix);
   VLOG_WITH_PREFIX(2) << "Creating temp. file for place holder segment, template: " << path_tmpl;
   unique_ptr<WritableFile> segment_file;
   RETURN_NOT_OK(fs_manager_->env()->NewTempWritableFile(opts,
@@ -1244,12 +1511,224 @@ Status Log::CreatePlaceholderSegment(const WritableFileOptions& opts,
   return Status::OK();
 }
 
+Status Log::ReuseRecycledSegment(const WritableFileOptions& opts,
+                                 string* result_path,
+                                 shared_ptr<WritableFile>* out) {
+  CHECK(!FLAGS_raft_derived_log_mode);
+  out->reset();
+  string path;
+  uint64_t size;
+  {
+    // Files can't be renamed across WAL directories.
+    std::lock_guard<simple_spinlock> l(recycle_lock_);
+    auto it = std::find_if(recycled_segments_.begin(), recycled_segments_.end(),
+                           [&](const pair<string, uint64_t>& e) {
+                             return DirName(e.first) == next_segment_dir_;
+                           });
+    if (it == recycled_segments_.end()) {
+      return Status::OK();
+    }
+    std::tie(path, size) = *it;
+    recycled_segments_.erase(it);
+    recycled_bytes_ -= size;
+  }
+
+  // If the file can't be reused, get rid of it.
+  Env* env = fs_manager_->env();
+  auto delete_file = MakeScopedCleanup([&]() {
+    WARN_NOT_OK(env->DeleteFile(path),
+                Substitute("$0Unable to delete recycled log segment", LogPrefix()));
+  });
+
+  // Zero a block at either end, covering the old header and footer, so that
+  // neither the file is taken for the old segment nor the old footer for one
+  // of the new segment if the server crashes before the new segment has been
+  // written and closed. The old entries in between are left alone: the new
+  // segment seeds its entry header CRCs with its own sequence number, so
+  // replaying it after a crash stops at its last entry rather than reading on
+  // into the old ones. Appends then overwrite blocks which are already
+  // allocated and written, so that syncing them needn't update any file
+  // system metadata.
+  TRACE("Invalidating $0 byte recycled segment $1", size, path);
+  {
+    RWFileOptions rw_opts;
+    rw_opts.mode = Env::OPEN_EXISTING;
+    unique_ptr<RWFile> file;
+    RETURN_NOT_OK(env->NewRWFile(rw_opts, path, &file));
+    const uint64_t kZeroedBlockSize = 4096;
+    faststring zeros;
+    zeros.resize(std::min(size, kZeroedBlockSize));
+    memset(zeros.data(), 0, zeros.size());
+    RETURN_NOT_OK(file->Write(0, Slice(zeros)));
+    RETURN_NOT_OK(file->Write(size - zeros.size(), Slice(zeros)));
+    RETURN_NOT_OK(file->Sync());
+    RETURN_NOT_OK(file->Close());
+  }
+
+  WritableFileOptions reuse_opts = opts;
+  reuse_opts.mode = Env::OPEN_EXISTING;
+  reuse_opts.overwrite_existing = true;
+  unique_ptr<WritableFile> segment_file;
+  RETURN_NOT_OK(env->NewWritableFile(reuse_opts, path, &segment_file));
+  delete_file.cancel();
+
+  VLOG_WITH_PREFIX(1) << "Reusing recycled WAL segment for next segment, path: " << path;
+  *result_path = std::move(path);
+  out->reset(segment_file.release());
+  return Status::OK();
+}
+
+Status Log::MaybeRecycleSegment(const string& path, bool* recycled) {
+  CHECK(!FLAGS_raft_derived_log_mode);
+  *recycled = false;
+  const int max_recycled = FLAGS_log_max_recycled_segments;
+  {
+    std::lock_guard<simple_spinlock> l(recycle_lock_);
+    if (max_recycled <= 0 || recycled_segments_.size() >= static_cast<size_t>(max_recycled)) {
+      return Status::OK();
+    }
+  }
+
+  // Hidden and tmp-infixed, the recycled file is ignored by the log reader and
+  // deleted along with the other tmp files if the server restarts.
+  Env* env = fs_manager_->env();
+  uint64_t size;
+  RETURN_NOT_OK(env->GetFileSize(path, &size));
+  string recycled_path = JoinPathSegments(
+      DirName(path), Substitute("$0.recycled-$1", kTmpInfix, BaseName(path)));
+  RETURN_NOT_OK(env->RenameFile(path, recycled_path));
+
+  std::lock_guard<simple_spinlock> l(recycle_lock_);
+  recycled_segments_.emplace_back(std::move(recycled_path), size);
+  recycled_bytes_ += size;
+  *recycled = true;
+  return Status::OK();
+}
+
+Status Log::ScheduleSegmentDeletion(const string& path, bool truncate_in_steps) {
+  CHECK(!FLAGS_raft_derived_log_mode);
+  Env* env = fs_manager_->env();
+  uint64_t size;
+  RETURN_NOT_OK(env->GetFileSize(path, &size));
+  string deleting_path = JoinPathSegments(
+      DirName(path), Substitute("$0.deleting-$1", kTmpInfix, BaseName(path)));
+  RETURN_NOT_OK(env->RenameFile(path, deleting_path));
+
+  pending_delete_bytes_ += size;
+  Status s = deletion_pool_->SubmitFunc([this, deleting_path, size, truncate_in_steps]() {
+    DeleteSegmentFile(deleting_path, size, truncate_in_steps);
+  });
+  if (PREDICT_FALSE(!s.ok())) {
+    // The log is closing: delete the file right away.
+    DeleteSegmentFile(deleting_path, size, /*truncate_in_steps=*/false);
+  }
+  return Status::OK();
+}
+
+namespace {
+
+// Paces the freeing of the files of GC'd segments, across all the logs of the
+// server, to --log_gc_delete_rate_bytes_per_sec. Allows bursts of up to a
+// second's worth of bytes.
+class SegmentDeletionThrottle {
+ public:
+  static SegmentDeletionThrottle* Get() {
+    static SegmentDeletionThrottle throttle;
+    return &throttle;
+  }
+
+  // Waits until 'bytes' more may be freed, or until 'unthrottled' is set.
+  //
+  // Nothing is reserved while waiting, so that changes to the rate take
+  // effect right away and waits which are cut short don't hold up others.
+  void Throttle(int64_t bytes, const std::atomic<bool>& unthrottled) {
+    while (!unthrottled) {
+      const int64_t rate = FLAGS_log_gc_delete_rate_bytes_per_sec;
+      if (rate <= 0) {
+        return;
+      }
+      // A step larger than the burst only needs a full bucket, and leaves
+      // it in debt.
+      const double needed = std::min<double>(bytes, rate);
+      MonoDelta wait;
+      {
+        std::lock_guard<simple_spinlock> l(lock_);
+        const MonoTime now = MonoTime::Now();
+        available_bytes_ = std::min<double>(
+            rate, available_bytes_ + (now - last_refill_).ToSeconds() * rate);
+        last_refill_ = now;
+        if (available_bytes_ >= needed) {
+          available_bytes_ -= bytes;
+          return;
+        }
+        wait = MonoDelta::FromSeconds((needed - available_bytes_) / rate);
+      }
+      // Sleep in bounded chunks to notice 'unthrottled' and rate changes.
+      SleepFor(std::min(wait, MonoDelta::FromMilliseconds(100)));
+    }
+  }
+
+ private:
+  SegmentDeletionThrottle()
+      : last_refill_(MonoTime::Now()),
+        available_bytes_(0) {
+  }
+
+  simple_spinlock lock_;
+  MonoTime last_refill_;
+  double available_bytes_;
+};
+
+} // anonymous namespace
+
+void Log::DeleteSegmentFile(const string& path, uint64_t size, bool truncate_in_steps) {
+  TRACE_EVENT1("log", "Log::DeleteSegmentFile", "path", path);
+  Env* env = fs_manager_->env();
+  SegmentDeletionThrottle* throttle = SegmentDeletionThrottle::Get();
+  uint64_t remaining = size;
+
+  // Unlinking a large file frees all of its blocks at once, which can keep
+  // the file system journal busy long enough to stall the appends of other
+  // logs. Truncating it in steps spreads that work out.
+  if (truncate_in_steps) {
+    RWFileOptions opts;
+    opts.mode = Env::OPEN_EXISTING;
+    unique_ptr<RWFile> file;
+    Status s = env->NewRWFile(opts, path, &file);
+    const uint64_t step = FLAGS_log_gc_delete_step_bytes;
+    while (s.ok() && remaining > step) {
+      throttle->Throttle(step, deletion_unthrottled_);
+      s = file->Truncate(remaining - step);
+      if (s.ok()) {
+        remaining -= step;
+        pending_delete_bytes_ -= step;
+      }
+    }
+    if (s.ok()) {
+      s = file->Close();
+    }
+    WARN_NOT_OK(s, Substitute("$0Unable to truncate log segment $1 before deleting it",
+                              LogPrefix(), path));
+  }
+
+  throttle->Throttle(remaining, deletion_unthrottled_);
+  WARN_NOT_OK(env->DeleteFile(path),
+              Substitute("$0Unable to delete log segment", LogPrefix()));
+  pending_delete_bytes_ -= remaining;
+}
+
 std::string Log::LogPrefix() const {
   return Substitute("T $0 P $1: ", tablet_id_, fs_manager_->uuid());
 }
 
 Log::~Log() {
-  // Close() of log is now called from simple_tablet_manager
+  // Close() of log is now called from simple_tablet_manager, which may not
+  // have happened. The deletion tasks use this object's members, so let them
+  // finish before any of those go away.
+  deletion_unthrottled_ = true;
+  deletion_pool_->Wait();
+  deletion_pool_->Shutdown();
+  allocation_pool_->Shutdown();
 }
 
 LogEntryBatch::LogEntryBatch(LogEntryTypePB type,
@@ -1268,7 +1747,7 @@ LogEntryBatch::~LogEntryBatch() {
     for (LogEntryPB& entry : *entry_batch_pb_->mutable_entry()) {
       // ReplicateMsg elements are owned by and must be freed by the caller
       // (e.g. the LogCache).
-      entry.release_replicate();
+      entry.unsafe_arena_release_replicate();
     }
   }
 }
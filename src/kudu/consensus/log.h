@@ -27,10 +27,12 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <limits>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <glog/logging.h>
@@ -50,6 +52,7 @@
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/util/blocking_queue.h"
 #include "kudu/util/faststring.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/promise.h"
 #include "kudu/util/rw_mutex.h"
@@ -178,6 +181,12 @@ class Log : public RefCountedThreadSafe<Log> {
 
   virtual Status TruncateOpsAfter(int64_t index);
 
+  // Discards the whole log after a snapshot through 'last_included' was
+  // installed: rolls over to a new segment, which the ops after the snapshot
+  // are appended to, and deletes the segments before it. The caller must make
+  // sure that no REPLICATE messages are appended concurrently.
+  virtual Status ResetToSnapshot(const consensus::OpId& last_included);
+
   // Kick off an asynchronous task that pre-allocates a new
   // log-segment, setting 'allocation_status_'. To wait for the
   // result of the task, use allocation_status_.Get().
@@ -201,7 +210,10 @@ class Log : public RefCountedThreadSafe<Log> {
   // provided the log is initialized and not yet closed. After being closed,
   // this function will return NULL, but existing reader references will
   // remain live.
-  std::shared_ptr<LogReader> reader() const { return reader_; }
+  std::shared_ptr<LogReader> reader() const {
+    shared_lock<rw_spinlock> l(state_lock_.get_lock());
+    return reader_;
+  }
 
   void SetMaxSegmentSizeForTests(uint64_t max_segment_size) {
     max_segment_size_ = max_segment_size;
@@ -265,7 +277,8 @@ class Log : public RefCountedThreadSafe<Log> {
   // Note that the returned values are in units of bytes, not MB.
   void GetReplaySizeMap(std::map<int64_t, int64_t>* replay_size) const;
 
-  // Returns the total size of the current segments, in bytes.
+  // Returns the total size of the current segments, in bytes, along with the
+  // files of GC'd segments which are kept for reuse or not yet deleted.
   // Returns 0 if the log is shut down.
   int64_t OnDiskSize();
 
@@ -363,9 +376,44 @@ class Log : public RefCountedThreadSafe<Log> {
   // disk as the header, and sets active_segment_ to point to this new segment.
   Status SwitchToAllocatedSegment();
 
+  // The first half of SwitchToAllocatedSegment(): moves the allocated file
+  // into place as the next segment and writes its header. Doesn't touch the
+  // active segment, which may be closed concurrently.
+  Status OpenAllocatedSegment(gscoped_ptr<WritableLogSegment>* new_segment);
+
+  // The second half of SwitchToAllocatedSegment(): replaces the closed active
+  // segment in the reader and makes 'new_segment' the active one.
+  Status SwitchToOpenedSegment(gscoped_ptr<WritableLogSegment> new_segment);
+
   // Preallocates the space for a new segment.
   Status PreAllocateNewSegment();
 
+  // Sets 'out' to a file recycled from a GC'd segment and 'result_path' to its
+  // path. The old header and footer are zeroed; the old entries are left in
+  // place, and the segment is kept from mistaking them for its own by
+  // LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS. Sets 'out' to nullptr if there
+  // is no recycled file to reuse in the directory of the next segment.
+  Status ReuseRecycledSegment(const WritableFileOptions& opts,
+                              std::string* result_path,
+                              std::shared_ptr<WritableFile>* out);
+
+  // Moves the file of the GC'd segment at 'path' to the pool of recycled
+  // files, unless the pool is full. Sets 'recycled' to false if the caller
+  // should delete the file instead.
+  Status MaybeRecycleSegment(const std::string& path, bool* recycled);
+
+  // Hands the file of the GC'd segment at 'path' over to 'deletion_pool_',
+  // which deletes it at the rate set by --log_gc_delete_rate_bytes_per_sec.
+  // The file is first renamed so that it's ignored by the log reader, and
+  // deleted along with the other tmp files if the server restarts before it's
+  // gone. If 'truncate_in_steps' is true, the file's blocks are freed by
+  // truncating it a step at a time before it is unlinked. Only safe if
+  // nothing else has the file open.
+  Status ScheduleSegmentDeletion(const std::string& path, bool truncate_in_steps);
+
+  // Deletes the file at 'path' of 'size' bytes. Runs on 'deletion_pool_'.
+  void DeleteSegmentFile(const std::string& path, uint64_t size, bool truncate_in_steps);
+
   // Writes serialized contents of 'entry' to the log. Called inside
   // AppenderThread.
   Status DoAppend(LogEntryBatch* entry_batch);
@@ -373,6 +421,21 @@ class Log : public RefCountedThreadSafe<Log> {
   // Update footer_builder_ to reflect the log indexes seen in 'batch'.
   void UpdateFooterForBatch(LogEntryBatch* batch);
 
+  // Add the write payloads in 'batch' to the samples used to train the
+  // compression dictionary of the next segment, until they add up to
+  // --log_compression_dictionary_sample_bytes. Later payloads aren't copied.
+  void SampleForCompressionDictionary(const LogEntryBatch& batch);
+
+  // If enough payloads have been sampled, trains a dictionary from them and
+  // sets 'next_dict_' and 'next_dict_codec_' for the segment being allocated.
+  // Runs on 'allocation_pool_'.
+  void TrainNextCompressionDictionary();
+
+  // Set up the compression codec for a new segment with header 'header',
+  // storing in it the dictionary trained while the segment was allocated, if
+  // any.
+  void InitSegmentCompression(LogSegmentHeaderPB* header);
+
   // Update the LogIndex to include entries for the replicate messages found in
   // 'batch'. The index entry points to the offset 'start_offset' in the current
   // log segment.
@@ -389,6 +452,15 @@ class Log : public RefCountedThreadSafe<Log> {
   Status GetSegmentsToGCUnlocked(RetentionIndexes retention_indexes,
                                  SegmentSequence* segments_to_gc) const;
 
+  // Recycles or deletes the files of 'segments', which must already have
+  // been trimmed from the reader. Sets 'num_deleted' to the number of
+  // segments handled.
+  Status DeleteTrimmedSegments(SegmentSequence* segments, int32_t* num_deleted);
+
+  // Starts allocating a new segment, like AsyncAllocateSegment(). Requires
+  // 'allocation_lock_' to be held in exclusive mode.
+  Status AsyncAllocateSegmentUnlocked();
+
   LogEntryBatchQueue* entry_queue() {
     return &entry_batch_queue_;
   }
@@ -429,14 +501,24 @@ class Log : public RefCountedThreadSafe<Log> {
   // The path for the next allocated segment.
   std::string next_segment_path_;
 
+  // Whether 'next_segment_file_' was recycled from a GC'd segment.
+  bool next_segment_recycled_;
+
+  // The directory of the next allocated segment, which differs from the
+  // directory of the active one when the log is striped across several WAL
+  // directories. Set when the allocation starts.
+  std::string next_segment_dir_;
+
   // Lock to protect mutations to log_state_ and other shared state variables.
-  mutable percpu_rwlock state_lock_;
+  mutable profiled_percpu_rwlock state_lock_;
 
   LogState log_state_;
 
   // A reader for the previous segments that were not yet GC'd.
   //
-  // Will be NULL after the log is Closed().
+  // Will be NULL after the log is Closed(). Only reset by Close(), under
+  // 'state_lock_'. Other threads must hold 'state_lock_' to read it; the
+  // append thread may read it without, since Close() stops that thread first.
   std::shared_ptr<LogReader> reader_;
 
   // Index which translates between operation indexes and the position
@@ -473,8 +555,28 @@ class Log : public RefCountedThreadSafe<Log> {
   mutable RWMutex allocation_lock_;
   SegmentAllocationState allocation_state_;
 
-  // The codec used to compress entries, or nullptr if not configured.
+  // The codec configured by --log_compression_codec, or nullptr if not
+  // configured.
+  const CompressionCodec* configured_codec_;
+
+  // The codec used to compress entries in the active segment, or nullptr if
+  // not configured. Points to 'dict_codec_' if the segment has a dictionary.
   const CompressionCodec* codec_;
+  std::unique_ptr<CompressionCodec> dict_codec_;
+
+  // Write payloads appended since the last dictionary was trained, from which
+  // the compression dictionary of the next segment is trained, and their
+  // total size. Only used if the configured codec supports dictionaries.
+  bool sample_for_dictionary_;
+  simple_spinlock dict_samples_lock_;
+  std::vector<std::string> dict_samples_;
+  size_t dict_samples_bytes_;
+
+  // The dictionary trained for the segment being allocated and a codec using
+  // it, if any. Set by TrainNextCompressionDictionary() before the allocation
+  // finishes, and taken by the append thread when it switches to the segment.
+  std::string next_dict_;
+  std::unique_ptr<CompressionCodec> next_dict_codec_;
 
   scoped_refptr<MetricEntity> metric_entity_;
   gscoped_ptr<LogMetrics> metrics_;
@@ -484,6 +586,22 @@ class Log : public RefCountedThreadSafe<Log> {
   // The cached on-disk size of the log, used to track its size even if it has been closed.
   std::atomic<int64_t> on_disk_size_;
 
+  // Paths and sizes of the files of GC'd segments waiting to be reused by new
+  // segments, oldest first, and their total size. Protected by 'recycle_lock_'.
+  simple_spinlock recycle_lock_;
+  std::deque<std::pair<std::string, uint64_t>> recycled_segments_;
+  int64_t recycled_bytes_;
+
+  // Deletes the files of GC'd segments in the background, one at a time.
+  gscoped_ptr<ThreadPool> deletion_pool_;
+
+  // The total size of the files of GC'd segments which haven't been freed yet.
+  std::atomic<int64_t> pending_delete_bytes_;
+
+  // Set once the log is closing, after which the remaining files are deleted
+  // without throttling.
+  std::atomic<bool> deletion_unthrottled_;
+
   DISALLOW_COPY_AND_ASSIGN(Log);
 };
 
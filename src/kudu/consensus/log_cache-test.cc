@@ -30,8 +30,8 @@
 
 #include "kudu/clock/clock.h"
 #include "kudu/clock/hybrid_clock.h"
-#include "kudu/common/schema.h"
-#include "kudu/common/wire_protocol-test-util.h"
+//#include "kudu/common/schema.h"
+//#include "kudu/common/wire_protocol-test-util.h"
 #include "kudu/consensus/consensus-test-util.h"
 #include "kudu/consensus/consensus.pb.h"
 #include "kudu/consensus/log.h"
@@ -43,6 +43,7 @@
 #include "kudu/fs/fs_manager.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/gutil/map-util.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/gutil/strings/substitute.h"
@@ -74,7 +75,10 @@ static const char* kTestTablet = "test-tablet";
 class LogCacheTest : public KuduTest {
  public:
   LogCacheTest()
-    : schema_(GetSimpleTestSchema()),
+    :
+#ifdef FB_DO_NOT_REMOVE
+      schema_(GetSimpleTestSchema()),
+#endif
       metric_entity_(METRIC_ENTITY_server.Instantiate(&metric_registry_, "LogCacheTest")) {
   }
 
@@ -86,8 +90,10 @@ class LogCacheTest : public KuduTest {
     CHECK_OK(log::Log::Open(log::LogOptions(),
                             fs_manager_.get(),
                             kTestTablet,
+#ifdef FB_DO_NOT_REMOVE
                             schema_,
                             0, // schema_version
+#endif
                             nullptr,
                             &log_));
 
@@ -127,7 +133,9 @@ class LogCacheTest : public KuduTest {
     return Status::OK();
   }
 
+#ifdef FB_DO_NOT_REMOVE
   const Schema schema_;
+#endif
   MetricRegistry metric_registry_;
   scoped_refptr<MetricEntity> metric_entity_;
   gscoped_ptr<FsManager> fs_manager_;
@@ -377,6 +385,67 @@ TEST_F(LogCacheTest, TestTruncation) {
   }
 }
 
+// Test that resetting the cache to a snapshot drops all of the ops and
+// continues from the op after the snapshot.
+TEST_F(LogCacheTest, TestResetToSnapshot) {
+  ASSERT_OK(AppendReplicateMessagesToCache(1, 5, 100));
+  ASSERT_EQ(5, cache_->metrics_.log_cache_num_ops->value());
+
+  cache_->ResetToSnapshot(MakeOpId(2, 20));
+  ASSERT_EQ(0, cache_->metrics_.log_cache_num_ops->value());
+  ASSERT_EQ(0, cache_->metrics_.log_cache_size->value());
+  ASSERT_TRUE(cache_->HasOpBeenWritten(20));
+  ASSERT_FALSE(cache_->HasOpBeenWritten(21));
+
+  ASSERT_OK(AppendReplicateMessagesToCache(21, 2, 100));
+  ASSERT_EQ(2, cache_->metrics_.log_cache_num_ops->value());
+  OpId op;
+  ASSERT_OK(cache_->LookupOpId(22, &op));
+  ASSERT_OPID_EQ(MakeOpId(3, 22), op);
+}
+
+// The arenas of the ops allocated by the leader are charged to the cache's
+// arena tracker, and the last few cached ops of an evicted arena are moved off
+// it so that it can be freed.
+TEST_F(LogCacheTest, TestArenaOps) {
+  const shared_ptr<MemTracker>& arena_tracker = cache_->arena_mem_tracker();
+  ReplicateMsgAllocator allocator(16 * 1024, arena_tracker);
+
+  // Append ops until they span a few arenas, and find the first op of the
+  // second arena.
+  int64_t second_arena_index = 0;
+  {
+    vector<ReplicateRefPtr> ops;
+    for (int64_t index = 1; index <= 1000; index++) {
+      ReplicateRefPtr msg = allocator.NewReplicateMsg();
+      *msg->get()->mutable_id() = MakeOpId(1, index);
+      msg->get()->set_op_type(NO_OP);
+      msg->get()->mutable_noop_request();
+      msg->get()->set_timestamp(clock_->Now().ToUint64());
+      ASSERT_OK(cache_->AppendOperations({ msg }, Bind(&FatalOnError)));
+      if (second_arena_index == 0 && !ops.empty() && msg->arena() != ops.front()->arena()) {
+        second_arena_index = index;
+      }
+      ops.emplace_back(std::move(msg));
+    }
+  }
+  ASSERT_GT(second_arena_index, 2);
+  log_->WaitUntilAllFlushed();
+  const int64_t consumption = arena_tracker->consumption();
+  ASSERT_GT(consumption, 0);
+
+  // Evicting all but the last op of the first arena moves that op to the heap
+  // and frees the arena. The log may take a moment to drop its references.
+  const int64_t last_index = second_arena_index - 1;
+  ASSERT_EVENTUALLY([&]() {
+      cache_->EvictThroughOp(last_index - 1);
+      ASSERT_EQ(nullptr, FindOrDie(cache_->cache_, last_index).msg->arena());
+    });
+  ASSERT_EQ(last_index, FindOrDie(cache_->cache_, last_index).msg->get()->id().index());
+  ASSERT_NE(nullptr, FindOrDie(cache_->cache_, second_arena_index).msg->arena());
+  ASSERT_LT(arena_tracker->consumption(), consumption);
+}
+
 TEST_F(LogCacheTest, TestMTReadAndWrite) {
   atomic<bool> stop { false };
   vector<thread> threads;
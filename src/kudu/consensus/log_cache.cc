@@ -35,6 +35,7 @@
 #include "kudu/consensus/opid.pb.h"
 #include "kudu/consensus/opid_util.h"
 #include "kudu/consensus/ref_counted_replicate.h"
+#include "kudu/consensus/replication_trace.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/bind_helpers.h"
 #include "kudu/gutil/map-util.h"
@@ -42,6 +43,7 @@
 #include "kudu/gutil/strings/human_readable.h"
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/util/flag_tags.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/mem_tracker.h"
@@ -79,6 +81,8 @@ static const char kParentMemTrackerId[] = "log_cache";
 
 typedef vector<const ReplicateMsg*>::const_iterator MsgIter;
 
+static LockSite g_log_cache_lock_site("LogCache::lock_");
+
 LogCache::LogCache(const scoped_refptr<MetricEntity>& metric_entity,
                    scoped_refptr<log::Log> log,
                    string local_uuid,
@@ -86,6 +90,7 @@ LogCache::LogCache(const scoped_refptr<MetricEntity>& metric_entity,
   : log_(std::move(log)),
     local_uuid_(std::move(local_uuid)),
     tablet_id_(std::move(tablet_id)),
+    lock_(&g_log_cache_lock_site),
     next_sequential_op_index_(0),
     min_pinned_op_index_(0),
     metrics_(metric_entity) {
@@ -105,6 +110,12 @@ LogCache::LogCache(const scoped_refptr<MetricEntity>& metric_entity,
                                      local_uuid, tablet_id),
       parent_tracker_);
 
+  // The arenas of the ReplicateMsgs allocated by the leader count against the
+  // global limit too, but aren't freed by evicting this tablet's ops alone.
+  arena_tracker_ = MemTracker::CreateTracker(
+      -1, Substitute("$0:$1:$2:arenas", kParentMemTrackerId, local_uuid, tablet_id),
+      parent_tracker_);
+
   // Put a fake message at index 0, since this simplifies a lot of our
   // code paths elsewhere.
   auto zero_op = new ReplicateMsg();
@@ -118,7 +129,7 @@ LogCache::~LogCache() {
 }
 
 void LogCache::Init(const OpId& preceding_op) {
-  std::lock_guard<simple_spinlock> l(lock_);
+  std::lock_guard<profiled_spinlock> l(lock_);
   CHECK_EQ(cache_.size(), 1)
     << "Cache should have only our special '0' op";
   next_sequential_op_index_ = preceding_op.index() + 1;
@@ -127,7 +138,7 @@ void LogCache::Init(const OpId& preceding_op) {
 
 void LogCache::TruncateOpsAfter(int64_t index) {
   {
-    std::unique_lock<simple_spinlock> l(lock_);
+    std::unique_lock<profiled_spinlock> l(lock_);
     TruncateOpsAfterUnlocked(index);
   }
 
@@ -163,6 +174,21 @@ void LogCache::TruncateOpsAfterUnlocked(int64_t index) {
   next_sequential_op_index_ = index + 1;
 }
 
+void LogCache::ResetToSnapshot(const OpId& last_included) {
+  std::lock_guard<profiled_spinlock> l(lock_);
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    // Keep our special '0' op.
+    if (it->first == 0) {
+      ++it;
+      continue;
+    }
+    AccountForMessageRemovalUnlocked(it->second);
+    it = cache_.erase(it);
+  }
+  next_sequential_op_index_ = last_included.index() + 1;
+  min_pinned_op_index_ = next_sequential_op_index_;
+}
+
 Status LogCache::AppendOperations(const vector<ReplicateRefPtr>& msgs,
                                   const StatusCallback& callback) {
   CHECK_GT(msgs.size(), 0);
@@ -172,7 +198,13 @@ Status LogCache::AppendOperations(const vector<ReplicateRefPtr>& msgs,
   int64_t mem_required = 0;
   vector<CacheEntry> entries_to_insert;
   entries_to_insert.reserve(msgs.size());
+  ReplicateArena* last_arena = nullptr;
   for (const auto& msg : msgs) {
+    // The ops are filled in by now, so their arenas are done growing for them.
+    if (msg->arena() != nullptr && msg->arena() != last_arena) {
+      last_arena = msg->arena();
+      last_arena->UpdateMemTracker();
+    }
     CacheEntry e = { msg, static_cast<int64_t>(msg->get()->SpaceUsedLong()) };
     mem_required += e.mem_usage;
     entries_to_insert.emplace_back(std::move(e));
@@ -181,7 +213,7 @@ Status LogCache::AppendOperations(const vector<ReplicateRefPtr>& msgs,
   int64_t first_idx_in_batch = msgs.front()->get()->id().index();
   int64_t last_idx_in_batch = msgs.back()->get()->id().index();
 
-  std::unique_lock<simple_spinlock> l(lock_);
+  std::unique_lock<profiled_spinlock> l(lock_);
   // If we're not appending a consecutive op we're likely overwriting and
   // need to replace operations in the cache.
   if (first_idx_in_batch != next_sequential_op_index_) {
@@ -226,9 +258,15 @@ Status LogCache::AppendOperations(const vector<ReplicateRefPtr>& msgs,
   metrics_.log_cache_size->IncrementBy(mem_required);
   metrics_.log_cache_num_ops->IncrementBy(msgs.size());
 
+  ReplicationTrace* trace = ReplicationTrace::GetSingleton();
+  for (const auto& msg : msgs) {
+    trace->Record(ReplicationStage::kLogCacheAppend, msg->get()->id());
+  }
+
   Status log_status = log_->AsyncAppendReplicates(
     msgs, Bind(&LogCache::LogCallback,
                Unretained(this),
+               msgs.front()->get()->id(),
                last_idx_in_batch,
                borrowed_memory,
                callback));
@@ -239,16 +277,20 @@ Status LogCache::AppendOperations(const vector<ReplicateRefPtr>& msgs,
     return log_status;
   }
 
-
   return Status::OK();
 }
 
-void LogCache::LogCallback(int64_t last_idx_in_batch,
+void LogCache::LogCallback(const OpId& first_id_in_batch,
+                           int64_t last_idx_in_batch,
                            bool borrowed_memory,
                            const StatusCallback& user_callback,
                            const Status& log_status) {
   if (log_status.ok()) {
-    std::lock_guard<simple_spinlock> l(lock_);
+    ReplicationTrace::GetSingleton()->RecordRange(ReplicationStage::kWalGroupCommit,
+                                                  first_id_in_batch.term(),
+                                                  first_id_in_batch.index() - 1,
+                                                  last_idx_in_batch);
+    std::lock_guard<profiled_spinlock> l(lock_);
     if (min_pinned_op_index_ <= last_idx_in_batch) {
       VLOG_WITH_PREFIX_UNLOCKED(1) << "Updating pinned index to " << (last_idx_in_batch + 1);
       min_pinned_op_index_ = last_idx_in_batch + 1;
@@ -267,14 +309,14 @@ void LogCache::LogCallback(int64_t last_idx_in_batch,
 }
 
 bool LogCache::HasOpBeenWritten(int64_t index) const {
-  std::lock_guard<simple_spinlock> l(lock_);
+  std::lock_guard<profiled_spinlock> l(lock_);
   return index < next_sequential_op_index_;
 }
 
 Status LogCache::LookupOpId(int64_t op_index, OpId* op_id) const {
   // First check the log cache itself.
   {
-    std::lock_guard<simple_spinlock> l(lock_);
+    std::lock_guard<profiled_spinlock> l(lock_);
 
     // We sometimes try to look up OpIds that have never been written
     // on the local node. In that case, don't try to read the op from
@@ -315,7 +357,7 @@ Status LogCache::ReadOps(int64_t after_op_index,
   DCHECK_GE(after_op_index, 0);
   RETURN_NOT_OK(LookupOpId(after_op_index, preceding_op));
 
-  std::unique_lock<simple_spinlock> l(lock_);
+  std::unique_lock<profiled_spinlock> l(lock_);
   int64_t next_index = after_op_index + 1;
 
   // Return as many operations as we can, up to the limit
@@ -384,7 +426,7 @@ Status LogCache::ReadOps(int64_t after_op_index,
 
 
 void LogCache::EvictThroughOp(int64_t index) {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  std::lock_guard<profiled_spinlock> lock(lock_);
 
   EvictSomeUnlocked(index, MathLimits<int64_t>::kMax);
 }
@@ -428,9 +470,46 @@ void LogCache::EvictSomeUnlocked(int64_t stop_after_index, int64_t bytes_to_evic
       break;
     }
   }
+  MoveOpsOffOldestArenaUnlocked();
   VLOG_WITH_PREFIX_UNLOCKED(1) << "Evicting log cache: after state: " << ToStringUnlocked();
 }
 
+void LogCache::MoveOpsOffOldestArenaUnlocked() {
+  DCHECK(lock_.is_locked());
+  // Ops are allocated on arenas in index order, so eviction leaves at most
+  // the arena of the oldest cached op partly cached. If only a few of its ops
+  // are left, the cache would keep the whole arena alive for them, so copy
+  // them to the heap instead.
+  auto first = cache_.begin();
+  if (first != cache_.end() && first->first == 0) {
+    ++first;
+  }
+  if (first == cache_.end()) {
+    return;
+  }
+  const ReplicateArena* arena = first->second.msg->arena();
+  if (arena == nullptr || !arena->retired()) {
+    return;
+  }
+  int64_t cached_bytes = 0;
+  auto last = first;
+  for (; last != cache_.end() && last->second.msg->arena() == arena; ++last) {
+    // An op also used by a peer keeps the arena alive anyway.
+    if (!last->second.msg->HasOneRef()) {
+      return;
+    }
+    cached_bytes += last->second.mem_usage;
+    if (cached_bytes > arena->SpaceAllocated() / 4) {
+      return;
+    }
+  }
+  for (auto iter = first; iter != last; ++iter) {
+    VLOG_WITH_PREFIX_UNLOCKED(2) << "Moving " << iter->second.msg->get()->id()
+                                 << " off its arena";
+    iter->second.msg = make_scoped_refptr_replicate(new ReplicateMsg(*iter->second.msg->get()));
+  }
+}
+
 void LogCache::AccountForMessageRemovalUnlocked(const LogCache::CacheEntry& entry) {
   tracker_->Release(entry.mem_usage);
   metrics_.log_cache_size->DecrementBy(entry.mem_usage);
@@ -442,7 +521,7 @@ int64_t LogCache::BytesUsed() const {
 }
 
 string LogCache::StatsString() const {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  std::lock_guard<profiled_spinlock> lock(lock_);
   return StatsStringUnlocked();
 }
 
@@ -453,7 +532,7 @@ string LogCache::StatsStringUnlocked() const {
 }
 
 std::string LogCache::ToString() const {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  std::lock_guard<profiled_spinlock> lock(lock_);
   return ToStringUnlocked();
 }
 
@@ -478,7 +557,7 @@ void LogCache::DumpToLog() const {
 }
 
 void LogCache::DumpToStrings(vector<string>* lines) const {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  std::lock_guard<profiled_spinlock> lock(lock_);
   int counter = 0;
   lines->push_back(ToStringUnlocked());
   lines->push_back("Messages:");
@@ -495,7 +574,7 @@ void LogCache::DumpToStrings(vector<string>* lines) const {
 void LogCache::DumpToHtml(std::ostream& out) const {
   using std::endl;
 
-  std::lock_guard<simple_spinlock> lock(lock_);
+  std::lock_guard<profiled_spinlock> lock(lock_);
   out << "<h3>Messages:</h3>" << endl;
   out << "<table>" << endl;
   out << "<tr><th>Entry</th><th>OpId</th><th>Type</th><th>Size</th><th>Status</th></tr>" << endl;
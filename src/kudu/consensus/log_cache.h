@@ -29,6 +29,7 @@
 #include "kudu/consensus/ref_counted_replicate.h"
 #include "kudu/gutil/macros.h"
 #include "kudu/gutil/ref_counted.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/status.h"
@@ -106,6 +107,14 @@ class LogCache {
   // not persist across server restarts.
   void TruncateOpsAfter(int64_t index);
 
+  // Drop all operations and make the next AppendOperations() call follow
+  // 'last_included', the last op covered by a snapshot installed in place of
+  // the ops up to it.
+  //
+  // The dropped operations are not removed from the log, which then lacks
+  // those between its last op and the snapshot.
+  void ResetToSnapshot(const OpId& last_included);
+
   // Return true if an operation with the given index has been written through
   // the cache. The operation may not necessarily be durable yet -- it could still be
   // en route to the log.
@@ -117,6 +126,12 @@ class LogCache {
   // Return the number of bytes of memory currently in use by the cache.
   int64_t BytesUsed() const;
 
+  // The MemTracker from which the arenas of the ops appended by the leader
+  // should consume their memory (see ReplicateMsgAllocator).
+  const std::shared_ptr<MemTracker>& arena_mem_tracker() const {
+    return arena_tracker_;
+  }
+
   int64_t num_cached_ops() const {
     return metrics_.log_cache_num_ops->value();
   }
@@ -144,9 +159,11 @@ class LogCache {
 
  private:
   FRIEND_TEST(LogCacheTest, TestAppendAndGetMessages);
+  FRIEND_TEST(LogCacheTest, TestArenaOps);
   FRIEND_TEST(LogCacheTest, TestGlobalMemoryLimit);
   FRIEND_TEST(LogCacheTest, TestReplaceMessages);
   FRIEND_TEST(LogCacheTest, TestTruncation);
+  FRIEND_TEST(LogCacheTest, TestResetToSnapshot);
   friend class LogCacheTest;
 
   // An entry in the cache.
@@ -162,6 +179,11 @@ class LogCache {
   // 'stop_after_index' has been evicted, whichever comes first.
   void EvictSomeUnlocked(int64_t stop_after_index, int64_t bytes_to_evict);
 
+  // Copies the cached ops of the arena of the oldest cached op to the heap,
+  // if they are the only ones keeping the arena alive and take up a small
+  // part of it.
+  void MoveOpsOffOldestArenaUnlocked();
+
   // Update metrics and MemTracker to account for the removal of the
   // given message.
   void AccountForMessageRemovalUnlocked(const CacheEntry& entry);
@@ -175,7 +197,8 @@ class LogCache {
 
   std::string LogPrefixUnlocked() const;
 
-  void LogCallback(int64_t last_idx_in_batch,
+  void LogCallback(const OpId& first_id_in_batch,
+                   int64_t last_idx_in_batch,
                    bool borrowed_memory,
                    const StatusCallback& user_callback,
                    const Status& log_status);
@@ -188,7 +211,7 @@ class LogCache {
   // The id of the tablet.
   const std::string tablet_id_;
 
-  mutable simple_spinlock lock_;
+  mutable profiled_spinlock lock_;
 
   // An ordered map that serves as the buffer for the cached messages.
   // Maps from log index -> ReplicateMsg
@@ -218,6 +241,12 @@ class LogCache {
   // A MemTracker for this instance.
   std::shared_ptr<MemTracker> tracker_;
 
+  // A MemTracker for the arenas of the ops appended by the leader, a sibling
+  // of 'tracker_'. The cache entries are charged their SpaceUsedLong(),
+  // which covers their payloads, while the arenas hold the rest of the ops.
+  // The part of each cached op which lives on its arena is counted twice.
+  std::shared_ptr<MemTracker> arena_tracker_;
+
   struct Metrics {
     explicit Metrics(const scoped_refptr<MetricEntity>& metric_entity);
 
@@ -82,9 +82,19 @@ Status LogReader::Open(Env* env,
                        const string& tablet_id,
                        const scoped_refptr<MetricEntity>& metric_entity,
                        shared_ptr<LogReader>* reader) {
+  return LogReader::Open(env, vector<string>({ tablet_wal_dir }), index, tablet_id,
+                         metric_entity, reader);
+}
+
+Status LogReader::Open(Env* env,
+                       const vector<string>& tablet_wal_dirs,
+                       const scoped_refptr<LogIndex>& index,
+                       const string& tablet_id,
+                       const scoped_refptr<MetricEntity>& metric_entity,
+                       shared_ptr<LogReader>* reader) {
   auto log_reader = LogReader::make_shared(env, index, tablet_id, metric_entity);
 
-  RETURN_NOT_OK_PREPEND(log_reader->Init(tablet_wal_dir),
+  RETURN_NOT_OK_PREPEND(log_reader->Init(tablet_wal_dirs),
                         "Unable to initialize log reader")
   *reader = log_reader;
   return Status::OK();
@@ -95,7 +105,7 @@ Status LogReader::Open(FsManager* fs_manager,
                        const std::string& tablet_id,
                        const scoped_refptr<MetricEntity>& metric_entity,
                        std::shared_ptr<LogReader>* reader) {
-  return LogReader::Open(fs_manager->env(), fs_manager->GetTabletWalDir(tablet_id),
+  return LogReader::Open(fs_manager->env(), fs_manager->GetTabletWalDirs(tablet_id),
                          index, tablet_id, metric_entity, reader);
 }
 
@@ -106,6 +116,7 @@ LogReader::LogReader(Env* env,
     : env_(env),
       log_index_(std::move(index)),
       tablet_id_(std::move(tablet_id)),
+      segments_(std::make_shared<SegmentSequence>()),
       state_(kLogReaderInitialized) {
   if (metric_entity) {
     bytes_read_ = METRIC_log_reader_bytes_read.Instantiate(metric_entity);
@@ -117,11 +128,8 @@ LogReader::LogReader(Env* env,
 LogReader::~LogReader() {
 }
 
-Status LogReader::Init(const string& tablet_wal_path) {
-  {
-    std::lock_guard<simple_spinlock> lock(lock_);
-    CHECK_EQ(state_, kLogReaderInitialized) << "bad state for Init(): " << state_;
-  }
+Status LogReader::ReadSegmentsFromPath(const string& tablet_wal_path,
+                                       SegmentSequence* read_segments) {
   VLOG(1) << "Reading wal from path:" << tablet_wal_path;
 
   if (!env_->FileExists(tablet_wal_path)) {
@@ -135,8 +143,6 @@ Status LogReader::Init(const string& tablet_wal_path) {
   RETURN_NOT_OK_PREPEND(env_->GetChildren(tablet_wal_path, &log_files),
                         "Unable to read children from path");
 
-  SegmentSequence read_segments;
-
   // build a log segment from each file
   for (const string &log_file : log_files) {
     if (HasPrefixString(log_file, FsManager::kWalFileNamePrefix)) {
@@ -162,9 +168,21 @@ Status LogReader::Init(const string& tablet_wal_path) {
         RETURN_NOT_OK(segment->RebuildFooterByScanning());
       }
 
-      read_segments.push_back(segment);
+      read_segments->push_back(segment);
     }
   }
+  return Status::OK();
+}
+
+Status LogReader::Init(const vector<string>& tablet_wal_paths) {
+  {
+    std::lock_guard<simple_spinlock> lock(lock_);
+    CHECK_EQ(state_.load(), kLogReaderInitialized) << "bad state for Init(): " << state_.load();
+  }
+  SegmentSequence read_segments;
+  for (const string& tablet_wal_path : tablet_wal_paths) {
+    RETURN_NOT_OK(ReadSegmentsFromPath(tablet_wal_path, &read_segments));
+  }
 
   // Sort the segments by sequence number.
   std::sort(read_segments.begin(), read_segments.end(), LogSegmentSeqnoComparator());
@@ -201,11 +219,17 @@ Status LogReader::InitEmptyReaderForTests() {
 }
 
 
+void LogReader::PublishSegmentsUnlocked(SegmentSequence segments) {
+  DCHECK(lock_.is_locked());
+  std::atomic_store(&segments_, shared_ptr<const SegmentSequence>(
+      std::make_shared<SegmentSequence>(std::move(segments))));
+}
+
 int64_t LogReader::GetMinReplicateIndex() const {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  const shared_ptr<const SegmentSequence> segs = segments();
   int64_t min_remaining_op_idx = -1;
 
-  for (const scoped_refptr<ReadableLogSegment>& segment : segments_) {
+  for (const scoped_refptr<ReadableLogSegment>& segment : *segs) {
     if (!segment->HasFooter()) continue;
     if (!segment->footer().has_min_replicate_index()) continue;
     if (min_remaining_op_idx == -1 ||
@@ -218,21 +242,21 @@ int64_t LogReader::GetMinReplicateIndex() const {
 
 
 scoped_refptr<ReadableLogSegment> LogReader::GetSegmentBySequenceNumber(int64_t seq) const {
-  std::lock_guard<simple_spinlock> lock(lock_);
-  if (segments_.empty()) {
+  const shared_ptr<const SegmentSequence> segs = segments();
+  if (segs->empty()) {
     return nullptr;
   }
 
   // We always have a contiguous set of log segments, so we can find the requested
   // segment in our vector by calculating its offset vs the first element.
-  int64_t first_seqno = segments_[0]->header().sequence_number();
+  int64_t first_seqno = (*segs)[0]->header().sequence_number();
   int64_t relative = seq - first_seqno;
-  if (relative < 0 || relative >= segments_.size()) {
+  if (relative < 0 || relative >= segs->size()) {
     return nullptr;
   }
 
-  DCHECK_EQ(segments_[relative]->header().sequence_number(), seq);
-  return segments_[relative];
+  DCHECK_EQ((*segs)[relative]->header().sequence_number(), seq);
+  return (*segs)[relative];
 }
 
 Status LogReader::ReadBatchUsingIndexEntry(const LogIndexEntry& index_entry,
@@ -354,37 +378,37 @@ Status LogReader::LookupOpId(int64_t op_index, OpId* op_id) const {
 }
 
 Status LogReader::GetSegmentsSnapshot(SegmentSequence* segments) const {
-  std::lock_guard<simple_spinlock> lock(lock_);
-  CHECK_EQ(state_, kLogReaderReading);
-  segments->assign(segments_.begin(), segments_.end());
+  CHECK_EQ(state_.load(), kLogReaderReading);
+  const shared_ptr<const SegmentSequence> segs = this->segments();
+  segments->assign(segs->begin(), segs->end());
   return Status::OK();
 }
 
 Status LogReader::TrimSegmentsUpToAndIncluding(int64_t segment_sequence_number) {
   std::lock_guard<simple_spinlock> lock(lock_);
-  CHECK_EQ(state_, kLogReaderReading);
-  auto iter = segments_.begin();
+  CHECK_EQ(state_.load(), kLogReaderReading);
+  const shared_ptr<const SegmentSequence> segs = segments();
+  auto iter = segs->begin();
   int num_deleted_segments = 0;
 
-  while (iter != segments_.end()) {
-    if ((*iter)->header().sequence_number() <= segment_sequence_number) {
-      iter = segments_.erase(iter);
-      num_deleted_segments++;
-      continue;
-    }
-    break;
+  while (iter != segs->end() && (*iter)->header().sequence_number() <= segment_sequence_number) {
+    ++iter;
+    num_deleted_segments++;
   }
+  PublishSegmentsUnlocked(SegmentSequence(iter, segs->end()));
   LOG(INFO) << "T " << tablet_id_ << ": removed " << num_deleted_segments
             << " log segments from log reader";
   return Status::OK();
 }
 
 void LogReader::UpdateLastSegmentOffset(int64_t readable_to_offset) {
-  std::lock_guard<simple_spinlock> lock(lock_);
-  CHECK_EQ(state_, kLogReaderReading);
-  DCHECK(!segments_.empty());
-  // Get the last segment
-  ReadableLogSegment* segment = segments_.back().get();
+  DCHECK_EQ(state_.load(), kLogReaderReading);
+  // The last segment only changes when the log rolls over, on the same thread
+  // as the appends, so it can't change under us. Its readable offset is
+  // atomic.
+  const shared_ptr<const SegmentSequence> segs = segments();
+  DCHECK(!segs->empty());
+  ReadableLogSegment* segment = segs->back().get();
   DCHECK(!segment->HasFooter());
   segment->UpdateReadableToOffset(readable_to_offset);
 }
@@ -395,11 +419,13 @@ Status LogReader::ReplaceLastSegment(const scoped_refptr<ReadableLogSegment>& se
   DCHECK(segment->HasFooter());
 
   std::lock_guard<simple_spinlock> lock(lock_);
-  CHECK_EQ(state_, kLogReaderReading);
+  CHECK_EQ(state_.load(), kLogReaderReading);
   // Make sure the segment we're replacing has the same sequence number
-  CHECK(!segments_.empty());
-  CHECK_EQ(segment->header().sequence_number(), segments_.back()->header().sequence_number());
-  segments_[segments_.size() - 1] = segment;
+  SegmentSequence segs = *segments();
+  CHECK(!segs.empty());
+  CHECK_EQ(segment->header().sequence_number(), segs.back()->header().sequence_number());
+  segs.back() = segment;
+  PublishSegmentsUnlocked(std::move(segs));
 
   return Status::OK();
 }
@@ -417,35 +443,38 @@ Status LogReader::AppendSegmentUnlocked(const scoped_refptr<ReadableLogSegment>&
   DCHECK(segment->IsInitialized());
   DCHECK(segment->HasFooter());
 
-  if (!segments_.empty()) {
-    CHECK_EQ(segments_.back()->header().sequence_number() + 1,
+  SegmentSequence segs = *segments();
+  if (!segs.empty()) {
+    CHECK_EQ(segs.back()->header().sequence_number() + 1,
              segment->header().sequence_number());
   }
-  segments_.push_back(segment);
+  segs.push_back(segment);
+  PublishSegmentsUnlocked(std::move(segs));
   return Status::OK();
 }
 
 Status LogReader::AppendEmptySegment(const scoped_refptr<ReadableLogSegment>& segment) {
   DCHECK(segment->IsInitialized());
   std::lock_guard<simple_spinlock> lock(lock_);
-  CHECK_EQ(state_, kLogReaderReading);
-  if (!segments_.empty()) {
-    CHECK_EQ(segments_.back()->header().sequence_number() + 1,
+  CHECK_EQ(state_.load(), kLogReaderReading);
+  SegmentSequence segs = *segments();
+  if (!segs.empty()) {
+    CHECK_EQ(segs.back()->header().sequence_number() + 1,
              segment->header().sequence_number());
   }
-  segments_.push_back(segment);
+  segs.push_back(segment);
+  PublishSegmentsUnlocked(std::move(segs));
   return Status::OK();
 }
 
 const int LogReader::num_segments() const {
-  std::lock_guard<simple_spinlock> lock(lock_);
-  return segments_.size();
+  return segments()->size();
 }
 
 string LogReader::ToString() const {
-  std::lock_guard<simple_spinlock> lock(lock_);
+  const shared_ptr<const SegmentSequence> segs = segments();
   string ret = "Reader's SegmentSequence: \n";
-  for (const SegmentSequence::value_type& entry : segments_) {
+  for (const SegmentSequence::value_type& entry : *segs) {
     ret.append(Substitute("Segment: $0 Footer: $1\n",
                           entry->header().sequence_number(),
                           !entry->HasFooter() ? "NONE" : SecureShortDebugString(entry->footer())));
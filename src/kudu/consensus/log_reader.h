@@ -17,6 +17,7 @@
 #ifndef KUDU_LOG_LOG_READER_H_
 #define KUDU_LOG_LOG_READER_H_
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -52,6 +53,12 @@ struct LogIndexEntry;
 
 // Reads a set of segments from a given path. Segment headers and footers
 // are read and parsed, but entries are not.
+//
+// The sequence of segments is published as an immutable snapshot which is
+// replaced as a whole when segments are added, replaced or trimmed, i.e. when
+// the log rolls over or is GCed. Readers only take a reference to the current
+// snapshot, so they never wait on the log appending to it, nor hold it up.
+//
 // This class is thread safe.
 class LogReader : public enable_make_shared<LogReader> {
  public:
@@ -69,7 +76,16 @@ class LogReader : public enable_make_shared<LogReader> {
                      const scoped_refptr<MetricEntity>& metric_entity,
                      std::shared_ptr<LogReader>* reader);
 
-  // Same as above, but will use `fs_manager` to determine the default WAL dir
+  // Same as above, but for a log whose segments are spread across the
+  // directories 'tablet_wal_dirs'.
+  static Status Open(Env* env,
+                     const std::vector<std::string>& tablet_wal_dirs,
+                     const scoped_refptr<LogIndex>& index,
+                     const std::string& tablet_id,
+                     const scoped_refptr<MetricEntity>& metric_entity,
+                     std::shared_ptr<LogReader>* reader);
+
+  // Same as above, but will use `fs_manager` to determine the WAL dirs
   // for the tablet.
   static Status Open(FsManager* fs_manager,
                      const scoped_refptr<LogIndex>& index,
@@ -162,17 +178,33 @@ class LogReader : public enable_make_shared<LogReader> {
   // Used by Log to update its LogReader on how far it is possible to read
   // the current segment. Requires that the reader has at least one segment
   // and that the last segment has no footer, meaning it is currently being
-  // written to.
+  // written to. Doesn't take 'lock_'.
   void UpdateLastSegmentOffset(int64_t readable_to_offset);
 
+  // Returns the current snapshot of the sequence of segments. Doesn't take
+  // 'lock_', so readers don't wait for writers to copy the sequence. Note that
+  // the atomic shared_ptr functions aren't lock-free in libstdc++: they
+  // briefly take one of a pool of internal mutexes to copy the pointer.
+  std::shared_ptr<const SegmentSequence> segments() const {
+    return std::atomic_load(&segments_);
+  }
+
+  // Publishes 'segments' as the new snapshot. Requires 'lock_'.
+  void PublishSegmentsUnlocked(SegmentSequence segments);
+
   // Read the LogEntryBatchPB pointed to by the provided index entry.
   // 'tmp_buf' is used as scratch space to avoid extra allocation.
   Status ReadBatchUsingIndexEntry(const LogIndexEntry& index_entry,
                                   faststring* tmp_buf,
                                   std::unique_ptr<LogEntryBatchPB>* batch) const;
 
-  // Reads the headers of all segments in 'tablet_wal_path'.
-  Status Init(const std::string& tablet_wal_path);
+  // Reads the headers of all segments in 'tablet_wal_paths'.
+  Status Init(const std::vector<std::string>& tablet_wal_paths);
+
+  // Opens all the segments in 'tablet_wal_path', appending them to
+  // 'read_segments'.
+  Status ReadSegmentsFromPath(const std::string& tablet_wal_path,
+                              SegmentSequence* read_segments);
 
   // Initializes an 'empty' reader for tests, i.e. does not scan a path looking for segments.
   Status InitEmptyReaderForTests();
@@ -187,12 +219,14 @@ class LogReader : public enable_make_shared<LogReader> {
   scoped_refptr<Histogram> read_batch_latency_;
 
   // The sequence of all current log segments in increasing sequence number
-  // order.
-  SegmentSequence segments_;
+  // order. Never modified once published, and only accessed through
+  // segments() and PublishSegmentsUnlocked().
+  std::shared_ptr<const SegmentSequence> segments_;
 
+  // Serializes the changes to 'segments_' and 'state_'.
   mutable simple_spinlock lock_;
 
-  State state_;
+  std::atomic<State> state_;
 
   DISALLOW_COPY_AND_ASSIGN(LogReader);
 };
@@ -17,7 +17,12 @@
 
 #include "kudu/consensus/log_util.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <memory>
@@ -29,6 +34,8 @@
 #include "kudu/consensus/opid_util.h"
 #include "kudu/consensus/ref_counted_replicate.h"
 #include "kudu/fs/fs_manager.h"
+#include "kudu/gutil/basictypes.h"
+#include "kudu/gutil/macros.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/strings/split.h"
 #include "kudu/gutil/strings/substitute.h"
@@ -41,6 +48,7 @@
 #include "kudu/util/crc.h"
 #include "kudu/util/debug/trace_event.h"
 #include "kudu/util/env_util.h"
+#include "kudu/util/errno.h"
 #include "kudu/util/fault_injection.h"
 #include "kudu/util/flag_tags.h"
 #include "kudu/util/logging.h"
@@ -62,6 +70,14 @@ DEFINE_bool(log_async_preallocate_segments, true,
             "Whether the WAL segments preallocation should happen asynchronously");
 TAG_FLAG(log_async_preallocate_segments, advanced);
 
+DEFINE_bool(log_mmap_sealed_segments, false,
+            "Whether to memory-map sealed (closed) WAL segments for reading. Entries "
+            "of mapped segments are read and, if uncompressed, parsed in place, "
+            "which avoids a copy per entry when replaying the log or catching up "
+            "peers from disk.");
+TAG_FLAG(log_mmap_sealed_segments, advanced);
+TAG_FLAG(log_mmap_sealed_segments, experimental);
+
 DEFINE_double(fault_crash_before_write_log_segment_header, 0.0,
               "Fraction of the time we will crash just before writing the log segment header");
 TAG_FLAG(fault_crash_before_write_log_segment_header, unsafe);
@@ -98,6 +114,27 @@ const size_t kEntryHeaderSizeV2 = 16;
 // Maximum log segment header/footer size, in bytes (8 MB).
 const uint32_t kLogSegmentMaxHeaderOrFooterSize = 8 * 1024 * 1024;
 
+// After this many consecutive batches fail to shrink when compressed, the
+// writer stops trying to compress for the next kSkipCompressionBatches.
+const int kMaxIncompressibleBatches = 8;
+const int kSkipCompressionBatches = 64;
+
+static bool HasIncompatibleFeature(const LogSegmentHeaderPB& header,
+                                   LogSegmentHeaderPB::FeatureFlag feature) {
+  for (int f : header.incompatible_features()) {
+    if (f == feature) return true;
+  }
+  return false;
+}
+
+// The value the CRCs of the entry headers of the segment start from.
+static uint32_t EntryHeaderCrcSeed(const LogSegmentHeaderPB& header) {
+  if (!HasIncompatibleFeature(header, LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS)) {
+    return 0;
+  }
+  return static_cast<uint32_t>(header.sequence_number());
+}
+
 LogOptions::LogOptions()
 : segment_size_mb(FLAGS_log_segment_size_mb),
   force_fsync_all(FLAGS_log_force_fsync_all),
@@ -125,9 +162,12 @@ LogEntryReader::LogEntryReader(ReadableLogSegment* seg)
   VLOG(1) << "Reading segment entries from "
           << seg_->path_ << ": offset=" << offset_ << " file_size="
           << seg_->file_size() << " readable_to_offset=" << readable_to_offset;
+  seg_->AdviseSequential(true);
 }
 
-LogEntryReader::~LogEntryReader() {}
+LogEntryReader::~LogEntryReader() {
+  seg_->AdviseSequential(false);
+}
 
 Status LogEntryReader::ReadNextEntry(unique_ptr<LogEntryPB>* entry) {
   // Refill pending_entries_ if none are available.
@@ -277,8 +317,59 @@ ReadableLogSegment::ReadableLogSegment(
       readable_to_offset_(0),
       readable_file_(std::move(readable_file)),
       codec_(nullptr),
+      mixed_compression_(false),
+      header_crc_seed_(0),
       is_initialized_(false),
-      footer_was_rebuilt_(false) {}
+      footer_was_rebuilt_(false),
+      mapped_data_(nullptr),
+      mapped_size_(0) {}
+
+ReadableLogSegment::~ReadableLogSegment() {
+  if (mapped_data_ != nullptr) {
+    PCHECK(munmap(mapped_data_, mapped_size_) == 0) << "munmap() failed for " << path_;
+  }
+}
+
+void ReadableLogSegment::MaybeMapSealedSegment() {
+  DCHECK(mapped_data_ == nullptr);
+  if (!FLAGS_log_mmap_sealed_segments || !HasFooter() || footer_was_rebuilt_) {
+    return;
+  }
+  size_t size = file_size();
+  if (size == 0) {
+    return;
+  }
+  // The file is opened again here rather than going through 'readable_file_'
+  // since RandomAccessFile doesn't expose its descriptor. If the segment
+  // doesn't live on the local filesystem (e.g. an in-memory Env in tests),
+  // the open fails and reads keep going through 'readable_file_'.
+  int fd;
+  RETRY_ON_EINTR(fd, open(path_.c_str(), O_RDONLY));
+  if (fd < 0) {
+    VLOG(1) << "Not mapping log segment " << path_ << ": " << ErrnoToString(errno);
+    return;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  int mmap_errno = errno;
+  int err;
+  RETRY_ON_EINTR(err, close(fd));
+  if (data == MAP_FAILED) {
+    LOG(WARNING) << "Unable to mmap log segment " << path_ << ": "
+                 << ErrnoToString(mmap_errno);
+    return;
+  }
+  mapped_data_ = static_cast<uint8_t*>(data);
+  mapped_size_ = size;
+  VLOG(1) << "Mapped sealed log segment " << path_ << " (" << size << " bytes)";
+}
+
+void ReadableLogSegment::AdviseSequential(bool sequential) const {
+  if (mapped_data_ != nullptr) {
+    // This is only a hint, so failures are ignored.
+    ignore_result(madvise(mapped_data_, mapped_size_,
+                          sequential ? MADV_SEQUENTIAL : MADV_NORMAL));
+  }
+}
 
 Status ReadableLogSegment::Init(const LogSegmentHeaderPB& header,
                                 const LogSegmentFooterPB& footer,
@@ -296,6 +387,7 @@ Status ReadableLogSegment::Init(const LogSegmentHeaderPB& header,
   first_entry_offset_ = first_entry_offset;
   is_initialized_ = true;
   readable_to_offset_.Store(file_size());
+  MaybeMapSealedSegment();
 
   return Status::OK();
 }
@@ -341,6 +433,7 @@ Status ReadableLogSegment::Init() {
   is_initialized_ = true;
 
   readable_to_offset_.Store(file_size());
+  MaybeMapSealedSegment();
 
   return Status::OK();
 }
@@ -348,9 +441,19 @@ Status ReadableLogSegment::Init() {
 Status ReadableLogSegment::InitCompressionCodec() {
   // Init the compression codec.
   if (header_.has_compression_codec() && header_.compression_codec() != NO_COMPRESSION) {
-    RETURN_NOT_OK_PREPEND(GetCompressionCodec(header_.compression_codec(), &codec_),
-                          "could not init compression codec");
+    if (header_.has_compression_dictionary()) {
+      RETURN_NOT_OK_PREPEND(NewCompressionCodecWithDictionary(header_.compression_codec(),
+                                                              header_.compression_dictionary(),
+                                                              &dict_codec_),
+                            "could not init compression codec with dictionary");
+      codec_ = dict_codec_.get();
+    } else {
+      RETURN_NOT_OK_PREPEND(GetCompressionCodec(header_.compression_codec(), &codec_),
+                            "could not init compression codec");
+    }
   }
+  mixed_compression_ = HasIncompatibleFeature(header_, LogSegmentHeaderPB::MIXED_COMPRESSION);
+  header_crc_seed_ = EntryHeaderCrcSeed(header_);
   return Status::OK();
 }
 
@@ -436,9 +539,13 @@ Status ReadableLogSegment::ReadHeader() {
                                                 header_size),
                         "Unable to parse protobuf");
 
-  if (header.incompatible_features_size() > 0) {
-    return Status::NotSupported("log segment uses a feature not supported by this version "
-                                "of Kudu");
+  for (int feature : header.incompatible_features()) {
+    if (feature != LogSegmentHeaderPB::MIXED_COMPRESSION &&
+        feature != LogSegmentHeaderPB::COMPRESSION_DICTIONARY &&
+        feature != LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS) {
+      return Status::NotSupported("log segment uses a feature not supported by this version "
+                                  "of Kudu");
+    }
   }
 
   header_.Swap(&header);
@@ -637,8 +744,16 @@ Status ReadableLogSegment::ReadEntryHeader(int64_t *offset, EntryHeader* header,
   const size_t header_size = entry_header_size();
   uint8_t scratch[header_size];
   Slice slice(scratch, header_size);
-  RETURN_NOT_OK_PREPEND(readable_file()->Read(*offset, slice),
-                        "Could not read log entry header");
+  if (mapped_data_ != nullptr) {
+    if (PREDICT_FALSE(*offset + header_size > mapped_size_)) {
+      return Status::IOError("Could not read log entry header",
+                             Substitute("offset $0 is past the end of $1", *offset, path_));
+    }
+    slice = Slice(mapped_data_ + *offset, header_size);
+  } else {
+    RETURN_NOT_OK_PREPEND(readable_file()->Read(*offset, slice),
+                          "Could not read log entry header");
+  }
 
   *status_detail = DecodeEntryHeader(slice, header);
   switch (*status_detail) {
@@ -665,7 +780,7 @@ EntryHeaderStatus ReadableLogSegment::DecodeEntryHeader(
     header->msg_length = DecodeFixed32(&data[4]);
     header->msg_crc    = DecodeFixed32(&data[8]);
     header->header_crc = DecodeFixed32(&data[12]);
-    computed_header_crc = crc::Crc32c(&data[0], 12);
+    computed_header_crc = crc::Crc32c(&data[0], 12, header_crc_seed_);
   } else {
     DCHECK_EQ(kEntryHeaderSizeV1, data.size());
     header->msg_length = DecodeFixed32(&data[0]);
@@ -707,18 +822,37 @@ Status ReadableLogSegment::ReadEntryBatch(int64_t* offset,
                    header.msg_length_compressed, *offset, path_, limit));
   }
 
+  // Entries which didn't shrink when compressed may have been stored as-is.
+  bool compressed = codec_ != nullptr &&
+      !(mixed_compression_ && header.msg_length_compressed == header.msg_length);
+
   tmp_buf->clear();
-  size_t buf_len = header.msg_length_compressed;
-  if (codec_) {
-    // Reserve some space for the decompressed copy as well.
-    buf_len += header.msg_length;
+  Slice entry_batch_slice;
+  uint8_t* uncompress_buf = nullptr;
+  if (mapped_data_ != nullptr) {
+    // Sealed segment: the entry can be used straight out of the mapping, so
+    // the scratch buffer is only needed for decompression.
+    entry_batch_slice = Slice(mapped_data_ + *offset, header.msg_length_compressed);
+    if (compressed) {
+      tmp_buf->resize(header.msg_length);
+      uncompress_buf = tmp_buf->data();
+    }
+  } else {
+    size_t buf_len = header.msg_length_compressed;
+    if (compressed) {
+      // Reserve some space for the decompressed copy as well.
+      buf_len += header.msg_length;
+    }
+    tmp_buf->resize(buf_len);
+    entry_batch_slice = Slice(tmp_buf->data(), header.msg_length_compressed);
+    Status s = readable_file()->Read(*offset, entry_batch_slice);
+
+    if (!s.ok()) return Status::IOError(Substitute("Could not read entry. Cause: $0",
+                                                   s.ToString()));
+    if (compressed) {
+      uncompress_buf = &(*tmp_buf)[header.msg_length_compressed];
+    }
   }
-  tmp_buf->resize(buf_len);
-  Slice entry_batch_slice(tmp_buf->data(), header.msg_length_compressed);
-  Status s =  readable_file()->Read(*offset, entry_batch_slice);
-
-  if (!s.ok()) return Status::IOError(Substitute("Could not read entry. Cause: $0",
-                                                 s.ToString()));
 
   // Verify the CRC.
   uint32_t read_crc = crc::Crc32c(entry_batch_slice.data(), entry_batch_slice.size());
@@ -730,16 +864,15 @@ Status ReadableLogSegment::ReadEntryBatch(int64_t* offset,
   }
 
   // If it was compressed, decompress it.
-  if (codec_) {
+  if (compressed) {
     // We pre-reserved space for the decompression up above.
-    uint8_t* uncompress_buf = &(*tmp_buf)[header.msg_length_compressed];
     RETURN_NOT_OK_PREPEND(codec_->Uncompress(entry_batch_slice, uncompress_buf, header.msg_length),
                           "failed to uncompress entry");
     entry_batch_slice = Slice(uncompress_buf, header.msg_length);
   }
 
   unique_ptr<LogEntryBatchPB> read_entry_batch(new LogEntryBatchPB);
-  s = pb_util::ParseFromArray(read_entry_batch.get(),
+  Status s = pb_util::ParseFromArray(read_entry_batch.get(),
                               entry_batch_slice.data(),
                               header.msg_length);
 
@@ -758,7 +891,11 @@ WritableLogSegment::WritableLogSegment(string path,
       writable_file_(std::move(writable_file)),
       is_header_written_(false),
       is_footer_written_(false),
-      written_offset_(0) {}
+      written_offset_(0),
+      may_skip_compression_(false),
+      header_crc_seed_(0),
+      incompressible_batches_(0),
+      skip_compression_batches_(0) {}
 
 Status WritableLogSegment::WriteHeaderAndOpen(const LogSegmentHeaderPB& new_header) {
   MAYBE_FAULT(FLAGS_fault_crash_before_write_log_segment_header);
@@ -777,6 +914,8 @@ Status WritableLogSegment::WriteHeaderAndOpen(const LogSegmentHeaderPB& new_head
   RETURN_NOT_OK(writable_file()->Append(Slice(buf)));
 
   header_.CopyFrom(new_header);
+  may_skip_compression_ = HasIncompatibleFeature(header_, LogSegmentHeaderPB::MIXED_COMPRESSION);
+  header_crc_seed_ = EntryHeaderCrcSeed(header_);
   first_entry_offset_ = buf.size();
   written_offset_ = first_entry_offset_;
   is_header_written_ = true;
@@ -817,23 +956,34 @@ Status WritableLogSegment::WriteEntryBatch(const Slice& data,
   const uint32_t uncompressed_len = data.size();
 
   // If necessary, compress the data.
-  Slice data_to_write;
-  if (codec) {
+  Slice data_to_write = data;
+  if (codec && skip_compression_batches_ > 0) {
+    DCHECK(may_skip_compression_);
+    skip_compression_batches_--;
+  } else if (codec) {
     DCHECK_NE(header_.compression_codec(), NO_COMPRESSION);
     compress_buf_.resize(codec->MaxCompressedLength(uncompressed_len));
     size_t compressed_len;
     RETURN_NOT_OK(codec->Compress(data, &compress_buf_[0], &compressed_len));
     compress_buf_.resize(compressed_len);
-    data_to_write = Slice(compress_buf_.data(), compress_buf_.size());
-  } else {
-    data_to_write = data;
+    if (!may_skip_compression_ || compressed_len < uncompressed_len) {
+      data_to_write = Slice(compress_buf_.data(), compress_buf_.size());
+      incompressible_batches_ = 0;
+    } else if (++incompressible_batches_ >= kMaxIncompressibleBatches) {
+      // The batch is stored uncompressed, which readers recognize by its equal
+      // compressed and uncompressed lengths. Since the payloads are evidently
+      // not compressible, don't waste CPU trying on the next few either.
+      incompressible_batches_ = 0;
+      skip_compression_batches_ = kSkipCompressionBatches;
+    }
   }
 
   // Fill in the header.
   InlineEncodeFixed32(&header_buf[0], data_to_write.size());
   InlineEncodeFixed32(&header_buf[4], uncompressed_len);
   InlineEncodeFixed32(&header_buf[8], crc::Crc32c(data_to_write.data(), data_to_write.size()));
-  InlineEncodeFixed32(&header_buf[12], crc::Crc32c(&header_buf[0], kEntryHeaderSizeV2 - 4));
+  InlineEncodeFixed32(&header_buf[12], crc::Crc32c(&header_buf[0], kEntryHeaderSizeV2 - 4,
+                                                   header_crc_seed_));
 
   // Write the header to the file, followed by the batch data itself.
   Slice slices[2] = {
@@ -852,7 +1002,8 @@ unique_ptr<LogEntryBatchPB> CreateBatchFromAllocatedOperations(
   for (const auto& msg : msgs) {
     LogEntryPB* entry_pb = entry_batch->add_entry();
     entry_pb->set_type(log::REPLICATE);
-    entry_pb->set_allocated_replicate(msg->get());
+    // Borrow the message without copying it, even if it lives on an arena.
+    entry_pb->unsafe_arena_set_allocated_replicate(msg->get());
   }
   return entry_batch;
 }
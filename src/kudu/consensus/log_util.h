@@ -273,6 +273,12 @@ class ReadableLogSegment : public RefCountedThreadSafe<ReadableLogSegment> {
   // Versions of Kudu older than 1.3 used a different log entry header format.
   size_t entry_header_size() const;
 
+  // Returns true if this segment is sealed and its contents are read through
+  // a memory mapping rather than through 'readable_file_'.
+  bool IsMapped() const {
+    return mapped_data_ != nullptr;
+  }
+
  private:
   friend class RefCountedThreadSafe<ReadableLogSegment>;
   friend class LogEntryReader;
@@ -295,7 +301,17 @@ class ReadableLogSegment : public RefCountedThreadSafe<ReadableLogSegment> {
     uint32_t header_crc;
   };
 
-  ~ReadableLogSegment() {}
+  ~ReadableLogSegment();
+
+  // If --log_mmap_sealed_segments is set and the segment has a footer on
+  // disk (i.e. it was properly closed and is immutable), map the whole file
+  // for reading. Failure to map is not an error: reads then simply go
+  // through 'readable_file_'.
+  void MaybeMapSealedSegment();
+
+  // Hint to the kernel whether the mapping, if any, is about to be read
+  // sequentially (as when replaying the segment) or randomly.
+  void AdviseSequential(bool sequential) const;
 
   // Helper functions called by Init().
 
@@ -391,6 +407,18 @@ class ReadableLogSegment : public RefCountedThreadSafe<ReadableLogSegment> {
   // Compression codec used to decompress entries in this file.
   const CompressionCodec* codec_;
 
+  // If the segment was compressed with a dictionary, the codec loaded with
+  // that dictionary, which 'codec_' then points to.
+  std::unique_ptr<CompressionCodec> dict_codec_;
+
+  // True if entries whose compressed and uncompressed lengths are equal were
+  // stored uncompressed (see LogSegmentHeaderPB::MIXED_COMPRESSION).
+  bool mixed_compression_;
+
+  // The value the entry header CRCs start from (see
+  // LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS).
+  uint32_t header_crc_seed_;
+
   bool is_initialized_;
 
   LogSegmentHeaderPB header_;
@@ -403,6 +431,12 @@ class ReadableLogSegment : public RefCountedThreadSafe<ReadableLogSegment> {
   // the offset of the first entry in the log
   int64_t first_entry_offset_;
 
+  // Read-only mapping of the whole file, set only for sealed segments (see
+  // MaybeMapSealedSegment()). Uncompressed entries are parsed directly out
+  // of the mapping without being copied into a scratch buffer.
+  uint8_t* mapped_data_;
+  size_t mapped_size_;
+
   DISALLOW_COPY_AND_ASSIGN(ReadableLogSegment);
 };
 
@@ -431,6 +465,10 @@ class WritableLogSegment {
   // and checksum. If 'codec' is not NULL, compresses the batch.
   // Makes sure that the log segment has not been closed.
   // Write a compressed entry to the log.
+  //
+  // If the segment header has the MIXED_COMPRESSION feature, batches which
+  // don't shrink when compressed are written uncompressed instead, and after
+  // a run of such batches compression is only attempted every so often.
   Status WriteEntryBatch(const Slice& data, const CompressionCodec* codec);
 
   // Makes sure the I/O buffers in the underlying writable file are flushed.
@@ -499,6 +537,20 @@ class WritableLogSegment {
   // Buffer used for output when compressing.
   faststring compress_buf_;
 
+  // True if the header allows batches to be written uncompressed even though
+  // the segment has a codec.
+  bool may_skip_compression_;
+
+  // The value the entry header CRCs start from (see
+  // LogSegmentHeaderPB::SEQUENCED_ENTRY_HEADERS).
+  uint32_t header_crc_seed_;
+
+  // The number of consecutive batches which did not shrink when compressed.
+  int incompressible_batches_;
+
+  // The number of upcoming batches to write without attempting compression.
+  int skip_compression_batches_;
+
   DISALLOW_COPY_AND_ASSIGN(WritableLogSegment);
 };
 
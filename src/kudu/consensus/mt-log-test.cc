@@ -38,7 +38,6 @@
 
 #include "kudu/clock/clock.h"
 #include "kudu/common/timestamp.h"
-#include "kudu/common/wire_protocol-test-util.h"
 #include "kudu/common/wire_protocol.pb.h"
 #include "kudu/consensus/consensus.pb.h"
 #include "kudu/consensus/log-test-base.h"
@@ -83,7 +82,7 @@ using std::vector;
 using consensus::OpId;
 using consensus::ReplicateRefPtr;
 using consensus::ReplicateMsg;
-using consensus::WRITE_OP;
+using consensus::WRITE_OP_EXT;
 using consensus::make_scoped_refptr_replicate;
 
 namespace {
@@ -131,13 +130,18 @@ class MultiThreadedLogTest : public LogTestBase {
     vector<consensus::ReplicateRefPtr> ret;
     for (int j = 0; j < num_ops; j++) {
       ReplicateRefPtr replicate = make_scoped_refptr_replicate(new ReplicateMsg);
-      replicate->get()->set_op_type(WRITE_OP);
       replicate->get()->set_timestamp(clock_->Now().ToUint64());
+#ifdef FB_DO_NOT_REMOVE
+      replicate->get()->set_op_type(WRITE_OP);
       tserver::WriteRequestPB* request = replicate->get()->mutable_write_request();
       AddTestRowToPB(RowOperationsPB::INSERT, schema_, 12345, 0,
                      "this is a test insert",
                      request->mutable_row_operations());
       request->set_tablet_id(kTestTablet);
+#else
+      replicate->get()->set_op_type(WRITE_OP_EXT);
+      replicate->get()->mutable_write_payload()->set_payload("this is a test insert");
+#endif
       ret.push_back(replicate);
     }
     return ret;
@@ -183,15 +187,24 @@ class MultiThreadedLogTest : public LogTestBase {
     }
 
     // Start a thread which calls some read-only methods on the log
-    // to check for races against writers.
+    // to check for races against writers, including the ones a peer being
+    // caught up calls on the reader while the log rolls over.
     std::atomic<bool> stop_reader(false);
     vector<std::thread> reader_threads;
     for (int i = 0; i < FLAGS_num_reader_threads; i++) {
       reader_threads.emplace_back([&]() {
           std::map<int64_t, int64_t> map;
+          SegmentSequence segments;
+          consensus::OpId op_id;
           while (!stop_reader) {
             log_->GetReplaySizeMap(&map);
             log_->GetGCableDataSize(RetentionIndexes(FLAGS_num_batches_per_thread));
+            shared_ptr<LogReader> reader = log_->reader();
+            CHECK_OK(reader->GetSegmentsSnapshot(&segments));
+            CHECK(!segments.empty());
+            // The first op may not have been appended yet.
+            Status s = reader->LookupOpId(kStartIndex, &op_id);
+            CHECK(s.ok() || s.IsNotFound()) << s.ToString();
           }
         });
     }
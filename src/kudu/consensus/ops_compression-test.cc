@@ -0,0 +1,179 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/ops_compression.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "kudu/common/timestamp.h"
+#include "kudu/consensus/consensus-test-util.h"
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/opid_util.h"
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/random.h"
+#include "kudu/util/random_util.h"
+#include "kudu/util/status.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+using std::string;
+
+namespace kudu {
+namespace consensus {
+
+class OpsCompressionTest : public KuduTest {
+ public:
+  void SetUp() override {
+    KuduTest::SetUp();
+    ASSERT_OK(GetCompressionCodec(LZ4, &codec_));
+  }
+
+ protected:
+  // Fills 'request' with 'num_ops' ops starting at index 'first_index'. If
+  // 'random' is set, their payloads are random and won't compress.
+  static void AddOps(ConsensusRequestPB* request, int64_t first_index, int num_ops,
+                     bool random) {
+    Random rng(SeedRandom());
+    for (int i = 0; i < num_ops; i++) {
+      ReplicateMsg* op = CreateDummyReplicate(1, first_index + i, Timestamp(i), 1024).release();
+      if (random) {
+        RandomString(&(*op->mutable_noop_request()->mutable_payload_for_tests())[0],
+                     1024, &rng);
+      }
+      request->mutable_ops()->AddAllocated(op);
+    }
+  }
+
+  const CompressionCodec* codec_;
+};
+
+TEST_F(OpsCompressionTest, TestRoundTrip) {
+  ConsensusRequestPB request;
+  request.set_caller_uuid("leader");
+  request.set_caller_term(1);
+  request.set_committed_index(5);
+  AddOps(&request, 1, 10, false);
+  const string original = request.SerializeAsString();
+
+  bool compressed;
+  size_t uncompressed_size;
+  size_t compressed_size;
+  ASSERT_OK(CompressOps(codec_, &request, &compressed, &uncompressed_size, &compressed_size));
+  ASSERT_TRUE(compressed);
+  ASSERT_LT(compressed_size, uncompressed_size);
+  ASSERT_EQ(compressed_size, request.compressed_ops().size());
+  ASSERT_EQ(uncompressed_size, request.ops_uncompressed_size());
+  ASSERT_EQ(LZ4, request.ops_compression_codec());
+
+  // The ops are left in place for the caller to remove.
+  ASSERT_EQ(10, request.ops_size());
+  request.clear_ops();
+
+  ConsensusRequestPB decompressed;
+  ASSERT_OK(DecompressOps(request, &decompressed));
+  ASSERT_FALSE(decompressed.has_compressed_ops());
+  ASSERT_FALSE(decompressed.has_ops_compression_codec());
+  ASSERT_FALSE(decompressed.has_ops_uncompressed_size());
+  ASSERT_EQ(original, decompressed.SerializeAsString());
+}
+
+TEST_F(OpsCompressionTest, TestIncompressibleOps) {
+  ConsensusRequestPB request;
+  AddOps(&request, 1, 4, true);
+
+  bool compressed;
+  size_t uncompressed_size;
+  size_t compressed_size;
+  ASSERT_OK(CompressOps(codec_, &request, &compressed, &uncompressed_size, &compressed_size));
+  ASSERT_FALSE(compressed);
+  ASSERT_EQ(uncompressed_size, compressed_size);
+  ASSERT_FALSE(request.has_compressed_ops());
+  ASSERT_EQ(4, request.ops_size());
+}
+
+// The same run of ops is only compressed once.
+TEST_F(OpsCompressionTest, TestCacheReusesCompressedOps) {
+  CompressedOpsCache cache;
+  bool compressed;
+  size_t uncompressed_size;
+  size_t compressed_size;
+
+  ConsensusRequestPB first;
+  AddOps(&first, 1, 10, false);
+  ASSERT_OK(cache.CompressOps(codec_, &first, &compressed, &uncompressed_size,
+                              &compressed_size));
+  ASSERT_TRUE(compressed);
+
+  // Ops with the same ids are taken to be the same ops, so the cached bytes
+  // are returned even though these payloads differ.
+  ConsensusRequestPB second;
+  AddOps(&second, 1, 10, true);
+  ASSERT_OK(cache.CompressOps(codec_, &second, &compressed, &uncompressed_size,
+                              &compressed_size));
+  ASSERT_TRUE(compressed);
+  ASSERT_EQ(first.compressed_ops(), second.compressed_ops());
+
+  // A different run is compressed anew.
+  ConsensusRequestPB third;
+  AddOps(&third, 2, 10, false);
+  ASSERT_OK(cache.CompressOps(codec_, &third, &compressed, &uncompressed_size,
+                              &compressed_size));
+  ASSERT_TRUE(compressed);
+  third.clear_ops();
+  ConsensusRequestPB decompressed;
+  ASSERT_OK(DecompressOps(third, &decompressed));
+  ASSERT_EQ(10, decompressed.ops_size());
+  ASSERT_OPID_EQ(MakeOpId(1, 2), decompressed.ops(0).id());
+}
+
+TEST_F(OpsCompressionTest, TestBadCompressedOps) {
+  ConsensusRequestPB request;
+  AddOps(&request, 1, 10, false);
+  bool compressed;
+  size_t uncompressed_size;
+  size_t compressed_size;
+  ASSERT_OK(CompressOps(codec_, &request, &compressed, &uncompressed_size, &compressed_size));
+  ASSERT_TRUE(compressed);
+  request.clear_ops();
+  ConsensusRequestPB decompressed;
+
+  {
+    ConsensusRequestPB bad(request);
+    bad.set_ops_compression_codec(UNKNOWN_COMPRESSION);
+    Status s = DecompressOps(bad, &decompressed);
+    ASSERT_TRUE(s.IsNotFound()) << s.ToString();
+  }
+  {
+    ConsensusRequestPB bad(request);
+    bad.set_ops_uncompressed_size(1024 * 1024 * 1024);
+    Status s = DecompressOps(bad, &decompressed);
+    ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+  }
+  {
+    ConsensusRequestPB bad(request);
+    bad.mutable_compressed_ops()->resize(compressed_size / 2);
+    ASSERT_FALSE(DecompressOps(bad, &decompressed).ok());
+  }
+}
+
+} // namespace consensus
+} // namespace kudu
@@ -0,0 +1,201 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/ops_compression.h"
+
+#include <cstdint>
+#include <mutex>
+
+#include <gflags/gflags_declare.h>
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/opid_util.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/faststring.h"
+#include "kudu/util/pb_util.h"
+#include "kudu/util/slice.h"
+
+DECLARE_int64(rpc_max_message_size);
+
+using google::protobuf::io::CodedInputStream;
+using std::shared_ptr;
+using std::string;
+using strings::Substitute;
+
+namespace kudu {
+namespace consensus {
+
+namespace {
+
+// Compresses the serialization of the ops of 'request' into 'out'. Leaves
+// 'out' empty if the ops don't shrink.
+Status CompressSerializedOps(const CompressionCodec* codec,
+                             ConsensusRequestPB* request,
+                             string* out,
+                             size_t* uncompressed_size) {
+  // Serialize the ops as a request that has nothing else set. The ops are
+  // borrowed rather than copied, the same way the queue lends them to
+  // requests.
+  faststring serialized;
+  {
+    ConsensusRequestPB ops_only;
+    ops_only.mutable_ops()->Reserve(request->ops_size());
+    for (ReplicateMsg& op : *request->mutable_ops()) {
+      ops_only.mutable_ops()->UnsafeArenaAddAllocated(&op);
+    }
+    pb_util::AppendPartialToString(ops_only, &serialized);
+    ops_only.mutable_ops()->ExtractSubrange(0, ops_only.ops_size(), nullptr);
+  }
+  *uncompressed_size = serialized.size();
+
+  out->resize(codec->MaxCompressedLength(serialized.size()));
+  size_t compressed_len;
+  RETURN_NOT_OK(codec->Compress(Slice(serialized),
+                                reinterpret_cast<uint8_t*>(&(*out)[0]),
+                                &compressed_len));
+  if (compressed_len >= serialized.size()) {
+    out->clear();
+  } else {
+    out->resize(compressed_len);
+  }
+  return Status::OK();
+}
+
+void SetCompressedOps(CompressionType codec, size_t uncompressed_size,
+                      const string& data, ConsensusRequestPB* request) {
+  request->set_compressed_ops(data);
+  request->set_ops_compression_codec(codec);
+  request->set_ops_uncompressed_size(uncompressed_size);
+}
+
+} // anonymous namespace
+
+Status CompressOps(const CompressionCodec* codec,
+                   ConsensusRequestPB* request,
+                   bool* compressed,
+                   size_t* uncompressed_size,
+                   size_t* compressed_size) {
+  string data;
+  RETURN_NOT_OK(CompressSerializedOps(codec, request, &data, uncompressed_size));
+  *compressed = !data.empty();
+  *compressed_size = *compressed ? data.size() : *uncompressed_size;
+  if (*compressed) {
+    SetCompressedOps(codec->type(), *uncompressed_size, data, request);
+  }
+  return Status::OK();
+}
+
+Status DecompressOps(const ConsensusRequestPB& request,
+                     ConsensusRequestPB* decompressed) {
+  DCHECK(request.has_compressed_ops());
+  const CompressionCodec* codec;
+  RETURN_NOT_OK_PREPEND(GetCompressionCodec(request.ops_compression_codec(), &codec),
+                        "unable to uncompress ops");
+  if (codec == nullptr || request.ops_size() > 0) {
+    return Status::InvalidArgument("invalid compressed ops");
+  }
+  const uint32_t size = request.ops_uncompressed_size();
+  if (size > FLAGS_rpc_max_message_size) {
+    return Status::InvalidArgument(
+        Substitute("uncompressed ops would take $0 bytes, more than the maximum of $1",
+                   size, FLAGS_rpc_max_message_size));
+  }
+
+  faststring buf;
+  buf.resize(size);
+  RETURN_NOT_OK_PREPEND(codec->Uncompress(Slice(request.compressed_ops()), buf.data(), size),
+                        "unable to uncompress ops");
+
+  // Parse into a separate request, so that nothing but the ops can be set
+  // from the compressed data.
+  ConsensusRequestPB ops_only;
+  CodedInputStream cis(buf.data(), size);
+  cis.SetTotalBytesLimit(512 * 1024 * 1024, -1);
+  if (PREDICT_FALSE(!ops_only.ParsePartialFromCodedStream(&cis) ||
+                    !cis.ConsumedEntireMessage())) {
+    return Status::Corruption("unable to parse uncompressed ops");
+  }
+
+  decompressed->CopyFrom(request);
+  decompressed->clear_compressed_ops();
+  decompressed->clear_ops_compression_codec();
+  decompressed->clear_ops_uncompressed_size();
+  decompressed->mutable_ops()->Swap(ops_only.mutable_ops());
+  return Status::OK();
+}
+
+CompressedOpsCache::CompressedOpsCache()
+    : next_entry_(0) {
+  for (Entry& e : entries_) {
+    e.codec = UNKNOWN_COMPRESSION;
+    e.uncompressed_size = 0;
+  }
+}
+
+Status CompressedOpsCache::CompressOps(const CompressionCodec* codec,
+                                       ConsensusRequestPB* request,
+                                       bool* compressed,
+                                       size_t* uncompressed_size,
+                                       size_t* compressed_size) {
+  DCHECK_GT(request->ops_size(), 0);
+  const OpId& first = request->ops(0).id();
+  const OpId& last = request->ops(request->ops_size() - 1).id();
+
+  // A cached entry with no data means the ops didn't shrink.
+  bool found = false;
+  shared_ptr<const string> data;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    for (const Entry& e : entries_) {
+      if (e.codec == codec->type() && OpIdEquals(e.first, first) && OpIdEquals(e.last, last)) {
+        found = true;
+        data = e.data;
+        *uncompressed_size = e.uncompressed_size;
+        break;
+      }
+    }
+  }
+
+  if (!found) {
+    string out;
+    RETURN_NOT_OK(CompressSerializedOps(codec, request, &out, uncompressed_size));
+    if (!out.empty()) {
+      data = std::make_shared<const string>(std::move(out));
+    }
+    std::lock_guard<simple_spinlock> l(lock_);
+    Entry& e = entries_[next_entry_];
+    next_entry_ = (next_entry_ + 1) % kNumEntries;
+    e.first = first;
+    e.last = last;
+    e.codec = codec->type();
+    e.uncompressed_size = *uncompressed_size;
+    e.data = data;
+  }
+
+  *compressed = data != nullptr;
+  *compressed_size = *compressed ? data->size() : *uncompressed_size;
+  if (*compressed) {
+    SetCompressedOps(codec->type(), *uncompressed_size, *data, request);
+  }
+  return Status::OK();
+}
+
+} // namespace consensus
+} // namespace kudu
@@ -0,0 +1,97 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#ifndef KUDU_CONSENSUS_OPS_COMPRESSION_H_
+#define KUDU_CONSENSUS_OPS_COMPRESSION_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "kudu/consensus/opid.pb.h"
+#include "kudu/gutil/macros.h"
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/locks.h"
+#include "kudu/util/status.h"
+
+namespace kudu {
+
+class CompressionCodec;
+
+namespace consensus {
+
+class ConsensusRequestPB;
+
+// Compresses the ops of 'request' with 'codec'. If they shrink, sets the
+// 'compressed_ops' fields of 'request' and sets 'compressed' to true, leaving
+// the ops themselves in place; it is up to the caller to remove them before
+// sending. Otherwise sets 'compressed' to false and leaves 'request' untouched.
+//
+// 'uncompressed_size' and 'compressed_size' are set to the sizes of the
+// serialized ops before and after compression.
+Status CompressOps(const CompressionCodec* codec,
+                   ConsensusRequestPB* request,
+                   bool* compressed,
+                   size_t* uncompressed_size,
+                   size_t* compressed_size);
+
+// Fills 'decompressed' with a copy of 'request' in which the compressed ops
+// are replaced by the ops themselves. 'request' must have 'compressed_ops'.
+Status DecompressOps(const ConsensusRequestPB& request,
+                     ConsensusRequestPB* decompressed);
+
+// Remembers the last few runs of ops compressed by CompressOps() so that,
+// when the same ops are sent to several peers, as is usual when all of them
+// are caught up, they are only compressed once.
+//
+// Runs are keyed by the ids of their first and last ops which, by the Raft
+// log matching property, identify the ops in between.
+//
+// This class is thread-safe.
+class CompressedOpsCache {
+ public:
+  CompressedOpsCache();
+
+  // Like CompressOps(), but reuses the compressed ops from an earlier call
+  // with the same run of ops and codec, if still cached.
+  Status CompressOps(const CompressionCodec* codec,
+                     ConsensusRequestPB* request,
+                     bool* compressed,
+                     size_t* uncompressed_size,
+                     size_t* compressed_size);
+
+ private:
+  struct Entry {
+    OpId first;
+    OpId last;
+    CompressionType codec;
+    size_t uncompressed_size;
+    std::shared_ptr<const std::string> data;
+  };
+
+  static const int kNumEntries = 4;
+
+  mutable simple_spinlock lock_;
+  Entry entries_[kNumEntries];
+  int next_entry_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompressedOpsCache);
+};
+
+} // namespace consensus
+} // namespace kudu
+
+#endif // KUDU_CONSENSUS_OPS_COMPRESSION_H_
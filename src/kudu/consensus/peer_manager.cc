@@ -20,9 +20,13 @@
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include <gflags/gflags_declare.h>
 #include <glog/logging.h>
 
 #include "kudu/consensus/consensus_peers.h"
@@ -34,8 +38,15 @@
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/util/pb_util.h"
 
+DECLARE_int64(raft_snapshot_transfer_rate_limit_bytes);
+
 using kudu::log::Log;
 using kudu::pb_util::SecureShortDebugString;
+using std::shared_ptr;
+using std::string;
+using std::unordered_map;
+using std::vector;
+using std::weak_ptr;
 using strings::Substitute;
 
 namespace kudu {
@@ -46,13 +57,15 @@ PeerManager::PeerManager(std::string tablet_id,
                          PeerProxyFactory* peer_proxy_factory,
                          PeerMessageQueue* queue,
                          ThreadPoolToken* raft_pool_token,
-                         scoped_refptr<log::Log> log)
+                         scoped_refptr<log::Log> log,
+                         SnapshotProvider* snapshot_provider)
     : tablet_id_(std::move(tablet_id)),
       local_uuid_(std::move(local_uuid)),
       peer_proxy_factory_(peer_proxy_factory),
       queue_(queue),
       raft_pool_token_(raft_pool_token),
-      log_(std::move(log)) {
+      log_(std::move(log)),
+      snapshot_provider_(snapshot_provider) {
 }
 
 PeerManager::~PeerManager() {
@@ -63,6 +76,10 @@ Status PeerManager::UpdateRaftConfig(const RaftConfigPB& config) {
   VLOG(1) << "Updating peers from new config: " << SecureShortDebugString(config);
 
   std::lock_guard<simple_spinlock> lock(lock_);
+  if (peers_.empty()) {
+    snapshot_throttler_ = std::make_shared<SnapshotThrottler>(
+        FLAGS_raft_snapshot_transfer_rate_limit_bytes);
+  }
   // Create new peers
   for (const RaftPeerPB& peer_pb : config.peers()) {
     if (ContainsKey(peers_, peer_pb.permanent_uuid())) {
@@ -85,10 +102,54 @@ Status PeerManager::UpdateRaftConfig(const RaftConfigPB& config) {
                                       raft_pool_token_,
                                       std::move(peer_proxy),
                                       peer_proxy_factory_->messenger(),
+                                      snapshot_provider_,
+                                      snapshot_throttler_,
                                       &remote_peer));
     peers_.emplace(peer_pb.permanent_uuid(), std::move(remote_peer));
   }
 
+  return UpdateRelaysUnlocked(config);
+}
+
+Status PeerManager::UpdateRelaysUnlocked(const RaftConfigPB& config) {
+  DCHECK(lock_.is_locked());
+  string local_region;
+  unordered_map<string, const RaftPeerPB*> relay_by_region;
+  for (const RaftPeerPB& peer_pb : config.peers()) {
+    const string& region = peer_pb.attrs().region();
+    if (peer_pb.permanent_uuid() == local_uuid_) {
+      local_region = region;
+    }
+    if (!region.empty() && peer_pb.attrs().relay()) {
+      relay_by_region.emplace(region, &peer_pb);
+    }
+  }
+
+  // Ops for the peers of other regions are sent through the relay of their
+  // region, if it has one. Peers in the local region, or in no region, are
+  // sent ops directly.
+  unordered_map<string, vector<weak_ptr<Peer>>> relayed_peers;
+  for (const RaftPeerPB& peer_pb : config.peers()) {
+    shared_ptr<Peer> peer = FindPtrOrNull(peers_, peer_pb.permanent_uuid());
+    if (!peer) {
+      continue;
+    }
+    const string& region = peer_pb.attrs().region();
+    const RaftPeerPB* relay = region.empty() || region == local_region ?
+        nullptr : FindPtrOrNull(relay_by_region, region);
+    if (relay == nullptr || relay->permanent_uuid() == peer_pb.permanent_uuid()) {
+      peer->SetRelay("", gscoped_ptr<PeerProxy>());
+      continue;
+    }
+    gscoped_ptr<PeerProxy> relay_proxy;
+    RETURN_NOT_OK_PREPEND(peer_proxy_factory_->NewProxy(*relay, &relay_proxy),
+                          "Could not obtain a remote proxy to the relay.");
+    peer->SetRelay(relay->permanent_uuid(), std::move(relay_proxy));
+    relayed_peers[relay->permanent_uuid()].emplace_back(peer);
+  }
+  for (const auto& entry : peers_) {
+    entry.second->SetRelayedPeers(std::move(relayed_peers[entry.first]));
+  }
   return Status::OK();
 }
 
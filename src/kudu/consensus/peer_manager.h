@@ -38,8 +38,10 @@ namespace consensus {
 
 class Peer;
 class PeerMessageQueue;
+class SnapshotThrottler;
 class PeerProxyFactory;
 class RaftConfigPB;
+class SnapshotProvider;
 
 // Manages the remote peers that pull data from the local queue and send updates to the
 // remote machines.
@@ -47,12 +49,16 @@ class PeerManager {
  public:
   // All of the raw pointer arguments are not owned by the PeerManager
   // and must live at least as long as the PeerManager.
+  //
+  // 'snapshot_provider' may be null, in which case peers which can't be
+  // caught up from the log aren't sent snapshots.
   PeerManager(std::string tablet_id,
               std::string local_uuid,
               PeerProxyFactory* peer_proxy_factory,
               PeerMessageQueue* queue,
               ThreadPoolToken* raft_pool_token,
-              scoped_refptr<log::Log> log);
+              scoped_refptr<log::Log> log,
+              SnapshotProvider* snapshot_provider = nullptr);
 
   ~PeerManager();
 
@@ -71,6 +77,10 @@ class PeerManager {
  private:
   std::string GetLogPrefix() const;
 
+  // Sets the relay through which each peer is sent ops, according to the
+  // regions and relays declared in the attributes of the peers of 'config'.
+  Status UpdateRelaysUnlocked(const RaftConfigPB& config);
+
   typedef std::unordered_map<std::string, std::shared_ptr<Peer>> PeersMap;
   const std::string tablet_id_;
   const std::string local_uuid_;
@@ -78,6 +88,11 @@ class PeerManager {
   PeerMessageQueue* queue_;
   ThreadPoolToken* raft_pool_token_;
   scoped_refptr<log::Log> log_;
+  SnapshotProvider* snapshot_provider_;
+  // Shared by the peers to limit the rate at which they send snapshots.
+  // Replaced whenever the first peer is added, e.g. when this replica
+  // becomes leader, so that it follows the rate limit flag.
+  std::shared_ptr<SnapshotThrottler> snapshot_throttler_;
   PeersMap peers_;
   mutable simple_spinlock lock_;
 
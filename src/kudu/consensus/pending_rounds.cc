@@ -212,6 +212,21 @@ Status PendingRounds::SetInitialCommittedOpId(const OpId& committed_op) {
   return Status::OK();
 }
 
+Status PendingRounds::SetCommittedOpIdFromSnapshot(const OpId& committed_op) {
+  if (!pending_txns_.empty()) {
+    return Status::IllegalState(Substitute(
+        "cannot install a snapshot with pending operations (snapshot=$0, first pending=$1)",
+        OpIdToString(committed_op), pending_txns_.begin()->first));
+  }
+  if (committed_op.index() < last_committed_op_id_.index()) {
+    return Status::IllegalState(Substitute(
+        "snapshot is older than the committed operation (snapshot=$0, committed=$1)",
+        OpIdToString(committed_op), OpIdToString(last_committed_op_id_)));
+  }
+  last_committed_op_id_ = committed_op;
+  return Status::OK();
+}
+
 Status PendingRounds::CheckOpInSequence(const OpId& previous, const OpId& current) {
   if (current.term() < previous.term()) {
     return Status::Corruption(Substitute("New operation's term is not >= than the previous "
@@ -49,6 +49,11 @@ class PendingRounds {
   // of triggering any that are now considered committed.
   Status SetInitialCommittedOpId(const OpId& committed_op);
 
+  // Sets the committed op to 'committed_op', the last op covered by a
+  // snapshot installed in place of the ops up to it. There must be no pending
+  // operations.
+  Status SetCommittedOpIdFromSnapshot(const OpId& committed_op);
+
   // Returns the the ConsensusRound with the provided index, if there is any, or NULL
   // if there isn't.
   scoped_refptr<ConsensusRound> GetPendingOpByIndexOrNull(int64_t index);
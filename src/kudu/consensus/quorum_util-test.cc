@@ -17,6 +17,8 @@
 
 #include "kudu/consensus/quorum_util.h"
 
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <ostream>
 #include <string>
@@ -340,6 +342,106 @@ TEST(QuorumUtilTest, TestIsRaftConfigVoter) {
   ASSERT_FALSE(ReplicaTypesEqual(*peer_b, *peer_c));
 }
 
+// Witnesses count towards quorums, but can't lead.
+TEST(QuorumUtilTest, TestWitnesses) {
+  RaftConfigPB config;
+  config.set_opid_index(1);
+  AddPeer(&config, "A", V);
+  AddPeer(&config, "B", V);
+  AddPeer(&config, "W", RaftPeerPB::WITNESS);
+  ASSERT_OK(VerifyRaftConfig(config));
+  EXPECT_EQ(2, CountVoters(config));
+  EXPECT_EQ(3, CountVotingMembers(config));
+  EXPECT_FALSE(IsRaftConfigVoter("W", config));
+  EXPECT_TRUE(IsRaftConfigWitness("W", config));
+  EXPECT_FALSE(IsRaftConfigWitness("A", config));
+
+  EXPECT_TRUE(IsCommitQuorum(config, "A", { "A", "W" }));
+  EXPECT_TRUE(IsElectionQuorum(config, { "B", "W" }));
+
+  EXPECT_EQ(RaftPeerPB::WITNESS_ROLE, GetConsensusRole("W", "A", config));
+  EXPECT_FALSE(IsVoterRole(GetConsensusRole("W", "A", config)));
+
+  // Someone must be able to lead.
+  RaftConfigPB witnesses_only;
+  witnesses_only.set_opid_index(1);
+  AddPeer(&witnesses_only, "W", RaftPeerPB::WITNESS);
+  Status s = VerifyRaftConfig(witnesses_only);
+  ASSERT_TRUE(s.IsIllegalState()) << s.ToString();
+  ASSERT_STR_CONTAINS(s.ToString(), "no voter");
+}
+
+// Commit quorums by region must span a majority of the leader's region and of
+// another region, and election quorums a majority of all regions but one.
+TEST(QuorumUtilTest, TestRegionMajoritiesQuorums) {
+  RaftConfigPB config;
+  config.set_opid_index(1);
+  config.set_quorum_policy(RaftConfigPB::REGION_MAJORITIES);
+  const vector<pair<string, string>> kPeers = {
+    { "A", "east" }, { "B", "east" }, { "C", "east" },
+    { "D", "west" }, { "E", "west" }, { "F", "west" },
+    { "G", "central" }, { "H", "central" }, { "I", "central" },
+  };
+  for (const auto& p : kPeers) {
+    AddPeer(&config, p.first, V);
+    config.mutable_peers(config.peers_size() - 1)->mutable_attrs()->set_region(p.second);
+  }
+  AddPeer(&config, "J", N);
+  ASSERT_OK(VerifyRaftConfig(config));
+
+  EXPECT_TRUE(IsCommitQuorum(config, "A", { "A", "B", "D", "E" }));
+  EXPECT_FALSE(IsCommitQuorum(config, "A", { "A", "B", "C" }));
+  EXPECT_FALSE(IsCommitQuorum(config, "A", { "A", "D", "E", "G", "H" }));
+  EXPECT_FALSE(IsCommitQuorum(config, "J", { "A", "B", "D", "E" }));
+
+  EXPECT_TRUE(IsElectionQuorum(config, { "A", "B", "D", "E" }));
+  EXPECT_TRUE(IsElectionQuorum(config, { "D", "E", "G", "H" }));
+  EXPECT_FALSE(IsElectionQuorum(config, { "A", "B", "C", "D" }));
+
+  // A plain majority would need five voters, and settle on index 8. By region,
+  // the leader's region only gets a majority at index 3.
+  const std::map<string, int64_t> kIndexes = {
+    { "A", 10 }, { "B", 3 }, { "C", 1 }, { "D", 8 }, { "E", 7 },
+    { "F", 2 }, { "G", 20 }, { "H", 20 }, { "I", 20 },
+  };
+  EXPECT_EQ(3, GetCommitQuorumIndex(config, "A", kIndexes));
+  EXPECT_EQ(-1, GetCommitQuorumIndex(config, "A", { { "A", 10 }, { "D", 10 }, { "E", 10 } }));
+
+  // Without regions, the quorums are plain majorities.
+  config.set_quorum_policy(RaftConfigPB::MAJORITY);
+  EXPECT_EQ(8, GetCommitQuorumIndex(config, "A", kIndexes));
+  EXPECT_TRUE(IsCommitQuorum(config, "A", { "A", "B", "C", "D", "E" }));
+  EXPECT_FALSE(IsElectionQuorum(config, { "A", "B", "C", "D" }));
+
+  // Quorums by region require every voter to have one.
+  config.set_quorum_policy(RaftConfigPB::REGION_MAJORITIES);
+  config.mutable_peers(0)->mutable_attrs()->clear_region();
+  Status s = VerifyRaftConfig(config);
+  ASSERT_TRUE(s.IsIllegalState()) << s.ToString();
+  ASSERT_STR_CONTAINS(s.ToString(), "has no region");
+}
+
+// Two candidates of different regions can't both be elected: with two
+// regions, an election quorum needs majorities of both.
+TEST(QuorumUtilTest, TestTwoRegionElectionQuorumsOverlap) {
+  RaftConfigPB config;
+  config.set_opid_index(1);
+  config.set_quorum_policy(RaftConfigPB::REGION_MAJORITIES);
+  const vector<pair<string, string>> kPeers = {
+    { "A", "east" }, { "B", "east" }, { "C", "east" },
+    { "D", "west" }, { "E", "west" }, { "F", "west" },
+  };
+  for (const auto& p : kPeers) {
+    AddPeer(&config, p.first, V);
+    config.mutable_peers(config.peers_size() - 1)->mutable_attrs()->set_region(p.second);
+  }
+  ASSERT_OK(VerifyRaftConfig(config));
+
+  EXPECT_FALSE(IsElectionQuorum(config, { "A", "B", "C" }));
+  EXPECT_FALSE(IsElectionQuorum(config, { "D", "E", "F" }));
+  EXPECT_TRUE(IsElectionQuorum(config, { "A", "B", "D", "E" }));
+}
+
 // Tests paremeterized by the policy on the replica majority's health.
 class QuorumUtilHealthPolicyParamTest :
     public ::testing::Test,
@@ -16,6 +16,9 @@
 // under the License.
 #include "kudu/consensus/quorum_util.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -68,6 +71,20 @@ bool IsRaftConfigVoter(const std::string& uuid, const RaftConfigPB& config) {
   return false;
 }
 
+bool IsRaftConfigWitness(const std::string& uuid, const RaftConfigPB& config) {
+  for (const RaftPeerPB& peer : config.peers()) {
+    if (peer.permanent_uuid() == uuid) {
+      return peer.member_type() == RaftPeerPB::WITNESS;
+    }
+  }
+  return false;
+}
+
+bool IsVotingMember(const RaftPeerPB& peer) {
+  return peer.member_type() == RaftPeerPB::VOTER ||
+         peer.member_type() == RaftPeerPB::WITNESS;
+}
+
 bool IsVoterRole(RaftPeerPB::Role role) {
   return role == RaftPeerPB::LEADER || role == RaftPeerPB::FOLLOWER;
 }
@@ -122,11 +139,136 @@ int CountVoters(const RaftConfigPB& config) {
   return voters;
 }
 
+int CountVotingMembers(const RaftConfigPB& config) {
+  int voters = 0;
+  for (const RaftPeerPB& peer : config.peers()) {
+    if (IsVotingMember(peer)) {
+      voters++;
+    }
+  }
+  return voters;
+}
+
 int MajoritySize(int num_voters) {
   DCHECK_GE(num_voters, 1);
   return (num_voters / 2) + 1;
 }
 
+namespace {
+
+// The number of voters of a region, and how many of them are in a set.
+struct RegionVoters {
+  int num_voters = 0;
+  int num_in_set = 0;
+
+  bool HasMajority() const {
+    return num_in_set >= MajoritySize(num_voters);
+  }
+};
+
+// Counts the voting members of each region of 'config', and those in 'voters'.
+map<string, RegionVoters> CountRegionVoters(const RaftConfigPB& config,
+                                            const set<string>& voters) {
+  map<string, RegionVoters> regions;
+  for (const RaftPeerPB& peer : config.peers()) {
+    if (!IsVotingMember(peer)) {
+      continue;
+    }
+    RegionVoters& region = regions[peer.attrs().region()];
+    region.num_voters++;
+    if (ContainsKey(voters, peer.permanent_uuid())) {
+      region.num_in_set++;
+    }
+  }
+  return regions;
+}
+
+bool IsVoterMajority(const RaftConfigPB& config, const set<string>& voters) {
+  int num_in_set = 0;
+  for (const RaftPeerPB& peer : config.peers()) {
+    if (IsVotingMember(peer) && ContainsKey(voters, peer.permanent_uuid())) {
+      num_in_set++;
+    }
+  }
+  return num_in_set >= MajoritySize(CountVotingMembers(config));
+}
+
+} // anonymous namespace
+
+bool IsCommitQuorum(const RaftConfigPB& config,
+                    const string& leader_uuid,
+                    const set<string>& voters) {
+  if (config.quorum_policy() == RaftConfigPB::MAJORITY) {
+    return IsVoterMajority(config, voters);
+  }
+  DCHECK_EQ(RaftConfigPB::REGION_MAJORITIES, config.quorum_policy());
+  map<string, RegionVoters> regions = CountRegionVoters(config, voters);
+  if (regions.size() < 2) {
+    return IsVoterMajority(config, voters);
+  }
+  const RaftPeerPB* leader = nullptr;
+  for (const RaftPeerPB& peer : config.peers()) {
+    if (peer.permanent_uuid() == leader_uuid) {
+      leader = &peer;
+      break;
+    }
+  }
+  if (leader == nullptr || leader->member_type() != RaftPeerPB::VOTER) {
+    return false;
+  }
+  const string& leader_region = leader->attrs().region();
+  if (!FindOrDie(regions, leader_region).HasMajority()) {
+    return false;
+  }
+  for (const auto& entry : regions) {
+    if (entry.first != leader_region && entry.second.HasMajority()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IsElectionQuorum(const RaftConfigPB& config, const set<string>& voters) {
+  if (config.quorum_policy() == RaftConfigPB::MAJORITY) {
+    return IsVoterMajority(config, voters);
+  }
+  DCHECK_EQ(RaftConfigPB::REGION_MAJORITIES, config.quorum_policy());
+  map<string, RegionVoters> regions = CountRegionVoters(config, voters);
+  if (regions.size() < 2) {
+    return IsVoterMajority(config, voters);
+  }
+  // Any two regions, which a commit quorum spans, include one of these. With
+  // only two regions that takes both: two election quorums must overlap, and
+  // majorities of different regions don't.
+  int num_regions_with_majority = 0;
+  for (const auto& entry : regions) {
+    if (entry.second.HasMajority()) {
+      num_regions_with_majority++;
+    }
+  }
+  return num_regions_with_majority >= std::max<int>(2, regions.size() - 1);
+}
+
+int64_t GetCommitQuorumIndex(const RaftConfigPB& config,
+                             const string& leader_uuid,
+                             const map<string, int64_t>& replicated_indexes) {
+  // Add the voters from the furthest along until they form a quorum.
+  vector<pair<int64_t, string>> by_index;
+  by_index.reserve(replicated_indexes.size());
+  for (const auto& entry : replicated_indexes) {
+    by_index.emplace_back(entry.second, entry.first);
+  }
+  std::sort(by_index.begin(), by_index.end(), std::greater<pair<int64_t, string>>());
+  set<string> voters;
+  for (const auto& entry : by_index) {
+    voters.insert(entry.second);
+    if (IsCommitQuorum(config, leader_uuid, voters)) {
+      return entry.first;
+    }
+  }
+  return -1;
+}
+
 RaftPeerPB::Role GetConsensusRole(const std::string& peer_uuid,
                                   const std::string& leader_uuid,
                                   const RaftConfigPB& config) {
@@ -142,6 +284,8 @@ RaftPeerPB::Role GetConsensusRole(const std::string& peer_uuid,
             return RaftPeerPB::LEADER;
           }
           return RaftPeerPB::FOLLOWER;
+        case RaftPeerPB::WITNESS:
+          return RaftPeerPB::WITNESS_ROLE;
         default:
           return RaftPeerPB::LEARNER;
       }
@@ -196,6 +340,19 @@ Status VerifyRaftConfig(const RaftConfigPB& config) {
           Substitute("Peer: $0 has no member type set. RaftConfig: $1", peer.permanent_uuid(),
                      SecureShortDebugString(config)));
     }
+    if (config.quorum_policy() == RaftConfigPB::REGION_MAJORITIES &&
+        IsVotingMember(peer) && peer.attrs().region().empty()) {
+      return Status::IllegalState(
+          Substitute("Peer: $0 has no region, which quorums by region require. RaftConfig: $1",
+                     peer.permanent_uuid(), SecureShortDebugString(config)));
+    }
+  }
+
+  // Witnesses can't lead, so they need a voter to.
+  if (CountVoters(config) == 0 && CountVotingMembers(config) > 0) {
+    return Status::IllegalState(
+        Substitute("RaftConfig has witnesses but no voter. RaftConfig: $0",
+                   SecureShortDebugString(config)));
   }
 
   return Status::OK();
@@ -453,6 +610,9 @@ bool ShouldAddReplica(const RaftConfigPB& config,
           ++num_non_voters_to_promote;
         }
         break;
+      case RaftPeerPB::WITNESS:
+        // Witnesses are placed by the operator and not replaced automatically.
+        break;
       default:
         LOG(DFATAL) << peer.member_type() << ": unsupported member type";
         break;
@@ -620,6 +780,9 @@ bool ShouldEvictReplica(const RaftConfigPB& config,
         has_non_voter_failed_unrecoverable |= failed_unrecoverable;
         break;
 
+      case RaftPeerPB::WITNESS:
+        // Witnesses are placed by the operator and not replaced automatically.
+        break;
       default:
         LOG(DFATAL) << peer.member_type() << ": unsupported member type";
         break;
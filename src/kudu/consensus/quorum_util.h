@@ -18,6 +18,9 @@
 #ifndef KUDU_CONSENSUS_QUORUM_UTIL_H_
 #define KUDU_CONSENSUS_QUORUM_UTIL_H_
 
+#include <cstdint>
+#include <map>
+#include <set>
 #include <string>
 
 #include "kudu/consensus/metadata.pb.h"
@@ -47,9 +50,14 @@ enum class MajorityHealthPolicy {
 
 bool IsRaftConfigMember(const std::string& uuid, const RaftConfigPB& config);
 bool IsRaftConfigVoter(const std::string& uuid, const RaftConfigPB& config);
+bool IsRaftConfigWitness(const std::string& uuid, const RaftConfigPB& config);
 
-// Whether the specified Raft role is attributed to a peer which can participate
-// in leader elections.
+// Whether 'peer' votes in elections and counts towards commit quorums, i.e.
+// is either a voter or a witness.
+bool IsVotingMember(const RaftPeerPB& peer);
+
+// Whether the specified Raft role is attributed to a peer which can run in
+// leader elections.
 bool IsVoterRole(RaftPeerPB::Role role);
 
 // Get the specified member of the config.
@@ -76,16 +84,39 @@ bool ReplicaTypesEqual(const RaftPeerPB& peer1, const RaftPeerPB& peer2);
 // Counts the number of voters in the configuration.
 int CountVoters(const RaftConfigPB& config);
 
+// Counts the number of voters and witnesses in the configuration.
+int CountVotingMembers(const RaftConfigPB& config);
+
 // Calculates size of a configuration majority based on # of voters.
 int MajoritySize(int num_voters);
 
+// Returns true iff the voting members of 'config' with uuids in 'voters' form
+// a quorum which commits the operations replicated by the leader with uuid
+// 'leader_uuid', according to the quorum policy of 'config'. Witnesses count
+// like voters: since they have the ids of the ops, a candidate missing a
+// committed op can't get the vote of a witness which has it.
+bool IsCommitQuorum(const RaftConfigPB& config,
+                    const std::string& leader_uuid,
+                    const std::set<std::string>& voters);
+
+// Returns true iff the voting members of 'config' with uuids in 'voters'
+// form a quorum which elects a leader, according to the quorum policy of 'config'.
+bool IsElectionQuorum(const RaftConfigPB& config, const std::set<std::string>& voters);
+
+// Returns the highest of 'replicated_indexes', by voter uuid, which has been
+// replicated to a commit quorum for the leader with uuid 'leader_uuid', or
+// -1 if no commit quorum is included in 'replicated_indexes'.
+int64_t GetCommitQuorumIndex(const RaftConfigPB& config,
+                             const std::string& leader_uuid,
+                             const std::map<std::string, int64_t>& replicated_indexes);
+
 // Determines the role that the peer with uuid 'peer_uuid' plays in the
 // cluster. If 'peer_uuid' is empty or is not a member of the configuration,
 // this function will return NON_PARTICIPANT, regardless of whether it is
 // specified as the leader in 'leader_uuid'. Likewise, if 'peer_uuid' is a
 // NON_VOTER in the config, this function will return LEARNER, regardless of
 // whether it is specified as the leader in 'leader_uuid' (although that
-// situation is illegal in practice).
+// situation is illegal in practice), and WITNESS_ROLE for a witness.
 RaftPeerPB::Role GetConsensusRole(const std::string& peer_uuid,
                                   const std::string& leader_uuid,
                                   const RaftConfigPB& config);
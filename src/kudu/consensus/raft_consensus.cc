@@ -34,6 +34,7 @@
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <boost/optional/optional.hpp>
 #include <gflags/gflags.h>
@@ -50,9 +51,12 @@
 #include "kudu/consensus/log.h"
 #include "kudu/consensus/metadata.pb.h"
 #include "kudu/consensus/opid_util.h"
+#include "kudu/consensus/ops_compression.h"
 #include "kudu/consensus/peer_manager.h"
 #include "kudu/consensus/pending_rounds.h"
 #include "kudu/consensus/quorum_util.h"
+#include "kudu/consensus/replication_trace.h"
+#include "kudu/consensus/snapshot_provider.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/bind_helpers.h"
 #include "kudu/gutil/macros.h"
@@ -64,15 +68,19 @@
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/gutil/walltime.h"
 #include "kudu/rpc/periodic.h"
+#include "kudu/rpc/rpc_controller.h"
 #include "kudu/util/async_util.h"
+#include "kudu/util/crc.h"
 #include "kudu/util/debug/trace_event.h"
 #include "kudu/util/flag_tags.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/pb_util.h"
 #include "kudu/util/process_memory.h"
 #include "kudu/util/random.h"
 #include "kudu/util/random_util.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 #include "kudu/util/thread_restrictions.h"
 #include "kudu/util/threadpool.h"
@@ -151,6 +159,13 @@ DEFINE_bool(raft_derived_log_mode, false,
             "When derived log mode is turned on, certain functions"
             " inside kudu raft become invalid");
 
+DEFINE_int32(raft_replicate_arena_size_kb, 1024,
+             "Size of the arenas on which the leader allocates the ReplicateMsgs of "
+             "new rounds. An arena is freed once all of its messages are durable and "
+             "evicted from the log cache. 0 allocates each message on the heap.");
+TAG_FLAG(raft_replicate_arena_size_kb, advanced);
+TAG_FLAG(raft_replicate_arena_size_kb, experimental);
+
 // Metrics
 // ---------
 METRIC_DEFINE_counter(server, follower_memory_pressure_rejections,
@@ -185,12 +200,15 @@ using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::unordered_set;
+using std::vector;
 using std::weak_ptr;
 using strings::Substitute;
 
 namespace kudu {
 namespace consensus {
 
+static LockSite g_raft_consensus_lock_site("RaftConsensus::lock_");
+
 RaftConsensus::RaftConsensus(
     ConsensusOptions options,
     RaftPeerPB local_peer_pb,
@@ -200,6 +218,9 @@ RaftConsensus::RaftConsensus(
       local_peer_pb_(std::move(local_peer_pb)),
       cmeta_manager_(std::move(cmeta_manager)),
       raft_pool_(raft_pool),
+      lock_(&g_raft_consensus_lock_site),
+      published_term_(0),
+      published_role_(RaftPeerPB::UNKNOWN_ROLE),
       state_(kNew),
       rng_(GetRandomSeed32()),
       leader_transfer_in_progress_(false),
@@ -216,6 +237,10 @@ RaftConsensus::RaftConsensus(
 Status RaftConsensus::Init() {
   DCHECK_EQ(kNew, state_) << State_Name(state_);
   RETURN_NOT_OK(cmeta_manager_->Load(options_.tablet_id, &cmeta_));
+  {
+    LockGuard l(lock_);
+    PublishStateUnlocked();
+  }
   SetStateUnlocked(kInitialized);
   return Status::OK();
 }
@@ -301,7 +326,8 @@ Status RaftConsensus::Start(const ConsensusBootstrapInfo& info,
                                                        peer_proxy_factory_.get(),
                                                        queue.get(),
                                                        raft_pool_token_.get(),
-                                                       log_));
+                                                       log_,
+                                                       round_handler_->snapshot_provider()));
 
   unique_ptr<PendingRounds> pending(new PendingRounds(LogPrefixThreadSafe(), time_manager_));
 
@@ -335,6 +361,9 @@ Status RaftConsensus::Start(const ConsensusBootstrapInfo& info,
     CHECK_EQ(kInitialized, state_) << LogPrefixUnlocked() << "Illegal state for Start(): "
                                    << State_Name(state_);
 
+    // The arenas count against the log cache's memory limit.
+    replicate_allocator_.reset(new ReplicateMsgAllocator(
+        FLAGS_raft_replicate_arena_size_kb * 1024, queue->replicate_arena_mem_tracker()));
     queue_ = std::move(queue);
     peer_manager_ = std::move(peer_manager);
     pending_ = std::move(pending);
@@ -511,9 +540,14 @@ Status RaftConsensus::StartElection(ElectionMode mode, ElectionReason reason) {
                                    << SecureShortDebugString(active_config);
 
     // Initialize the VoteCounter.
-    int num_voters = CountVoters(active_config);
-    int majority_size = MajoritySize(num_voters);
-    gscoped_ptr<VoteCounter> counter(new VoteCounter(num_voters, majority_size));
+    gscoped_ptr<VoteCounter> counter;
+    if (active_config.quorum_policy() != RaftConfigPB::MAJORITY) {
+      counter.reset(new VoteCounter(active_config));
+    } else {
+      int num_voters = CountVotingMembers(active_config);
+      int majority_size = MajoritySize(num_voters);
+      counter.reset(new VoteCounter(num_voters, majority_size));
+    }
 
     // Vote for ourselves.
     bool duplicate;
@@ -657,6 +691,19 @@ scoped_refptr<ConsensusRound> RaftConsensus::NewRound(
                                                std::move(replicated_cb)));
 }
 
+ReplicateRefPtr RaftConsensus::NewReplicateMsg() {
+  DCHECK(replicate_allocator_) << LogPrefixThreadSafe() << "not started";
+  return replicate_allocator_->NewReplicateMsg();
+}
+
+scoped_refptr<ConsensusRound> RaftConsensus::NewRound(
+    ReplicateRefPtr replicate_msg,
+    ConsensusReplicatedCallback replicated_cb) {
+  scoped_refptr<ConsensusRound> round(new ConsensusRound(this, std::move(replicate_msg)));
+  round->SetConsensusReplicatedCallback(std::move(replicated_cb));
+  return round;
+}
+
 void RaftConsensus::ReportFailureDetectedTask() {
   std::unique_lock<simple_spinlock> try_lock(failure_detector_election_lock_,
                                              std::try_to_lock);
@@ -700,13 +747,13 @@ Status RaftConsensus::BecomeLeaderUnlocked() {
 
   // Initiate a NO_OP transaction that is sent at the beginning of every term
   // change in raft.
-  auto replicate = new ReplicateMsg;
+  ReplicateRefPtr replicate_ptr = NewReplicateMsg();
+  ReplicateMsg* replicate = replicate_ptr->get();
   replicate->set_op_type(NO_OP);
   replicate->mutable_noop_request(); // Define the no-op request field.
   CHECK_OK(time_manager_->AssignTimestamp(replicate));
 
-  scoped_refptr<ConsensusRound> round(
-      new ConsensusRound(this, make_scoped_refptr(new RefCountedReplicate(replicate))));
+  scoped_refptr<ConsensusRound> round(new ConsensusRound(this, std::move(replicate_ptr)));
   round->SetConsensusReplicatedCallback(std::bind(
       &RaftConsensus::NonTxRoundReplicationFinished,
       this,
@@ -744,7 +791,7 @@ Status RaftConsensus::BecomeReplicaUnlocked(boost::optional<MonoDelta> fd_delta)
 
 Status RaftConsensus::Replicate(const scoped_refptr<ConsensusRound>& round) {
 
-  std::lock_guard<simple_spinlock> lock(update_lock_);
+  std::lock_guard<Mutex> lock(update_lock_);
   {
     ThreadRestrictions::AssertWaitAllowed();
     LockGuard l(lock_);
@@ -784,6 +831,8 @@ Status RaftConsensus::AppendNewRoundToQueueUnlocked(const scoped_refptr<Consensu
   } else {
     *round->replicate_msg()->mutable_id() = queue_->GetNextOpId();
   }
+  ReplicationTrace::GetSingleton()->Record(ReplicationStage::kReplicate,
+                                           round->replicate_msg()->id());
   RETURN_NOT_OK(AddPendingOperationUnlocked(round));
 
   // The only reasons for a bad status would be if the log itself were shut down,
@@ -859,7 +908,12 @@ void RaftConsensus::NotifyCommitIndex(int64_t commit_index) {
     return;
   }
 
+  int64_t committed_index_before = pending_->GetCommittedIndex();
   pending_->AdvanceCommittedIndex(commit_index);
+  ReplicationTrace::GetSingleton()->RecordRange(ReplicationStage::kCommitNotify,
+                                                CurrentTermUnlocked(),
+                                                committed_index_before,
+                                                pending_->GetCommittedIndex());
 
   if (cmeta_->active_role() == RaftPeerPB::LEADER) {
     peer_manager_->SignalRequest(false);
@@ -1040,13 +1094,24 @@ Status RaftConsensus::Update(const ConsensusRequestPB* request,
 
   response->set_responder_uuid(peer_uuid());
 
+  // Uncompress the ops before taking the lock: the rest of the update only
+  // deals with the ops themselves.
+  ConsensusRequestPB decompressed;
+  if (request->has_compressed_ops()) {
+    RETURN_NOT_OK_PREPEND(DecompressOps(*request, &decompressed),
+                          "unable to read ops sent by the leader");
+    request = &decompressed;
+  }
+
   VLOG_WITH_PREFIX(2) << "Replica received request: " << SecureShortDebugString(*request);
 
   // see var declaration
-  std::lock_guard<simple_spinlock> lock(update_lock_);
+  std::lock_guard<Mutex> lock(update_lock_);
+  // UpdateReplica() takes the ops out of the request.
+  const bool status_only = request->ops().empty();
   Status s = UpdateReplica(request, response);
   if (PREDICT_FALSE(VLOG_IS_ON(1))) {
-    if (request->ops().empty()) {
+    if (status_only) {
       VLOG_WITH_PREFIX(1) << "Replica replied to status only request. Replica: "
                           << ToString() << ". Response: "
                           << SecureShortDebugString(*response);
@@ -1055,6 +1120,218 @@ Status RaftConsensus::Update(const ConsensusRequestPB* request,
   return s;
 }
 
+Status RaftConsensus::InstallSnapshot(const InstallSnapshotRequestPB& request,
+                                      const Slice& chunk,
+                                      InstallSnapshotResponsePB* response) {
+  TRACE_EVENT2("consensus", "RaftConsensus::InstallSnapshot",
+               "peer", peer_uuid(),
+               "tablet", options_.tablet_id);
+  response->set_responder_uuid(peer_uuid());
+  const OpId& last_included = request.last_included_opid();
+  {
+    ThreadRestrictions::AssertWaitAllowed();
+    LockGuard l(lock_);
+    RETURN_NOT_OK(CheckRunningUnlocked());
+    if (request.caller_term() < CurrentTermUnlocked()) {
+      string msg = Substitute("Rejecting snapshot from peer $0 for earlier term $1. "
+                              "Current term is $2.",
+                              request.caller_uuid(),
+                              request.caller_term(),
+                              CurrentTermUnlocked());
+      LOG_WITH_PREFIX_UNLOCKED(INFO) << msg;
+      response->set_responder_term(CurrentTermUnlocked());
+      ConsensusErrorPB* error = response->mutable_consensus_error();
+      error->set_code(ConsensusErrorPB::INVALID_TERM);
+      StatusToPB(Status::IllegalState(msg), error->mutable_status());
+      return Status::OK();
+    }
+    if (request.caller_term() > CurrentTermUnlocked()) {
+      RETURN_NOT_OK(HandleTermAdvanceUnlocked(request.caller_term()));
+    }
+    response->set_responder_term(CurrentTermUnlocked());
+    if (PREDICT_FALSE(!HasLeaderUnlocked())) {
+      SetLeaderUuidUnlocked(request.caller_uuid());
+    }
+
+    // The transfer may take longer than an election timeout, during which
+    // the leader sends nothing else.
+    SnoozeFailureDetector();
+
+    // Nothing to do if the replica has caught up in the meantime, e.g. if it
+    // installed the snapshot but the response was lost.
+    if (pending_->GetCommittedIndex() >= last_included.index()) {
+      response->set_next_offset(request.snapshot_size());
+      return Status::OK();
+    }
+  }
+
+  SnapshotProvider* provider = round_handler_->snapshot_provider();
+  if (PREDICT_FALSE(provider == nullptr)) {
+    return Status::NotSupported("replica can't install snapshots");
+  }
+
+  MutexLock l(snapshot_lock_);
+  if (!snapshot_sink_ || !OpIdEquals(snapshot_sink_opid_, last_included)) {
+    // The leader started over with a different snapshot.
+    snapshot_sink_.reset();
+    RETURN_NOT_OK_PREPEND(provider->OpenSink(last_included, request.snapshot_size(),
+                                             &snapshot_sink_),
+                          "unable to open snapshot");
+    snapshot_sink_opid_ = last_included;
+  }
+
+  // Chunks at any other offset are duplicates or were sent before a restart;
+  // the response tells the leader where to continue from.
+  if (request.has_chunk_sidecar() && request.offset() == snapshot_sink_->size()) {
+    if (PREDICT_FALSE(crc::Crc32c(chunk.data(), chunk.size()) != request.chunk_crc32c())) {
+      return Status::Corruption(Substitute("snapshot chunk at offset $0 has a bad checksum",
+                                           request.offset()));
+    }
+    if (PREDICT_FALSE(request.offset() + chunk.size() > request.snapshot_size())) {
+      return Status::InvalidArgument(Substitute(
+          "snapshot chunk of $0 bytes at offset $1 is past the end of the $2 byte snapshot",
+          chunk.size(), request.offset(), request.snapshot_size()));
+    }
+    RETURN_NOT_OK_PREPEND(snapshot_sink_->Append(chunk), "unable to write snapshot");
+  }
+  response->set_next_offset(snapshot_sink_->size());
+  if (snapshot_sink_->size() == request.snapshot_size()) {
+    RETURN_NOT_OK(InstallReceivedSnapshot(request));
+  }
+  return Status::OK();
+}
+
+Status RaftConsensus::InstallReceivedSnapshot(const InstallSnapshotRequestPB& request) {
+  snapshot_lock_.AssertAcquired();
+  const OpId& last_included = request.last_included_opid();
+
+  // Updates must not be applied while the state is replaced.
+  std::lock_guard<Mutex> update_guard(update_lock_);
+  {
+    ThreadRestrictions::AssertWaitAllowed();
+    LockGuard l(lock_);
+    if (pending_->GetCommittedIndex() >= last_included.index()) {
+      snapshot_sink_.reset();
+      return Status::OK();
+    }
+  }
+
+  LOG_WITH_PREFIX(INFO) << "Installing snapshot through op " << OpIdToString(last_included);
+  RETURN_NOT_OK_PREPEND(snapshot_sink_->Install(), "unable to install snapshot");
+  snapshot_sink_.reset();
+
+  // The ops in the log up to 'last_included' are covered by the snapshot, and
+  // the log must not have a gap before the ops the leader sends next.
+  RETURN_NOT_OK_PREPEND(log_->ResetToSnapshot(last_included),
+                        "unable to reset the log after installing a snapshot");
+
+  ThreadRestrictions::AssertWaitAllowed();
+  LockGuard l(lock_);
+  // The ops after the committed one which weren't replicated yet are covered
+  // by the snapshot or were superseded by the leader.
+  pending_->AbortOpsAfter(pending_->GetCommittedIndex());
+  RETURN_NOT_OK(pending_->SetCommittedOpIdFromSnapshot(last_included));
+  queue_->ResetToSnapshot(last_included);
+  last_received_cur_leader_ = last_included;
+
+  // Adopt the leader's config if it was committed by the snapshot.
+  if (request.has_config() && request.config().has_opid_index() &&
+      request.config().opid_index() <= last_included.index() &&
+      request.config().opid_index() > cmeta_->CommittedConfig().opid_index()) {
+    cmeta_->clear_pending_config();
+    PublishStateUnlocked();
+    RETURN_NOT_OK(SetCommittedConfigUnlocked(request.config()));
+  }
+  SnoozeFailureDetector();
+  LOG_WITH_PREFIX_UNLOCKED(INFO) << "Installed snapshot through op "
+                                 << OpIdToString(last_included);
+  return Status::OK();
+}
+
+namespace {
+
+// An update being relayed to a peer, with the ops filled in.
+struct RelayedUpdate {
+  ~RelayedUpdate() {
+    // The ops are owned by 'ops'.
+    request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
+  }
+
+  ConsensusRequestPB request;
+  vector<ReplicateRefPtr> ops;
+  rpc::RpcController controller;
+  shared_ptr<PeerProxy> proxy;
+};
+
+} // anonymous namespace
+
+void RaftConsensus::RelayUpdateAsync(const ConsensusRequestPB* request,
+                                     ConsensusResponsePB* response,
+                                     StdStatusCallback callback) {
+  DCHECK(request->has_relay_dest_uuid());
+  const string& dest_uuid = request->relay_dest_uuid();
+  RaftPeerPB dest_pb;
+  {
+    ThreadRestrictions::AssertWaitAllowed();
+    LockGuard l(lock_);
+    Status s = CheckRunningUnlocked();
+    if (PREDICT_FALSE(!s.ok())) {
+      callback(s);
+      return;
+    }
+    bool found = false;
+    for (const RaftPeerPB& peer_pb : cmeta_->ActiveConfig().peers()) {
+      if (peer_pb.permanent_uuid() == dest_uuid) {
+        dest_pb = peer_pb;
+        found = true;
+        break;
+      }
+    }
+    if (PREDICT_FALSE(!found || dest_uuid == peer_uuid())) {
+      callback(Status::InvalidArgument("cannot relay request to peer", dest_uuid));
+      return;
+    }
+  }
+
+  shared_ptr<RelayedUpdate> update = std::make_shared<RelayedUpdate>();
+  {
+    std::lock_guard<simple_spinlock> l(relay_lock_);
+    update->proxy = FindPtrOrNull(relay_proxies_, dest_uuid);
+  }
+  if (!update->proxy) {
+    gscoped_ptr<PeerProxy> proxy;
+    Status s = peer_proxy_factory_->NewProxy(dest_pb, &proxy);
+    if (PREDICT_FALSE(!s.ok())) {
+      callback(s.CloneAndPrepend("could not obtain a remote proxy to the peer"));
+      return;
+    }
+    update->proxy.reset(proxy.release());
+    std::lock_guard<simple_spinlock> l(relay_lock_);
+    relay_proxies_[dest_uuid] = update->proxy;
+  }
+
+  Status s = queue_->ReadOpsForRelay(request->preceding_id(),
+                                     request->relay_last_op_id(),
+                                     &update->ops);
+  if (PREDICT_FALSE(!s.ok())) {
+    callback(s.CloneAndPrepend("unable to read the ops to relay"));
+    return;
+  }
+  update->request.CopyFrom(*request);
+  update->request.set_dest_uuid(dest_uuid);
+  update->request.clear_relay_dest_uuid();
+  update->request.clear_relay_last_op_id();
+  update->request.mutable_ops()->Reserve(update->ops.size());
+  for (const auto& op : update->ops) {
+    update->request.mutable_ops()->UnsafeArenaAddAllocated(op->get());
+  }
+
+  update->proxy->UpdateAsync(&update->request, response, &update->controller,
+                             [update, callback]() {
+                               callback(update->controller.status());
+                             });
+}
+
 // Helper function to check if the op is a non-Transaction op.
 static bool IsConsensusOnlyOperation(OperationType op_type) {
   return op_type == NO_OP || op_type == CHANGE_CONFIG_OP;
@@ -1067,23 +1344,34 @@ Status RaftConsensus::StartFollowerTransactionUnlocked(const ReplicateRefPtr& ms
     return StartConsensusOnlyRoundUnlocked(msg);
   }
 
+  // Witnesses only get the headers of the ops, which they log but don't apply.
+  if (IsRaftConfigWitness(peer_uuid(), cmeta_->ActiveConfig())) {
+    VLOG_WITH_PREFIX_UNLOCKED(1) << "Logging op header: "
+                                 << SecureShortDebugString(msg->get()->id());
+    return AddPendingOperationUnlocked(new ConsensusRound(this, msg));
+  }
+
+  scoped_refptr<ConsensusRound> round(new ConsensusRound(this, msg));
+  RETURN_NOT_OK(StartFollowerTransaction(round));
+  return AddPendingOperationUnlocked(round);
+}
+
+Status RaftConsensus::StartFollowerTransaction(const scoped_refptr<ConsensusRound>& round) {
+  DCHECK(!IsConsensusOnlyOperation(round->replicate_msg()->op_type()));
   if (PREDICT_FALSE(FLAGS_follower_fail_all_prepare)) {
     return Status::IllegalState("Rejected: --follower_fail_all_prepare "
                                 "is set to true.");
   }
 
-  VLOG_WITH_PREFIX_UNLOCKED(1) << "Starting transaction: "
-                               << SecureShortDebugString(msg->get()->id());
-  scoped_refptr<ConsensusRound> round(new ConsensusRound(this, msg));
-  ConsensusRound* round_ptr = round.get();
-  RETURN_NOT_OK(round_handler_->StartFollowerTransaction(round));
-  return AddPendingOperationUnlocked(round_ptr);
+  VLOG_WITH_PREFIX(1) << "Starting transaction: "
+                      << SecureShortDebugString(round->replicate_msg()->id());
+  return round_handler_->StartFollowerTransaction(round);
 }
 
 bool RaftConsensus::IsSingleVoterConfig() const {
   ThreadRestrictions::AssertWaitAllowed();
   LockGuard l(lock_);
-  return cmeta_->CountVotersInConfig(COMMITTED_CONFIG) == 1 &&
+  return CountVotingMembers(cmeta_->CommittedConfig()) == 1 &&
          cmeta_->IsVoterInConfig(peer_uuid(), COMMITTED_CONFIG);
 }
 
@@ -1102,7 +1390,41 @@ std::string RaftConsensus::LeaderRequest::OpsRangeString() const {
   return ret;
 }
 
-void RaftConsensus::DeduplicateLeaderRequestUnlocked(ConsensusRequestPB* rpc_req,
+Status RaftConsensus::ExtractLeaderRequestOps(ConsensusRequestPB* rpc_req,
+                                              LeaderRequest* req) {
+  if (rpc_req->has_deprecated_committed_index() ||
+      !rpc_req->has_all_replicated_index()) {
+    return Status::InvalidArgument("Leader appears to be running an earlier version "
+                                   "of Kudu. Please shut down and upgrade all servers "
+                                   "before restarting.");
+  }
+
+  // This is an additional check for KUDU-639 that makes sure the message's index
+  // and term are in the right sequence in the request. We do this before we change
+  // any of the internal state.
+  const OpId* prev = &rpc_req->preceding_id();
+  for (const ReplicateMsg& msg : rpc_req->ops()) {
+    Status s = PendingRounds::CheckOpInSequence(*prev, msg.id());
+    if (PREDICT_FALSE(!s.ok())) {
+      LOG(ERROR) << "Leader request contained out-of-sequence messages. Status: "
+          << s.ToString() << ". Leader Request: " << SecureShortDebugString(*rpc_req);
+      return s;
+    }
+    prev = &msg.id();
+  }
+
+  // We take ownership of the ops, so that the ones to append can be passed on
+  // and the duplicates are freed along with 'req'.
+  req->preceding_opid = &rpc_req->preceding_id();
+  req->messages.reserve(rpc_req->ops_size());
+  for (int i = 0; i < rpc_req->ops_size(); i++) {
+    req->messages.push_back(make_scoped_refptr_replicate(rpc_req->mutable_ops(i)));
+  }
+  rpc_req->mutable_ops()->ExtractSubrange(0, rpc_req->ops_size(), nullptr);
+  return Status::OK();
+}
+
+void RaftConsensus::DeduplicateLeaderRequestUnlocked(const ConsensusRequestPB& rpc_req,
                                                      LeaderRequest* deduplicated_req) {
   DCHECK(lock_.is_locked());
 
@@ -1110,63 +1432,63 @@ void RaftConsensus::DeduplicateLeaderRequestUnlocked(ConsensusRequestPB* rpc_req
   int64_t last_committed_index = pending_->GetCommittedIndex();
 
   // The leader's preceding id.
-  deduplicated_req->preceding_opid = &rpc_req->preceding_id();
+  deduplicated_req->preceding_opid = &rpc_req.preceding_id();
 
   int64_t dedup_up_to_index = queue_->GetLastOpIdInLog().index();
 
-  deduplicated_req->first_message_idx = -1;
+  auto& messages = deduplicated_req->messages;
 
   // In this loop we discard duplicates and advance the leader's preceding id
-  // accordingly.
-  for (int i = 0; i < rpc_req->ops_size(); i++) {
-    ReplicateMsg* leader_msg = rpc_req->mutable_ops(i);
+  // accordingly. Duplicates only ever come before the new messages.
+  auto first_new = messages.begin();
+  for (; first_new != messages.end(); ++first_new) {
+    const OpId& leader_id = (*first_new)->get()->id();
 
-    if (leader_msg->id().index() <= last_committed_index) {
-      VLOG_WITH_PREFIX_UNLOCKED(2) << "Skipping op id " << leader_msg->id()
+    if (leader_id.index() <= last_committed_index) {
+      VLOG_WITH_PREFIX_UNLOCKED(2) << "Skipping op id " << leader_id
                                    << " (already committed)";
-      deduplicated_req->preceding_opid = &leader_msg->id();
+      deduplicated_req->preceding_opid = &leader_id;
       continue;
     }
 
-    if (leader_msg->id().index() <= dedup_up_to_index) {
+    if (leader_id.index() <= dedup_up_to_index) {
       // If the index is uncommitted and below our match index, then it must be in the
       // pendings set.
       scoped_refptr<ConsensusRound> round =
-          pending_->GetPendingOpByIndexOrNull(leader_msg->id().index());
-      DCHECK(round) << "Could not find op with index " << leader_msg->id().index()
+          pending_->GetPendingOpByIndexOrNull(leader_id.index());
+      DCHECK(round) << "Could not find op with index " << leader_id.index()
                     << " in pending set. committed= " << last_committed_index
                     << " dedup=" << dedup_up_to_index;
 
       // If the OpIds match, i.e. if they have the same term and id, then this is just
       // duplicate, we skip...
-      if (OpIdEquals(round->replicate_msg()->id(), leader_msg->id())) {
-        VLOG_WITH_PREFIX_UNLOCKED(2) << "Skipping op id " << leader_msg->id()
+      if (OpIdEquals(round->replicate_msg()->id(), leader_id)) {
+        VLOG_WITH_PREFIX_UNLOCKED(2) << "Skipping op id " << leader_id
                                      << " (already replicated)";
-        deduplicated_req->preceding_opid = &leader_msg->id();
+        deduplicated_req->preceding_opid = &leader_id;
         continue;
       }
-
-      // ... otherwise we must adjust our match index, i.e. all messages from now on
-      // are "new"
-      dedup_up_to_index = leader_msg->id().index();
     }
 
-    if (deduplicated_req->first_message_idx == - 1) {
-      deduplicated_req->first_message_idx = i;
-    }
-    deduplicated_req->messages.push_back(make_scoped_refptr_replicate(leader_msg));
+    // ... otherwise this and all the messages after it are new.
+    break;
   }
 
-  if (deduplicated_req->messages.size() != rpc_req->ops_size()) {
+  if (first_new != messages.begin()) {
+    const string original_range = deduplicated_req->OpsRangeString();
+    // The preceding id may point into the last of the duplicates, so they're
+    // kept alive.
+    deduplicated_req->duplicates.assign(messages.begin(), first_new);
+    messages.erase(messages.begin(), first_new);
     LOG_WITH_PREFIX_UNLOCKED(INFO) << "Deduplicated request from leader. Original: "
-                          << rpc_req->preceding_id() << "->" << OpsRangeString(*rpc_req)
+                          << rpc_req.preceding_id() << "->" << original_range
                           << "   Dedup: " << *deduplicated_req->preceding_opid << "->"
                           << deduplicated_req->OpsRangeString();
   }
-
 }
 
 Status RaftConsensus::HandleLeaderRequestTermUnlocked(const ConsensusRequestPB* request,
+                                                      const LeaderRequest& deduped_req,
                                                       ConsensusResponsePB* response) {
   DCHECK(lock_.is_locked());
   // Do term checks first:
@@ -1179,7 +1501,7 @@ Status RaftConsensus::HandleLeaderRequestTermUnlocked(const ConsensusRequestPB*
                               request->caller_uuid(),
                               request->caller_term(),
                               CurrentTermUnlocked(),
-                              OpsRangeString(*request));
+                              deduped_req.OpsRangeString());
       LOG_WITH_PREFIX_UNLOCKED(INFO) << msg;
       FillConsensusResponseError(response,
                                  ConsensusErrorPB::INVALID_TERM,
@@ -1243,49 +1565,11 @@ Status RaftConsensus::CheckLeaderRequestUnlocked(const ConsensusRequestPB* reque
                                                  LeaderRequest* deduped_req) {
   DCHECK(lock_.is_locked());
 
-  if (request->has_deprecated_committed_index() ||
-      !request->has_all_replicated_index()) {
-    return Status::InvalidArgument("Leader appears to be running an earlier version "
-                                   "of Kudu. Please shut down and upgrade all servers "
-                                   "before restarting.");
-  }
-
-  ConsensusRequestPB* mutable_req = const_cast<ConsensusRequestPB*>(request);
-  DeduplicateLeaderRequestUnlocked(mutable_req, deduped_req);
-
-  // This is an additional check for KUDU-639 that makes sure the message's index
-  // and term are in the right sequence in the request, after we've deduplicated
-  // them. We do this before we change any of the internal state.
-  //
-  // TODO move this to raft_consensus-state or whatever we transform that into.
-  // We should be able to do this check for each append, but right now the way
-  // we initialize raft_consensus-state is preventing us from doing so.
-  Status s;
-  const OpId* prev = deduped_req->preceding_opid;
-  for (const ReplicateRefPtr& message : deduped_req->messages) {
-    s = PendingRounds::CheckOpInSequence(*prev, message->get()->id());
-    if (PREDICT_FALSE(!s.ok())) {
-      LOG(ERROR) << "Leader request contained out-of-sequence messages. Status: "
-          << s.ToString() << ". Leader Request: " << SecureShortDebugString(*request);
-      break;
-    }
-    prev = &message->get()->id();
-  }
-
-  // We only release the messages from the request after the above check so that
-  // that we can print the original request, if it fails.
-  if (!deduped_req->messages.empty()) {
-    // We take ownership of the deduped ops.
-    DCHECK_GE(deduped_req->first_message_idx, 0);
-    mutable_req->mutable_ops()->ExtractSubrange(
-        deduped_req->first_message_idx,
-        deduped_req->messages.size(),
-        nullptr);
-  }
-
-  RETURN_NOT_OK(s);
+  // The ops were already taken out of the request and checked to be in
+  // sequence by ExtractLeaderRequestOps().
+  DeduplicateLeaderRequestUnlocked(*request, deduped_req);
 
-  RETURN_NOT_OK(HandleLeaderRequestTermUnlocked(request, response));
+  RETURN_NOT_OK(HandleLeaderRequestTermUnlocked(request, *deduped_req, response));
 
   if (response->status().has_error()) {
     return Status::OK();
@@ -1356,7 +1640,9 @@ Status RaftConsensus::UpdateReplica(const ConsensusRequestPB* request,
   //
   // We split the operations into replicates and commits and make sure that we don't
   // don't do anything on operations we've already received in a previous call.
-  // This essentially makes this method idempotent.
+  // This essentially makes this method idempotent. Taking the ops out of the request
+  // and checking that they're in sequence doesn't need 'lock_'; deduplicating them
+  // against the pending ones does.
   //
   // 1 - We mark as many pending transactions as committed as we can.
   //
@@ -1370,7 +1656,15 @@ Status RaftConsensus::UpdateReplica(const ConsensusRequestPB* request,
   // 2 - We enqueue the Prepare of the transactions.
   //
   // The actual prepares are enqueued in order but happen asynchronously so we don't
-  // have decoding/acquiring locks on the critical path.
+  // have decoding/acquiring locks on the critical path. The rounds before the first
+  // config change are created and handed to the round handler without holding
+  // 'lock_', so that leader-side and read-only callers (e.g. GetLastOpId() or the
+  // queue's callbacks) aren't blocked behind them. The rounds are then added to the
+  // pending ones, in order, under 'lock_', after checking that the term and the
+  // leader didn't change meanwhile; if they did, the started rounds are aborted.
+  // The config change and the ops after it are started under 'lock_', since the
+  // config they're started with depends on it. 'update_lock_' keeps any other
+  // Update() or InstallSnapshot() from changing the pending ops in between.
   //
   // We need to do this now for a number of reasons:
   // - Prepares, by themselves, are inconsequential, i.e. they do not mutate the
@@ -1429,6 +1723,14 @@ Status RaftConsensus::UpdateReplica(const ConsensusRequestPB* request,
   // The deduplicated request.
   LeaderRequest deduped_req;
   auto& messages = deduped_req.messages;
+  deduped_req.leader_uuid = request->caller_uuid();
+  RETURN_NOT_OK(ExtractLeaderRequestOps(const_cast<ConsensusRequestPB*>(request),
+                                        &deduped_req));
+
+  // The term and whether we're a witness when the request was accepted, to
+  // start the transactions without holding 'lock_'.
+  int64_t term;
+  bool is_witness;
   {
     ThreadRestrictions::AssertWaitAllowed();
     LockGuard l(lock_);
@@ -1437,8 +1739,6 @@ Status RaftConsensus::UpdateReplica(const ConsensusRequestPB* request,
       LOG_WITH_PREFIX_UNLOCKED(INFO) << "Allowing update even though not a member of the config";
     }
 
-    deduped_req.leader_uuid = request->caller_uuid();
-
     RETURN_NOT_OK(CheckLeaderRequestUnlocked(request, response, &deduped_req));
     if (response->status().has_error()) {
       // We had an error, like an invalid term, we still fill the response.
@@ -1514,21 +1814,105 @@ Status RaftConsensus::UpdateReplica(const ConsensusRequestPB* request,
       }
     }
 
-    Status prepare_status;
+    term = CurrentTermUnlocked();
+    is_witness = IsRaftConfigWitness(peer_uuid(), cmeta_->ActiveConfig());
+  }
+
+  // Start the transactions of the ops, in order, stopping at the first one
+  // which fails to start. NO_OPs are started under 'lock_' below, and are left
+  // null here. So are the ops from the first config change on: whether we're a
+  // witness may change with it, so they're started under 'lock_' too, with the
+  // config in effect once the ops before them were added.
+  Status prepare_status;
+  vector<scoped_refptr<ConsensusRound>> rounds;
+  rounds.reserve(messages.size());
+  for (const ReplicateRefPtr& msg : messages) {
+    if (msg->get()->op_type() == CHANGE_CONFIG_OP) {
+      break;
+    }
+    if (IsConsensusOnlyOperation(msg->get()->op_type())) {
+      rounds.emplace_back();
+      continue;
+    }
+    scoped_refptr<ConsensusRound> round(new ConsensusRound(this, msg));
+    // Witnesses only get the headers of the ops, which they log but don't apply.
+    if (!is_witness) {
+      prepare_status = StartFollowerTransaction(round);
+      if (PREDICT_FALSE(!prepare_status.ok())) {
+        break;
+      }
+    }
+    rounds.emplace_back(std::move(round));
+  }
+
+  {
+    ThreadRestrictions::AssertWaitAllowed();
+    LockGuard l(lock_);
+
+    // Anything may have happened while we didn't hold 'lock_', except for
+    // another Update(). If we're no longer following this leader in this
+    // term, the ops we started aren't ours to add anymore.
+    Status s = CheckRunningUnlocked();
+    if (PREDICT_FALSE(!s.ok() ||
+                      CurrentTermUnlocked() != term ||
+                      GetLeaderUuidUnlocked() != deduped_req.leader_uuid)) {
+      for (const auto& round : rounds) {
+        if (round) {
+          round->NotifyReplicationFinished(Status::Aborted(
+              "Leader or term changed while starting the transaction"));
+        }
+      }
+      RETURN_NOT_OK(s);
+      string msg = Substitute("Rejecting Update request from peer $0 for term $1. "
+                              "The term or the leader changed while the ops were "
+                              "being prepared.",
+                              request->caller_uuid(),
+                              request->caller_term());
+      LOG_WITH_PREFIX_UNLOCKED(INFO) << msg;
+      FillConsensusResponseError(response, ConsensusErrorPB::INVALID_TERM,
+                                 Status::IllegalState(msg));
+      FillConsensusResponseOKUnlocked(response);
+      return Status::OK();
+    }
+
+    // If all the ops were started, 'iter' ends up at the end of 'messages';
+    // otherwise at the first op which wasn't added.
     auto iter = messages.begin();
-    while (iter != messages.end()) {
+    for (size_t i = 0; iter != messages.end(); i++, ++iter) {
+      if (i >= rounds.size() && !prepare_status.ok()) {
+        // The op failed to start above.
+        break;
+      }
       OperationType op_type = (*iter)->get()->op_type();
       if (op_type == NO_OP) {
         new_leader_detected_failsafe_ = false;
       }
-      prepare_status = StartFollowerTransactionUnlocked(*iter);
-      if (PREDICT_FALSE(!prepare_status.ok())) {
+      Status add_status;
+      if (i >= rounds.size()) {
+        // At or after a config change.
+        add_status = StartFollowerTransactionUnlocked(*iter);
+      } else if (!rounds[i]) {
+        add_status = StartConsensusOnlyRoundUnlocked(*iter);
+      } else {
+        if (is_witness) {
+          VLOG_WITH_PREFIX_UNLOCKED(1) << "Logging op header: "
+                                       << SecureShortDebugString((*iter)->get()->id());
+        }
+        add_status = AddPendingOperationUnlocked(rounds[i]);
+      }
+      if (PREDICT_FALSE(!add_status.ok())) {
+        // This op and the ones after it were started but won't be added.
+        for (size_t j = i; j < rounds.size(); j++) {
+          if (rounds[j]) {
+            rounds[j]->NotifyReplicationFinished(add_status);
+          }
+        }
+        prepare_status = add_status;
         break;
       }
       // TODO(dralves) Without leader leases this shouldn't be allowed to fail.
       // Once we have that functionality we'll have to revisit this.
       CHECK_OK(time_manager_->MessageReceivedFromLeader(*(*iter)->get()));
-      ++iter;
     }
 
     // If we stopped before reaching the end we failed to prepare some message(s) and need
@@ -1683,7 +2067,7 @@ Status RaftConsensus::RequestVote(const VoteRequestPB* request,
   // We must acquire the update lock in order to ensure that this vote action
   // takes place between requests.
   // Lock ordering: update_lock_ must be acquired before lock_.
-  std::unique_lock<simple_spinlock> update_guard(update_lock_, std::defer_lock);
+  std::unique_lock<Mutex> update_guard(update_lock_, std::defer_lock);
   if (FLAGS_enable_leader_failure_detection) {
     update_guard.try_lock();
   } else {
@@ -1882,8 +2266,9 @@ Status RaftConsensus::BulkChangeConfig(const BulkChangeConfigRequestPB& req,
     RaftConfigPB new_config = committed_config;
 
     // Enforce the "one by one" config change rules, even with the bulk API.
-    // Keep track of total voters added, including non-voters promoted to
-    // voters, and removed, including voters demoted to non-voters.
+    // Keep track of total voting members (voters and witnesses) added,
+    // including non-voters promoted to voters, and removed, including voters
+    // demoted to non-voters.
     int num_voters_modified = 0;
 
     // A record of the peers being modified so that we can enforce only one
@@ -1935,13 +2320,13 @@ Status RaftConsensus::BulkChangeConfig(const BulkChangeConfigRequestPB& req,
             return Status::InvalidArgument("peer must have last_known_addr specified",
                                            SecureShortDebugString(req));
           }
-          if (peer.member_type() == RaftPeerPB::VOTER) {
+          if (IsVotingMember(peer)) {
             num_voters_modified++;
           }
           *new_config.add_peers() = peer;
           break;
 
-        case REMOVE_PEER:
+        case REMOVE_PEER: {
           if (server_uuid == peer_uuid()) {
             return Status::InvalidArgument(
                 Substitute("Cannot remove peer $0 from the config because it is the leader. "
@@ -1950,15 +2335,18 @@ Status RaftConsensus::BulkChangeConfig(const BulkChangeConfigRequestPB& req,
                            server_uuid,
                            SecureShortDebugString(cmeta_->ToConsensusStatePB())));
           }
-          if (!RemoveFromRaftConfig(&new_config, server_uuid)) {
+          RaftPeerPB* removed_peer;
+          if (!GetRaftConfigMember(&new_config, server_uuid, &removed_peer).ok()) {
             return Status::NotFound(
                 Substitute("Server with UUID $0 not a member of the config. RaftConfig: $1",
                            server_uuid, SecureShortDebugString(committed_config)));
           }
-          if (IsRaftConfigVoter(server_uuid, committed_config)) {
+          if (IsVotingMember(*removed_peer)) {
             num_voters_modified++;
           }
+          CHECK(RemoveFromRaftConfig(&new_config, server_uuid));
           break;
+        }
 
         case MODIFY_PEER: {
           RaftPeerPB* modified_peer;
@@ -1968,10 +2356,21 @@ Status RaftConsensus::BulkChangeConfig(const BulkChangeConfigRequestPB& req,
           // explicitly passed in the request. At least one field must be
           // modified to be a valid request.
           if (peer.has_member_type() && peer.member_type() != modified_peer->member_type()) {
-            if (modified_peer->member_type() == RaftPeerPB::VOTER ||
+            // A witness only logged the headers of the ops, so it has none of
+            // their payloads to apply, and a leader elected from it would
+            // replicate a hollow log. It must be removed and added back as a
+            // voter, to get a full copy.
+            if (modified_peer->member_type() == RaftPeerPB::WITNESS &&
                 peer.member_type() == RaftPeerPB::VOTER) {
-              // This is a 'member_type' change involving a VOTER, i.e. a
-              // promotion or demotion.
+              *error_code = ServerErrorPB::INVALID_CONFIG;
+              return Status::InvalidArgument(
+                  Substitute("Cannot promote witness $0 to a voter: it has only the "
+                             "headers of the ops. Remove it and add it back as a voter.",
+                             server_uuid));
+            }
+            if (IsVotingMember(*modified_peer) || IsVotingMember(peer)) {
+              // This is a 'member_type' change involving a voting member,
+              // i.e. a promotion or demotion.
               num_voters_modified++;
             }
             // A leader must be forced to step down before demoting it.
@@ -2014,8 +2413,8 @@ Status RaftConsensus::BulkChangeConfig(const BulkChangeConfigRequestPB& req,
 
     // Ensure this wasn't an illegal bulk change.
     if (num_voters_modified > 1) {
-      return Status::InvalidArgument("it is not safe to modify the VOTER status "
-                                     "of more than one peer at a time",
+      return Status::InvalidArgument("it is not safe to modify the VOTER or WITNESS "
+                                     "status of more than one peer at a time",
                                      SecureShortDebugString(req));
     }
 
@@ -2408,19 +2807,16 @@ Status RaftConsensus::RequestVoteRespondVoteGranted(const VoteRequestPB* request
 }
 
 RaftPeerPB::Role RaftConsensus::role() const {
-  ThreadRestrictions::AssertWaitAllowed();
-  LockGuard l(lock_);
-  return cmeta_->active_role();
+  return published_role_.load(std::memory_order_acquire);
 }
 
 int64_t RaftConsensus::CurrentTerm() const {
-  LockGuard l(lock_);
-  return CurrentTermUnlocked();
+  return published_term_.load(std::memory_order_acquire);
 }
 
 string RaftConsensus::GetLeaderUuid() const {
-  LockGuard l(lock_);
-  return GetLeaderUuidUnlocked();
+  std::lock_guard<simple_spinlock> l(published_leader_lock_);
+  return published_leader_uuid_;
 }
 
 std::pair<string, unsigned int> RaftConsensus::GetLeaderHostPort() const
@@ -2478,15 +2874,28 @@ void RaftConsensus::SetLeaderUuidUnlocked(const string& uuid) {
   failed_elections_since_stable_leader_ = 0;
   num_failed_elections_metric_->set_value(failed_elections_since_stable_leader_);
   cmeta_->set_leader_uuid(uuid);
+  PublishStateUnlocked();
   MarkDirty(Substitute("New leader $0", uuid));
 }
 
+void RaftConsensus::PublishStateUnlocked() {
+  DCHECK(lock_.is_locked());
+  published_term_.store(cmeta_->current_term(), std::memory_order_release);
+  published_role_.store(cmeta_->active_role(), std::memory_order_release);
+  const string& leader_uuid = cmeta_->leader_uuid();
+  std::lock_guard<simple_spinlock> l(published_leader_lock_);
+  if (published_leader_uuid_ != leader_uuid) {
+    published_leader_uuid_ = leader_uuid;
+  }
+}
+
 Status RaftConsensus::ReplicateConfigChangeUnlocked(
     RaftConfigPB old_config,
     RaftConfigPB new_config,
     StdStatusCallback client_cb) {
   DCHECK(lock_.is_locked());
-  auto cc_replicate = new ReplicateMsg();
+  ReplicateRefPtr cc_replicate_ptr = NewReplicateMsg();
+  ReplicateMsg* cc_replicate = cc_replicate_ptr->get();
   cc_replicate->set_op_type(CHANGE_CONFIG_OP);
   ChangeConfigRecordPB* cc_req = cc_replicate->mutable_change_config_record();
   cc_req->set_tablet_id(options_.tablet_id);
@@ -2494,8 +2903,7 @@ Status RaftConsensus::ReplicateConfigChangeUnlocked(
   *cc_req->mutable_new_config() = std::move(new_config);
   CHECK_OK(time_manager_->AssignTimestamp(cc_replicate));
 
-  scoped_refptr<ConsensusRound> round(
-      new ConsensusRound(this, make_scoped_refptr(new RefCountedReplicate(cc_replicate))));
+  scoped_refptr<ConsensusRound> round(new ConsensusRound(this, std::move(cc_replicate_ptr)));
   round->SetConsensusReplicatedCallback(std::bind(
       &RaftConsensus::NonTxRoundReplicationFinished,
       this,
@@ -2841,6 +3249,8 @@ void RaftConsensus::CompleteConfigChangeRoundUnlocked(ConsensusRound* round, con
       LOG_WITH_PREFIX_UNLOCKED(INFO) << "Aborting config change with OpId "
                                      << op_id << ": " << status.ToString();
       cmeta_->clear_pending_config();
+      PublishStateUnlocked();
+      ClearRelayProxies();
 
       // Disable leader failure detection if transitioning from VOTER to
       // NON_VOTER and vice versa.
@@ -3052,6 +3462,8 @@ Status RaftConsensus::SetPendingConfigUnlocked(const RaftConfigPB& new_config) {
         << "New pending config: " << SecureShortDebugString(new_config);
   }
   cmeta_->set_pending_config(new_config);
+  PublishStateUnlocked();
+  ClearRelayProxies();
 
   UpdateFailureDetectorState();
 
@@ -3085,10 +3497,17 @@ Status RaftConsensus::SetCommittedConfigUnlocked(const RaftConfigPB& config_to_c
   }
   cmeta_->set_committed_config(config_to_commit);
   cmeta_->clear_pending_config();
+  PublishStateUnlocked();
+  ClearRelayProxies();
   CHECK_OK(cmeta_->Flush());
   return Status::OK();
 }
 
+void RaftConsensus::ClearRelayProxies() {
+  std::lock_guard<simple_spinlock> l(relay_lock_);
+  relay_proxies_.clear();
+}
+
 void RaftConsensus::ScheduleTermAdvancementCallback(int64_t new_term) {
   WARN_NOT_OK(
       raft_pool_token_->SubmitFunc(
@@ -3144,6 +3563,7 @@ Status RaftConsensus::SetCurrentTermUnlocked(int64_t new_term,
     CHECK_OK(cmeta_->Flush());
   }
 
+  // Publishes the new term too.
   ClearLeaderUnlocked();
 
   // Trigger term advancement callback
@@ -3170,6 +3590,7 @@ bool RaftConsensus::HasLeaderUnlocked() const {
 void RaftConsensus::ClearLeaderUnlocked() {
   DCHECK(lock_.is_locked());
   cmeta_->set_leader_uuid("");
+  PublishStateUnlocked();
 }
 
 const bool RaftConsensus::HasVotedCurrentTermUnlocked() const {
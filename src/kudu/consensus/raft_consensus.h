@@ -29,6 +29,7 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -56,10 +57,12 @@
 #endif
 
 #include "kudu/util/atomic.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/make_shared.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
+#include "kudu/util/mutex.h"
 #include "kudu/util/random.h"
 #include "kudu/util/status_callback.h"
 
@@ -68,6 +71,7 @@ namespace kudu {
 typedef std::lock_guard<simple_spinlock> Lock;
 typedef gscoped_ptr<Lock> ScopedLock;
 
+class Slice;
 class Status;
 class ThreadPool;
 class ThreadPoolToken;
@@ -88,8 +92,11 @@ class ConsensusMetadataManager;
 class ConsensusRound;
 class ConsensusRoundHandler;
 class PeerManager;
+class PeerProxy;
 class PeerProxyFactory;
 class PendingRounds;
+class SnapshotProvider;
+class SnapshotSink;
 struct ConsensusBootstrapInfo;
 struct ElectionResult;
 
@@ -247,10 +254,26 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   // structures required for a consensus round, such as the ReplicateMsg
   // (and later on the CommitMsg). ConsensusRound will also point to and
   // increase the reference count for the provided callbacks.
+  //
+  // Prefer allocating the message with NewReplicateMsg() and passing it to
+  // the overload below: a message passed here stays on the heap.
   scoped_refptr<ConsensusRound> NewRound(
       gscoped_ptr<ReplicateMsg> replicate_msg,
       ConsensusReplicatedCallback replicated_cb);
 
+  // Allocates an empty ReplicateMsg for a new round. Messages allocated this
+  // way are grouped on shared arenas (see --raft_replicate_arena_size_kb) and
+  // must be passed to the NewRound() overload below, never deleted. This is
+  // the allocation path for the application's writes.
+  //
+  // Requires that Start() was called.
+  ReplicateRefPtr NewReplicateMsg();
+
+  // Like NewRound() above, for a message obtained from NewReplicateMsg().
+  scoped_refptr<ConsensusRound> NewRound(
+      ReplicateRefPtr replicate_msg,
+      ConsensusReplicatedCallback replicated_cb);
+
   // Called by a Leader to replicate an entry to the state machine.
   //
   // From the leader instance perspective execution proceeds as follows:
@@ -319,6 +342,26 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   Status Update(const ConsensusRequestPB* request,
                 ConsensusResponsePB* response);
 
+  // Handles a chunk of a snapshot sent by the leader because this replica
+  // can't be caught up from its log. 'chunk' holds the data of the chunk, if
+  // the request has one. Once all of the snapshot has been received, installs
+  // it through the round handler's SnapshotProvider, and resets the replica to
+  // continue from the op after the last one covered by the snapshot.
+  //
+  // Returns a non-OK Status if the chunk couldn't be handled, in which case
+  // the leader sends it again later.
+  Status InstallSnapshot(const InstallSnapshotRequestPB& request,
+                         const Slice& chunk,
+                         InstallSnapshotResponsePB* response);
+
+  // Forwards 'request', which the leader sent through this replica as the
+  // relay of its region, to the peer it is meant for, after filling in its
+  // ops from this replica's log. Calls 'callback' once 'response' holds the
+  // peer's response, or with an error if the request couldn't be relayed.
+  void RelayUpdateAsync(const ConsensusRequestPB* request,
+                        ConsensusResponsePB* response,
+                        StdStatusCallback callback);
+
   // Messages sent from CANDIDATEs to voting peers to request their vote
   // in leader election.
   //
@@ -350,13 +393,13 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
 
   boost::optional<OpId> GetNextOpId() const;
 
-  // Returns the current Raft role of this instance.
+  // Returns the current Raft role of this instance. Doesn't take 'lock_'.
   RaftPeerPB::Role role() const;
 
-  // Returns the current term.
+  // Returns the current term. Doesn't take 'lock_'.
   int64_t CurrentTerm() const;
 
-  // Returns uuid of the current leader
+  // Returns uuid of the current leader. Doesn't take 'lock_'.
   std::string GetLeaderUuid() const;
 
   // Returns hostport of the current leader
@@ -506,16 +549,17 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   struct LeaderRequest {
     std::string leader_uuid;
     const OpId* preceding_opid;
+    // Owned here once taken out of the leader's request, before they're
+    // deduplicated.
     std::vector<ReplicateRefPtr> messages;
-    // The positional index of the first message selected to be appended, in the
-    // original leader's request message sequence.
-    int64_t first_message_idx;
+    // The messages dropped as duplicates, which 'preceding_opid' may point into.
+    std::vector<ReplicateRefPtr> duplicates;
 
     std::string OpsRangeString() const;
   };
 
-  using LockGuard = std::lock_guard<simple_spinlock>;
-  using UniqueLock = std::unique_lock<simple_spinlock>;
+  using LockGuard = std::lock_guard<profiled_spinlock>;
+  using UniqueLock = std::unique_lock<profiled_spinlock>;
 
   // Initializes the RaftConsensus object, including loading the consensus
   // metadata.
@@ -561,19 +605,28 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   // and triggering the required transactions. This method won't return until all
   // operations have been stored in the log and all Prepares() have been completed,
   // and a replica cannot accept any more Update() requests until this is done.
+  // 'lock_' is released while the transactions are started; see the .cc.
   Status UpdateReplica(const ConsensusRequestPB* request,
                        ConsensusResponsePB* response);
 
-  // Deduplicates an RPC request making sure that we get only messages that we
+  // Checks that the ops of 'rpc_req' are in sequence and takes them out of it
+  // into 'req'. This doesn't depend on the state of the replica, so it doesn't
+  // need 'lock_'.
+  Status ExtractLeaderRequestOps(ConsensusRequestPB* rpc_req,
+                                 LeaderRequest* req) WARN_UNUSED_RESULT;
+
+  // Deduplicates the messages of a request extracted by
+  // ExtractLeaderRequestOps(), making sure that we get only messages that we
   // haven't appended to our log yet.
-  // On return 'deduplicated_req' is instantiated with only the new messages
-  // and the correct preceding id.
-  void DeduplicateLeaderRequestUnlocked(ConsensusRequestPB* rpc_req,
+  // On return 'deduplicated_req' has only the new messages and the correct
+  // preceding id.
+  void DeduplicateLeaderRequestUnlocked(const ConsensusRequestPB& rpc_req,
                                         LeaderRequest* deduplicated_req);
 
   // Handles a request from a leader, refusing the request if the term is lower than
   // ours or stepping down if it's higher.
   Status HandleLeaderRequestTermUnlocked(const ConsensusRequestPB* request,
+                                         const LeaderRequest& deduped_req,
                                          ConsensusResponsePB* response);
 
   // Checks that the preceding op in 'req' is locally committed or pending and sets an
@@ -585,14 +638,20 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
                                                    ConsensusResponsePB* response)
          WARN_UNUSED_RESULT;
 
+  // Installs 'snapshot_sink_', the complete snapshot sent in 'request', and
+  // resets the replica to continue after the last op covered by it. Requires
+  // 'snapshot_lock_' to be held.
+  Status InstallReceivedSnapshot(const InstallSnapshotRequestPB& request);
+
   // Check a request received from a leader, making sure:
   // - The request is in the right term
   // - The log matching property holds
   // - Messages are de-duplicated so that we only process previously unprocessed requests.
   // - We abort transactions if the leader sends transactions that have the same index as
   //   transactions currently on the pendings set, but different terms.
-  // If this returns ok and the response has no errors, 'deduped_req' is set with only
-  // the messages to add to our state machine.
+  // 'deduped_req' must already hold the ops taken out of 'request' by
+  // ExtractLeaderRequestOps(). If this returns ok and the response has no errors,
+  // 'deduped_req' is left with only the messages to add to our state machine.
   Status CheckLeaderRequestUnlocked(const ConsensusRequestPB* request,
                                     ConsensusResponsePB* response,
                                     LeaderRequest* deduped_req) WARN_UNUSED_RESULT;
@@ -605,6 +664,15 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   // that uses transactions, delegates to StartConsensusOnlyRoundUnlocked().
   Status StartFollowerTransactionUnlocked(const ReplicateRefPtr& msg);
 
+  // Has the round handler start the replica transaction of 'round', which must
+  // be of a type that uses transactions. Doesn't need 'lock_', but the round
+  // must be added to the pending rounds under it afterwards, or aborted.
+  Status StartFollowerTransaction(const scoped_refptr<ConsensusRound>& round);
+
+  // Publishes the current term, role and leader for the readers which don't
+  // take 'lock_'. Must be called whenever any of them changes.
+  void PublishStateUnlocked();
+
   // Returns true if this node is the only voter in the Raft configuration.
   bool IsSingleVoterConfig() const;
 
@@ -796,6 +864,11 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   // Resets the pending configuration to null.
   Status SetCommittedConfigUnlocked(const RaftConfigPB& config_to_commit);
 
+  // Drops the proxies to the peers which requests were relayed to, so that
+  // those of peers removed from the config, or which moved, aren't kept.
+  // Called whenever the active config changes.
+  void ClearRelayProxies();
+
   void ScheduleTermAdvancementCallback(int64_t term);
   void DoTermAdvancmentCallback(int64_t term);
 
@@ -870,10 +943,31 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   //
   // Lock ordering note: If both 'update_lock_' and 'lock_' are to be taken,
   // 'update_lock_' lock must be taken first.
-  mutable simple_spinlock update_lock_;
+  //
+  // A Mutex rather than a spinlock: it's held while the log appends are
+  // made durable, and while a received snapshot is installed.
+  mutable Mutex update_lock_;
+
+  // The snapshot being received from the leader, if any, and the id of the
+  // last op it covers. Protected by 'snapshot_lock_', which must be taken
+  // before 'update_lock_'.
+  Mutex snapshot_lock_;
+  std::shared_ptr<SnapshotSink> snapshot_sink_;
+  OpId snapshot_sink_opid_;
 
   // Coarse-grained lock that protects all mutable data members.
-  mutable simple_spinlock lock_;
+  mutable profiled_spinlock lock_;
+
+  // Copies of the current term, role and leader, published under 'lock_' by
+  // PublishStateUnlocked() so that role(), CurrentTerm() and GetLeaderUuid(),
+  // which are called a lot from outside, don't contend for 'lock_'. Each is
+  // read on its own, so a reader may see the term of one state and the role
+  // of the next.
+  std::atomic<int64_t> published_term_;
+  std::atomic<RaftPeerPB::Role> published_role_;
+  // Protects 'published_leader_uuid_'. Never held while taking another lock.
+  mutable simple_spinlock published_leader_lock_;
+  std::string published_leader_uuid_;
 
   State state_;
 
@@ -887,6 +981,11 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   scoped_refptr<TimeManager> time_manager_;
   gscoped_ptr<PeerProxyFactory> peer_proxy_factory_;
 
+  // Proxies to the peers of the active config which requests were relayed
+  // to, by uuid.
+  simple_spinlock relay_lock_;
+  std::unordered_map<std::string, std::shared_ptr<PeerProxy>> relay_proxies_;
+
   // When we receive a message from a remote peer telling us to start a
   // transaction, or finish a round, we use this handler to handle it.
   // This may update replica state (e.g. the tablet replica).
@@ -960,6 +1059,9 @@ class RaftConsensus : public std::enable_shared_from_this<RaftConsensus>,
   // The number of times Update() has been called, used for some test assertions.
   AtomicInt<int32_t> update_calls_for_tests_;
 
+  // Allocates the ReplicateMsgs of new rounds. Set by Start().
+  std::unique_ptr<ReplicateMsgAllocator> replicate_allocator_;
+
   FunctionGaugeDetacher metric_detacher_;
 
   std::atomic<int64_t> last_leader_communication_time_micros_;
@@ -1012,6 +1114,11 @@ class ConsensusRoundHandler {
   // replication. This can be used to trigger callbacks, akin to an Apply() for
   // transaction ops.
   virtual void FinishConsensusOnlyRound(ConsensusRound* round) = 0;
+
+  // Returns the provider used to transfer the application state to followers
+  // which can't be caught up from the log, or nullptr if the application
+  // doesn't support it, in which case such followers stay behind.
+  virtual SnapshotProvider* snapshot_provider() { return nullptr; }
 };
 
 // Context for a consensus round on the LEADER side, typically created as an
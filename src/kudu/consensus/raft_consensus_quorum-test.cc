@@ -76,6 +76,7 @@
 //METRIC_DEFINE_entity(tablet);
 #include "kudu/util/monotime.h"
 #include "kudu/util/pb_util.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 #include "kudu/util/status_callback.h"
 #include "kudu/util/test_macros.h"
@@ -276,14 +277,14 @@ class RaftConsensusQuorumTest : public KuduTest {
 
   Status AppendDummyMessage(int peer_idx,
                             scoped_refptr<ConsensusRound>* round) {
-    gscoped_ptr<ReplicateMsg> msg(new ReplicateMsg());
-    msg->set_op_type(NO_OP);
-    msg->mutable_noop_request();
-    msg->set_timestamp(clock_->Now().ToUint64());
-
     shared_ptr<RaftConsensus> peer;
     CHECK_OK(peers_->GetPeerByIdx(peer_idx, &peer));
 
+    ReplicateRefPtr msg = peer->NewReplicateMsg();
+    msg->get()->set_op_type(NO_OP);
+    msg->get()->mutable_noop_request();
+    msg->get()->set_timestamp(clock_->Now().ToUint64());
+
     // Use a latch in place of a Transaction callback.
     gscoped_ptr<Synchronizer> sync(new Synchronizer());
     *round = peer->NewRound(std::move(msg), sync->AsStdStatusCallback());
@@ -934,6 +935,18 @@ TEST_F(RaftConsensusQuorumTest, TestLeaderElectionWithQuiescedQuorum) {
     for (int i = 0; i < current_config_size - 2; i++) {
       WaitForCommitIfNotAlreadyPresent(last_op_id.index(), i, current_config_size - 2);
     }
+
+    // The role, term and leader published by the replicas, which are read
+    // without their locks, reflect the election.
+    ASSERT_EQ(RaftPeerPB::LEADER, new_leader->role());
+    ASSERT_EQ(new_leader->peer_uuid(), new_leader->GetLeaderUuid());
+    for (int i = 0; i < current_config_size - 2; i++) {
+      shared_ptr<RaftConsensus> follower;
+      CHECK_OK(peers_->GetPeerByIdx(i, &follower));
+      ASSERT_EQ(RaftPeerPB::FOLLOWER, follower->role());
+      ASSERT_EQ(new_leader->CurrentTerm(), follower->CurrentTerm());
+      ASSERT_EQ(new_leader->peer_uuid(), follower->GetLeaderUuid());
+    }
   }
   // We can only verify the logs of the peers that were not killed, due to the
   // old leaders being out-of-date now.
@@ -972,27 +985,31 @@ TEST_F(RaftConsensusQuorumTest, TestReplicasEnforceTheLogMatchingProperty) {
   req.set_committed_index(last_op_id.index());
   req.set_all_replicated_index(0);
 
-  // Send a request with the next index.
-  ReplicateMsg* replicate = req.add_ops();
-  replicate->set_timestamp(clock_->Now().ToUint64());
-  OpId* id = replicate->mutable_id();
-  id->set_term(last_op_id.term());
-  id->set_index(last_op_id.index() + 1);
-  replicate->set_op_type(NO_OP);
+  // Send a request with the next index. Update() takes the ops out of the
+  // request, so they're added again for each call.
+  OpId id = MakeOpId(last_op_id.term(), last_op_id.index() + 1);
+  auto add_op = [&]() {
+    ReplicateMsg* replicate = req.add_ops();
+    replicate->set_timestamp(clock_->Now().ToUint64());
+    *replicate->mutable_id() = id;
+    replicate->set_op_type(NO_OP);
+  };
+  add_op();
 
   // Since the req adds the next op, the leader must have also appended it.
-  req.set_last_idx_appended_to_leader(id->index());
+  req.set_last_idx_appended_to_leader(id.index());
 
   // Appending this message to peer0 should work and update
   // its 'last_received' to 'id'.
   ASSERT_OK(follower->Update(&req, &resp));
-  ASSERT_TRUE(OpIdEquals(resp.status().last_received(), *id));
+  ASSERT_TRUE(OpIdEquals(resp.status().last_received(), id));
   ASSERT_EQ(0, follower->queue_->metrics_.num_ops_behind_leader->value());
 
   // Now skip one message in the same term. The replica should
   // complain with the right error message.
-  req.mutable_preceding_id()->set_index(id->index() + 1);
-  id->set_index(id->index() + 2);
+  req.mutable_preceding_id()->set_index(id.index() + 1);
+  id.set_index(id.index() + 2);
+  add_op();
   // Appending this message to peer0 should return a Status::OK
   // but should contain an error referring to the log matching property.
   ASSERT_OK(follower->Update(&req, &resp));
@@ -1003,6 +1020,203 @@ TEST_F(RaftConsensusQuorumTest, TestReplicasEnforceTheLogMatchingProperty) {
                       "Log matching property violated");
 }
 
+// A follower which installs a snapshot discards its log, and continues from
+// the op after the snapshot without a gap.
+TEST_F(RaftConsensusQuorumTest, TestFollowerResetsLogAfterInstallingSnapshot) {
+  const int kFollowerIdx = 0;
+  const int kLeaderIdx = 2;
+  ASSERT_OK(BuildAndStartConfig(3));
+  TestSnapshotProvider snapshot_provider;
+  txn_factories_[kFollowerIdx]->SetSnapshotProvider(&snapshot_provider);
+
+  OpId last_op_id;
+  shared_ptr<Synchronizer> last_commit_sync;
+  vector<scoped_refptr<ConsensusRound>> rounds;
+  NO_FATALS(ReplicateSequenceOfMessages(
+      10, kLeaderIdx, WAIT_FOR_ALL_REPLICAS, COMMIT_ONE_BY_ONE,
+      &last_op_id, &rounds, &last_commit_sync));
+  ASSERT_OK(last_commit_sync->Wait());
+  WaitForCommitIfNotAlreadyPresent(last_op_id.index(), kFollowerIdx, kLeaderIdx);
+
+  // Stop the leader so that only the requests below reach the follower.
+  shared_ptr<RaftConsensus> leader;
+  CHECK_OK(peers_->GetPeerByIdx(kLeaderIdx, &leader));
+  const string leader_uuid = leader->peer_uuid();
+  leader->Shutdown();
+  peers_->RemovePeer(leader_uuid);
+
+  shared_ptr<RaftConsensus> follower;
+  CHECK_OK(peers_->GetPeerByIdx(kFollowerIdx, &follower));
+
+  // An empty snapshot is installed as soon as it's opened.
+  const OpId last_included = MakeOpId(last_op_id.term(), last_op_id.index() + 20);
+  InstallSnapshotRequestPB snapshot_req;
+  InstallSnapshotResponsePB snapshot_resp;
+  snapshot_req.set_tablet_id(kTestTablet);
+  snapshot_req.set_caller_uuid(leader_uuid);
+  snapshot_req.set_caller_term(last_op_id.term());
+  *snapshot_req.mutable_last_included_opid() = last_included;
+  snapshot_req.set_snapshot_size(0);
+  snapshot_req.set_offset(0);
+  ASSERT_OK(follower->InstallSnapshot(snapshot_req, Slice(), &snapshot_resp));
+  ASSERT_FALSE(snapshot_resp.has_consensus_error())
+      << SecureShortDebugString(snapshot_resp);
+  ASSERT_TRUE(OpIdEquals(last_included, snapshot_provider.installed_opid()));
+
+  // Only the segment for the ops after the snapshot is left.
+  log::SegmentSequence segments;
+  ASSERT_OK(logs_[kFollowerIdx]->reader()->GetSegmentsSnapshot(&segments));
+  ASSERT_EQ(1, segments.size());
+  vector<ReplicateMsg*> replicates;
+  ElementDeleter deleter(&replicates);
+  Status s = logs_[kFollowerIdx]->reader()->ReadReplicatesInRange(
+      1, last_op_id.index(), log::LogReader::kNoSizeLimit, &replicates);
+  ASSERT_TRUE(s.IsNotFound()) << s.ToString();
+
+  // The op after the snapshot is appended and read back from the log.
+  ConsensusRequestPB req;
+  ConsensusResponsePB resp;
+  req.set_caller_uuid(leader_uuid);
+  req.set_caller_term(last_op_id.term());
+  *req.mutable_preceding_id() = last_included;
+  req.set_committed_index(last_included.index());
+  req.set_all_replicated_index(0);
+  const OpId next_id = MakeOpId(last_op_id.term(), last_included.index() + 1);
+  ReplicateMsg* replicate = req.add_ops();
+  replicate->set_timestamp(clock_->Now().ToUint64());
+  *replicate->mutable_id() = next_id;
+  replicate->set_op_type(NO_OP);
+  req.set_last_idx_appended_to_leader(next_id.index());
+  ASSERT_OK(follower->Update(&req, &resp));
+  ASSERT_FALSE(resp.status().has_error()) << SecureShortDebugString(resp);
+  ASSERT_TRUE(OpIdEquals(next_id, resp.status().last_received()));
+
+  ASSERT_OK(logs_[kFollowerIdx]->WaitUntilAllFlushed());
+  ASSERT_OK(logs_[kFollowerIdx]->reader()->ReadReplicatesInRange(
+      next_id.index(), next_id.index(), log::LogReader::kNoSizeLimit, &replicates));
+  ASSERT_EQ(1, replicates.size());
+  ASSERT_TRUE(OpIdEquals(next_id, replicates[0]->id()));
+}
+
+// The ops after a config change in the same request are started with the
+// config it sets: once a follower is demoted to a witness, it only logs the
+// headers of the ops which follow.
+TEST_F(RaftConsensusQuorumTest, TestOpsAfterConfigChangeUseTheNewConfig) {
+  const int kFollowerIdx = 0;
+  const int kLeaderIdx = 2;
+  ASSERT_OK(BuildAndStartConfig(3));
+
+  OpId last_op_id;
+  shared_ptr<Synchronizer> last_commit_sync;
+  vector<scoped_refptr<ConsensusRound>> rounds;
+  NO_FATALS(ReplicateSequenceOfMessages(
+      2, kLeaderIdx, WAIT_FOR_ALL_REPLICAS, COMMIT_ONE_BY_ONE,
+      &last_op_id, &rounds, &last_commit_sync));
+  ASSERT_OK(last_commit_sync->Wait());
+  WaitForCommitIfNotAlreadyPresent(last_op_id.index(), kFollowerIdx, kLeaderIdx);
+
+  // Stop the leader so that only the request below reaches the follower.
+  shared_ptr<RaftConsensus> leader;
+  CHECK_OK(peers_->GetPeerByIdx(kLeaderIdx, &leader));
+  const string leader_uuid = leader->peer_uuid();
+  leader->Shutdown();
+  peers_->RemovePeer(leader_uuid);
+
+  shared_ptr<RaftConsensus> follower;
+  CHECK_OK(peers_->GetPeerByIdx(kFollowerIdx, &follower));
+  const int num_started = txn_factories_[kFollowerIdx]->num_follower_transactions_started();
+
+  ConsensusRequestPB req;
+  ConsensusResponsePB resp;
+  req.set_caller_uuid(leader_uuid);
+  req.set_caller_term(last_op_id.term());
+  *req.mutable_preceding_id() = last_op_id;
+  req.set_committed_index(last_op_id.index());
+  req.set_all_replicated_index(0);
+
+  ReplicateMsg* change_config = req.add_ops();
+  change_config->set_timestamp(clock_->Now().ToUint64());
+  *change_config->mutable_id() = MakeOpId(last_op_id.term(), last_op_id.index() + 1);
+  change_config->set_op_type(CHANGE_CONFIG_OP);
+  ChangeConfigRecordPB* record = change_config->mutable_change_config_record();
+  record->set_tablet_id(kTestTablet);
+  *record->mutable_old_config() = follower->CommittedConfig();
+  *record->mutable_new_config() = follower->CommittedConfig();
+  record->mutable_new_config()->clear_opid_index();
+  RaftPeerPB* follower_pb;
+  ASSERT_OK(GetRaftConfigMember(record->mutable_new_config(), follower->peer_uuid(),
+                                &follower_pb));
+  follower_pb->set_member_type(RaftPeerPB::WITNESS);
+
+  ReplicateMsg* write = req.add_ops();
+  write->set_timestamp(clock_->Now().ToUint64());
+  *write->mutable_id() = MakeOpId(last_op_id.term(), last_op_id.index() + 2);
+  write->set_op_type(WRITE_OP_EXT);
+  req.set_last_idx_appended_to_leader(write->id().index());
+
+  ASSERT_OK(follower->Update(&req, &resp));
+  ASSERT_FALSE(resp.status().has_error()) << SecureShortDebugString(resp);
+  ASSERT_TRUE(OpIdEquals(MakeOpId(last_op_id.term(), last_op_id.index() + 2),
+                         resp.status().last_received()));
+  // The write was logged, but not started as a transaction.
+  ASSERT_EQ(num_started, txn_factories_[kFollowerIdx]->num_follower_transactions_started());
+}
+
+// If the term changes while a follower starts the ops of a request without
+// holding its lock, the ops are aborted rather than added, and the request
+// is rejected.
+TEST_F(RaftConsensusQuorumTest, TestTermChangeWhileStartingOpsAbortsThem) {
+  const int kFollowerIdx = 0;
+  const int kLeaderIdx = 2;
+  ASSERT_OK(BuildAndStartConfig(3));
+
+  OpId last_op_id;
+  shared_ptr<Synchronizer> last_commit_sync;
+  vector<scoped_refptr<ConsensusRound>> rounds;
+  NO_FATALS(ReplicateSequenceOfMessages(
+      2, kLeaderIdx, WAIT_FOR_ALL_REPLICAS, COMMIT_ONE_BY_ONE,
+      &last_op_id, &rounds, &last_commit_sync));
+  ASSERT_OK(last_commit_sync->Wait());
+  WaitForCommitIfNotAlreadyPresent(last_op_id.index(), kFollowerIdx, kLeaderIdx);
+
+  // Stop the leader so that only the request below reaches the follower.
+  shared_ptr<RaftConsensus> leader;
+  CHECK_OK(peers_->GetPeerByIdx(kLeaderIdx, &leader));
+  const string leader_uuid = leader->peer_uuid();
+  leader->Shutdown();
+  peers_->RemovePeer(leader_uuid);
+
+  shared_ptr<RaftConsensus> follower;
+  CHECK_OK(peers_->GetPeerByIdx(kFollowerIdx, &follower));
+  txn_factories_[kFollowerIdx]->SetStartFollowerTransactionHook([&]() {
+    CHECK_OK(follower->AdvanceTermForTests(last_op_id.term() + 1));
+  });
+
+  ConsensusRequestPB req;
+  ConsensusResponsePB resp;
+  req.set_caller_uuid(leader_uuid);
+  req.set_caller_term(last_op_id.term());
+  *req.mutable_preceding_id() = last_op_id;
+  req.set_committed_index(last_op_id.index());
+  req.set_all_replicated_index(0);
+  ReplicateMsg* write = req.add_ops();
+  write->set_timestamp(clock_->Now().ToUint64());
+  *write->mutable_id() = MakeOpId(last_op_id.term(), last_op_id.index() + 1);
+  write->set_op_type(WRITE_OP_EXT);
+  req.set_last_idx_appended_to_leader(last_op_id.index() + 1);
+
+  ASSERT_OK(follower->Update(&req, &resp));
+  txn_factories_[kFollowerIdx]->SetStartFollowerTransactionHook(nullptr);
+  ASSERT_TRUE(resp.status().has_error()) << SecureShortDebugString(resp);
+  ASSERT_EQ(ConsensusErrorPB::INVALID_TERM, resp.status().error().code());
+  ASSERT_STR_CONTAINS(resp.status().error().status().message(),
+                      "changed while the ops were being prepared");
+  ASSERT_EQ(last_op_id.term() + 1, resp.responder_term());
+  // The op was neither added nor logged.
+  ASSERT_TRUE(OpIdEquals(last_op_id, resp.status().last_received()));
+  ASSERT_TRUE(OpIdEquals(last_op_id, follower->GetLastOpId(RECEIVED_OPID).get()));
+}
+
 // Test that RequestVote performs according to "spec".
 TEST_F(RaftConsensusQuorumTest, TestRequestVote) {
   ASSERT_OK(BuildAndStartConfig(3));
@@ -1180,5 +1394,69 @@ TEST_F(RaftConsensusQuorumTest, TestRequestVote) {
   LOG(INFO) << "Follower rejected old heartbeat, as expected: " << SecureShortDebugString(res);
 }
 
+// Witnesses vote, so they count towards the one-voter-at-a-time rule of
+// config changes, and they can't be promoted to voters in place since they
+// only have the headers of the ops.
+TEST_F(RaftConsensusQuorumTest, TestWitnessConfigChanges) {
+  const int kFollowerIdx = 0;
+  const int kLeaderIdx = 2;
+  ASSERT_OK(BuildAndStartConfig(3));
+
+  OpId last_op_id;
+  vector<scoped_refptr<ConsensusRound>> rounds;
+  shared_ptr<Synchronizer> commit_sync;
+  NO_FATALS(ReplicateSequenceOfMessages(
+      1, kLeaderIdx, WAIT_FOR_ALL_REPLICAS, COMMIT_ONE_BY_ONE,
+      &last_op_id, &rounds, &commit_sync));
+  ASSERT_OK(commit_sync->Wait());
+
+  shared_ptr<RaftConsensus> leader;
+  CHECK_OK(peers_->GetPeerByIdx(kLeaderIdx, &leader));
+  const string follower_uuid = fs_managers_[kFollowerIdx]->uuid();
+
+  auto change_config = [&](const BulkChangeConfigRequestPB& req) {
+    Synchronizer sync;
+    boost::optional<ServerErrorPB::Code> error_code;
+    RETURN_NOT_OK(leader->BulkChangeConfig(req, sync.AsStdStatusCallback(), &error_code));
+    return sync.Wait();
+  };
+  auto add_change = [](BulkChangeConfigRequestPB* req, ChangeConfigType type,
+                       const string& uuid, RaftPeerPB::MemberType member_type) {
+    auto* item = req->add_config_changes();
+    item->set_type(type);
+    item->mutable_peer()->set_permanent_uuid(uuid);
+    item->mutable_peer()->set_member_type(member_type);
+    if (type == ADD_PEER) {
+      item->mutable_peer()->mutable_last_known_addr()->set_host("new-witness");
+      item->mutable_peer()->mutable_last_known_addr()->set_port(0);
+    }
+  };
+
+  // Demoting a voter to a witness is fine, once the leader has committed an
+  // op in its term.
+  BulkChangeConfigRequestPB req;
+  add_change(&req, MODIFY_PEER, follower_uuid, RaftPeerPB::WITNESS);
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_OK(change_config(req));
+  });
+  ASSERT_EQ(RaftPeerPB::WITNESS_ROLE,
+            GetConsensusRole(follower_uuid, leader->peer_uuid(), leader->CommittedConfig()));
+
+  // Replacing the witness with another one changes two voting members.
+  req.Clear();
+  add_change(&req, REMOVE_PEER, follower_uuid, RaftPeerPB::WITNESS);
+  add_change(&req, ADD_PEER, "new-witness", RaftPeerPB::WITNESS);
+  Status s = change_config(req);
+  ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+  ASSERT_STR_CONTAINS(s.ToString(), "more than one peer at a time");
+
+  // Nor can the witness be made a voter in place.
+  req.Clear();
+  add_change(&req, MODIFY_PEER, follower_uuid, RaftPeerPB::VOTER);
+  s = change_config(req);
+  ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+  ASSERT_STR_CONTAINS(s.ToString(), "Cannot promote witness");
+}
+
 }  // namespace consensus
 }  // namespace kudu
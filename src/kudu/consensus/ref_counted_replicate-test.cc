@@ -0,0 +1,146 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/ref_counted_replicate.h"
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/log.pb.h"
+#include "kudu/consensus/log_util.h"
+#include "kudu/consensus/opid_util.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/util/mem_tracker.h"
+#include "kudu/util/stopwatch.h"
+#include "kudu/util/test_util.h"
+
+using std::shared_ptr;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+namespace consensus {
+
+class ReplicateMsgAllocatorTest : public KuduTest {
+ public:
+  ReplicateMsgAllocatorTest()
+      : tracker_(MemTracker::CreateTracker(-1, "replicate_arenas-test")) {
+  }
+
+ protected:
+  // Allocates 'num_ops' ops with 'payload_size' byte payloads.
+  static void AllocateOps(ReplicateMsgAllocator* allocator, int num_ops, int payload_size,
+                          vector<ReplicateRefPtr>* ops) {
+    for (int i = 0; i < num_ops; i++) {
+      ReplicateRefPtr op = allocator->NewReplicateMsg();
+      *op->get()->mutable_id() = MakeOpId(1, i + 1);
+      op->get()->set_timestamp(i);
+      op->get()->set_op_type(NO_OP);
+      op->get()->mutable_noop_request()->mutable_payload_for_tests()->resize(payload_size);
+      // As when appended to the LogCache.
+      if (op->arena() != nullptr) {
+        op->arena()->UpdateMemTracker();
+      }
+      ops->emplace_back(std::move(op));
+    }
+  }
+
+  shared_ptr<MemTracker> tracker_;
+};
+
+TEST_F(ReplicateMsgAllocatorTest, TestHeapAllocation) {
+  ReplicateMsgAllocator allocator(0, tracker_);
+  vector<ReplicateRefPtr> ops;
+  AllocateOps(&allocator, 10, 100, &ops);
+  EXPECT_EQ(nullptr, google::protobuf::Arena::GetArena(ops[0]->get()));
+  EXPECT_EQ(0, tracker_->consumption());
+}
+
+// Arenas are shared by consecutive ops until full, and freed along with
+// their last op.
+TEST_F(ReplicateMsgAllocatorTest, TestArenasAreFreedWithTheirOps) {
+  const int kArenaSize = 64 * 1024;
+  ReplicateMsgAllocator allocator(kArenaSize, tracker_);
+  vector<ReplicateRefPtr> ops;
+  AllocateOps(&allocator, 1000, 1000, &ops);
+
+  google::protobuf::Arena* first_arena = google::protobuf::Arena::GetArena(ops[0]->get());
+  ASSERT_NE(nullptr, first_arena);
+  EXPECT_EQ(first_arena, google::protobuf::Arena::GetArena(ops[1]->get()));
+  EXPECT_NE(first_arena, google::protobuf::Arena::GetArena(ops.back()->get()));
+  EXPECT_GT(tracker_->consumption(), 0);
+
+  // Releasing all but one op of each arena doesn't free anything.
+  const int64_t consumption = tracker_->consumption();
+  vector<ReplicateRefPtr> survivors;
+  google::protobuf::Arena* last_arena = nullptr;
+  for (auto& op : ops) {
+    google::protobuf::Arena* arena = google::protobuf::Arena::GetArena(op->get());
+    if (arena != last_arena) {
+      survivors.push_back(op);
+      last_arena = arena;
+    }
+  }
+  ops.clear();
+  EXPECT_EQ(consumption, tracker_->consumption());
+
+  survivors.clear();
+  // The arena being filled is still referenced by the allocator.
+  EXPECT_LE(tracker_->consumption(), kArenaSize * 2);
+}
+
+// Arena-allocated ops are borrowed, not copied, by the log and by requests.
+TEST_F(ReplicateMsgAllocatorTest, TestArenaOpsAreNotCopied) {
+  ReplicateMsgAllocator allocator(64 * 1024, tracker_);
+  vector<ReplicateRefPtr> ops;
+  AllocateOps(&allocator, 10, 100, &ops);
+
+  unique_ptr<log::LogEntryBatchPB> batch = log::CreateBatchFromAllocatedOperations(ops);
+  ConsensusRequestPB request;
+  for (const auto& op : ops) {
+    request.mutable_ops()->UnsafeArenaAddAllocated(op->get());
+  }
+  for (size_t i = 0; i < ops.size(); i++) {
+    EXPECT_EQ(ops[i]->get(), &batch->entry(i).replicate());
+    EXPECT_EQ(ops[i]->get(), &request.ops(i));
+  }
+  for (auto& entry : *batch->mutable_entry()) {
+    entry.unsafe_arena_release_replicate();
+  }
+  request.mutable_ops()->ExtractSubrange(0, request.ops_size(), nullptr);
+}
+
+// Compares the time spent allocating and freeing ops on the heap and on arenas.
+TEST_F(ReplicateMsgAllocatorTest, BenchmarkAllocation) {
+  const int kNumOps = AllowSlowTests() ? 1000000 : 100000;
+  for (int arena_size : { 0, 1024 * 1024 }) {
+    ReplicateMsgAllocator allocator(arena_size, tracker_);
+    LOG_TIMING(INFO, Substitute("allocating and freeing $0 ops with arena size $1",
+                                kNumOps, arena_size)) {
+      vector<ReplicateRefPtr> ops;
+      ops.reserve(kNumOps);
+      AllocateOps(&allocator, kNumOps, 100, &ops);
+    }
+  }
+}
+
+} // namespace consensus
+} // namespace kudu
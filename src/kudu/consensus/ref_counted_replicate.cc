@@ -0,0 +1,104 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/ref_counted_replicate.h"
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+#include "kudu/util/mem_tracker.h"
+
+using std::shared_ptr;
+
+namespace kudu {
+namespace consensus {
+
+namespace {
+
+// Size of the first block of each arena. Later blocks double in size up to
+// the configured maximum.
+const size_t kArenaStartBlockSize = 8 * 1024;
+
+google::protobuf::ArenaOptions ArenaOptionsWithMaxBlockSize(size_t max_block_size) {
+  google::protobuf::ArenaOptions options;
+  options.start_block_size = std::min(kArenaStartBlockSize, max_block_size);
+  options.max_block_size = max_block_size;
+  return options;
+}
+
+} // anonymous namespace
+
+ReplicateArena::ReplicateArena(size_t block_size, shared_ptr<MemTracker> mem_tracker)
+    : arena_(ArenaOptionsWithMaxBlockSize(block_size)),
+      mem_tracker_(std::move(mem_tracker)),
+      consumed_bytes_(0),
+      retired_(false) {
+}
+
+ReplicateArena::~ReplicateArena() {
+  if (mem_tracker_) {
+    mem_tracker_->Release(consumed_bytes_);
+  }
+}
+
+ReplicateMsg* ReplicateArena::NewReplicateMsg() {
+  return google::protobuf::Arena::CreateMessage<ReplicateMsg>(&arena_);
+}
+
+void ReplicateArena::UpdateMemTracker() {
+  if (!mem_tracker_) {
+    return;
+  }
+  std::lock_guard<simple_spinlock> l(lock_);
+  int64_t allocated = arena_.SpaceAllocated();
+  if (allocated > consumed_bytes_) {
+    mem_tracker_->Consume(allocated - consumed_bytes_);
+    consumed_bytes_ = allocated;
+  }
+}
+
+ReplicateMsgAllocator::ReplicateMsgAllocator(size_t arena_size,
+                                             shared_ptr<MemTracker> mem_tracker)
+    : arena_size_(arena_size),
+      mem_tracker_(std::move(mem_tracker)) {
+}
+
+ReplicateRefPtr ReplicateMsgAllocator::NewReplicateMsg() {
+  if (arena_size_ == 0) {
+    return make_scoped_refptr_replicate(new ReplicateMsg);
+  }
+
+  scoped_refptr<ReplicateArena> arena;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    // Start a new arena once the current one is full. The old one lives on
+    // until the last of its messages is released.
+    if (!current_ || current_->SpaceAllocated() >= arena_size_) {
+      if (current_) {
+        current_->Retire();
+      }
+      current_ = new ReplicateArena(std::max(arena_size_ / 4, kArenaStartBlockSize),
+                                    mem_tracker_);
+    }
+    arena = current_;
+  }
+  return ReplicateRefPtr(new RefCountedReplicate(arena->NewReplicateMsg(), arena));
+}
+
+} // namespace consensus
+} // namespace kudu
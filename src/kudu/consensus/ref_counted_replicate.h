@@ -18,23 +18,97 @@
 #ifndef KUDU_CONSENSUS_REF_COUNTED_REPLICATE_H_
 #define KUDU_CONSENSUS_REF_COUNTED_REPLICATE_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <google/protobuf/arena.h>
+
 #include "kudu/consensus/consensus.pb.h"
+#include "kudu/gutil/basictypes.h"
+#include "kudu/gutil/macros.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/util/locks.h"
 
 namespace kudu {
+
+class MemTracker;
+
 namespace consensus {
 
+// A protobuf arena on which a group of ReplicateMsgs is allocated. The arena
+// is freed in one go once the last of its messages is released, i.e. once all
+// of them are durable, evicted from the LogCache and no longer in flight to
+// any peer.
+//
+// The memory allocated by the arena is consumed from 'mem_tracker', if any.
+class ReplicateArena : public RefCountedThreadSafe<ReplicateArena> {
+ public:
+  ReplicateArena(size_t block_size, std::shared_ptr<MemTracker> mem_tracker);
+
+  // Allocates an empty ReplicateMsg on the arena. Thread-safe.
+  ReplicateMsg* NewReplicateMsg();
+
+  // Consumes the memory allocated by the arena since the last call. The
+  // arena grows as its messages are filled in, so this is called once they
+  // are, when they're appended to the LogCache. Thread-safe.
+  void UpdateMemTracker();
+
+  // Total size of the blocks allocated by the arena.
+  uint64_t SpaceAllocated() const { return arena_.SpaceAllocated(); }
+
+  // Whether the allocator has moved on to another arena, so that no more
+  // messages will be allocated on this one.
+  bool retired() const { return retired_; }
+  void Retire() { retired_ = true; }
+
+ private:
+  friend class RefCountedThreadSafe<ReplicateArena>;
+  ~ReplicateArena();
+
+  google::protobuf::Arena arena_;
+  std::shared_ptr<MemTracker> mem_tracker_;
+
+  simple_spinlock lock_;
+  int64_t consumed_bytes_;
+
+  std::atomic<bool> retired_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplicateArena);
+};
+
 // A simple ref-counted wrapper around ReplicateMsg.
 class RefCountedReplicate : public RefCountedThreadSafe<RefCountedReplicate> {
  public:
   explicit RefCountedReplicate(ReplicateMsg* msg) : msg_(msg) {}
 
+  // Wraps 'msg', which was allocated on 'arena'. The arena is kept alive at
+  // least as long as this object.
+  RefCountedReplicate(ReplicateMsg* msg, scoped_refptr<ReplicateArena> arena)
+      : arena_(std::move(arena)),
+        msg_(msg) {
+  }
+
+  ~RefCountedReplicate() {
+    if (arena_) {
+      // The message is freed with its arena.
+      ignore_result(msg_.release());
+    }
+  }
+
   ReplicateMsg* get() {
     return msg_.get();
   }
 
+  // The arena the message was allocated on, or null if it's on the heap.
+  ReplicateArena* arena() const {
+    return arena_.get();
+  }
+
  private:
+  scoped_refptr<ReplicateArena> arena_;
   gscoped_ptr<ReplicateMsg> msg_;
 };
 
@@ -44,6 +118,30 @@ inline ReplicateRefPtr make_scoped_refptr_replicate(ReplicateMsg* replicate) {
   return ReplicateRefPtr(new RefCountedReplicate(replicate));
 }
 
+// Allocates ReplicateMsgs for new rounds, grouping them on shared
+// ReplicateArenas of up to 'arena_size' bytes each. Saves one or more heap
+// allocations per op and per nested message (e.g. the OpId) on the leader
+// append path.
+//
+// This class is thread-safe.
+class ReplicateMsgAllocator {
+ public:
+  // If 'arena_size' is 0, messages are allocated on the heap. The arenas
+  // consume their memory from 'mem_tracker', if any.
+  ReplicateMsgAllocator(size_t arena_size, std::shared_ptr<MemTracker> mem_tracker);
+
+  ReplicateRefPtr NewReplicateMsg();
+
+ private:
+  const size_t arena_size_;
+  std::shared_ptr<MemTracker> mem_tracker_;
+
+  simple_spinlock lock_;
+  scoped_refptr<ReplicateArena> current_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplicateMsgAllocator);
+};
+
 } // namespace consensus
 } // namespace kudu
 
@@ -0,0 +1,172 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/replication_trace.h"
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags_declare.h>
+#include <gtest/gtest.h>
+
+#include "kudu/consensus/opid.pb.h"
+#include "kudu/consensus/opid_util.h"
+#include "kudu/gutil/ref_counted.h"
+#include "kudu/util/countdown_latch.h"
+#include "kudu/util/metrics.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+METRIC_DECLARE_entity(server);
+METRIC_DECLARE_histogram(replication_trace_wal_group_commit_latency);
+METRIC_DECLARE_histogram(replication_trace_peer_send_latency);
+METRIC_DECLARE_histogram(replication_trace_commit_notify_latency);
+
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace kudu {
+namespace consensus {
+
+class ReplicationTraceTest : public KuduTest {
+ public:
+  ReplicationTraceTest()
+      : trace_(ReplicationTrace::GetSingleton()) {
+  }
+
+  // The tracer is a singleton which only instantiates its histograms once, so
+  // all tests share a metric entity.
+  static void SetUpTestCase() {
+    metric_registry_ = new MetricRegistry();
+    metric_entity_ = METRIC_ENTITY_server.Instantiate(metric_registry_, "trace-test");
+  }
+
+  void SetUp() override {
+    KuduTest::SetUp();
+    FLAGS_raft_replication_trace_sample_interval = 10;
+    ASSERT_OK(trace_->StartInstrumentation(metric_entity_, nullptr));
+    trace_->ResetForTests();
+  }
+
+ protected:
+  static MetricRegistry* metric_registry_;
+  static scoped_refptr<MetricEntity> metric_entity_;
+  ReplicationTrace* trace_;
+};
+
+MetricRegistry* ReplicationTraceTest::metric_registry_;
+scoped_refptr<MetricEntity> ReplicationTraceTest::metric_entity_;
+
+TEST_F(ReplicationTraceTest, TestSampling) {
+  EXPECT_FALSE(ReplicationTrace::IsSampled(0));
+  EXPECT_FALSE(ReplicationTrace::IsSampled(9));
+  EXPECT_TRUE(ReplicationTrace::IsSampled(10));
+  EXPECT_TRUE(ReplicationTrace::IsSampled(20));
+
+  for (int64_t i = 1; i <= 25; i++) {
+    trace_->Record(ReplicationStage::kReplicate, MakeOpId(1, i));
+  }
+  // Only the sampled ops within the range are recorded.
+  trace_->RecordRange(ReplicationStage::kCommitNotify, 1, 5, 25);
+
+  vector<ReplicationTrace::Event> events;
+  trace_->GetEvents(&events);
+  ASSERT_EQ(4, events.size());
+  EXPECT_EQ(10, events[0].index);
+  EXPECT_EQ(ReplicationStage::kReplicate, events[0].stage);
+  EXPECT_EQ(10, events[1].index);
+  EXPECT_EQ(ReplicationStage::kCommitNotify, events[1].stage);
+  EXPECT_EQ(20, events[2].index);
+  EXPECT_EQ(20, events[3].index);
+
+  // Tracing can be disabled at runtime.
+  FLAGS_raft_replication_trace_sample_interval = 0;
+  trace_->Record(ReplicationStage::kReplicate, MakeOpId(1, 30));
+  trace_->GetEvents(&events);
+  ASSERT_EQ(4, events.size());
+}
+
+// Each stage is only counted in its histogram the first time it is reached
+// for an op, and only for ops whose start was observed.
+TEST_F(ReplicationTraceTest, TestStageHistograms) {
+  scoped_refptr<Histogram> peer_send =
+      METRIC_replication_trace_peer_send_latency.Instantiate(metric_entity_);
+  scoped_refptr<Histogram> wal_commit =
+      METRIC_replication_trace_wal_group_commit_latency.Instantiate(metric_entity_);
+  scoped_refptr<Histogram> commit_notify =
+      METRIC_replication_trace_commit_notify_latency.Instantiate(metric_entity_);
+  int64_t peer_send_before = peer_send->TotalCount();
+  int64_t wal_commit_before = wal_commit->TotalCount();
+  int64_t commit_notify_before = commit_notify->TotalCount();
+
+  OpId id = MakeOpId(3, 100);
+  trace_->Record(ReplicationStage::kReplicate, id);
+  trace_->Record(ReplicationStage::kPeerSend, id);
+  trace_->Record(ReplicationStage::kPeerSend, id);
+  trace_->RecordRange(ReplicationStage::kWalGroupCommit, 3, 90, 100);
+  trace_->RecordRange(ReplicationStage::kCommitNotify, 3, 99, 100);
+
+  // An op which was never seen by Replicate() (e.g. on a follower) is only
+  // buffered.
+  trace_->Record(ReplicationStage::kPeerSend, MakeOpId(3, 110));
+
+  EXPECT_EQ(peer_send_before + 1, peer_send->TotalCount());
+  EXPECT_EQ(wal_commit_before + 1, wal_commit->TotalCount());
+  EXPECT_EQ(commit_notify_before + 1, commit_notify->TotalCount());
+
+  vector<string> lines;
+  trace_->DumpToStrings(&lines);
+  ASSERT_EQ(2, lines.size());
+  ASSERT_STR_CONTAINS(lines[0], "3.100: replicate=+0us");
+  ASSERT_STR_CONTAINS(lines[0], "commit_notify=");
+  ASSERT_STR_CONTAINS(lines[1], "3.110: peer_send=+0us");
+}
+
+// Events recorded by other threads are merged by readers.
+TEST_F(ReplicationTraceTest, TestMultipleThreads) {
+  const int kNumThreads = 4;
+  CountDownLatch recorded(kNumThreads);
+  CountDownLatch done(1);
+  vector<thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int64_t i = 1; i <= 100; i++) {
+        trace_->Record(ReplicationStage::kPeerSend, MakeOpId(1, i * 10 * kNumThreads + t * 10));
+      }
+      recorded.CountDown();
+      // A thread's ring is dropped when the thread exits.
+      done.Wait();
+    });
+  }
+  recorded.Wait();
+  vector<ReplicationTrace::Event> events;
+  trace_->GetEvents(&events);
+  done.CountDown();
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(kNumThreads * 100, events.size());
+  for (size_t i = 1; i < events.size(); i++) {
+    ASSERT_LT(events[i - 1].index, events[i].index);
+  }
+}
+
+} // namespace consensus
+} // namespace kudu
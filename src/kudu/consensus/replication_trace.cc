@@ -0,0 +1,361 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/replication_trace.h"
+
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <utility>
+
+#include <boost/bind.hpp> // IWYU pragma: keep
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "kudu/consensus/opid.pb.h"
+#include "kudu/gutil/dynamic_annotations.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/gutil/walltime.h"
+#include "kudu/util/flag_tags.h"
+#include "kudu/util/threadlocal.h"
+#include "kudu/util/url-coding.h"
+
+DEFINE_int32(raft_replication_trace_sample_interval, 1024,
+             "Trace one out of every this many replicated ops, chosen by op index. "
+             "Sampled ops are timestamped at each stage of the replication "
+             "pipeline and feed the replication_trace_*_latency histograms. "
+             "Set to 0 to disable replication tracing.");
+TAG_FLAG(raft_replication_trace_sample_interval, advanced);
+TAG_FLAG(raft_replication_trace_sample_interval, runtime);
+
+METRIC_DEFINE_histogram(server, replication_trace_log_cache_append_latency,
+                        "Replication Trace: Log Cache Append Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the call to Replicate() until a sampled op "
+                        "was appended to the log cache",
+                        60000000LU, 2);
+METRIC_DEFINE_histogram(server, replication_trace_wal_group_commit_latency,
+                        "Replication Trace: WAL Group Commit Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the previous stage until the WAL group commit "
+                        "containing a sampled op was synced",
+                        60000000LU, 2);
+METRIC_DEFINE_histogram(server, replication_trace_peer_send_latency,
+                        "Replication Trace: Peer Send Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the previous stage until a sampled op was "
+                        "first sent to a remote peer",
+                        60000000LU, 2);
+METRIC_DEFINE_histogram(server, replication_trace_follower_append_latency,
+                        "Replication Trace: Follower Append Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the previous stage until a remote peer first "
+                        "acknowledged a sampled op",
+                        60000000LU, 2);
+METRIC_DEFINE_histogram(server, replication_trace_majority_ack_latency,
+                        "Replication Trace: Majority Ack Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the previous stage until a sampled op was "
+                        "replicated to a majority",
+                        60000000LU, 2);
+METRIC_DEFINE_histogram(server, replication_trace_commit_notify_latency,
+                        "Replication Trace: Commit Notification Latency",
+                        kudu::MetricUnit::kMicroseconds,
+                        "Microseconds from the previous stage until consensus was "
+                        "notified that a sampled op committed",
+                        60000000LU, 2);
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+namespace consensus {
+
+const char* ReplicationStageToString(ReplicationStage stage) {
+  switch (stage) {
+    case ReplicationStage::kReplicate: return "replicate";
+    case ReplicationStage::kLogCacheAppend: return "log_cache_append";
+    case ReplicationStage::kWalGroupCommit: return "wal_group_commit";
+    case ReplicationStage::kPeerSend: return "peer_send";
+    case ReplicationStage::kFollowerAppend: return "follower_append";
+    case ReplicationStage::kMajorityAck: return "majority_ack";
+    case ReplicationStage::kCommitNotify: return "commit_notify";
+    case ReplicationStage::kNumStages: break;
+  }
+  DCHECK(false);
+  return "<unknown>";
+}
+
+// A fixed-size ring of events written by a single thread.
+//
+// The writer publishes each event by advancing 'next_' after filling in the
+// event. Readers copy the ring without synchronizing with the writer and then
+// discard any events which the writer may have overwritten during the copy.
+class ReplicationTrace::ThreadRing {
+ public:
+  ThreadRing() : next_(0) {}
+
+  void Append(const Event& event) {
+    int64_t pos = next_.load(std::memory_order_relaxed);
+    events_[pos % kRingCapacity] = event;
+    next_.store(pos + 1, std::memory_order_release);
+  }
+
+  void CopyTo(vector<Event>* out) const {
+    int64_t end = next_.load(std::memory_order_acquire);
+    int64_t start = std::max<int64_t>(0, end - kRingCapacity);
+    vector<Event> copy;
+    copy.reserve(end - start);
+    ANNOTATE_IGNORE_READS_BEGIN();
+    for (int64_t pos = start; pos < end; pos++) {
+      copy.push_back(events_[pos % kRingCapacity]);
+    }
+    ANNOTATE_IGNORE_READS_END();
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // The writer may have been filling in the event at position 'end_after'
+    // while we copied, which overwrites position 'end_after - kRingCapacity'.
+    int64_t end_after = next_.load(std::memory_order_relaxed);
+    int64_t first_valid = std::max(start, end_after - kRingCapacity + 1);
+    for (int64_t pos = first_valid; pos < end; pos++) {
+      out->push_back(copy[pos - start]);
+    }
+  }
+
+  void Clear() {
+    next_.store(0, std::memory_order_release);
+  }
+
+ private:
+  std::atomic<int64_t> next_;
+  Event events_[kRingCapacity];
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadRing);
+};
+
+// Thread-local owner of a ThreadRing. Registers the ring with the tracer on
+// construction and unregisters it when the thread exits.
+class ReplicationTrace::ThreadRingHandle {
+ public:
+  explicit ThreadRingHandle(ReplicationTrace* trace)
+      : trace_(trace),
+        ring_(std::make_shared<ThreadRing>()) {
+    trace_->RegisterRing(ring_);
+  }
+
+  ~ThreadRingHandle() {
+    trace_->UnregisterRing(ring_.get());
+  }
+
+  ThreadRing* ring() const { return ring_.get(); }
+
+ private:
+  ReplicationTrace* const trace_;
+  const shared_ptr<ThreadRing> ring_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadRingHandle);
+};
+
+ReplicationTrace* ReplicationTrace::GetSingleton() {
+  return Singleton<ReplicationTrace>::get();
+}
+
+ReplicationTrace::ReplicationTrace()
+    : metrics_started_(false) {
+  for (auto& slot : slots_) {
+    slot.index.store(-1, std::memory_order_relaxed);
+    slot.last_micros.store(0, std::memory_order_relaxed);
+    slot.stages_seen.store(0, std::memory_order_relaxed);
+  }
+}
+
+void ReplicationTrace::Record(ReplicationStage stage, const OpId& id) {
+  if (IsSampled(id.index())) {
+    RecordSampled(stage, id.term(), id.index());
+  }
+}
+
+void ReplicationTrace::RecordRange(ReplicationStage stage, int64_t term,
+                                   int64_t after_index, int64_t up_to_index) {
+  int32_t interval = FLAGS_raft_replication_trace_sample_interval;
+  if (PREDICT_TRUE(interval <= 0 || up_to_index <= after_index)) {
+    return;
+  }
+  // Only the most recent ops can still be tracked by a slot, so there is no
+  // point in walking through a large range (e.g. at startup) op by op.
+  int64_t first = std::max(after_index + 1,
+                           up_to_index - static_cast<int64_t>(interval) * kNumSlots);
+  for (int64_t index = (first + interval - 1) / interval * interval;
+       index <= up_to_index;
+       index += interval) {
+    if (index > 0) {
+      RecordSampled(stage, term, index);
+    }
+  }
+}
+
+void ReplicationTrace::RecordSampled(ReplicationStage stage, int64_t term, int64_t index) {
+  int64_t now = GetMonoTimeMicros();
+  GetThreadRing()->Append({ term, index, now, stage });
+  UpdateSlot(stage, index, now);
+}
+
+void ReplicationTrace::UpdateSlot(ReplicationStage stage, int64_t index, int64_t now) {
+  if (!metrics_started_.load(std::memory_order_acquire)) {
+    return;
+  }
+  int32_t interval = std::max(1, FLAGS_raft_replication_trace_sample_interval);
+  Slot* slot = &slots_[(index / interval) % kNumSlots];
+  uint32_t bit = 1U << static_cast<int>(stage);
+
+  if (stage == ReplicationStage::kReplicate) {
+    // Claim the slot for this op. A concurrent update for the op that used to
+    // own the slot may still slip in, which at worst skews a single sample.
+    slot->index.store(-1, std::memory_order_relaxed);
+    slot->last_micros.store(now, std::memory_order_relaxed);
+    slot->stages_seen.store(bit, std::memory_order_relaxed);
+    slot->index.store(index, std::memory_order_release);
+    return;
+  }
+
+  if (slot->index.load(std::memory_order_acquire) != index) {
+    return;
+  }
+  // Only the first time a stage is reached counts; e.g. an op is sent to
+  // every peer, and may be re-sent after a timeout.
+  if (slot->stages_seen.fetch_or(bit) & bit) {
+    return;
+  }
+  int64_t prev = slot->last_micros.exchange(now);
+  stage_latency_[static_cast<int>(stage)]->Increment(std::max<int64_t>(0, now - prev));
+}
+
+ReplicationTrace::ThreadRing* ReplicationTrace::GetThreadRing() {
+  BLOCK_STATIC_THREAD_LOCAL(ThreadRingHandle, handle, this);
+  return handle->ring();
+}
+
+void ReplicationTrace::RegisterRing(const shared_ptr<ThreadRing>& ring) {
+  std::lock_guard<simple_spinlock> l(lock_);
+  rings_.push_back(ring);
+}
+
+void ReplicationTrace::UnregisterRing(const ThreadRing* ring) {
+  std::lock_guard<simple_spinlock> l(lock_);
+  rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                              [&](const shared_ptr<ThreadRing>& r) { return r.get() == ring; }),
+               rings_.end());
+}
+
+Status ReplicationTrace::StartInstrumentation(const scoped_refptr<MetricEntity>& metric_entity,
+                                              WebCallbackRegistry* web) {
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    if (!metrics_started_.load(std::memory_order_relaxed)) {
+#define MINIT(stage, x) \
+      stage_latency_[static_cast<int>(ReplicationStage::stage)] = \
+          METRIC_replication_trace_##x##_latency.Instantiate(metric_entity)
+      MINIT(kLogCacheAppend, log_cache_append);
+      MINIT(kWalGroupCommit, wal_group_commit);
+      MINIT(kPeerSend, peer_send);
+      MINIT(kFollowerAppend, follower_append);
+      MINIT(kMajorityAck, majority_ack);
+      MINIT(kCommitNotify, commit_notify);
+#undef MINIT
+      metrics_started_.store(true, std::memory_order_release);
+    }
+  }
+
+  if (web) {
+    WebCallbackRegistry::PrerenderedPathHandlerCallback callback =
+        boost::bind<void>(boost::mem_fn(&ReplicationTrace::HandleTracePage), this, _1, _2);
+    web->RegisterPrerenderedPathHandler("/replication-trace", "Replication Trace", callback,
+                                        true /* is_styled */,
+                                        false /* is_on_nav_bar */);
+  }
+  return Status::OK();
+}
+
+void ReplicationTrace::GetEvents(vector<Event>* events) const {
+  vector<shared_ptr<ThreadRing>> rings;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    rings = rings_;
+  }
+  events->clear();
+  for (const auto& ring : rings) {
+    ring->CopyTo(events);
+  }
+  std::stable_sort(events->begin(), events->end(), [](const Event& a, const Event& b) {
+      return a.index != b.index ? a.index < b.index : a.micros < b.micros;
+    });
+}
+
+void ReplicationTrace::DumpToStrings(vector<string>* lines) const {
+  vector<Event> events;
+  GetEvents(&events);
+
+  auto iter = events.begin();
+  while (iter != events.end()) {
+    const Event& first = *iter;
+    string line = Substitute("$0.$1:", first.term, first.index);
+    for (; iter != events.end() && iter->index == first.index; ++iter) {
+      line += Substitute(" $0=+$1us", ReplicationStageToString(iter->stage),
+                         iter->micros - first.micros);
+    }
+    lines->emplace_back(std::move(line));
+  }
+}
+
+void ReplicationTrace::ResetForTests() {
+  vector<shared_ptr<ThreadRing>> rings;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    rings = rings_;
+  }
+  for (const auto& ring : rings) {
+    ring->Clear();
+  }
+  for (auto& slot : slots_) {
+    slot.index.store(-1, std::memory_order_relaxed);
+    slot.stages_seen.store(0, std::memory_order_relaxed);
+  }
+}
+
+void ReplicationTrace::HandleTracePage(const WebCallbackRegistry::WebRequest& /*req*/,
+                                       WebCallbackRegistry::PrerenderedWebResponse* resp) {
+  std::ostringstream* output = resp->output;
+  vector<string> lines;
+  DumpToStrings(&lines);
+
+  *output << "<h1>Replication Trace</h1>\n";
+  *output << "<p>One line per sampled op (term.index), with the time of each stage "
+          << "relative to the first stage recorded for the op. Sampling interval: "
+          << FLAGS_raft_replication_trace_sample_interval << " ops.</p>\n";
+  *output << "<pre>\n";
+  for (const string& line : lines) {
+    EscapeForHtml(line, output);
+    *output << "\n";
+  }
+  *output << "</pre>\n";
+}
+
+} // namespace consensus
+} // namespace kudu
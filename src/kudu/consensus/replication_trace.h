@@ -0,0 +1,189 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#ifndef KUDU_CONSENSUS_REPLICATION_TRACE_H_
+#define KUDU_CONSENSUS_REPLICATION_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags_declare.h>
+
+#include "kudu/gutil/macros.h"
+#include "kudu/gutil/port.h"
+#include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/singleton.h"
+#include "kudu/util/locks.h"
+#include "kudu/util/metrics.h"
+#include "kudu/util/status.h"
+#include "kudu/util/web_callback_registry.h"
+
+DECLARE_int32(raft_replication_trace_sample_interval);
+
+namespace kudu {
+namespace consensus {
+
+class OpId;
+
+// The stages of the replication pipeline that a sampled op is timestamped at,
+// in the order they are normally reached on the leader.
+enum class ReplicationStage : uint8_t {
+  // RaftConsensus::Replicate() was called for the op.
+  kReplicate = 0,
+  // The op was added to the LogCache and handed to the WAL.
+  kLogCacheAppend,
+  // The WAL group commit containing the op was synced.
+  kWalGroupCommit,
+  // The op was first sent to a remote peer.
+  kPeerSend,
+  // A remote peer first acknowledged having appended the op.
+  kFollowerAppend,
+  // The op became majority-replicated.
+  kMajorityAck,
+  // RaftConsensus was notified that the op is committed.
+  kCommitNotify,
+
+  kNumStages
+};
+
+const char* ReplicationStageToString(ReplicationStage stage);
+
+// Low-overhead, sampled per-op latency tracing for the replication pipeline.
+//
+// Ops are sampled by index ('--raft_replication_trace_sample_interval'), so
+// every stage and every replica agrees on which ops are traced without having
+// to carry any state along with the op. Unsampled ops cost a flag load and a
+// modulo.
+//
+// For sampled ops, each call to Record() appends a timestamped event to a
+// fixed-size ring buffer owned by the calling thread, so the recording path
+// never takes a lock. Events are only merged when a reader asks for them
+// (see DumpToStrings()).
+//
+// In addition, a small lock-free table keyed by op index tracks the time of
+// the last stage seen for each in-flight sampled op. When a stage is reached
+// for the first time, the time elapsed since the previous stage is added to
+// that stage's histogram, which gives a per-stage breakdown of where time is
+// spent. Since stages may run concurrently (e.g. the local WAL sync and the
+// send to peers), the breakdown measures the time since the previously
+// observed stage, whichever it was.
+//
+// This class is thread-safe.
+class ReplicationTrace {
+ public:
+  // A single timestamped stage event for a sampled op.
+  struct Event {
+    int64_t term;
+    int64_t index;
+    int64_t micros;
+    ReplicationStage stage;
+  };
+
+  static ReplicationTrace* GetSingleton();
+
+  // Return true if the op with the given index is sampled.
+  static bool IsSampled(int64_t index) {
+    int32_t interval = FLAGS_raft_replication_trace_sample_interval;
+    return PREDICT_FALSE(interval > 0 && index > 0 && index % interval == 0);
+  }
+
+  // Record that the op 'id' reached 'stage'. Does nothing if the op is not
+  // sampled.
+  void Record(ReplicationStage stage, const OpId& id);
+  void Record(ReplicationStage stage, int64_t term, int64_t index) {
+    if (IsSampled(index)) {
+      RecordSampled(stage, term, index);
+    }
+  }
+
+  // Record that every op with index in (after_index, up_to_index] reached
+  // 'stage', for stages which are reached by ranges of ops at a time, like
+  // a group commit or a commit index advancement.
+  void RecordRange(ReplicationStage stage, int64_t term,
+                   int64_t after_index, int64_t up_to_index);
+
+  // Instantiate the per-stage latency histograms on 'metric_entity' and, if
+  // 'web' is not null, register the /replication-trace page. Only the first
+  // call instantiates the histograms; subsequent calls are no-ops.
+  Status StartInstrumentation(const scoped_refptr<MetricEntity>& metric_entity,
+                              WebCallbackRegistry* web);
+
+  // Return all events currently held in the per-thread ring buffers, sorted
+  // by op index, then by time.
+  void GetEvents(std::vector<Event>* events) const;
+
+  // Dump the buffered events, one line per sampled op, with the offset of
+  // each stage from the first stage recorded for that op.
+  void DumpToStrings(std::vector<std::string>* lines) const;
+
+  // Drop all buffered events and in-flight op state. For tests.
+  void ResetForTests();
+
+ private:
+  friend class Singleton<ReplicationTrace>;
+  class ThreadRing;
+  class ThreadRingHandle;
+
+  // Number of events kept per thread.
+  static const int kRingCapacity = 1024;
+
+  // Number of in-flight sampled ops tracked for the stage histograms.
+  static const int kNumSlots = 1024;
+
+  struct Slot {
+    std::atomic<int64_t> index;
+    std::atomic<int64_t> last_micros;
+    std::atomic<uint32_t> stages_seen;
+  };
+
+  ReplicationTrace();
+
+  void RecordSampled(ReplicationStage stage, int64_t term, int64_t index);
+
+  // Update the stage histograms for the given event.
+  void UpdateSlot(ReplicationStage stage, int64_t index, int64_t now);
+
+  ThreadRing* GetThreadRing();
+
+  void RegisterRing(const std::shared_ptr<ThreadRing>& ring);
+  void UnregisterRing(const ThreadRing* ring);
+
+  void HandleTracePage(const WebCallbackRegistry::WebRequest& req,
+                       WebCallbackRegistry::PrerenderedWebResponse* resp);
+
+  Slot slots_[kNumSlots];
+
+  // Set once the histograms below have been instantiated.
+  std::atomic<bool> metrics_started_;
+  scoped_refptr<Histogram> stage_latency_[static_cast<int>(ReplicationStage::kNumStages)];
+
+  // Protects 'rings_' and the instantiation of the histograms.
+  mutable simple_spinlock lock_;
+
+  // Rings of all live threads that have recorded at least one event. Readers
+  // take a reference so a ring stays valid if its thread exits mid-read.
+  std::vector<std::shared_ptr<ThreadRing>> rings_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplicationTrace);
+};
+
+} // namespace consensus
+} // namespace kudu
+
+#endif // KUDU_CONSENSUS_REPLICATION_TRACE_H_
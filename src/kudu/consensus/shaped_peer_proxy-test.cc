@@ -0,0 +1,192 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/shaped_peer_proxy.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "kudu/common/wire_protocol.pb.h"
+#include "kudu/consensus/consensus-test-util.h"
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/metadata.pb.h"
+#include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/rpc/rpc_controller.h"
+#include "kudu/util/countdown_latch.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+using kudu::rpc::RpcController;
+using std::string;
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+namespace consensus {
+
+class ShapedPeerProxyTest : public KuduTest {
+ protected:
+  // Returns the median of the delays of 'n' messages sent over a link of
+  // 'shape', each long after the previous one arrived.
+  static int64_t MedianDelayMs(const LinkShape& shape, int n) {
+    ShapedLink link(shape, SeedRandom());
+    const MonoTime start = MonoTime::Now();
+    vector<int64_t> delays_us;
+    for (int i = 0; i < n; i++) {
+      const MonoTime sent = start + MonoDelta::FromSeconds(i * 100);
+      delays_us.push_back((link.Transmit(sent, 0) - sent).ToMicroseconds());
+    }
+    std::nth_element(delays_us.begin(), delays_us.begin() + n / 2, delays_us.end());
+    return delays_us[n / 2] / 1000;
+  }
+};
+
+TEST_F(ShapedPeerProxyTest, TestParseLinkShape) {
+  LinkShape shape;
+  ASSERT_OK(ParseLinkShape("latency_ms=40,jitter_ms=2.5,jitter=pareto,"
+                           "bandwidth_mbps=80,loss=0.01,rto_ms=300", &shape));
+  ASSERT_EQ(40, shape.latency.ToMilliseconds());
+  ASSERT_EQ(2500, shape.jitter.ToMicroseconds());
+  ASSERT_EQ(LinkShape::PARETO, shape.jitter_distribution);
+  ASSERT_EQ(10 * 1000 * 1000, shape.bandwidth_bytes_per_sec);
+  ASSERT_DOUBLE_EQ(0.01, shape.loss_rate);
+  ASSERT_EQ(300, shape.retransmit_timeout.ToMilliseconds());
+
+  // Keys which aren't given are left alone.
+  ASSERT_OK(ParseLinkShape("latency_ms=5", &shape));
+  ASSERT_EQ(5, shape.latency.ToMilliseconds());
+  ASSERT_EQ(LinkShape::PARETO, shape.jitter_distribution);
+
+  for (const char* bad : { "latency", "latency_ms=-1", "latency_ms=x", "loss=1",
+                           "jitter=gaussian", "color=blue" }) {
+    SCOPED_TRACE(bad);
+    Status s = ParseLinkShape(bad, &shape);
+    ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+  }
+}
+
+// Messages are serialized at the link's bandwidth, then delayed by its
+// latency.
+TEST_F(ShapedPeerProxyTest, TestLatencyAndBandwidth) {
+  LinkShape shape;
+  shape.latency = MonoDelta::FromMilliseconds(10);
+  shape.bandwidth_bytes_per_sec = 1000 * 1000;
+  ShapedLink link(shape, SeedRandom());
+
+  const MonoTime now = MonoTime::Now();
+  ASSERT_EQ(11, (link.Transmit(now, 1000) - now).ToMilliseconds());
+  // Sent at the same time, so it waits for the first message to be sent.
+  ASSERT_EQ(12, (link.Transmit(now, 1000) - now).ToMilliseconds());
+  // Once the link is idle, messages don't wait.
+  const MonoTime later = now + MonoDelta::FromSeconds(1);
+  ASSERT_EQ(11, (link.Transmit(later, 1000) - later).ToMilliseconds());
+}
+
+TEST_F(ShapedPeerProxyTest, TestJitterDistributions) {
+  LinkShape shape;
+  shape.latency = MonoDelta::FromMilliseconds(10);
+  shape.jitter = MonoDelta::FromMilliseconds(100);
+  const int kNumMessages = 10001;
+
+  // The medians of the distributions, as fractions of the jitter.
+  shape.jitter_distribution = LinkShape::UNIFORM;
+  ASSERT_NEAR(10 + 50, MedianDelayMs(shape, kNumMessages), 5);
+  shape.jitter_distribution = LinkShape::NORMAL;
+  ASSERT_NEAR(10 + 67, MedianDelayMs(shape, kNumMessages), 5);
+  shape.jitter_distribution = LinkShape::PARETO;
+  ASSERT_NEAR(10 + 41, MedianDelayMs(shape, kNumMessages), 5);
+}
+
+// However jittery the link, messages arrive in the order they were sent.
+TEST_F(ShapedPeerProxyTest, TestMessagesArriveInOrder) {
+  LinkShape shape;
+  shape.jitter = MonoDelta::FromMilliseconds(100);
+  ShapedLink link(shape, SeedRandom());
+
+  MonoTime sent = MonoTime::Now();
+  MonoTime last_arrival = sent;
+  for (int i = 0; i < 1000; i++) {
+    sent += MonoDelta::FromMilliseconds(1);
+    const MonoTime arrival = link.Transmit(sent, 0);
+    ASSERT_GE(arrival, last_arrival);
+    ASSERT_LE(arrival, std::max(last_arrival, sent + shape.jitter));
+    last_arrival = arrival;
+  }
+}
+
+// Lost messages are delayed by whole retransmit timeouts.
+TEST_F(ShapedPeerProxyTest, TestLossRetransmits) {
+  LinkShape shape;
+  shape.latency = MonoDelta::FromMilliseconds(10);
+  shape.loss_rate = 0.5;
+  shape.retransmit_timeout = MonoDelta::FromMilliseconds(200);
+  ShapedLink link(shape, SeedRandom());
+
+  const int kNumMessages = 1000;
+  int num_lost = 0;
+  const MonoTime start = MonoTime::Now();
+  for (int i = 0; i < kNumMessages; i++) {
+    const MonoTime sent = start + MonoDelta::FromSeconds(i * 100);
+    const int64_t delay_ms = (link.Transmit(sent, 0) - sent).ToMilliseconds();
+    ASSERT_EQ(0, (delay_ms - 10) % 200) << delay_ms;
+    if (delay_ms > 10) {
+      num_lost++;
+    }
+  }
+  ASSERT_NEAR(kNumMessages / 2, num_lost, kNumMessages / 10);
+}
+
+// The requests to the peer and the responses from it are both delayed,
+// without blocking the caller.
+TEST_F(ShapedPeerProxyTest, TestShapedProxy) {
+  const MonoDelta kLatency = MonoDelta::FromMilliseconds(50);
+  RaftPeerPB peer_pb;
+  peer_pb.set_permanent_uuid("peer");
+  peer_pb.mutable_last_known_addr()->set_host("127.0.0.1");
+  peer_pb.mutable_last_known_addr()->set_port(12345);
+
+  ShapedPeerProxyOptions opts;
+  opts.shapes[Substitute("127.0.0.1:$0", 12345)].latency = kLatency;
+  ShapedPeerProxyFactory factory(
+      gscoped_ptr<PeerProxyFactory>(new NoOpTestPeerProxyFactory()), opts);
+  gscoped_ptr<PeerProxy> proxy;
+  ASSERT_OK(factory.NewProxy(peer_pb, &proxy));
+
+  ConsensusRequestPB req;
+  req.set_caller_term(1);
+  ConsensusResponsePB resp;
+  RpcController controller;
+  CountDownLatch done(1);
+  const MonoTime start = MonoTime::Now();
+  proxy->UpdateAsync(&req, &resp, &controller, [&]() { done.CountDown(); });
+  ASSERT_LT(MonoTime::Now() - start, kLatency);
+
+  done.Wait();
+  const MonoDelta elapsed = MonoTime::Now() - start;
+  ASSERT_GE(elapsed.ToMilliseconds(), 2 * kLatency.ToMilliseconds());
+  ASSERT_EQ("peer", resp.responder_uuid());
+}
+
+} // namespace consensus
+} // namespace kudu
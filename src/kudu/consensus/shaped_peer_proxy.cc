@@ -0,0 +1,300 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/consensus/shaped_peer_proxy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "kudu/common/wire_protocol.pb.h"
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/metadata.pb.h"
+#include "kudu/gutil/map-util.h"
+#include "kudu/gutil/strings/numbers.h"
+#include "kudu/gutil/strings/split.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/rpc/messenger.h"
+#include "kudu/rpc/timer_wheel.h"
+#include "kudu/util/random_util.h"
+
+using kudu::rpc::Messenger;
+using kudu::rpc::ResponseCallback;
+using kudu::rpc::RpcController;
+using kudu::rpc::TimerWheel;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using std::weak_ptr;
+using strings::Substitute;
+
+namespace kudu {
+namespace consensus {
+
+namespace {
+
+const char* JitterDistributionToString(LinkShape::JitterDistribution d) {
+  switch (d) {
+    case LinkShape::UNIFORM: return "uniform";
+    case LinkShape::NORMAL: return "normal";
+    case LinkShape::PARETO: return "pareto";
+  }
+  LOG(FATAL) << "unknown jitter distribution " << d;
+  return nullptr;
+}
+
+// Runs 'f' at 'when' on a reactor ticking 'timers', or on this thread if
+// 'when' has passed or 'timers' is gone.
+void RunAt(const weak_ptr<TimerWheel>& timers, MonoTime when, std::function<void()> f) {
+  const MonoDelta delay = when - MonoTime::Now();
+  shared_ptr<TimerWheel> t = timers.lock();
+  if (!t || delay.ToNanoseconds() <= 0) {
+    f();
+    return;
+  }
+  t->Schedule(delay, std::move(f));
+}
+
+} // anonymous namespace
+
+string LinkShape::ToString() const {
+  return Substitute("latency $0, jitter $1 ($2), bandwidth $3 B/s, loss $4, rto $5",
+                    latency.ToString(), jitter.ToString(),
+                    JitterDistributionToString(jitter_distribution),
+                    bandwidth_bytes_per_sec, loss_rate, retransmit_timeout.ToString());
+}
+
+Status ParseLinkShape(const string& spec, LinkShape* shape) {
+  vector<string> pairs = strings::Split(spec, ",", strings::SkipEmpty());
+  for (const string& pair : pairs) {
+    vector<string> kv = strings::Split(pair, "=");
+    if (kv.size() != 2) {
+      return Status::InvalidArgument("expected key=value", pair);
+    }
+    const string& key = kv[0];
+    const string& value = kv[1];
+    double num;
+    if (key == "jitter") {
+      if (value == "uniform") {
+        shape->jitter_distribution = LinkShape::UNIFORM;
+      } else if (value == "normal") {
+        shape->jitter_distribution = LinkShape::NORMAL;
+      } else if (value == "pareto") {
+        shape->jitter_distribution = LinkShape::PARETO;
+      } else {
+        return Status::InvalidArgument("unknown jitter distribution", value);
+      }
+      continue;
+    }
+    if (!safe_strtod(value.c_str(), &num) || num < 0) {
+      return Status::InvalidArgument("expected a non-negative number", pair);
+    }
+    if (key == "latency_ms") {
+      shape->latency = MonoDelta::FromSeconds(num / 1000);
+    } else if (key == "jitter_ms") {
+      shape->jitter = MonoDelta::FromSeconds(num / 1000);
+    } else if (key == "bandwidth_mbps") {
+      shape->bandwidth_bytes_per_sec = static_cast<int64_t>(num * 1000 * 1000 / 8);
+    } else if (key == "loss") {
+      if (num >= 1) {
+        return Status::InvalidArgument("loss rate must be less than 1", pair);
+      }
+      shape->loss_rate = num;
+    } else if (key == "rto_ms") {
+      shape->retransmit_timeout = MonoDelta::FromSeconds(num / 1000);
+    } else {
+      return Status::InvalidArgument("unknown link shape key", key);
+    }
+  }
+  return Status::OK();
+}
+
+ShapedLink::ShapedLink(LinkShape shape, uint32_t seed)
+    : shape_(std::move(shape)),
+      rng_(seed),
+      idle_at_(MonoTime::Min()),
+      last_arrival_(MonoTime::Min()) {
+  DCHECK_LT(shape_.loss_rate, 1);
+}
+
+MonoTime ShapedLink::Transmit(MonoTime now, int64_t bytes) {
+  std::lock_guard<simple_spinlock> l(lock_);
+  // The message waits for the ones before it to be serialized.
+  MonoTime sent = std::max(now, idle_at_);
+  if (shape_.bandwidth_bytes_per_sec > 0) {
+    sent += MonoDelta::FromNanoseconds(bytes * 1000000000LL / shape_.bandwidth_bytes_per_sec);
+  }
+  idle_at_ = sent;
+
+  MonoTime arrival = sent + shape_.latency + SampleJitterUnlocked();
+  while (shape_.loss_rate > 0 && rng_.NextDoubleFraction() < shape_.loss_rate) {
+    arrival += shape_.retransmit_timeout;
+  }
+  // Like over a TCP connection, a message is delivered only after the ones
+  // before it, even if it could have arrived sooner.
+  arrival = std::max(arrival, last_arrival_);
+  last_arrival_ = arrival;
+  return arrival;
+}
+
+MonoDelta ShapedLink::SampleJitterUnlocked() {
+  DCHECK(lock_.is_locked());
+  const double jitter_nanos = shape_.jitter.ToNanoseconds();
+  if (jitter_nanos <= 0) {
+    return MonoDelta::FromNanoseconds(0);
+  }
+  double nanos = 0;
+  switch (shape_.jitter_distribution) {
+    case LinkShape::UNIFORM:
+      nanos = jitter_nanos * rng_.NextDoubleFraction();
+      break;
+    case LinkShape::NORMAL:
+      nanos = std::fabs(rng_.Normal(0, jitter_nanos));
+      break;
+    case LinkShape::PARETO: {
+      // With a shape of 2, the mean of scale * (U^(-1/2) - 1) is the scale.
+      const double u = 1 - rng_.NextDoubleFraction();
+      nanos = jitter_nanos * (1 / std::sqrt(u) - 1);
+      break;
+    }
+  }
+  return MonoDelta::FromNanoseconds(static_cast<int64_t>(nanos));
+}
+
+ShapedPeerProxy::ShapedPeerProxy(gscoped_ptr<PeerProxy> proxy,
+                                 shared_ptr<ShapedLink> to_peer,
+                                 shared_ptr<ShapedLink> from_peer,
+                                 weak_ptr<TimerWheel> timers)
+    : proxy_(proxy.release()),
+      to_peer_(std::move(to_peer)),
+      from_peer_(std::move(from_peer)),
+      timers_(std::move(timers)) {
+}
+
+void ShapedPeerProxy::UpdateAsync(const ConsensusRequestPB* request,
+                                  ConsensusResponsePB* response,
+                                  RpcController* controller,
+                                  const ResponseCallback& callback) {
+  shared_ptr<PeerProxy> proxy = proxy_;
+  SendShaped(request->ByteSizeLong(),
+             [=](const ResponseCallback& cb) {
+               proxy->UpdateAsync(request, response, controller, cb);
+             },
+             [response]() { return response->ByteSizeLong(); },
+             callback);
+}
+
+void ShapedPeerProxy::RequestConsensusVoteAsync(const VoteRequestPB* request,
+                                                VoteResponsePB* response,
+                                                RpcController* controller,
+                                                const ResponseCallback& callback) {
+  shared_ptr<PeerProxy> proxy = proxy_;
+  SendShaped(request->ByteSizeLong(),
+             [=](const ResponseCallback& cb) {
+               proxy->RequestConsensusVoteAsync(request, response, controller, cb);
+             },
+             [response]() { return response->ByteSizeLong(); },
+             callback);
+}
+
+Status ShapedPeerProxy::StartElection(const RunLeaderElectionRequestPB* request,
+                                      RunLeaderElectionResponsePB* response,
+                                      RpcController* controller) {
+  return proxy_->StartElection(request, response, controller);
+}
+
+void ShapedPeerProxy::InstallSnapshotAsync(const InstallSnapshotRequestPB* request,
+                                           InstallSnapshotResponsePB* response,
+                                           RpcController* controller,
+                                           const ResponseCallback& callback) {
+  shared_ptr<PeerProxy> proxy = proxy_;
+  SendShaped(request->ByteSizeLong(),
+             [=](const ResponseCallback& cb) {
+               proxy->InstallSnapshotAsync(request, response, controller, cb);
+             },
+             [response]() { return response->ByteSizeLong(); },
+             callback);
+}
+
+string ShapedPeerProxy::PeerName() const {
+  return proxy_->PeerName();
+}
+
+bool ShapedPeerProxy::SupportsCompressedOps() const {
+  return proxy_->SupportsCompressedOps();
+}
+
+void ShapedPeerProxy::SendShaped(int64_t request_bytes,
+                                 std::function<void(const ResponseCallback&)> send,
+                                 std::function<int64_t()> response_bytes,
+                                 const ResponseCallback& callback) {
+  shared_ptr<ShapedLink> from_peer = from_peer_;
+  weak_ptr<TimerWheel> timers = timers_;
+  ResponseCallback shaped_cb = [from_peer, timers, response_bytes, callback]() {
+    RunAt(timers, from_peer->Transmit(MonoTime::Now(), response_bytes()), callback);
+  };
+  RunAt(timers_, to_peer_->Transmit(MonoTime::Now(), request_bytes),
+        [send, shaped_cb]() { send(shaped_cb); });
+}
+
+ShapedPeerProxyFactory::ShapedPeerProxyFactory(gscoped_ptr<PeerProxyFactory> factory,
+                                               ShapedPeerProxyOptions options)
+    : factory_(std::move(factory)),
+      options_(std::move(options)),
+      timers_(TimerWheel::Create(factory_->messenger().get(), options_.timer_tick)),
+      seed_rng_(options_.seed != 0 ? options_.seed : GetRandomSeed32()) {
+}
+
+ShapedPeerProxyFactory::~ShapedPeerProxyFactory() {
+}
+
+Status ShapedPeerProxyFactory::NewProxy(const RaftPeerPB& peer_pb,
+                                        gscoped_ptr<PeerProxy>* proxy) {
+  gscoped_ptr<PeerProxy> inner;
+  RETURN_NOT_OK(factory_->NewProxy(peer_pb, &inner));
+
+  const string addr = Substitute("$0:$1", peer_pb.last_known_addr().host(),
+                                 peer_pb.last_known_addr().port());
+  Link link;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    Link* existing = FindOrNull(links_, addr);
+    if (existing) {
+      link = *existing;
+    } else {
+      const LinkShape& shape = FindWithDefault(options_.shapes, addr, options_.default_shape);
+      link.to_peer = std::make_shared<ShapedLink>(shape, seed_rng_.Next());
+      link.from_peer = std::make_shared<ShapedLink>(shape, seed_rng_.Next());
+      InsertOrDie(&links_, addr, link);
+      VLOG(1) << "Shaping the link to " << addr << ": " << shape.ToString();
+    }
+  }
+  proxy->reset(new ShapedPeerProxy(std::move(inner), std::move(link.to_peer),
+                                   std::move(link.from_peer), timers_));
+  return Status::OK();
+}
+
+const shared_ptr<Messenger>& ShapedPeerProxyFactory::messenger() const {
+  return factory_->messenger();
+}
+
+} // namespace consensus
+} // namespace kudu
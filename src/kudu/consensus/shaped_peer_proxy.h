@@ -0,0 +1,225 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#ifndef KUDU_CONSENSUS_SHAPED_PEER_PROXY_H_
+#define KUDU_CONSENSUS_SHAPED_PEER_PROXY_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "kudu/consensus/consensus_peers.h"
+#include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/gutil/macros.h"
+#include "kudu/rpc/response_callback.h"
+#include "kudu/util/locks.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/random.h"
+#include "kudu/util/status.h"
+
+namespace kudu {
+
+namespace rpc {
+class Messenger;
+class RpcController;
+class TimerWheel;
+} // namespace rpc
+
+namespace consensus {
+
+// The shape of one direction of a simulated network link.
+struct LinkShape {
+  enum JitterDistribution {
+    // Uniform over [0, jitter].
+    UNIFORM,
+    // The absolute value of a normal distribution with 'jitter' as its
+    // standard deviation.
+    NORMAL,
+    // A Pareto distribution with a mean of 'jitter', for a long tail.
+    PARETO,
+  };
+
+  // The one-way latency of every message, before jitter.
+  MonoDelta latency = MonoDelta::FromNanoseconds(0);
+
+  // The random latency added to every message.
+  MonoDelta jitter = MonoDelta::FromNanoseconds(0);
+  JitterDistribution jitter_distribution = UNIFORM;
+
+  // Messages are serialized onto the link at this rate. 0 is unlimited.
+  int64_t bandwidth_bytes_per_sec = 0;
+
+  // The probability that a message, or its retransmission, is lost. Like
+  // over TCP, a lost message is retransmitted after 'retransmit_timeout',
+  // delaying it and the messages behind it. Must be less than 1.
+  double loss_rate = 0;
+  MonoDelta retransmit_timeout = MonoDelta::FromMilliseconds(200);
+
+  std::string ToString() const;
+};
+
+// Parses 'spec', comma-separated 'key=value' pairs, into 'shape'. The keys
+// are latency_ms, jitter_ms, jitter (uniform, normal or pareto),
+// bandwidth_mbps (megabits per second), loss (a probability) and rto_ms
+// (the retransmit timeout), e.g. "latency_ms=40,jitter_ms=5,jitter=pareto".
+// Keys which aren't in 'spec' are left as they are in 'shape'.
+Status ParseLinkShape(const std::string& spec, LinkShape* shape);
+
+// The state of one direction of a simulated link: when it's done sending
+// the messages so far, and when the last of them arrives.
+//
+// This class is thread-safe.
+class ShapedLink {
+ public:
+  ShapedLink(LinkShape shape, uint32_t seed);
+
+  // Sends a message of 'bytes' at 'now' and returns when it arrives. Messages
+  // arrive in the order they were sent.
+  MonoTime Transmit(MonoTime now, int64_t bytes);
+
+  const LinkShape& shape() const { return shape_; }
+
+ private:
+  // Returns the random part of the latency of a message.
+  MonoDelta SampleJitterUnlocked();
+
+  const LinkShape shape_;
+
+  simple_spinlock lock_;
+  Random rng_;
+  // When the link is done serializing the messages sent so far.
+  MonoTime idle_at_;
+  // When the last message sent arrives.
+  MonoTime last_arrival_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShapedLink);
+};
+
+// Decorates another PeerProxy, delaying the requests to the peer and the
+// responses from it as if they went over simulated links. The delays are
+// timers of a TimerWheel ticked by the reactors, so no thread blocks while a
+// message is in flight, and the messages are sent and the callbacks run on
+// the reactor threads.
+//
+// Meant for tests and benchmarks, e.g. to reproduce cross-region commit
+// latencies with a cluster on a single host.
+class ShapedPeerProxy : public PeerProxy {
+ public:
+  // 'timers' is held weakly: once it's gone, messages are no longer delayed.
+  ShapedPeerProxy(gscoped_ptr<PeerProxy> proxy,
+                  std::shared_ptr<ShapedLink> to_peer,
+                  std::shared_ptr<ShapedLink> from_peer,
+                  std::weak_ptr<rpc::TimerWheel> timers);
+
+  void UpdateAsync(const ConsensusRequestPB* request,
+                   ConsensusResponsePB* response,
+                   rpc::RpcController* controller,
+                   const rpc::ResponseCallback& callback) override;
+
+  void RequestConsensusVoteAsync(const VoteRequestPB* request,
+                                 VoteResponsePB* response,
+                                 rpc::RpcController* controller,
+                                 const rpc::ResponseCallback& callback) override;
+
+  // Not shaped: it's synchronous, and only used to transfer leadership.
+  Status StartElection(const RunLeaderElectionRequestPB* request,
+                       RunLeaderElectionResponsePB* response,
+                       rpc::RpcController* controller) override;
+
+  void InstallSnapshotAsync(const InstallSnapshotRequestPB* request,
+                            InstallSnapshotResponsePB* response,
+                            rpc::RpcController* controller,
+                            const rpc::ResponseCallback& callback) override;
+
+  std::string PeerName() const override;
+
+  bool SupportsCompressedOps() const override;
+
+ private:
+  // Transmits a request of 'request_bytes' to the peer, calls 'send' with
+  // the callback for the response once the request arrives, and calls
+  // 'callback' once the response of 'response_bytes()' arrives back.
+  void SendShaped(int64_t request_bytes,
+                  std::function<void(const rpc::ResponseCallback&)> send,
+                  std::function<int64_t()> response_bytes,
+                  const rpc::ResponseCallback& callback);
+
+  // Shared with the timers, which may outlive this proxy.
+  const std::shared_ptr<PeerProxy> proxy_;
+  const std::shared_ptr<ShapedLink> to_peer_;
+  const std::shared_ptr<ShapedLink> from_peer_;
+  const std::weak_ptr<rpc::TimerWheel> timers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShapedPeerProxy);
+};
+
+struct ShapedPeerProxyOptions {
+  // The shape of the links to the peers which aren't in 'shapes'.
+  LinkShape default_shape;
+
+  // The shapes of the links to the peers, by the "host:port" of their last
+  // known addresses. Each shape applies to both directions of the link.
+  std::unordered_map<std::string, LinkShape> shapes;
+
+  // The resolution of the delays.
+  MonoDelta timer_tick = MonoDelta::FromMilliseconds(1);
+
+  // The seed of the random jitter and losses. If 0, a random seed is used.
+  uint32_t seed = 0;
+};
+
+// Makes the proxies of another factory into ShapedPeerProxies. All the
+// proxies to a peer share its links, e.g. heartbeats and votes compete for
+// its bandwidth.
+class ShapedPeerProxyFactory : public PeerProxyFactory {
+ public:
+  ShapedPeerProxyFactory(gscoped_ptr<PeerProxyFactory> factory,
+                         ShapedPeerProxyOptions options);
+
+  ~ShapedPeerProxyFactory();
+
+  Status NewProxy(const RaftPeerPB& peer_pb, gscoped_ptr<PeerProxy>* proxy) override;
+
+  const std::shared_ptr<rpc::Messenger>& messenger() const override;
+
+ private:
+  struct Link {
+    std::shared_ptr<ShapedLink> to_peer;
+    std::shared_ptr<ShapedLink> from_peer;
+  };
+
+  // Declared first, so that its messenger outlives 'timers_'.
+  gscoped_ptr<PeerProxyFactory> factory_;
+  const ShapedPeerProxyOptions options_;
+
+  // Owned here only: the proxies' peers are referenced by the timers, so the
+  // proxies mustn't keep the timers alive.
+  std::shared_ptr<rpc::TimerWheel> timers_;
+
+  simple_spinlock lock_;
+  Random seed_rng_;
+  // By the "host:port" of the peers.
+  std::unordered_map<std::string, Link> links_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShapedPeerProxyFactory);
+};
+
+} // namespace consensus
+} // namespace kudu
+
+#endif // KUDU_CONSENSUS_SHAPED_PEER_PROXY_H_
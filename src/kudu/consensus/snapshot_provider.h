@@ -0,0 +1,96 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#ifndef KUDU_CONSENSUS_SNAPSHOT_PROVIDER_H_
+#define KUDU_CONSENSUS_SNAPSHOT_PROVIDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "kudu/consensus/opid.pb.h"
+#include "kudu/util/status.h"
+
+namespace kudu {
+
+class faststring;
+class Slice;
+
+namespace consensus {
+
+// A snapshot of the application state being sent by the leader.
+class SnapshotSource {
+ public:
+  virtual ~SnapshotSource() {}
+
+  // The id of the last op whose effects are reflected by the snapshot. It
+  // must still be in the leader's log when the snapshot is opened, so that the
+  // follower can be caught up from the log once the snapshot is installed.
+  virtual OpId last_included_opid() const = 0;
+
+  // The size of the snapshot, in bytes.
+  virtual uint64_t size() const = 0;
+
+  // Reads the 'length' bytes of the snapshot at 'offset' into 'data'.
+  virtual Status Read(uint64_t offset, size_t length, faststring* data) = 0;
+};
+
+// A snapshot of the application state being received by a follower.
+class SnapshotSink {
+ public:
+  virtual ~SnapshotSink() {}
+
+  // The number of bytes of the snapshot received so far. The transfer
+  // resumes from there.
+  virtual uint64_t size() const = 0;
+
+  // Appends 'data' to the snapshot.
+  virtual Status Append(const Slice& data) = 0;
+
+  // Replaces the application state with the snapshot, once all of it has
+  // been received. Ops after the snapshot are then applied on top of it.
+  virtual Status Install() = 0;
+};
+
+// Application hook to transfer its state to followers which the leader can
+// no longer catch up from its log, because the ops they need were garbage
+// collected.
+//
+// The leader opens a snapshot with OpenSnapshot() and sends it in chunks to
+// the follower, which writes them into the sink opened with OpenSink() and
+// installs it once complete. The follower then continues from the op after
+// the last one covered by the snapshot.
+//
+// Implementations must be thread-safe.
+class SnapshotProvider {
+ public:
+  virtual ~SnapshotProvider() {}
+
+  // Sets 'source' to a new snapshot of the application state.
+  virtual Status OpenSnapshot(std::shared_ptr<SnapshotSource>* source) = 0;
+
+  // Sets 'sink' to receive the snapshot of 'size' bytes identified by
+  // 'last_included'. If the bytes received for the same snapshot before were
+  // kept, e.g. across restarts, the sink may start with them.
+  virtual Status OpenSink(const OpId& last_included,
+                          uint64_t size,
+                          std::shared_ptr<SnapshotSink>* sink) = 0;
+};
+
+} // namespace consensus
+} // namespace kudu
+
+#endif // KUDU_CONSENSUS_SNAPSHOT_PROVIDER_H_
@@ -23,6 +23,8 @@
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -52,18 +54,23 @@
 #include "kudu/util/faststring.h"
 #include "kudu/util/file_cache-test-util.h"
 #include "kudu/util/locks.h"
+#include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
 #include "kudu/util/random.h"
 #include "kudu/util/slice.h"
 #include "kudu/util/status.h"
+#include "kudu/util/stopwatch.h"
 #include "kudu/util/test_macros.h"
 #include "kudu/util/test_util.h"
 #include "kudu/util/thread.h"
 
 DECLARE_bool(cache_force_single_shard);
+DECLARE_bool(log_container_coalesce_syncs);
+DECLARE_bool(never_fsync);
 DECLARE_double(log_container_excess_space_before_cleanup_fraction);
 DECLARE_double(log_container_live_metadata_before_compact_ratio);
 DECLARE_int64(block_manager_max_open_files);
+DECLARE_int64(log_container_snapshot_min_replay_bytes);
 DECLARE_uint64(log_container_max_size);
 DECLARE_uint64(log_container_preallocate_bytes);
 
@@ -86,6 +93,13 @@ DEFINE_int32(num_inconsistencies, 16,
 DEFINE_string(block_manager_paths, "", "Comma-separated list of paths to "
               "use for block storage. If empty, will use the default unit "
               "test path");
+DEFINE_int32(num_open_benchmark_blocks, 10000,
+             "Number of blocks to create before timing block manager opens");
+DEFINE_int32(num_commits_per_writer, 100,
+             "Number of single block transactions committed by each writer "
+             "thread in the multi-writer commit benchmark");
+
+METRIC_DECLARE_counter(block_manager_total_disk_sync);
 
 using std::string;
 using std::shared_ptr;
@@ -122,6 +136,7 @@ class BlockManagerStressTest : public KuduTest {
     rand_seed_(SeedRandom()),
     stop_latch_(1),
     test_error_manager_(new FsErrorManager()),
+    metric_entity_(METRIC_ENTITY_server.Instantiate(&metric_registry_, "test")),
     test_tablet_name_("test_tablet"),
     total_blocks_written_(0),
     total_bytes_written_(0),
@@ -190,8 +205,9 @@ class BlockManagerStressTest : public KuduTest {
       CHECK_OK(DataDirManager::OpenExistingForTests(env_, data_dirs,
           DataDirManagerOptions(), &dd_manager_));
     }
-    return new T(env_, dd_manager_.get(), test_error_manager_.get(),
-                 BlockManagerOptions());
+    BlockManagerOptions opts;
+    opts.metric_entity = metric_entity_;
+    return new T(env_, dd_manager_.get(), test_error_manager_.get(), std::move(opts));
   }
 
   void RunTest(double secs) {
@@ -277,6 +293,10 @@ class BlockManagerStressTest : public KuduTest {
   // The error manager.
   unique_ptr<FsErrorManager> test_error_manager_;
 
+  // The metrics of the block manager.
+  MetricRegistry metric_registry_;
+  scoped_refptr<MetricEntity> metric_entity_;
+
   // Test group of disk to spread data across.
   DataDirGroupPB test_group_pb_;
 
@@ -575,5 +595,101 @@ TYPED_TEST(BlockManagerStressTest, StressTest) {
                           FLAGS_num_deleter_threads);
 }
 
+// Reports how long it takes to open a block manager with many small blocks,
+// e.g. 1M blocks with --num_open_benchmark_blocks=1000000 (the default for
+// slow tests), with and without container snapshots.
+TYPED_TEST(BlockManagerStressTest, OpenBenchmark) {
+  if (!std::is_same<TypeParam, LogBlockManager>::value) {
+    LOG(INFO) << "Only the log block manager keeps metadata to load at startup";
+    return;
+  }
+  OverrideFlagForSlowTests("num_open_benchmark_blocks", "1000000");
+
+  // Fill 1 MB containers with blocks of a single byte, i.e. a filesystem
+  // block on disk: that's a few hundred blocks per container.
+  {
+    unique_ptr<BlockCreationTransaction> transaction = this->bm_->NewCreationTransaction();
+    for (int i = 0; i < FLAGS_num_open_benchmark_blocks; i++) {
+      unique_ptr<WritableBlock> block;
+      ASSERT_OK_FAST(this->bm_->CreateBlock(CreateBlockOptions({ this->test_tablet_name_ }),
+                                            &block));
+      ASSERT_OK_FAST(block->Append("x"));
+      ASSERT_OK_FAST(block->Finalize());
+      transaction->AddCreatedBlock(std::move(block));
+      if (i % 1000 == 999) {
+        ASSERT_OK(transaction->CommitCreatedBlocks());
+        transaction = this->bm_->NewCreationTransaction();
+      }
+    }
+    ASSERT_OK(transaction->CommitCreatedBlocks());
+  }
+
+  // Without snapshots, the block manager replays all of the metadata. With
+  // them, the snapshots are written at the shutdown preceding the open.
+  for (bool use_snapshots : { false, true }) {
+    FLAGS_log_container_snapshot_min_replay_bytes = use_snapshots ? 0 : -1;
+    this->bm_.reset(this->CreateBlockManager());
+    FsReport report;
+    LOG_TIMING(INFO, Substitute("opening block manager with $0 blocks $1 snapshots",
+                                FLAGS_num_open_benchmark_blocks,
+                                use_snapshots ? "with" : "without")) {
+      ASSERT_OK(this->bm_->Open(&report));
+    }
+    ASSERT_EQ(FLAGS_num_open_benchmark_blocks, report.stats.live_block_count);
+  }
+}
+
+// Reports the throughput and the number of disk syncs of writer threads
+// committing small blocks at the same time, with and without coalescing the
+// syncs of the log containers the blocks share.
+TYPED_TEST(BlockManagerStressTest, MultiWriterCommitBenchmark) {
+  if (!std::is_same<TypeParam, LogBlockManager>::value) {
+    LOG(INFO) << "Only the log block manager shares containers between writers";
+    return;
+  }
+  OverrideFlagForSlowTests("num_commits_per_writer", "1000");
+  FLAGS_never_fsync = false;
+  scoped_refptr<Counter> disk_syncs =
+      METRIC_block_manager_total_disk_sync.Instantiate(this->metric_entity_);
+
+  const string kData(4096, 'x');
+  for (bool coalesce_syncs : { false, true }) {
+    FLAGS_log_container_coalesce_syncs = coalesce_syncs;
+    const int64_t syncs_before = disk_syncs->value();
+    Stopwatch sw;
+    sw.start();
+    vector<std::thread> threads;
+    for (int i = 0; i < FLAGS_num_writer_threads; i++) {
+      threads.emplace_back([&]() {
+        for (int j = 0; j < FLAGS_num_commits_per_writer; j++) {
+          unique_ptr<WritableBlock> block;
+          CHECK_OK(this->bm_->CreateBlock(CreateBlockOptions({ this->test_tablet_name_ }),
+                                          &block));
+          CHECK_OK(block->Append(kData));
+          CHECK_OK(block->Finalize());
+          unique_ptr<BlockCreationTransaction> transaction =
+              this->bm_->NewCreationTransaction();
+          transaction->AddCreatedBlock(std::move(block));
+          CHECK_OK(transaction->CommitCreatedBlocks());
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    sw.stop();
+
+    const int num_commits = FLAGS_num_writer_threads * FLAGS_num_commits_per_writer;
+    const int64_t syncs = disk_syncs->value() - syncs_before;
+    LOG(INFO) << Substitute("$0 writers committed $1 blocks $2 sync coalescing in $3s "
+                            "($4 commits/s), with $5 disk syncs ($6 per commit)",
+                            FLAGS_num_writer_threads, num_commits,
+                            coalesce_syncs ? "with" : "without",
+                            sw.elapsed().wall_seconds(),
+                            num_commits / sw.elapsed().wall_seconds(),
+                            syncs, static_cast<double>(syncs) / num_commits);
+  }
+}
+
 } // namespace fs
 } // namespace kudu
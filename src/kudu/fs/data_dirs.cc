@@ -1160,5 +1160,218 @@ vector<string> DataDirManager::GetDataDirs() const {
   return JoinPathSegmentsV(GetDataRoots(), kDataDirName);
 }
 
+////////////////////////////////////////////////////////////
+// WalDirManager
+////////////////////////////////////////////////////////////
+
+const char* const WalDirManager::kPlacementFileName = "placement";
+
+WalDirManager::WalDirManager(Env* env, vector<string> wal_dirs, WalPlacementMode mode)
+    : env_(env),
+      wal_dirs_(std::move(wal_dirs)),
+      mode_(mode),
+      num_logs_by_dir_(wal_dirs_.size(), 0) {
+  CHECK(!wal_dirs_.empty());
+}
+
+Status WalDirManager::Load() {
+  unordered_map<string, vector<int>> dirs_by_tablet;
+  vector<int> num_logs_by_dir(wal_dirs_.size(), 0);
+  for (int i = 0; i < wal_dirs_.size(); i++) {
+    vector<string> children;
+    RETURN_NOT_OK_PREPEND(env_->GetChildren(wal_dirs_[i], &children),
+                          Substitute("could not list WAL directory $0", wal_dirs_[i]));
+    for (const string& child : children) {
+      // Tablet ids have no dots, unlike recovery directories, temporary files
+      // and the like.
+      if (child.find('.') != string::npos) {
+        continue;
+      }
+      const string dir = JoinPathSegments(wal_dirs_[i], child);
+      bool is_dir;
+      RETURN_NOT_OK_PREPEND(env_->IsDirectory(dir, &is_dir),
+                            Substitute("could not stat $0", dir));
+      if (!is_dir) {
+        continue;
+      }
+      num_logs_by_dir[i]++;
+
+      const string placement_path = JoinPathSegments(dir, kPlacementFileName);
+      if (!env_->FileExists(placement_path)) {
+        continue;
+      }
+      WalPlacementPB pb;
+      RETURN_NOT_OK_PREPEND(pb_util::ReadPBContainerFromPath(env_, placement_path, &pb),
+                            Substitute("could not read WAL placement of tablet $0", child));
+      vector<int> indexes;
+      for (const string& d : pb.dirs()) {
+        auto it = std::find(wal_dirs_.begin(), wal_dirs_.end(), d);
+        if (it == wal_dirs_.end()) {
+          return Status::IllegalState(Substitute(
+              "WAL of tablet $0 spans directory $1, which is not configured", child, d));
+        }
+        indexes.push_back(std::distance(wal_dirs_.begin(), it));
+      }
+      if (indexes.empty() || indexes[0] != i) {
+        return Status::Corruption(Substitute(
+            "WAL placement of tablet $0 in $1 does not start with its home directory",
+            child, wal_dirs_[i]));
+      }
+      if (!InsertIfNotPresent(&dirs_by_tablet, child, std::move(indexes))) {
+        return Status::Corruption(Substitute(
+            "tablet $0 has WAL placements in several directories", child));
+      }
+    }
+  }
+
+  std::lock_guard<simple_spinlock> l(lock_);
+  dirs_by_tablet_.swap(dirs_by_tablet);
+  num_logs_by_dir_.swap(num_logs_by_dir);
+  return Status::OK();
+}
+
+Status WalDirManager::CreateTabletDirs(const string& tablet_id) {
+  // Logs without a placement record are in the first directory.
+  const bool in_first_dir = env_->FileExists(JoinPathSegments(wal_dirs_[0], tablet_id));
+  vector<int> indexes;
+  bool new_placement = false;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    if (ContainsKey(dirs_by_tablet_, tablet_id) || in_first_dir) {
+      indexes = GetTabletDirIndexesUnlocked(tablet_id);
+    } else if (wal_dirs_.size() == 1) {
+      indexes = { 0 };
+      num_logs_by_dir_[0]++;
+    } else {
+      indexes = PlaceNewTabletUnlocked();
+      InsertOrDie(&dirs_by_tablet_, tablet_id, indexes);
+      for (int idx : indexes) {
+        num_logs_by_dir_[idx]++;
+      }
+      new_placement = true;
+    }
+  }
+  auto unplace = MakeScopedCleanup([&]() {
+    std::lock_guard<simple_spinlock> l(lock_);
+    dirs_by_tablet_.erase(tablet_id);
+    for (int idx : indexes) {
+      num_logs_by_dir_[idx]--;
+    }
+  });
+  if (!new_placement) {
+    unplace.cancel();
+  }
+
+  // The placement record is written right after the home directory is
+  // created, and before the other directories are: any directory missing
+  // after a crash is created when the log is opened again. A crash before the
+  // record is written leaves an empty home directory, whose log is placed
+  // again from scratch.
+  vector<string> created_dirs;
+  for (int i = 0; i < indexes.size(); i++) {
+    const string dir = JoinPathSegments(wal_dirs_[indexes[i]], tablet_id);
+    bool created;
+    RETURN_NOT_OK_PREPEND(env_util::CreateDirIfMissing(env_, dir, &created),
+                          Substitute("could not create WAL directory $0", dir));
+    if (created) {
+      created_dirs.emplace_back(dir);
+    }
+    if (i == 0 && new_placement) {
+      WalPlacementPB pb;
+      for (int idx : indexes) {
+        pb.add_dirs(wal_dirs_[idx]);
+      }
+      RETURN_NOT_OK_PREPEND(pb_util::WritePBContainerToPath(
+          env_, JoinPathSegments(dir, kPlacementFileName), pb,
+          pb_util::OVERWRITE, pb_util::SYNC),
+                            Substitute("could not write WAL placement of tablet $0", tablet_id));
+    }
+  }
+  for (const string& dir : created_dirs) {
+    RETURN_NOT_OK_PREPEND(env_->SyncDir(DirName(dir)),
+                          Substitute("could not sync the parent of $0", dir));
+  }
+  unplace.cancel();
+  return Status::OK();
+}
+
+Status WalDirManager::DeleteTabletDirs(const string& tablet_id) {
+  vector<int> indexes;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    indexes = GetTabletDirIndexesUnlocked(tablet_id);
+  }
+  // As long as the home directory is there, so is the placement record, so
+  // that a failed deletion can be retried.
+  bool deleted_home = false;
+  for (int i = indexes.size() - 1; i >= 0; i--) {
+    const string dir = JoinPathSegments(wal_dirs_[indexes[i]], tablet_id);
+    if (!env_->FileExists(dir)) {
+      continue;
+    }
+    RETURN_NOT_OK_PREPEND(env_->DeleteRecursively(dir),
+                          Substitute("could not delete WAL directory $0", dir));
+    deleted_home = i == 0;
+  }
+
+  std::lock_guard<simple_spinlock> l(lock_);
+  if (dirs_by_tablet_.erase(tablet_id) > 0) {
+    for (int idx : indexes) {
+      num_logs_by_dir_[idx]--;
+    }
+  } else if (deleted_home) {
+    num_logs_by_dir_[0]--;
+  }
+  return Status::OK();
+}
+
+string WalDirManager::GetTabletHomeDir(const string& tablet_id) const {
+  std::lock_guard<simple_spinlock> l(lock_);
+  return JoinPathSegments(wal_dirs_[GetTabletDirIndexesUnlocked(tablet_id)[0]], tablet_id);
+}
+
+vector<string> WalDirManager::GetTabletDirs(const string& tablet_id) const {
+  vector<int> indexes;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    indexes = GetTabletDirIndexesUnlocked(tablet_id);
+  }
+  vector<string> dirs;
+  for (int idx : indexes) {
+    dirs.emplace_back(JoinPathSegments(wal_dirs_[idx], tablet_id));
+  }
+  return dirs;
+}
+
+string WalDirManager::GetSegmentDir(const string& tablet_id, uint64_t sequence_number) const {
+  std::lock_guard<simple_spinlock> l(lock_);
+  const vector<int> indexes = GetTabletDirIndexesUnlocked(tablet_id);
+  return JoinPathSegments(wal_dirs_[indexes[sequence_number % indexes.size()]], tablet_id);
+}
+
+vector<int> WalDirManager::GetTabletDirIndexesUnlocked(const string& tablet_id) const {
+  DCHECK(lock_.is_locked());
+  const vector<int>* indexes = FindOrNull(dirs_by_tablet_, tablet_id);
+  return indexes ? *indexes : vector<int>({ 0 });
+}
+
+vector<int> WalDirManager::PlaceNewTabletUnlocked() const {
+  DCHECK(lock_.is_locked());
+  // Home the log in the directory with the fewest logs, the first one on
+  // ties. Striped logs span all the directories, starting with their home,
+  // so that the logs of different tablets roll onto different devices.
+  const int home = std::distance(
+      num_logs_by_dir_.begin(),
+      std::min_element(num_logs_by_dir_.begin(), num_logs_by_dir_.end()));
+  if (mode_ == WalPlacementMode::TABLET) {
+    return { home };
+  }
+  vector<int> indexes;
+  for (int i = 0; i < wal_dirs_.size(); i++) {
+    indexes.push_back((home + i) % wal_dirs_.size());
+  }
+  return indexes;
+}
+
 } // namespace fs
 } // namespace kudu
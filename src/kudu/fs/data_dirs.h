@@ -519,5 +519,88 @@ class DataDirManager {
   DISALLOW_COPY_AND_ASSIGN(DataDirManager);
 };
 
+// How the write-ahead logs of tablets are placed across the WAL directories.
+enum class WalPlacementMode {
+  // All the segments of a tablet's log are in the same directory, and the
+  // logs of the tablets are spread across the directories.
+  TABLET,
+
+  // The segments of each tablet's log are spread round-robin across all the
+  // directories, so that a single busy log is written to several devices.
+  // Only one segment is written to at a time, but a full segment is synced
+  // and closed while the next one is set up on the next device.
+  STRIPE,
+};
+
+// Places the write-ahead logs of tablets across the WAL directories of the
+// server (the "wals" directories of all of the WAL roots).
+//
+// A tablet's log has a home directory, <wal dir>/<tablet id>, and, when
+// striped, a directory of the same name in every other WAL directory. The
+// directories a log spans are recorded in a WalPlacementPB in its home
+// directory, so that logs keep their placement when the configured mode or
+// directories change, and so that all of their segments are found when the
+// server restarts. Logs without a placement record are entirely in the first
+// WAL directory, which is also the layout of servers with a single WAL
+// directory.
+//
+// This class is thread-safe.
+class WalDirManager {
+ public:
+  // The name of the placement record in the home directory of a log. It
+  // doesn't start with the WAL segment prefix, so the log reader skips it.
+  static const char* const kPlacementFileName;
+
+  // 'wal_dirs' must not be empty. Nothing is read from disk until Load().
+  WalDirManager(Env* env, std::vector<std::string> wal_dirs, WalPlacementMode mode);
+
+  // Loads the placements of the logs in the WAL directories.
+  Status Load();
+
+  // Places the log of 'tablet_id', unless it's already placed, and creates its
+  // directories. New logs are homed in the WAL directory holding the fewest
+  // logs.
+  Status CreateTabletDirs(const std::string& tablet_id);
+
+  // Deletes all the directories of the log of 'tablet_id', the home directory
+  // last, and forgets its placement.
+  Status DeleteTabletDirs(const std::string& tablet_id);
+
+  // Returns the home directory of the log of 'tablet_id'.
+  std::string GetTabletHomeDir(const std::string& tablet_id) const;
+
+  // Returns all the directories of the log of 'tablet_id', home first.
+  std::vector<std::string> GetTabletDirs(const std::string& tablet_id) const;
+
+  // Returns the directory of the segment 'sequence_number' of the log of
+  // 'tablet_id'.
+  std::string GetSegmentDir(const std::string& tablet_id, uint64_t sequence_number) const;
+
+  const std::vector<std::string>& wal_dirs() const { return wal_dirs_; }
+
+ private:
+  // Returns the indexes into 'wal_dirs_' of the directories of the log of
+  // 'tablet_id', home first.
+  std::vector<int> GetTabletDirIndexesUnlocked(const std::string& tablet_id) const;
+
+  // Picks the directories of a new log, home first.
+  std::vector<int> PlaceNewTabletUnlocked() const;
+
+  Env* env_;
+  const std::vector<std::string> wal_dirs_;
+  const WalPlacementMode mode_;
+
+  // Protects the maps below.
+  mutable simple_spinlock lock_;
+
+  // The directories of each log with a placement record, home first.
+  std::unordered_map<std::string, std::vector<int>> dirs_by_tablet_;
+
+  // The number of logs with a directory in each of 'wal_dirs_'.
+  std::vector<int> num_logs_by_dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(WalDirManager);
+};
+
 } // namespace fs
 } // namespace kudu
@@ -353,6 +353,64 @@ TEST_F(FsManagerTestBase, TestIsolatedMetadataDir) {
   ASSERT_TRUE(s.IsNotFound()) << s.ToString();
 }
 
+// WALs are spread across the WAL roots, and found where they were placed when
+// the file system is reopened, whatever the placement mode then.
+TEST_F(FsManagerTestBase, TestMultipleWalRoots) {
+  FsManagerOpts opts;
+  opts.wal_root = GetTestPath("wal0");
+  opts.extra_wal_roots = { GetTestPath("wal1") };
+  opts.data_roots = { GetTestPath("data") };
+  opts.wal_placement = fs::WalPlacementMode::TABLET;
+  ReinitFsManagerWithOpts(opts);
+  ASSERT_OK(fs_manager()->CreateInitialFileSystemLayout());
+  ASSERT_OK(fs_manager()->Open());
+  const vector<string> wals_dirs = fs_manager()->GetWalsRootDirs();
+  ASSERT_EQ(2, wals_dirs.size());
+
+  // Whole logs are placed in the least loaded root.
+  for (int i = 0; i < 4; i++) {
+    const string tablet_id = Substitute("tablet-$0", i);
+    ASSERT_OK(fs_manager()->CreateTabletWalDirs(tablet_id));
+    const string wal_dir = JoinPathSegments(wals_dirs[i % 2], tablet_id);
+    ASSERT_EQ(wal_dir, fs_manager()->GetTabletWalDir(tablet_id));
+    ASSERT_EQ(vector<string>({ wal_dir }), fs_manager()->GetTabletWalDirs(tablet_id));
+    ASSERT_EQ(wal_dir, DirName(fs_manager()->GetWalSegmentFileName(tablet_id, 2)));
+  }
+
+  // Existing logs keep their placement when the mode changes.
+  opts.wal_placement = fs::WalPlacementMode::STRIPE;
+  ReinitFsManagerWithOpts(opts);
+  ASSERT_OK(fs_manager()->Open());
+  ASSERT_EQ(JoinPathSegments(wals_dirs[1], "tablet-1"),
+            fs_manager()->GetTabletWalDir("tablet-1"));
+  ASSERT_EQ(1, fs_manager()->GetTabletWalDirs("tablet-1").size());
+
+  // Striped logs roll their segments onto each root in turn.
+  const string kStriped = "striped";
+  ASSERT_OK(fs_manager()->CreateTabletWalDirs(kStriped));
+  const vector<string> striped_dirs = fs_manager()->GetTabletWalDirs(kStriped);
+  ASSERT_EQ(2, striped_dirs.size());
+  ASSERT_NE(DirName(fs_manager()->GetWalSegmentFileName(kStriped, 1)),
+            DirName(fs_manager()->GetWalSegmentFileName(kStriped, 2)));
+  ASSERT_EQ(DirName(fs_manager()->GetWalSegmentFileName(kStriped, 1)),
+            DirName(fs_manager()->GetWalSegmentFileName(kStriped, 3)));
+  for (const string& dir : striped_dirs) {
+    ASSERT_TRUE(env_->FileExists(dir));
+  }
+
+  opts.wal_placement = fs::WalPlacementMode::TABLET;
+  ReinitFsManagerWithOpts(opts);
+  ASSERT_OK(fs_manager()->Open());
+  ASSERT_EQ(striped_dirs, fs_manager()->GetTabletWalDirs(kStriped));
+
+  // Deleting a striped log deletes all of its directories.
+  ASSERT_OK(fs_manager()->DeleteTabletWalDirs(kStriped));
+  for (const string& dir : striped_dirs) {
+    ASSERT_FALSE(env_->FileExists(dir));
+  }
+  ASSERT_EQ(1, fs_manager()->GetTabletWalDirs(kStriped).size());
+}
+
 Status CountTmpFiles(Env* env, const string& path, const vector<string>& children,
                      unordered_set<string>* checked_dirs, int* count) {
   int n = 0;
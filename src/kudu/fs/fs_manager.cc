@@ -17,6 +17,7 @@
 
 #include "kudu/fs/fs_manager.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <ctime>
 #include <iostream>
@@ -86,6 +87,24 @@ DEFINE_string(fs_wal_dir, "",
               "Directory with write-ahead logs. If this is not specified, the "
               "program will not start. May be the same as fs_data_dirs");
 TAG_FLAG(fs_wal_dir, stable);
+DEFINE_string(fs_wal_dirs, "",
+              "Comma-separated list of additional directories with write-ahead "
+              "logs, preferably on other devices than fs_wal_dir. WALs are "
+              "spread across fs_wal_dir and these directories according to "
+              "fs_wal_placement.");
+TAG_FLAG(fs_wal_dirs, experimental);
+DEFINE_string(fs_wal_placement, "tablet",
+              "How the write-ahead logs of new tablets are spread across "
+              "fs_wal_dir and fs_wal_dirs. 'tablet' places each tablet's "
+              "log entirely in the directory holding the fewest logs. "
+              "'stripe' spreads the segments of each tablet's log round-robin "
+              "across all the directories, for servers with a few very busy "
+              "tablets. Existing logs keep their placement.");
+TAG_FLAG(fs_wal_placement, experimental);
+static bool ValidateWalPlacement(const char* /*flagname*/, const std::string& value) {
+  return value == "tablet" || value == "stripe";
+}
+DEFINE_validator(fs_wal_placement, &ValidateWalPlacement);
 DEFINE_string(fs_data_dirs, "",
               "Comma-separated list of directories with data blocks. If this "
               "is not specified, fs_wal_dir will be used as the sole data "
@@ -111,6 +130,8 @@ using kudu::fs::FileBlockManager;
 using kudu::fs::FsReport;
 using kudu::fs::LogBlockManager;
 using kudu::fs::ReadableBlock;
+using kudu::fs::WalDirManager;
+using kudu::fs::WalPlacementMode;
 using kudu::fs::WritableBlock;
 using kudu::pb_util::SecureDebugString;
 using std::ostream;
@@ -137,15 +158,19 @@ const char *FsManager::kConsensusMetadataDirName = "consensus-meta";
 
 FsManagerOpts::FsManagerOpts()
   : wal_root(FLAGS_fs_wal_dir),
+    wal_placement(FLAGS_fs_wal_placement == "stripe" ? WalPlacementMode::STRIPE
+                                                     : WalPlacementMode::TABLET),
     metadata_root(FLAGS_fs_metadata_dir),
     block_manager_type(FLAGS_block_manager),
     read_only(false),
     consistency_check(ConsistencyCheckBehavior::ENFORCE_CONSISTENCY) {
+  extra_wal_roots = strings::Split(FLAGS_fs_wal_dirs, ",", strings::SkipEmpty());
   data_roots = strings::Split(FLAGS_fs_data_dirs, ",", strings::SkipEmpty());
 }
 
 FsManagerOpts::FsManagerOpts(const string& root)
   : wal_root(root),
+    wal_placement(WalPlacementMode::TABLET),
     data_roots({ root }),
     block_manager_type(FLAGS_block_manager),
     read_only(false),
@@ -188,6 +213,7 @@ Status FsManager::Init() {
 
   // Deduplicate all of the roots.
   unordered_set<string> all_roots = { opts_.wal_root };
+  all_roots.insert(opts_.extra_wal_roots.begin(), opts_.extra_wal_roots.end());
   all_roots.insert(opts_.data_roots.begin(), opts_.data_roots.end());
 
   // If the metadata root not set, Kudu will either use the wal root or the
@@ -252,6 +278,20 @@ Status FsManager::Init() {
   if (InsertIfNotPresent(&unique_roots, canonicalized_wal_fs_root_.path)) {
     canonicalized_all_fs_roots_.emplace_back(canonicalized_wal_fs_root_);
   }
+  unordered_set<string> unique_wal_roots;
+  for (const string& wal_fs_root : opts_.extra_wal_roots) {
+    const auto& root = FindOrDie(canonicalized_roots, wal_fs_root);
+    if (root.path == canonicalized_wal_fs_root_.path ||
+        !InsertIfNotPresent(&unique_wal_roots, root.path)) {
+      continue;
+    }
+    canonicalized_wal_fs_roots_.emplace_back(root);
+    if (InsertIfNotPresent(&unique_roots, root.path)) {
+      canonicalized_all_fs_roots_.emplace_back(root);
+    }
+  }
+  canonicalized_wal_fs_roots_.insert(canonicalized_wal_fs_roots_.begin(),
+                                     canonicalized_wal_fs_root_);
 
   // Decide on a metadata root to use.
   if (opts_.metadata_root.empty()) {
@@ -276,17 +316,22 @@ Status FsManager::Init() {
     }
   }
 
-  // The server cannot start if the WAL root or metadata root failed to
+  // The server cannot start if a WAL root or the metadata root failed to
   // canonicalize.
-  const string& wal_root = canonicalized_wal_fs_root_.path;
-  RETURN_NOT_OK_PREPEND(canonicalized_wal_fs_root_.status,
-      Substitute("Write-ahead log directory $0 failed to canonicalize", wal_root));
+  vector<string> wals_dirs;
+  for (const auto& root : canonicalized_wal_fs_roots_) {
+    RETURN_NOT_OK_PREPEND(root.status,
+        Substitute("Write-ahead log directory $0 failed to canonicalize", root.path));
+    wals_dirs.emplace_back(JoinPathSegments(root.path, kWalDirName));
+  }
+  wal_dir_manager_.reset(new WalDirManager(env_, std::move(wals_dirs), opts_.wal_placement));
   const string& meta_root = canonicalized_metadata_fs_root_.path;
   RETURN_NOT_OK_PREPEND(canonicalized_metadata_fs_root_.status,
       Substitute("Metadata directory $0 failed to canonicalize", meta_root));
 
   if (VLOG_IS_ON(1)) {
-    VLOG(1) << "WAL root: " << canonicalized_wal_fs_root_.path;
+    VLOG(1) << "WAL roots: " <<
+      JoinStrings(DataDirManager::GetRootNames(canonicalized_wal_fs_roots_), ",");
     VLOG(1) << "Metadata root: " << canonicalized_metadata_fs_root_.path;
     VLOG(1) << "Data roots: " <<
       JoinStrings(DataDirManager::GetRootNames(canonicalized_data_fs_roots_), ",");
@@ -353,10 +398,21 @@ Status FsManager::Open(FsReport* report) {
     return Status::NotFound("could not find a healthy instance file");
   }
 
-  // Ensure all of the ancillary directories exist.
-  vector<string> ancillary_dirs = { GetWalsRootDir(),
-                                    GetTabletMetadataDir(),
+  // Ensure all of the ancillary directories exist. The WAL directories of
+  // missing roots are created along with the roots, if desired.
+  vector<string> ancillary_dirs = { GetTabletMetadataDir(),
                                     GetConsensusMetadataDir() };
+  vector<string> missing_wals_dirs;
+  for (const auto& root : canonicalized_wal_fs_roots_) {
+    const string wals_dir = JoinPathSegments(root.path, kWalDirName);
+    if (opts_.consistency_check == ConsistencyCheckBehavior::UPDATE_ON_DISK &&
+        std::any_of(missing_roots.begin(), missing_roots.end(),
+                    [&](const CanonicalizedRootAndStatus& r) { return r.path == root.path; })) {
+      missing_wals_dirs.emplace_back(wals_dir);
+    } else {
+      ancillary_dirs.emplace_back(wals_dir);
+    }
+  }
   for (const auto& d : ancillary_dirs) {
     bool is_dir;
     RETURN_NOT_OK_PREPEND(env_->IsDirectory(d, &is_dir),
@@ -387,8 +443,19 @@ Status FsManager::Open(FsReport* report) {
     RETURN_NOT_OK_PREPEND(CreateFileSystemRoots(
         missing_roots, *metadata_, &created_dirs, &created_files),
                           "unable to create missing filesystem roots");
+    for (const string& dir : missing_wals_dirs) {
+      bool created;
+      RETURN_NOT_OK_PREPEND(env_util::CreateDirIfMissing(env_, dir, &created),
+                            Substitute("Unable to create directory $0", dir));
+      if (created) {
+        created_dirs.emplace_back(dir);
+      }
+    }
   }
 
+  // Find where the WALs of the existing tablets are.
+  RETURN_NOT_OK_PREPEND(wal_dir_manager_->Load(), "could not load WAL placements");
+
   // Open the directory manager if it has not been opened already.
   if (!dd_manager_) {
     DataDirManagerOptions dm_opts;
@@ -482,9 +549,9 @@ Status FsManager::CreateInitialFileSystemLayout(boost::optional<string> uuid) {
                         "unable to create file system roots");
 
   // Create ancillary directories.
-  vector<string> ancillary_dirs = { GetWalsRootDir(),
-                                    GetTabletMetadataDir(),
-                                    GetConsensusMetadataDir() };
+  vector<string> ancillary_dirs = GetWalsRootDirs();
+  ancillary_dirs.emplace_back(GetTabletMetadataDir());
+  ancillary_dirs.emplace_back(GetConsensusMetadataDir());
   for (const string& dir : ancillary_dirs) {
     bool created;
     RETURN_NOT_OK_PREPEND(env_util::CreateDirIfMissing(env_, dir, &created),
@@ -668,15 +735,28 @@ string FsManager::GetInstanceMetadataPath(const string& root) const {
   return JoinPathSegments(root, kInstanceMetadataFileName);
 }
 
+Status FsManager::CreateTabletWalDirs(const string& tablet_id) {
+  CHECK(!opts_.read_only);
+  DCHECK(initted_);
+  return wal_dir_manager_->CreateTabletDirs(tablet_id);
+}
+
+Status FsManager::DeleteTabletWalDirs(const string& tablet_id) {
+  CHECK(!opts_.read_only);
+  DCHECK(initted_);
+  return wal_dir_manager_->DeleteTabletDirs(tablet_id);
+}
+
 string FsManager::GetTabletWalRecoveryDir(const string& tablet_id) const {
-  string path = JoinPathSegments(GetWalsRootDir(), tablet_id);
+  string path = GetTabletWalDir(tablet_id);
   StrAppend(&path, kWalsRecoveryDirSuffix);
   return path;
 }
 
 string FsManager::GetWalSegmentFileName(const string& tablet_id,
                                         uint64_t sequence_number) const {
-  return JoinPathSegments(GetTabletWalDir(tablet_id),
+  DCHECK(initted_);
+  return JoinPathSegments(wal_dir_manager_->GetSegmentDir(tablet_id, sequence_number),
                           strings::Substitute("$0-$1",
                                               kWalFileNamePrefix,
                                               StringPrintf("%09" PRIu64, sequence_number)));
@@ -686,9 +766,10 @@ void FsManager::CleanTmpFiles() {
   DCHECK(!opts_.read_only);
   // Temporary files in the Block Manager directories are cleaned during
   // Block Manager startup.
-  for (const auto& s : { GetWalsRootDir(),
-                         GetTabletMetadataDir(),
-                         GetConsensusMetadataDir() }) {
+  vector<string> dirs = GetWalsRootDirs();
+  dirs.emplace_back(GetTabletMetadataDir());
+  dirs.emplace_back(GetConsensusMetadataDir());
+  for (const auto& s : dirs) {
     WARN_NOT_OK(env_util::DeleteTmpFilesRecursively(env_, s),
                 Substitute("Error deleting tmp files in $0", s));
   }
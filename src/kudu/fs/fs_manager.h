@@ -89,6 +89,16 @@ struct FsManagerOpts {
   // The directory root where WALs will be stored. Cannot be empty.
   std::string wal_root;
 
+  // Additional directory roots where WALs will be stored.
+  //
+  // Defaults to the value of FLAGS_fs_wal_dirs.
+  std::vector<std::string> extra_wal_roots;
+
+  // How WALs are placed across 'wal_root' and 'extra_wal_roots'.
+  //
+  // Defaults to the value of FLAGS_fs_wal_placement.
+  fs::WalPlacementMode wal_placement;
+
   // The directory root where data blocks will be stored. If empty, Kudu will
   // use the WAL root.
   std::vector<std::string> data_roots;
@@ -202,10 +212,32 @@ class FsManager {
     return JoinPathSegments(canonicalized_wal_fs_root_.path, kWalDirName);
   }
 
+  // Returns the WAL directories of all the WAL roots, the one of the primary
+  // WAL root first.
+  const std::vector<std::string>& GetWalsRootDirs() const {
+    DCHECK(initted_);
+    return wal_dir_manager_->wal_dirs();
+  }
+
+  // Returns the home WAL directory of 'tablet_id'.
   std::string GetTabletWalDir(const std::string& tablet_id) const {
-    return JoinPathSegments(GetWalsRootDir(), tablet_id);
+    DCHECK(initted_);
+    return wal_dir_manager_->GetTabletHomeDir(tablet_id);
+  }
+
+  // Returns all the WAL directories of 'tablet_id', the home one first.
+  std::vector<std::string> GetTabletWalDirs(const std::string& tablet_id) const {
+    DCHECK(initted_);
+    return wal_dir_manager_->GetTabletDirs(tablet_id);
   }
 
+  // Places the WAL of 'tablet_id' across the WAL roots, unless it's already
+  // placed, and creates its directories.
+  Status CreateTabletWalDirs(const std::string& tablet_id);
+
+  // Deletes all the WAL directories of 'tablet_id'.
+  Status DeleteTabletWalDirs(const std::string& tablet_id);
+
   std::string GetTabletWalRecoveryDir(const std::string& tablet_id) const;
 
   std::string GetWalSegmentFileName(const std::string& tablet_id,
@@ -339,6 +371,7 @@ class FsManager {
   // - The first data root is used as the metadata root.
   // - Common roots in the collections have been deduplicated.
   CanonicalizedRootAndStatus canonicalized_wal_fs_root_;
+  CanonicalizedRootsList canonicalized_wal_fs_roots_;
   CanonicalizedRootAndStatus canonicalized_metadata_fs_root_;
   CanonicalizedRootsList canonicalized_data_fs_roots_;
   CanonicalizedRootsList canonicalized_all_fs_roots_;
@@ -347,6 +380,7 @@ class FsManager {
 
   std::unique_ptr<fs::FsErrorManager> error_manager_;
   std::unique_ptr<fs::DataDirManager> dd_manager_;
+  std::unique_ptr<fs::WalDirManager> wal_dir_manager_;
   std::unique_ptr<fs::BlockManager> block_manager_;
 
   ObjectIdGenerator oid_generator_;
@@ -20,10 +20,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <limits>
 #include <memory>
 #include <ostream>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -53,6 +55,7 @@
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/gutil/strings/util.h"
 #include "kudu/util/atomic.h"
+#include "kudu/util/barrier.h"
 #include "kudu/util/env.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/path_util.h"
@@ -81,6 +84,7 @@ DECLARE_double(log_container_excess_space_before_cleanup_fraction);
 DECLARE_double(log_container_live_metadata_before_compact_ratio);
 DECLARE_int64(block_manager_max_open_files);
 DECLARE_int64(log_container_max_blocks);
+DECLARE_int64(log_container_snapshot_min_replay_bytes);
 DECLARE_string(block_manager_preflush_control);
 DECLARE_string(env_inject_eio_globs);
 DECLARE_uint64(log_container_preallocate_bytes);
@@ -88,11 +92,13 @@ DECLARE_uint64(log_container_max_size);
 
 // Block manager metrics.
 METRIC_DECLARE_counter(block_manager_total_blocks_deleted);
+METRIC_DECLARE_counter(block_manager_total_disk_sync);
 
 // Log block manager metrics.
 METRIC_DECLARE_gauge_uint64(log_block_manager_bytes_under_management);
 METRIC_DECLARE_gauge_uint64(log_block_manager_blocks_under_management);
 METRIC_DECLARE_counter(log_block_manager_holes_punched);
+METRIC_DECLARE_counter(log_block_manager_disk_syncs_coalesced);
 METRIC_DECLARE_gauge_uint64(log_block_manager_containers);
 METRIC_DECLARE_gauge_uint64(log_block_manager_full_containers);
 
@@ -1057,6 +1063,62 @@ TEST_F(LogBlockManagerTest, TestFailMultipleTransactionsPerContainer) {
   }
 }
 
+// Transactions committing blocks to the same container at the same time may
+// share syncs of its files. Either way, each commit is accounted for by one
+// sync or coalesced sync of each of the container's files.
+TEST_F(LogBlockManagerTest, TestConcurrentCommitsShareSyncs) {
+  MetricRegistry registry;
+  scoped_refptr<MetricEntity> entity = METRIC_ENTITY_server.Instantiate(&registry, "test");
+  ASSERT_OK(ReopenBlockManager(entity));
+
+  // Finalizing each block makes its container available again, so all of the
+  // transactions share one container.
+  const int kNumTransactions = 8;
+  vector<unique_ptr<BlockCreationTransaction>> block_transactions;
+  vector<BlockId> block_ids;
+  for (int i = 0; i < kNumTransactions; i++) {
+    unique_ptr<WritableBlock> block;
+    ASSERT_OK(bm_->CreateBlock(test_block_opts_, &block));
+    ASSERT_OK(block->Append("x"));
+    ASSERT_OK(block->Finalize());
+    block_ids.emplace_back(block->id());
+    block_transactions.emplace_back(bm_->NewCreationTransaction());
+    block_transactions.back()->AddCreatedBlock(std::move(block));
+  }
+  ASSERT_EQ(1, bm_->all_containers_by_name_.size());
+
+  Barrier barrier(kNumTransactions);
+  vector<Status> statuses(kNumTransactions);
+  vector<std::thread> threads;
+  for (int i = 0; i < kNumTransactions; i++) {
+    threads.emplace_back([&, i]() {
+      barrier.Wait();
+      statuses[i] = block_transactions[i]->CommitCreatedBlocks();
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (const auto& s : statuses) {
+    ASSERT_OK(s);
+  }
+
+  // Two file syncs per commit, plus one sync of the data directory where the
+  // container was created.
+  const int64_t syncs = METRIC_block_manager_total_disk_sync.Instantiate(entity)->value();
+  const int64_t coalesced =
+      METRIC_log_block_manager_disk_syncs_coalesced.Instantiate(entity)->value();
+  LOG(INFO) << Substitute("$0 syncs, $1 coalesced", syncs, coalesced);
+  ASSERT_EQ(2 * kNumTransactions + 1, syncs + coalesced);
+
+  // All of the blocks are durable.
+  ASSERT_OK(ReopenBlockManager());
+  for (const auto& id : block_ids) {
+    unique_ptr<ReadableBlock> block;
+    ASSERT_OK(bm_->OpenBlock(id, &block));
+  }
+}
+
 TEST_F(LogBlockManagerTest, TestLookupBlockLimit) {
   int64_t limit_1024 = LogBlockManager::LookupBlockLimit(1024);
   int64_t limit_2048 = LogBlockManager::LookupBlockLimit(2048);
@@ -1546,6 +1608,102 @@ TEST_F(LogBlockManagerTest, TestCompactFullContainerMetadataAtStartup) {
   ASSERT_EQ(last_live_aligned_bytes, report.stats.live_block_bytes_aligned);
 }
 
+// Containers are snapshotted at shutdown, and opened from their snapshot and
+// the metadata records appended after it. Snapshots which don't match their
+// metadata file are ignored.
+TEST_F(LogBlockManagerTest, TestContainerSnapshots) {
+  // Snapshot the container at every shutdown.
+  FLAGS_log_container_snapshot_min_replay_bytes = 0;
+
+  // Each block holds its own id.
+  vector<BlockId> created;
+  set<BlockId> live;
+  auto create_blocks = [&](int num_blocks) {
+    for (int i = 0; i < num_blocks; i++) {
+      unique_ptr<WritableBlock> block;
+      ASSERT_OK(bm_->CreateBlock(test_block_opts_, &block));
+      ASSERT_OK(block->Append(block->id().ToString()));
+      ASSERT_OK(block->Close());
+      created.emplace_back(block->id());
+      live.emplace(block->id());
+    }
+  };
+  auto delete_block = [&](const BlockId& id) {
+    shared_ptr<BlockDeletionTransaction> deletion_transaction =
+        bm_->NewDeletionTransaction();
+    deletion_transaction->AddDeletedBlock(id);
+    vector<BlockId> deleted;
+    ASSERT_OK(deletion_transaction->CommitDeletedBlocks(&deleted));
+    live.erase(id);
+  };
+  auto reopen_and_check = [&](bool expect_empty_report) {
+    FsReport report;
+    ASSERT_OK(ReopenBlockManager(nullptr, &report));
+    if (expect_empty_report) {
+      NO_FATALS(AssertEmptyReport(report));
+    }
+    vector<BlockId> ids;
+    ASSERT_OK(bm_->GetAllBlockIds(&ids));
+    ASSERT_EQ(live, set<BlockId>(ids.begin(), ids.end()));
+    for (const auto& id : ids) {
+      unique_ptr<ReadableBlock> block;
+      ASSERT_OK(bm_->OpenBlock(id, &block));
+      string expected = id.ToString();
+      uint8_t scratch[expected.size()];
+      Slice data(scratch, expected.size());
+      ASSERT_OK(block->Read(0, data));
+      ASSERT_EQ(expected, data.ToString());
+    }
+  };
+
+  NO_FATALS(create_blocks(10));
+  for (int i = 0; i < 3; i++) {
+    NO_FATALS(delete_block(created[i]));
+  }
+  NO_FATALS(reopen_and_check(true));
+
+  string container;
+  NO_FATALS(GetOnlyContainer(&container));
+  const string snapshot_path = container + LogBlockManager::kContainerSnapshotFileSuffix;
+  BlockContainerSnapshotPB snapshot;
+  ASSERT_OK(pb_util::ReadPBContainerFromPath(env_, snapshot_path, &snapshot));
+  ASSERT_EQ(7, snapshot.block_ids_size());
+  ASSERT_EQ(10, snapshot.total_blocks());
+
+  // Stop snapshotting, and change the container: the records appended after
+  // the snapshot are replayed on top of it, whether they create new blocks or
+  // delete blocks from the snapshot.
+  FLAGS_log_container_snapshot_min_replay_bytes = std::numeric_limits<int64_t>::max();
+  NO_FATALS(create_blocks(2));
+  NO_FATALS(delete_block(created[5]));
+  NO_FATALS(reopen_and_check(true));
+  BlockContainerSnapshotPB same_snapshot;
+  ASSERT_OK(pb_util::ReadPBContainerFromPath(env_, snapshot_path, &same_snapshot));
+  ASSERT_EQ(snapshot.metadata_length(), same_snapshot.metadata_length());
+
+  // A snapshot which doesn't end on the same record as the metadata file's
+  // prefix is ignored.
+  snapshot.set_metadata_length(snapshot.metadata_length() + 1);
+  ASSERT_OK(pb_util::WritePBContainerToPath(env_, snapshot_path, snapshot,
+                                            pb_util::OVERWRITE, pb_util::NO_SYNC));
+  NO_FATALS(reopen_and_check(true));
+
+  // So is a corrupt one.
+  ASSERT_OK(WriteStringToFile(env_, "not a snapshot", snapshot_path));
+  NO_FATALS(reopen_and_check(true));
+
+  // Compacting the metadata file of the container, once full, replaces the
+  // snapshot. Full containers may report excess space.
+  FLAGS_log_container_snapshot_min_replay_bytes = 0;
+  FLAGS_log_container_live_metadata_before_compact_ratio = 0.99;
+  FLAGS_log_container_max_blocks = created.size();
+  NO_FATALS(reopen_and_check(false));
+  ASSERT_OK(pb_util::ReadPBContainerFromPath(env_, snapshot_path, &snapshot));
+  ASSERT_EQ(live.size(), snapshot.block_ids_size());
+  ASSERT_EQ(live.size(), snapshot.total_blocks());
+  NO_FATALS(reopen_and_check(false));
+}
+
 // Regression test for a bug in which, after a metadata file was compacted,
 // we would not properly handle appending to the new (post-compaction) metadata.
 //
@@ -18,9 +18,11 @@
 #include "kudu/fs/log_block_manager.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <errno.h>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -30,6 +32,7 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <boost/optional/optional.hpp>
@@ -47,6 +50,7 @@
 #include "kudu/gutil/bind_helpers.h"
 #include "kudu/gutil/callback.h"
 #include "kudu/gutil/casts.h"
+#include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/map-util.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/stl_util.h"
@@ -65,6 +69,7 @@
 #include "kudu/util/malloc.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
+#include "kudu/util/mutex.h"
 #include "kudu/util/path_util.h"
 #include "kudu/util/pb_util.h"
 #include "kudu/util/random.h"
@@ -72,7 +77,9 @@
 #include "kudu/util/scoped_cleanup.h"
 #include "kudu/util/slice.h"
 #include "kudu/util/sorted_disjoint_interval_list.h"
+#include "kudu/util/stopwatch.h"
 #include "kudu/util/test_util_prod.h"
+#include "kudu/util/threadpool.h"
 #include "kudu/util/trace.h"
 
 DECLARE_bool(enable_data_block_fsync);
@@ -107,6 +114,26 @@ DEFINE_double(log_container_live_metadata_before_compact_ratio, 0.50,
               "the container's metadata file will be compacted at startup.");
 TAG_FLAG(log_container_live_metadata_before_compact_ratio, experimental);
 
+DEFINE_int64(log_container_snapshot_min_replay_bytes, 64 * 1024,
+             "Number of bytes appended to a log container's metadata file "
+             "since its last snapshot beyond which a new snapshot of its live "
+             "blocks is written at shutdown. At startup, only the metadata "
+             "appended after a container's snapshot is replayed. Use -1 to "
+             "disable container snapshots.");
+TAG_FLAG(log_container_snapshot_min_replay_bytes, experimental);
+
+DEFINE_int32(log_block_manager_open_threads_per_data_dir, 4,
+             "Number of threads per data directory used to open log "
+             "containers when the block manager is opened.");
+TAG_FLAG(log_block_manager_open_threads_per_data_dir, advanced);
+
+DEFINE_bool(log_container_coalesce_syncs, true,
+            "Whether concurrent syncs of the same log container file are "
+            "coalesced. If true, transactions committing blocks to the same "
+            "container at the same time share syncs of its data and metadata "
+            "files rather than each syncing them.");
+TAG_FLAG(log_container_coalesce_syncs, advanced);
+
 DEFINE_bool(log_block_manager_test_hole_punching, true,
             "Ensure hole punching is supported by the underlying filesystem");
 TAG_FLAG(log_block_manager_test_hole_punching, advanced);
@@ -137,6 +164,13 @@ METRIC_DEFINE_counter(server, log_block_manager_holes_punched,
                       kudu::MetricUnit::kHoles,
                       "Number of holes punched since service start");
 
+METRIC_DEFINE_counter(server, log_block_manager_disk_syncs_coalesced,
+                      "Number of Disk Syncs Coalesced",
+                      kudu::MetricUnit::kUnits,
+                      "Number of syncs of log container files skipped since "
+                      "service start because a concurrent sync of the same "
+                      "file covered them");
+
 namespace kudu {
 
 namespace fs {
@@ -181,6 +215,7 @@ struct LogBlockManagerMetrics {
   scoped_refptr<AtomicGauge<uint64_t>> full_containers;
 
   scoped_refptr<Counter> holes_punched;
+  scoped_refptr<Counter> disk_syncs_coalesced;
 };
 
 #define MINIT(x) x(METRIC_log_block_manager_##x.Instantiate(metric_entity))
@@ -191,10 +226,77 @@ LogBlockManagerMetrics::LogBlockManagerMetrics(const scoped_refptr<MetricEntity>
     GINIT(blocks_under_management),
     GINIT(containers),
     GINIT(full_containers),
-    MINIT(holes_punched) {
+    MINIT(holes_punched),
+    MINIT(disk_syncs_coalesced) {
 }
 #undef GINIT
 
+////////////////////////////////////////////////////////////
+// ContainerSyncCoalescer
+////////////////////////////////////////////////////////////
+
+// Coalesces the syncs of a container file requested concurrently, e.g. by
+// transactions committing blocks to the same container.
+//
+// Syncs are serialized. A caller whose writes were made before a sync began
+// shares that sync rather than issuing one of its own: callers arriving while
+// a sync is in progress wait for it, and are then all covered by the next one.
+//
+// Once a sync fails, all later ones fail too: the file's dirty pages may have
+// been dropped, so a later successful sync wouldn't make them durable.
+//
+// This class is thread-safe.
+class ContainerSyncCoalescer {
+ public:
+  ContainerSyncCoalescer()
+      : requested_(0),
+        completed_(0) {
+  }
+
+  // Makes all writes to the file which completed before the call durable,
+  // calling 'sync_fn' to sync the file unless a sync which began after the
+  // call already did. Sets 'coalesced' to whether 'sync_fn' was skipped.
+  Status Sync(const std::function<Status()>& sync_fn, bool* coalesced);
+
+ private:
+  // The number of syncs requested so far. Each caller is numbered in order.
+  std::atomic<uint64_t> requested_;
+
+  // Held while syncing.
+  Mutex lock_;
+
+  // Callers numbered up to this one are covered by a completed sync.
+  uint64_t completed_;
+
+  // The error of the first failed sync, if any.
+  Status error_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContainerSyncCoalescer);
+};
+
+Status ContainerSyncCoalescer::Sync(const std::function<Status()>& sync_fn,
+                                    bool* coalesced) {
+  const uint64_t seq = requested_.fetch_add(1) + 1;
+  std::lock_guard<Mutex> l(lock_);
+  RETURN_NOT_OK(error_);
+  if (completed_ >= seq) {
+    *coalesced = true;
+    return Status::OK();
+  }
+  *coalesced = false;
+
+  // Every caller numbered up to 'target' finished its writes before this
+  // point, so the sync below covers them all.
+  const uint64_t target = requested_.load();
+  Status s = sync_fn();
+  if (!s.ok()) {
+    error_ = s;
+    return s;
+  }
+  completed_ = target;
+  return Status::OK();
+}
+
 ////////////////////////////////////////////////////////////
 // LogBlock (declaration)
 ////////////////////////////////////////////////////////////
@@ -418,12 +520,16 @@ class LogBlockContainer {
   // Synchronize this container's data file with the disk. On success,
   // guarantees that the data is made durable.
   //
+  // Concurrent calls may share a single sync of the file.
+  //
   // TODO(unknown): Add support to synchronize just a range.
   Status SyncData();
 
   // Synchronize this container's metadata file with the disk. On success,
   // guarantees that the metadata is made durable.
   //
+  // Concurrent calls may share a single sync of the file.
+  //
   // TODO(unknown): Add support to synchronize just a range.
   Status SyncMetadata();
 
@@ -449,6 +555,10 @@ class LogBlockContainer {
   // 'dead_blocks'. Live records are written to 'live_block_records'. The
   // greatest block ID seen thus far in the container is written to 'max_block_id'.
   //
+  // If 'use_snapshot' is true and the container has a valid snapshot, the
+  // snapshot is loaded and only the records after it are processed. Blocks
+  // deleted before the snapshot are then not written to 'dead_blocks'.
+  //
   // Returns an error only if there was a problem accessing the container from
   // disk; such errors are fatal and effectively halt processing immediately.
   Status ProcessRecords(
@@ -456,7 +566,18 @@ class LogBlockContainer {
       LogBlockManager::UntrackedBlockMap* live_blocks,
       LogBlockManager::BlockRecordMap* live_block_records,
       std::vector<scoped_refptr<internal::LogBlock>>* dead_blocks,
-      uint64_t* max_block_id);
+      uint64_t* max_block_id,
+      bool use_snapshot);
+
+  // Writes 'snapshot', which lists the container's live blocks and the
+  // number and size of all of its blocks, as the container's snapshot. The
+  // rest of 'snapshot' is filled in here.
+  //
+  // The metadata file is synced first, so that the snapshot never covers
+  // records which aren't durable. The snapshot itself isn't synced: if it's
+  // lost, either an older snapshot (of a shorter prefix of the same metadata
+  // file) or none is found at startup, and more records are replayed.
+  Status WriteSnapshot(BlockContainerSnapshotPB* snapshot);
 
   // Updates internal bookkeeping state to reflect the creation of a block.
   void BlockCreated(const scoped_refptr<LogBlock>& block);
@@ -512,6 +633,8 @@ class LogBlockContainer {
     return next_block_offset() >= FLAGS_log_container_max_size ||
         (max_num_blocks_ && (total_blocks() >= max_num_blocks_));
   }
+  uint64_t metadata_length() const { return metadata_file_->offset(); }
+  uint64_t snapshot_metadata_length() const { return snapshot_metadata_length_; }
   const LogBlockManagerMetrics* metrics() const { return metrics_; }
   DataDir* data_dir() const { return data_dir_; }
   const PathInstanceMetadataPB* instance() const { return data_dir_->instance()->metadata(); }
@@ -552,6 +675,31 @@ class LogBlockContainer {
   // This function is thread unsafe.
   void UpdateNextBlockOffset(int64_t block_offset, int64_t block_length);
 
+  // Loads the container's snapshot into 'live_blocks' and
+  // 'live_block_records', which must be empty, and moves 'pb_reader' past
+  // the metadata records covered by it. 'data_file_size' is updated with the
+  // size of the container's data file, and 'max_block_id' with the largest
+  // block ID in the snapshot.
+  //
+  // A missing or invalid snapshot isn't an error: nothing is loaded, and all
+  // of the records are processed. Returns an error only if there was a
+  // problem accessing the container from disk.
+  Status LoadSnapshot(ReadablePBContainerFile* pb_reader,
+                      LogBlockManager::UntrackedBlockMap* live_blocks,
+                      LogBlockManager::BlockRecordMap* live_block_records,
+                      uint64_t* data_file_size,
+                      uint64_t* max_block_id);
+
+  // Syncs one of the container's files with 'sync_fn' through 'coalescer',
+  // unless coalescing is disabled.
+  Status SyncFile(ContainerSyncCoalescer* coalescer,
+                  const std::function<Status()>& sync_fn);
+
+  // Reads the last few bytes of the first 'length' bytes of the metadata
+  // file into 'tail'. They tell whether a snapshot covering 'length' bytes
+  // matches the metadata file.
+  Status ReadMetadataTail(uint64_t length, string* tail) const;
+
   // The owning block manager. Must outlive the container itself.
   LogBlockManager* const block_manager_;
 
@@ -563,10 +711,18 @@ class LogBlockContainer {
   // Offset up to which we have preallocated bytes.
   int64_t preallocated_offset_ = 0;
 
+  // The length of the prefix of the metadata file covered by the container's
+  // snapshot, or 0 if it has none.
+  uint64_t snapshot_metadata_length_ = 0;
+
   // Opened file handles to the container's files.
   unique_ptr<WritablePBContainerFile> metadata_file_;
   shared_ptr<RWFile> data_file_;
 
+  // Coalesce concurrent syncs of the data and metadata files.
+  ContainerSyncCoalescer data_sync_;
+  ContainerSyncCoalescer metadata_sync_;
+
   // The offset of the next block to be written to the container.
   AtomicInt<int64_t> next_block_offset_;
 
@@ -777,7 +933,8 @@ Status LogBlockContainer::ProcessRecords(
     LogBlockManager::UntrackedBlockMap* live_blocks,
     LogBlockManager::BlockRecordMap* live_block_records,
     vector<scoped_refptr<internal::LogBlock>>* dead_blocks,
-    uint64_t* max_block_id) {
+    uint64_t* max_block_id,
+    bool use_snapshot) {
   string metadata_path = metadata_file_->filename();
   unique_ptr<RandomAccessFile> metadata_reader;
   RETURN_NOT_OK_HANDLE_ERROR(block_manager()->env()->NewRandomAccessFile(
@@ -786,6 +943,10 @@ Status LogBlockContainer::ProcessRecords(
   RETURN_NOT_OK_HANDLE_ERROR(pb_reader.Open());
 
   uint64_t data_file_size = 0;
+  if (use_snapshot) {
+    RETURN_NOT_OK(LoadSnapshot(&pb_reader, live_blocks, live_block_records,
+                               &data_file_size, max_block_id));
+  }
   Status read_status;
   while (true) {
     BlockRecordPB record;
@@ -817,6 +978,134 @@ Status LogBlockContainer::ProcessRecords(
   return read_status;
 }
 
+Status LogBlockContainer::LoadSnapshot(
+    ReadablePBContainerFile* pb_reader,
+    LogBlockManager::UntrackedBlockMap* live_blocks,
+    LogBlockManager::BlockRecordMap* live_block_records,
+    uint64_t* data_file_size,
+    uint64_t* max_block_id) {
+  DCHECK(live_blocks->empty());
+  DCHECK(live_block_records->empty());
+  const string snapshot_path = StrCat(ToString(),
+                                      LogBlockManager::kContainerSnapshotFileSuffix);
+  BlockContainerSnapshotPB snapshot;
+  Status s = pb_util::ReadPBContainerFromPath(block_manager()->env(),
+                                              snapshot_path, &snapshot);
+  if (s.IsNotFound()) {
+    return Status::OK();
+  }
+  if (s.IsDiskFailure()) {
+    HandleError(s);
+    return s;
+  }
+  RETURN_NOT_OK_HANDLE_ERROR(data_file_->Size(data_file_size));
+
+  // Only trust the snapshot if it's consistent with the container's files;
+  // otherwise fall back to processing all of the records.
+  auto invalid_reason = [&]() -> string {
+    if (!s.ok()) {
+      return s.ToString();
+    }
+    if (snapshot.metadata_length() < pb_reader->offset() ||
+        snapshot.metadata_length() > metadata_length()) {
+      return Substitute("it covers $0 bytes of a metadata file of $1 bytes",
+                        snapshot.metadata_length(), metadata_length());
+    }
+    const int num_blocks = snapshot.block_ids_size();
+    if (snapshot.offsets_size() != num_blocks || snapshot.lengths_size() != num_blocks ||
+        snapshot.total_blocks() < num_blocks || snapshot.total_bytes() < 0) {
+      return "its block counts are inconsistent";
+    }
+    for (int i = 0; i < num_blocks; i++) {
+      int64_t offset = snapshot.offsets(i);
+      int64_t length = snapshot.lengths(i);
+      if (offset < 0 || length < 0 ||
+          offset + length > snapshot.next_block_offset() ||
+          offset + length > *data_file_size) {
+        return Substitute("block $0 at offset $1 with length $2 is out of bounds",
+                          snapshot.block_ids(i), offset, length);
+      }
+    }
+    return "";
+  };
+  string reason = invalid_reason();
+  if (reason.empty()) {
+    string tail;
+    RETURN_NOT_OK(ReadMetadataTail(snapshot.metadata_length(), &tail));
+    if (tail != snapshot.metadata_tail()) {
+      reason = "it doesn't match the metadata file";
+    }
+  }
+  if (!reason.empty()) {
+    LOG(WARNING) << Substitute("Ignoring snapshot of container $0: $1", ToString(), reason);
+    return Status::OK();
+  }
+
+  LogBlockManager::UntrackedBlockMap blocks;
+  LogBlockManager::BlockRecordMap records;
+  for (int i = 0; i < snapshot.block_ids_size(); i++) {
+    const BlockId block_id(snapshot.block_ids(i));
+    scoped_refptr<LogBlock> lb(new LogBlock(this, block_id,
+                                            snapshot.offsets(i), snapshot.lengths(i)));
+    if (!InsertIfNotPresent(&blocks, block_id, lb)) {
+      LOG(WARNING) << Substitute("Ignoring snapshot of container $0: block $1 is listed twice",
+                                 ToString(), block_id.ToString());
+      return Status::OK();
+    }
+    // Snapshots don't keep the blocks' creation times. They only matter to
+    // order the records of a compacted metadata file, where the records of
+    // the blocks from the snapshot come first, by offset.
+    BlockRecordPB& record = records[block_id];
+    block_id.CopyToPB(record.mutable_block_id());
+    record.set_op_type(CREATE);
+    record.set_timestamp_us(0);
+    record.set_offset(lb->offset());
+    record.set_length(lb->length());
+  }
+  RETURN_NOT_OK_HANDLE_ERROR(pb_reader->SkipTo(snapshot.metadata_length()));
+
+  for (const auto& e : blocks) {
+    BlockCreated(e.second);
+    *max_block_id = std::max(*max_block_id, e.first.id());
+  }
+  // Deleted blocks count towards the container's totals too.
+  total_blocks_.Store(snapshot.total_blocks());
+  total_bytes_.Store(snapshot.total_bytes());
+  next_block_offset_.StoreMax(snapshot.next_block_offset());
+  live_blocks->swap(blocks);
+  live_block_records->swap(records);
+  snapshot_metadata_length_ = snapshot.metadata_length();
+  VLOG(1) << Substitute("Loaded snapshot of container $0 with $1 live blocks",
+                        ToString(), live_blocks->size());
+  return Status::OK();
+}
+
+Status LogBlockContainer::ReadMetadataTail(uint64_t length, string* tail) const {
+  static const uint64_t kMaxTailLength = 16;
+  unique_ptr<RandomAccessFile> reader;
+  RETURN_NOT_OK_HANDLE_ERROR(block_manager()->env()->NewRandomAccessFile(
+      metadata_file_->filename(), &reader));
+  uint8_t scratch[kMaxTailLength];
+  Slice result(scratch, std::min(length, kMaxTailLength));
+  RETURN_NOT_OK_HANDLE_ERROR(reader->Read(length - result.size(), result));
+  *tail = result.ToString();
+  return Status::OK();
+}
+
+Status LogBlockContainer::WriteSnapshot(BlockContainerSnapshotPB* snapshot) {
+  RETURN_NOT_OK(SyncMetadata());
+  snapshot->set_metadata_length(metadata_length());
+  RETURN_NOT_OK(ReadMetadataTail(snapshot->metadata_length(),
+                                 snapshot->mutable_metadata_tail()));
+  snapshot->set_next_block_offset(next_block_offset());
+  RETURN_NOT_OK_HANDLE_ERROR(pb_util::WritePBContainerToPath(
+      block_manager()->env(),
+      StrCat(ToString(), LogBlockManager::kContainerSnapshotFileSuffix),
+      *snapshot, pb_util::OVERWRITE, pb_util::NO_SYNC));
+  snapshot_metadata_length_ = snapshot->metadata_length();
+  return Status::OK();
+}
+
 Status LogBlockContainer::ProcessRecord(
     BlockRecordPB* record,
     FsReport* report,
@@ -1020,8 +1309,9 @@ Status LogBlockContainer::FlushMetadata() {
 Status LogBlockContainer::SyncData() {
   RETURN_NOT_OK_HANDLE_ERROR(read_only_status());
   if (FLAGS_enable_data_block_fsync) {
-    if (metrics_) metrics_->generic_metrics.total_disk_sync->Increment();
-    RETURN_NOT_OK_HANDLE_ERROR(data_file_->Sync());
+    RETURN_NOT_OK_HANDLE_ERROR(SyncFile(&data_sync_, [this]() {
+      return data_file_->Sync();
+    }));
   }
   return Status::OK();
 }
@@ -1029,8 +1319,26 @@ Status LogBlockContainer::SyncData() {
 Status LogBlockContainer::SyncMetadata() {
   RETURN_NOT_OK_HANDLE_ERROR(read_only_status());
   if (FLAGS_enable_data_block_fsync) {
+    RETURN_NOT_OK_HANDLE_ERROR(SyncFile(&metadata_sync_, [this]() {
+      return metadata_file_->Sync();
+    }));
+  }
+  return Status::OK();
+}
+
+Status LogBlockContainer::SyncFile(ContainerSyncCoalescer* coalescer,
+                                   const std::function<Status()>& sync_fn) {
+  if (!FLAGS_log_container_coalesce_syncs) {
+    if (metrics_) metrics_->generic_metrics.total_disk_sync->Increment();
+    return sync_fn();
+  }
+  bool coalesced;
+  RETURN_NOT_OK(coalescer->Sync([&]() {
     if (metrics_) metrics_->generic_metrics.total_disk_sync->Increment();
-    RETURN_NOT_OK_HANDLE_ERROR(metadata_file_->Sync());
+    return sync_fn();
+  }, &coalesced));
+  if (coalesced && metrics_) {
+    metrics_->disk_syncs_coalesced->Increment();
   }
   return Status::OK();
 }
@@ -1675,6 +1983,7 @@ size_t LogReadableBlock::memory_footprint() const {
 
 const char* LogBlockManager::kContainerMetadataFileSuffix = ".metadata";
 const char* LogBlockManager::kContainerDataFileSuffix = ".data";
+const char* LogBlockManager::kContainerSnapshotFileSuffix = ".snapshot";
 
 // These values were arrived at via experimentation. See commit 4923a74 for
 // more details.
@@ -1722,6 +2031,10 @@ LogBlockManager::LogBlockManager(Env* env,
 }
 
 LogBlockManager::~LogBlockManager() {
+  // Snapshot the containers while their blocks are still around, so that the
+  // next open doesn't need to replay their metadata.
+  WriteContainerSnapshots();
+
   // Release all of the memory accounted by the blocks.
   int64_t mem = 0;
   for (const auto& entry : blocks_by_block_id_) {
@@ -1782,6 +2095,16 @@ Status LogBlockManager::Open(FsReport* report) {
     InsertOrDie(&block_limits_by_data_dir_, dd.get(), limit);
   }
 
+  // The containers of all of the data directories are opened on a shared
+  // pool, while each directory's own thread waits for them and repairs the
+  // directory.
+  gscoped_ptr<ThreadPool> open_pool;
+  RETURN_NOT_OK(ThreadPoolBuilder("lbm-open")
+                .set_max_threads(std::max<int>(
+                    1, FLAGS_log_block_manager_open_threads_per_data_dir *
+                    dd_manager_->data_dirs().size()))
+                .Build(&open_pool));
+
   vector<FsReport> reports(dd_manager_->data_dirs().size());
   vector<Status> statuses(dd_manager_->data_dirs().size());
   int i = -1;
@@ -1800,6 +2123,7 @@ Status LogBlockManager::Open(FsReport* report) {
         Bind(&LogBlockManager::OpenDataDir,
              Unretained(this),
              dd.get(),
+             open_pool.get(),
              &reports[i],
              &statuses[i]));
   }
@@ -2156,256 +2480,335 @@ Status LogBlockManager::RemoveLogBlockUnlocked(const BlockId& block_id,
   return Status::OK();
 }
 
-void LogBlockManager::OpenDataDir(DataDir* dir,
-                                  FsReport* report,
-                                  Status* result_status) {
-  FsReport local_report;
-  local_report.data_dirs.push_back(dir->dir());
+// The outcome of opening a single container.
+struct LogBlockManager::ContainerOpenResult {
+  // Set if the container couldn't be opened. Inconsistencies found in the
+  // container don't fail its open; they're recorded in 'report'.
+  Status status;
 
-  // We are going to perform these checks.
-  //
-  // Note: this isn't necessarily the complete set of FsReport checks; there
-  // may be checks that the LBM cannot perform.
-  local_report.full_container_space_check.emplace();
-  local_report.incomplete_container_check.emplace();
-  local_report.malformed_record_check.emplace();
-  local_report.misaligned_block_check.emplace();
-  local_report.partial_record_check.emplace();
-
-  // Keep track of deleted blocks whose space hasn't been punched; they will
-  // be repunched during repair.
-  vector<scoped_refptr<internal::LogBlock>> need_repunching;
+  // The inconsistencies found in the container, and its stats.
+  FsReport report;
 
-  // Keep track of containers that have nothing but dead blocks; they will be
-  // deleted during repair.
+  // The repairs the container needs, as passed to Repair().
+  vector<scoped_refptr<internal::LogBlock>> need_repunching;
   vector<string> dead_containers;
-
-  // Keep track of containers whose live block ratio is low; their metadata
-  // files will be compacted during repair.
   unordered_map<string, vector<BlockRecordPB>> low_live_block_containers;
+};
 
-  // Find all containers and open them.
-  unordered_set<string> containers_seen;
-  vector<string> children;
-  Status s = env_->GetChildren(dir->dir(), &children);
+namespace {
+
+// Sets up 'report' with the checks performed when opening containers.
+//
+// Note: this isn't necessarily the complete set of FsReport checks; there
+// may be checks that the LBM cannot perform.
+void InitContainerChecks(FsReport* report) {
+  report->full_container_space_check.emplace();
+  report->incomplete_container_check.emplace();
+  report->malformed_record_check.emplace();
+  report->misaligned_block_check.emplace();
+  report->partial_record_check.emplace();
+}
+
+} // anonymous namespace
+
+void LogBlockManager::OpenContainer(DataDir* dir,
+                                    const string& container_name,
+                                    ContainerOpenResult* result) {
+  FsReport& local_report = result->report;
+  InitContainerChecks(&local_report);
+
+  unique_ptr<LogBlockContainer> container;
+  Status s = LogBlockContainer::Open(
+      this, dir, &local_report, container_name, &container);
+  if (s.IsAborted()) {
+    // Skip the container. Open() added a record of it to 'local_report' for us.
+    return;
+  }
   if (!s.ok()) {
-    HANDLE_DISK_FAILURE(s, error_manager_->RunErrorNotificationCb(
-        ErrorHandlerType::DISK_ERROR, dir));
-    *result_status = s.CloneAndPrepend(Substitute(
-        "Could not list children of $0", dir->dir()));
+    result->status = s.CloneAndPrepend(Substitute(
+        "Could not open container $0", container_name));
     return;
   }
-  MonoTime last_opened_container_log_time = MonoTime::Now();
-  for (const string& child : children) {
-    string container_name;
-    if (!TryStripSuffixString(
-            child, LogBlockManager::kContainerDataFileSuffix, &container_name) &&
-        !TryStripSuffixString(
-            child, LogBlockManager::kContainerMetadataFileSuffix, &container_name)) {
-      continue;
-    }
-    if (!InsertIfNotPresent(&containers_seen, container_name)) {
-      continue;
-    }
 
-    unique_ptr<LogBlockContainer> container;
-    s = LogBlockContainer::Open(
-        this, dir, &local_report, container_name, &container);
-    if (s.IsAborted()) {
-      // Skip the container. Open() added a record of it to 'local_report' for us.
-      continue;
-    }
+  // Process the records, building a container-local map for live blocks and
+  // a list of dead blocks.
+  //
+  // It's important that we don't try to add these blocks to the global map
+  // incrementally as we see each record, since it's possible that one container
+  // has a "CREATE <b>" while another has a "CREATE <b> ; DELETE <b>" pair.
+  // If we processed those two containers in this order, then upon processing
+  // the second container, we'd think there was a duplicate block. Building
+  // the container-local map first ensures that we discount deleted blocks
+  // before checking for duplicate IDs.
+  //
+  // NOTE: Since KUDU-1538, we allocate sequential block IDs, which makes reuse
+  // exceedingly unlikely. However, we might have old data which still exhibits
+  // the above issue.
+  UntrackedBlockMap live_blocks;
+  BlockRecordMap live_block_records;
+  vector<scoped_refptr<internal::LogBlock>> dead_blocks;
+  uint64_t max_block_id = 0;
+  s = container->ProcessRecords(&local_report,
+                                &live_blocks,
+                                &live_block_records,
+                                &dead_blocks,
+                                &max_block_id,
+                                FLAGS_log_container_snapshot_min_replay_bytes >= 0);
+  if (!s.ok() && !s.IsDiskFailure() && container->snapshot_metadata_length() > 0) {
+    // The records after the snapshot couldn't be processed, e.g. because the
+    // snapshot doesn't end on a record boundary. Start over without it.
+    LOG(WARNING) << Substitute("Could not process records after the snapshot of "
+                               "container $0, processing all of them: $1",
+                               container->ToString(), s.ToString());
+    live_blocks.clear();
+    live_block_records.clear();
+    dead_blocks.clear();
+    max_block_id = 0;
+    container.reset();
+    local_report = FsReport();
+    InitContainerChecks(&local_report);
+    s = LogBlockContainer::Open(this, dir, &local_report, container_name, &container);
     if (!s.ok()) {
-      *result_status = s.CloneAndPrepend(Substitute(
-          "Could not open container $0", container_name));
+      result->status = s.CloneAndPrepend(Substitute(
+          "Could not reopen container $0", container_name));
       return;
     }
-
-    // Process the records, building a container-local map for live blocks and
-    // a list of dead blocks.
-    //
-    // It's important that we don't try to add these blocks to the global map
-    // incrementally as we see each record, since it's possible that one container
-    // has a "CREATE <b>" while another has a "CREATE <b> ; DELETE <b>" pair.
-    // If we processed those two containers in this order, then upon processing
-    // the second container, we'd think there was a duplicate block. Building
-    // the container-local map first ensures that we discount deleted blocks
-    // before checking for duplicate IDs.
-    //
-    // NOTE: Since KUDU-1538, we allocate sequential block IDs, which makes reuse
-    // exceedingly unlikely. However, we might have old data which still exhibits
-    // the above issue.
-    UntrackedBlockMap live_blocks;
-    BlockRecordMap live_block_records;
-    vector<scoped_refptr<internal::LogBlock>> dead_blocks;
-    uint64_t max_block_id = 0;
     s = container->ProcessRecords(&local_report,
                                   &live_blocks,
                                   &live_block_records,
                                   &dead_blocks,
-                                  &max_block_id);
-    if (!s.ok()) {
-      *result_status = s.CloneAndPrepend(Substitute(
-          "Could not process records in container $0", container->ToString()));
-      return;
+                                  &max_block_id,
+                                  false);
+  }
+  if (!s.ok()) {
+    result->status = s.CloneAndPrepend(Substitute(
+        "Could not process records in container $0", container->ToString()));
+    return;
+  }
+
+  // With deleted blocks out of the way, check for misaligned blocks.
+  //
+  // We could also enforce that the record's offset is aligned with the
+  // underlying filesystem's block size, an invariant maintained by the log
+  // block manager. However, due to KUDU-1793, that invariant may have been
+  // broken, so we'll note but otherwise allow it.
+  for (const auto& e : live_blocks) {
+    if (PREDICT_FALSE(e.second->offset() %
+                      container->instance()->filesystem_block_size_bytes() != 0)) {
+      local_report.misaligned_block_check->entries.emplace_back(
+          container->ToString(), e.first);
+
     }
+  }
 
-    // With deleted blocks out of the way, check for misaligned blocks.
+  if (container->full()) {
+    // Full containers without any live blocks can be deleted outright.
     //
-    // We could also enforce that the record's offset is aligned with the
-    // underlying filesystem's block size, an invariant maintained by the log
-    // block manager. However, due to KUDU-1793, that invariant may have been
-    // broken, so we'll note but otherwise allow it.
-    for (const auto& e : live_blocks) {
-      if (PREDICT_FALSE(e.second->offset() %
-                        container->instance()->filesystem_block_size_bytes() != 0)) {
-        local_report.misaligned_block_check->entries.emplace_back(
-            container->ToString(), e.first);
-
+    // TODO(adar): this should be reported as an inconsistency once dead
+    // container deletion is also done in real time. Until then, it would be
+    // confusing to report it as such since it'll be a natural event at startup.
+    if (container->live_blocks() == 0) {
+      DCHECK(live_blocks.empty());
+      result->dead_containers.emplace_back(container->ToString());
+    } else if (static_cast<double>(container->live_blocks()) /
+        container->total_blocks() <= FLAGS_log_container_live_metadata_before_compact_ratio) {
+      // Metadata files of containers with very few live blocks will be compacted.
+      //
+      // TODO(adar): this should be reported as an inconsistency once
+      // container metadata compaction is also done in realtime. Until then,
+      // it would be confusing to report it as such since it'll be a natural
+      // event at startup.
+      vector<BlockRecordPB> records(live_block_records.size());
+      int i = 0;
+      for (auto& e : live_block_records) {
+        records[i].Swap(&e.second);
+        i++;
       }
-    }
 
-    if (container->full()) {
-      // Full containers without any live blocks can be deleted outright.
+      // Sort the records such that their ordering reflects the ordering in
+      // the pre-compacted metadata file.
       //
-      // TODO(adar): this should be reported as an inconsistency once dead
-      // container deletion is also done in real time. Until then, it would be
-      // confusing to report it as such since it'll be a natural event at startup.
-      if (container->live_blocks() == 0) {
-        DCHECK(live_blocks.empty());
-        dead_containers.emplace_back(container->ToString());
-      } else if (static_cast<double>(container->live_blocks()) /
-          container->total_blocks() <= FLAGS_log_container_live_metadata_before_compact_ratio) {
-        // Metadata files of containers with very few live blocks will be compacted.
-        //
-        // TODO(adar): this should be reported as an inconsistency once
-        // container metadata compaction is also done in realtime. Until then,
-        // it would be confusing to report it as such since it'll be a natural
-        // event at startup.
-        vector<BlockRecordPB> records(live_block_records.size());
-        int i = 0;
-        for (auto& e : live_block_records) {
-          records[i].Swap(&e.second);
-          i++;
+      // This is preferred to storing the records in an order-preserving
+      // container (such as std::map) because while records are temporarily
+      // retained for every container, only some containers will actually
+      // undergo metadata compaction.
+      std::sort(records.begin(), records.end(),
+                [](const BlockRecordPB& a, const BlockRecordPB& b) {
+        // Sort by timestamp.
+        if (a.timestamp_us() != b.timestamp_us()) {
+          return a.timestamp_us() < b.timestamp_us();
         }
 
-        // Sort the records such that their ordering reflects the ordering in
-        // the pre-compacted metadata file.
+        // If the timestamps match, sort by offset.
         //
-        // This is preferred to storing the records in an order-preserving
-        // container (such as std::map) because while records are temporarily
-        // retained for every container, only some containers will actually
-        // undergo metadata compaction.
-        std::sort(records.begin(), records.end(),
-                  [](const BlockRecordPB& a, const BlockRecordPB& b) {
-          // Sort by timestamp.
-          if (a.timestamp_us() != b.timestamp_us()) {
-            return a.timestamp_us() < b.timestamp_us();
-          }
-
-          // If the timestamps match, sort by offset.
-          //
-          // If the offsets also match (i.e. both blocks are of zero length),
-          // it doesn't matter which of the two records comes first.
-          return a.offset() < b.offset();
-        });
-
-        low_live_block_containers[container->ToString()] = std::move(records);
-      }
+        // If the offsets also match (i.e. both blocks are of zero length),
+        // it doesn't matter which of the two records comes first.
+        return a.offset() < b.offset();
+      });
 
-      // Having processed the block records, let's check whether any full
-      // containers have any extra space (left behind after a crash or from an
-      // older version of Kudu).
-      //
-      // Filesystems are unpredictable beasts and may misreport the amount of
-      // space allocated to a file in various interesting ways. Some examples:
-      // - XFS's speculative preallocation feature may artificially enlarge the
-      //   container's data file without updating its file size. This makes the
-      //   file size untrustworthy for the purposes of measuring allocated space.
-      //   See KUDU-1856 for more details.
-      // - On el6.6/ext4 a container data file that consumed ~32K according to
-      //   its extent tree was actually reported as consuming an additional fs
-      //   block (2k) of disk space. A similar container data file (generated
-      //   via the same workload) on Ubuntu 16.04/ext4 did not exhibit this.
-      //   The suspicion is that older versions of ext4 include interior nodes
-      //   of the extent tree when reporting file block usage.
-      //
-      // To deal with these issues, our extra space cleanup code (deleted block
-      // repunching and container truncation) is gated on an "actual disk space
-      // consumed" heuristic. To prevent unnecessary triggering of the
-      // heuristic, we allow for some slop in our size measurements. The exact
-      // amount of slop is configurable via
-      // log_container_excess_space_before_cleanup_fraction.
-      //
-      // Too little slop and we'll do unnecessary work at startup. Too much and
-      // more unused space may go unreclaimed.
-      string data_filename = StrCat(container->ToString(), kContainerDataFileSuffix);
-      uint64_t reported_size;
-      s = env_->GetFileSizeOnDisk(data_filename, &reported_size);
-      if (!s.ok()) {
-        HANDLE_DISK_FAILURE(s, error_manager_->RunErrorNotificationCb(
-            ErrorHandlerType::DISK_ERROR, dir));
-        *result_status = s.CloneAndPrepend(Substitute(
-            "Could not get on-disk file size of container $0", container->ToString()));
-        return;
-      }
-      int64_t cleanup_threshold_size = container->live_bytes_aligned() *
-          (1 + FLAGS_log_container_excess_space_before_cleanup_fraction);
-      if (reported_size > cleanup_threshold_size) {
-        local_report.full_container_space_check->entries.emplace_back(
-            container->ToString(), reported_size - container->live_bytes_aligned());
-
-        // If the container is to be deleted outright, don't bother repunching
-        // its blocks. The report entry remains, however, so it's clear that
-        // there was a space discrepancy.
-        if (container->live_blocks()) {
-          need_repunching.insert(need_repunching.end(),
-                                 dead_blocks.begin(), dead_blocks.end());
-        }
-      }
+      result->low_live_block_containers[container->ToString()] = std::move(records);
+    }
 
-      local_report.stats.lbm_full_container_count++;
+    // Having processed the block records, let's check whether any full
+    // containers have any extra space (left behind after a crash or from an
+    // older version of Kudu).
+    //
+    // Filesystems are unpredictable beasts and may misreport the amount of
+    // space allocated to a file in various interesting ways. Some examples:
+    // - XFS's speculative preallocation feature may artificially enlarge the
+    //   container's data file without updating its file size. This makes the
+    //   file size untrustworthy for the purposes of measuring allocated space.
+    //   See KUDU-1856 for more details.
+    // - On el6.6/ext4 a container data file that consumed ~32K according to
+    //   its extent tree was actually reported as consuming an additional fs
+    //   block (2k) of disk space. A similar container data file (generated
+    //   via the same workload) on Ubuntu 16.04/ext4 did not exhibit this.
+    //   The suspicion is that older versions of ext4 include interior nodes
+    //   of the extent tree when reporting file block usage.
+    //
+    // To deal with these issues, our extra space cleanup code (deleted block
+    // repunching and container truncation) is gated on an "actual disk space
+    // consumed" heuristic. To prevent unnecessary triggering of the
+    // heuristic, we allow for some slop in our size measurements. The exact
+    // amount of slop is configurable via
+    // log_container_excess_space_before_cleanup_fraction.
+    //
+    // Too little slop and we'll do unnecessary work at startup. Too much and
+    // more unused space may go unreclaimed.
+    string data_filename = StrCat(container->ToString(), kContainerDataFileSuffix);
+    uint64_t reported_size;
+    s = env_->GetFileSizeOnDisk(data_filename, &reported_size);
+    if (!s.ok()) {
+      HANDLE_DISK_FAILURE(s, error_manager_->RunErrorNotificationCb(
+          ErrorHandlerType::DISK_ERROR, dir));
+      result->status = s.CloneAndPrepend(Substitute(
+          "Could not get on-disk file size of container $0", container->ToString()));
+      return;
     }
-    local_report.stats.live_block_bytes += container->live_bytes();
-    local_report.stats.live_block_bytes_aligned += container->live_bytes_aligned();
-    local_report.stats.live_block_count += container->live_blocks();
-    local_report.stats.lbm_container_count++;
-
-    // Log number of containers opened every 10 seconds
-    MonoTime now = MonoTime::Now();
-    if ((now - last_opened_container_log_time).ToSeconds() > 10) {
-      LOG(INFO) << Substitute("Opened $0 log block containers in $1",
-                              local_report.stats.lbm_container_count, dir->dir());
-      last_opened_container_log_time = now;
+    int64_t cleanup_threshold_size = container->live_bytes_aligned() *
+        (1 + FLAGS_log_container_excess_space_before_cleanup_fraction);
+    if (reported_size > cleanup_threshold_size) {
+      local_report.full_container_space_check->entries.emplace_back(
+          container->ToString(), reported_size - container->live_bytes_aligned());
+
+      // If the container is to be deleted outright, don't bother repunching
+      // its blocks. The report entry remains, however, so it's clear that
+      // there was a space discrepancy.
+      if (container->live_blocks()) {
+        result->need_repunching.insert(result->need_repunching.end(),
+                                       dead_blocks.begin(), dead_blocks.end());
+      }
     }
 
-    next_block_id_.StoreMax(max_block_id + 1);
+    local_report.stats.lbm_full_container_count++;
+  }
+  local_report.stats.live_block_bytes += container->live_bytes();
+  local_report.stats.live_block_bytes_aligned += container->live_bytes_aligned();
+  local_report.stats.live_block_count += container->live_blocks();
+  local_report.stats.lbm_container_count++;
+
+  next_block_id_.StoreMax(max_block_id + 1);
 
-    // Under the lock, merge this map into the main block map and add
-    // the container.
-    {
-      std::lock_guard<simple_spinlock> l(lock_);
-      // To avoid cacheline contention during startup, we aggregate all of the
-      // memory in a local and add it to the mem-tracker in a single increment
-      // at the end of this loop.
-      int64_t mem_usage = 0;
-      for (UntrackedBlockMap::value_type& e : live_blocks) {
-        int block_mem = kudu_malloc_usable_size(e.second.get());
-        if (!AddLogBlockUnlocked(std::move(e.second))) {
-          // TODO(adar): track as an inconsistency?
-          LOG(FATAL) << "Found duplicate CREATE record for block " << e.first
-                     << " which already is alive from another container when "
-                     << " processing container " << container->ToString();
-        }
-        mem_usage += block_mem;
+  // Under the lock, merge this map into the main block map and add
+  // the container.
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    // To avoid cacheline contention during startup, we aggregate all of the
+    // memory in a local and add it to the mem-tracker in a single increment
+    // at the end of this loop.
+    int64_t mem_usage = 0;
+    for (UntrackedBlockMap::value_type& e : live_blocks) {
+      int block_mem = kudu_malloc_usable_size(e.second.get());
+      if (!AddLogBlockUnlocked(std::move(e.second))) {
+        // TODO(adar): track as an inconsistency?
+        LOG(FATAL) << "Found duplicate CREATE record for block " << e.first
+                   << " which already is alive from another container when "
+                   << " processing container " << container->ToString();
       }
+      mem_usage += block_mem;
+    }
+
+    mem_tracker_->Consume(mem_usage);
+    AddNewContainerUnlocked(container.get());
+    MakeContainerAvailableUnlocked(container.release());
+  }
+}
+
+void LogBlockManager::OpenDataDir(DataDir* dir,
+                                  ThreadPool* pool,
+                                  FsReport* report,
+                                  Status* result_status) {
+  FsReport local_report;
+  local_report.data_dirs.push_back(dir->dir());
+
+  // We are going to perform these checks.
+  InitContainerChecks(&local_report);
 
-      mem_tracker_->Consume(mem_usage);
-      AddNewContainerUnlocked(container.get());
-      MakeContainerAvailableUnlocked(container.release());
+  // Find all containers.
+  unordered_set<string> containers_seen;
+  vector<string> container_names;
+  vector<string> children;
+  Status s = env_->GetChildren(dir->dir(), &children);
+  if (!s.ok()) {
+    HANDLE_DISK_FAILURE(s, error_manager_->RunErrorNotificationCb(
+        ErrorHandlerType::DISK_ERROR, dir));
+    *result_status = s.CloneAndPrepend(Substitute(
+        "Could not list children of $0", dir->dir()));
+    return;
+  }
+  for (const string& child : children) {
+    string container_name;
+    if (!TryStripSuffixString(
+            child, LogBlockManager::kContainerDataFileSuffix, &container_name) &&
+        !TryStripSuffixString(
+            child, LogBlockManager::kContainerMetadataFileSuffix, &container_name)) {
+      continue;
+    }
+    if (InsertIfNotPresent(&containers_seen, container_name)) {
+      container_names.emplace_back(std::move(container_name));
     }
   }
 
+  // Open the containers in parallel, logging progress every 10 seconds.
+  vector<ContainerOpenResult> results(container_names.size());
+  std::atomic<int> num_opened(0);
+  unique_ptr<ThreadPoolToken> token = pool->NewToken(ThreadPool::ExecutionMode::CONCURRENT);
+  for (int i = 0; i < container_names.size(); i++) {
+    const string* name = &container_names[i];
+    ContainerOpenResult* result = &results[i];
+    auto open = [this, dir, name, result, &num_opened]() {
+      OpenContainer(dir, *name, result);
+      num_opened++;
+    };
+    if (!token->SubmitFunc(open).ok()) {
+      open();
+    }
+  }
+  while (!token->WaitFor(MonoDelta::FromSeconds(10))) {
+    LOG(INFO) << Substitute("Opened $0 of $1 log block containers in $2",
+                            num_opened.load(), container_names.size(), dir->dir());
+  }
+
+  // Merge the results in directory listing order.
+  vector<scoped_refptr<internal::LogBlock>> need_repunching;
+  vector<string> dead_containers;
+  unordered_map<string, vector<BlockRecordPB>> low_live_block_containers;
+  for (auto& r : results) {
+    if (!r.status.ok()) {
+      *result_status = r.status;
+      return;
+    }
+    local_report.MergeFrom(r.report);
+    need_repunching.insert(need_repunching.end(),
+                           r.need_repunching.begin(), r.need_repunching.end());
+    dead_containers.insert(dead_containers.end(),
+                           r.dead_containers.begin(), r.dead_containers.end());
+    for (auto& e : r.low_live_block_containers) {
+      low_live_block_containers.emplace(e.first, std::move(e.second));
+    }
+  }
+  results.clear();
+
   // Like the rest of Open(), repairs are performed per data directory to take
   // advantage of parallelism.
   s = Repair(dir,
@@ -2523,6 +2926,10 @@ Status LogBlockManager::Repair(
                 "Could not delete dead container data file " + data_file_name);
     WARN_NOT_OK_LBM_DISK_FAILURE(file_cache_.DeleteFile(metadata_file_name),
                 "Could not delete dead container metadata file " + metadata_file_name);
+    s = env_->DeleteFile(StrCat(d, kContainerSnapshotFileSuffix));
+    if (!s.ok() && !s.IsNotFound()) {
+      WARN_NOT_OK_LBM_DISK_FAILURE(s, "Could not delete dead container snapshot file");
+    }
   }
   if (!dead_containers.empty()) {
     WARN_NOT_OK_LBM_DISK_FAILURE(env_->SyncDir(dir->dir()), "Could not sync data directory");
@@ -2584,6 +2991,11 @@ Status LogBlockManager::Repair(
       if (!s.ok() && !s.IsNotFound()) {
         WARN_NOT_OK_LBM_DISK_FAILURE(s, "could not delete incomplete container data file");
       }
+
+      s = env_->DeleteFile(StrCat(ic.container, kContainerSnapshotFileSuffix));
+      if (!s.ok() && !s.IsNotFound()) {
+        WARN_NOT_OK_LBM_DISK_FAILURE(s, "could not delete incomplete container snapshot file");
+      }
       ic.repaired = true;
     }
   }
@@ -2630,6 +3042,7 @@ Status LogBlockManager::Repair(
   // the live block records.
   int64_t metadata_files_compacted = 0;
   int64_t metadata_bytes_delta = 0;
+  vector<std::pair<internal::LogBlockContainer*, const vector<BlockRecordPB>*>> compacted;
   for (const auto& e : low_live_block_containers) {
     internal::LogBlockContainer* container = FindPtrOrNull(containers_by_name,
                                                            e.first);
@@ -2653,6 +3066,7 @@ Status LogBlockManager::Repair(
 
     metadata_files_compacted++;
     metadata_bytes_delta += file_bytes_delta;
+    compacted.emplace_back(container, &e.second);
     VLOG(1) << "Compacted metadata file " << meta_path
             << " (saved " << file_bytes_delta << " bytes)";
 
@@ -2675,9 +3089,82 @@ Status LogBlockManager::Repair(
                             metadata_files_compacted, metadata_bytes_delta);
   }
 
+  // Snapshot the compacted containers. This is only done once their new
+  // metadata files durably replaced the old ones, lest a snapshot of a new
+  // file be applied to an old one after a crash.
+  if (FLAGS_log_container_snapshot_min_replay_bytes >= 0) {
+    for (const auto& c : compacted) {
+      BlockContainerSnapshotPB snapshot;
+      for (const auto& r : *c.second) {
+        snapshot.add_block_ids(BlockId::FromPB(r.block_id()).id());
+        snapshot.add_offsets(r.offset());
+        snapshot.add_lengths(r.length());
+      }
+      // The compacted metadata file only has the records of the live blocks.
+      snapshot.set_total_blocks(c.first->live_blocks());
+      snapshot.set_total_bytes(c.first->live_bytes_aligned());
+      WARN_NOT_OK(c.first->WriteSnapshot(&snapshot),
+                  "could not write snapshot of compacted container " + c.first->ToString());
+    }
+  }
+
+  return Status::OK();
+}
+
+Status LogBlockManager::DeleteContainerSnapshot(DataDir* dir, const string& container_name) {
+  Status s = env_->DeleteFile(StrCat(container_name, kContainerSnapshotFileSuffix));
+  if (s.IsNotFound()) {
+    return Status::OK();
+  }
+  RETURN_NOT_OK_LBM_DISK_FAILURE_PREPEND(s, "could not delete container snapshot");
+  RETURN_NOT_OK_LBM_DISK_FAILURE_PREPEND(env_->SyncDir(dir->dir()),
+                                         "could not sync data directory");
   return Status::OK();
 }
 
+void LogBlockManager::WriteContainerSnapshots() {
+  if (opts_.read_only || FLAGS_log_container_snapshot_min_replay_bytes < 0) {
+    return;
+  }
+
+  // Pick the containers whose snapshots are worth updating. Containers which
+  // failed writes may disagree with their metadata files, and are skipped.
+  unordered_map<LogBlockContainer*, BlockContainerSnapshotPB> snapshots;
+  for (const auto& e : all_containers_by_name_) {
+    LogBlockContainer* container = e.second;
+    int uuid_idx;
+    CHECK(dd_manager_->FindUuidIndexByDataDir(container->data_dir(), &uuid_idx));
+    int64_t replay_bytes = static_cast<int64_t>(container->metadata_length()) -
+        container->snapshot_metadata_length();
+    if (container->read_only() ||
+        dd_manager_->IsDataDirFailed(uuid_idx) ||
+        replay_bytes < FLAGS_log_container_snapshot_min_replay_bytes) {
+      continue;
+    }
+    BlockContainerSnapshotPB& snapshot = snapshots[container];
+    snapshot.set_total_blocks(container->total_blocks());
+    snapshot.set_total_bytes(container->total_bytes());
+  }
+  if (snapshots.empty()) {
+    return;
+  }
+  for (const auto& e : blocks_by_block_id_) {
+    BlockContainerSnapshotPB* snapshot = FindOrNull(snapshots, e.second->container());
+    if (snapshot) {
+      snapshot->add_block_ids(e.first.id());
+      snapshot->add_offsets(e.second->offset());
+      snapshot->add_lengths(e.second->length());
+    }
+  }
+
+  LOG_TIMING(INFO, Substitute("writing $0 log block container snapshots", snapshots.size())) {
+    for (auto& e : snapshots) {
+      WARN_NOT_OK(e.first->WriteSnapshot(&e.second),
+                  "could not write snapshot of container " + e.first->ToString());
+    }
+  }
+}
+
 Status LogBlockManager::RewriteMetadataFile(const LogBlockContainer& container,
                                             const vector<BlockRecordPB>& records,
                                             int64_t* file_bytes_delta) {
@@ -2719,6 +3206,9 @@ Status LogBlockManager::RewriteMetadataFile(const LogBlockContainer& container,
   uint64_t new_metadata_size;
   RETURN_NOT_OK_LBM_DISK_FAILURE_PREPEND(env_->GetFileSize(tmp_file_name, &new_metadata_size),
                                          "could not get file size of temporary metadata file");
+  // The container's snapshot describes the old file; make sure it's gone for
+  // good before the new file takes its place.
+  RETURN_NOT_OK(DeleteContainerSnapshot(container.data_dir(), container.ToString()));
   RETURN_NOT_OK_LBM_DISK_FAILURE_PREPEND(env_->RenameFile(tmp_file_name, metadata_file_name),
                                          "could not rename temporary metadata file");
   // Evict the old path from the file cache, so that when we re-open the new
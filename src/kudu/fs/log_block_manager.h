@@ -47,6 +47,7 @@ namespace kudu {
 class BlockRecordPB;
 class Env;
 class RWFile;
+class ThreadPool;
 
 namespace fs {
 class DataDir;
@@ -133,6 +134,12 @@ struct LogBlockManagerMetrics;
 // locations of various blocks. Each entry in the map consumes ~64 bytes,
 // putting the memory overhead at ~610 MB for 10 million blocks.
 //
+// To keep opens fast, a snapshot of each container's live blocks is written
+// next to it (as "<id>.snapshot") when its metadata is compacted and at clean
+// shutdown. When a container is opened, its snapshot is loaded in place of
+// the metadata records it covers, and only the records appended since are
+// replayed. The containers of all data directories are opened in parallel.
+//
 // New blocks are placed on a filesystem block boundary, and the size of
 // hole punch requests is rounded up to the nearest filesystem block size.
 // Taken together, this guarantees that hole punching can actually reclaim
@@ -181,6 +188,7 @@ class LogBlockManager : public BlockManager {
  public:
   static const char* kContainerMetadataFileSuffix;
   static const char* kContainerDataFileSuffix;
+  static const char* kContainerSnapshotFileSuffix;
 
   // Note: all objects passed as pointers should remain alive for the lifetime
   // of the block manager.
@@ -213,6 +221,8 @@ class LogBlockManager : public BlockManager {
   FRIEND_TEST(LogBlockManagerTest, TestAbortBlock);
   FRIEND_TEST(LogBlockManagerTest, TestCloseFinalizedBlock);
   FRIEND_TEST(LogBlockManagerTest, TestCompactFullContainerMetadataAtStartup);
+  FRIEND_TEST(LogBlockManagerTest, TestConcurrentCommitsShareSyncs);
+  FRIEND_TEST(LogBlockManagerTest, TestContainerSnapshots);
   FRIEND_TEST(LogBlockManagerTest, TestFinalizeBlock);
   FRIEND_TEST(LogBlockManagerTest, TestLIFOContainerSelection);
   FRIEND_TEST(LogBlockManagerTest, TestLookupBlockLimit);
@@ -360,12 +370,31 @@ class LogBlockManager : public BlockManager {
                              const std::vector<BlockRecordPB>& records,
                              int64_t* file_bytes_delta);
 
+  // Deletes the snapshot of container 'container_name', if it has one, and
+  // syncs 'dir' so that the deletion is durable.
+  Status DeleteContainerSnapshot(DataDir* dir, const std::string& container_name);
+
+  // Writes snapshots of the containers whose metadata files grew enough since
+  // their last snapshot. Called at shutdown, once the block manager is idle.
+  void WriteContainerSnapshots();
+
+  // The outcome of opening a single container. See OpenContainer().
+  struct ContainerOpenResult;
+
+  // Opens container 'container_name' in 'dir', processes its records and
+  // adds its blocks to the block manager. The results of consistency checking
+  // and the repairs needed are written to 'result'.
+  void OpenContainer(DataDir* dir,
+                     const std::string& container_name,
+                     ContainerOpenResult* result);
+
   // Opens a particular data directory belonging to the block manager. The
   // results of consistency checking (and repair, if applicable) are written to
-  // 'report'.
+  // 'report'. The containers of the directory are opened on 'pool'.
   //
   // Success or failure is set in 'result_status'.
   void OpenDataDir(DataDir* dir,
+                   ThreadPool* pool,
                    FsReport* report,
                    Status* result_status);
 
@@ -55,6 +55,12 @@ static bool ValidateThreadPoolThreadLimit(const char* /*flagname*/, int32_t valu
 }
 DEFINE_validator(server_thread_pool_max_thread_count, &ValidateThreadPoolThreadLimit);
 
+DEFINE_bool(raft_pool_work_stealing, false,
+            "Whether the server-wide Raft thread pool queues tasks on per-worker "
+            "queues which idle workers steal from, rather than on a single queue. "
+            "This reduces contention on the pool when many replicas share it.");
+TAG_FLAG(raft_pool_work_stealing, experimental);
+
 using std::string;
 using strings::Substitute;
 
@@ -160,6 +166,7 @@ Status KuduServer::Init() {
   RETURN_NOT_OK(ThreadPoolBuilder("raft")
                 .set_trace_metric_prefix("raft")
                 .set_max_threads(server_wide_pool_limit)
+                .set_work_stealing(FLAGS_raft_pool_work_stealing)
                 .Build(&raft_pool_));
 
   return Status::OK();
@@ -25,6 +25,7 @@
 #include <type_traits>
 #include <utility>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "kudu/gutil/gscoped_ptr.h"
@@ -44,6 +45,7 @@
 #include "kudu/rpc/sasl_common.h"
 #include "kudu/rpc/server_negotiation.h"
 #include "kudu/rpc/service_if.h"
+#include "kudu/rpc/timer_wheel.h"
 #include "kudu/security/openssl_util.h"
 #include "kudu/security/tls_context.h"
 #include "kudu/security/token_verifier.h"
@@ -61,6 +63,12 @@ using std::shared_ptr;
 using std::make_shared;
 using strings::Substitute;
 
+DEFINE_int32(rpc_timer_wheel_tick_ms, 10,
+             "Resolution of the timing wheel shared by the timers of a messenger, "
+             "e.g. the heartbeat timers of consensus peers. The wheel wakes up a "
+             "reactor once per tick while it has timers scheduled.");
+TAG_FLAG(rpc_timer_wheel_tick_ms, advanced);
+
 namespace boost {
 template <typename Signature> class function;
 }
@@ -407,6 +415,8 @@ Messenger::Messenger(const MessengerBuilder &bld)
     tls_context_(new security::TlsContext(bld.rpc_tls_ciphers_, bld.rpc_tls_min_protocol_)),
     token_verifier_(new security::TokenVerifier()),
     rpcz_store_(new RpczStore()),
+    timer_wheel_(TimerWheel::Create(this, MonoDelta::FromMilliseconds(
+        FLAGS_rpc_timer_wheel_tick_ms))),
     metric_entity_(bld.metric_entity_),
     rpc_negotiation_timeout_ms_(bld.rpc_negotiation_timeout_ms_),
     sasl_proto_name_(bld.sasl_proto_name_),
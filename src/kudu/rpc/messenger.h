@@ -68,6 +68,7 @@ class OutboundCall;
 class Reactor;
 class RpcService;
 class RpczStore;
+class TimerWheel;
 
 struct AcceptorPoolInfo {
  public:
@@ -276,6 +277,10 @@ class Messenger {
   void ScheduleOnReactor(const boost::function<void(const Status&)>& func,
                          MonoDelta when);
 
+  // A timing wheel, ticked on this messenger's reactors, for components
+  // which need many timers (e.g. one per peer) at once.
+  TimerWheel* timer_wheel() const { return timer_wheel_.get(); }
+
   const security::TlsContext& tls_context() const { return *tls_context_; }
   security::TlsContext* mutable_tls_context() { return tls_context_.get(); }
 
@@ -392,6 +397,8 @@ class Messenger {
 
   std::unique_ptr<RpczStore> rpcz_store_;
 
+  std::shared_ptr<TimerWheel> timer_wheel_;
+
   scoped_refptr<MetricEntity> metric_entity_;
 
   // Timeout in milliseconds after which an incomplete connection negotiation will timeout.
@@ -38,7 +38,8 @@ namespace rpc {
 
 PeriodicTimer::Options::Options()
     : jitter_pct(0.25),
-      one_shot(false) {
+      one_shot(false),
+      use_timer_wheel(true) {
 }
 
 shared_ptr<PeriodicTimer> PeriodicTimer::Create(
@@ -56,11 +57,13 @@ PeriodicTimer::PeriodicTimer(
     MonoDelta period,
     Options options)
     : messenger_(std::move(messenger)),
+      wheel_(options.use_timer_wheel ? messenger_->timer_wheel() : nullptr),
       functor_(std::move(functor)),
       period_(period),
       options_(options),
       rng_(GetRandomSeed32()),
       current_callback_generation_(0),
+      wheel_timer_id_(TimerWheel::kInvalidTimerId),
       num_callbacks_for_tests_(0),
       started_(false) {
   DCHECK_GE(options_.jitter_pct, 0);
@@ -92,6 +95,10 @@ void PeriodicTimer::Stop() {
 void PeriodicTimer::StopUnlocked() {
   DCHECK(lock_.is_locked());
   started_ = false;
+  if (wheel_) {
+    wheel_->Cancel(wheel_timer_id_);
+    wheel_timer_id_ = TimerWheel::kInvalidTimerId;
+  }
 }
 
 void PeriodicTimer::Snooze(boost::optional<MonoDelta> next_task_delta) {
@@ -114,7 +121,13 @@ void PeriodicTimer::SnoozeUnlocked(boost::optional<MonoDelta> next_task_delta) {
         options_.jitter_pct *
         (2 * period_.ToMilliseconds()));
   }
-  next_task_time_ = MonoTime::Now() + *next_task_delta;
+  MonoTime now = MonoTime::Now();
+  next_task_time_ = now + *next_task_delta;
+  if (wheel_) {
+    // If the callback is already running, this fails and the callback
+    // schedules itself again once it sees the new task time.
+    wheel_->Reschedule(wheel_timer_id_, *next_task_delta);
+  }
 }
 
 bool PeriodicTimer::started() const {
@@ -150,6 +163,9 @@ void PeriodicTimer::Callback(int64_t my_callback_generation) {
   // that a no-arg Snooze() on a jittered timer will always be honored, and as
   // long as the caller passes a value of at least GetMinimumPeriod() to
   // Snooze(), that too will be honored.
+  //
+  // None of this applies to timers on the timer wheel, whose callbacks are
+  // moved by Snooze() instead; see ScheduleCallback().
   MonoDelta delay = GetMinimumPeriod();
   bool run_task = false;
   {
@@ -201,9 +217,30 @@ void PeriodicTimer::Callback(int64_t my_callback_generation) {
     Snooze();
   }
 
+  ScheduleCallback(my_callback_generation, delay);
+}
+
+void PeriodicTimer::ScheduleCallback(int64_t my_callback_generation, MonoDelta delay) {
   // Capture a weak_ptr reference into the submitted functor so that we can
   // safely handle the functor outliving its timer.
   weak_ptr<PeriodicTimer> w = shared_from_this();
+  if (wheel_) {
+    // Unlike the reactors, the wheel lets the callback be moved and canceled,
+    // so it is scheduled for exactly the next task time. That must be done
+    // under 'lock_', lest a concurrent Snooze() or Stop() miss it.
+    std::lock_guard<simple_spinlock> l(lock_);
+    if (!started_ || current_callback_generation_ > my_callback_generation) {
+      return;
+    }
+    wheel_timer_id_ = wheel_->Schedule(
+        next_task_time_ - MonoTime::Now(),
+        [w, my_callback_generation]() {
+          if (auto timer = w.lock()) {
+            timer->Callback(my_callback_generation);
+          }
+        });
+    return;
+  }
   messenger_->ScheduleOnReactor([w, my_callback_generation](const Status& s) {
     if (!s.ok()) {
       // The reactor was shut down.
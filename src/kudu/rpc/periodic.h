@@ -25,6 +25,7 @@
 #include <gtest/gtest_prod.h>
 
 #include "kudu/gutil/macros.h"
+#include "kudu/rpc/timer_wheel.h"
 #include "kudu/util/locks.h"
 #include "kudu/util/make_shared.h"
 #include "kudu/util/monotime.h"
@@ -49,19 +50,20 @@ class Messenger;
 // there was an old loop, it remains intact until its scheduled callback runs,
 // at which point it will detect that a new loop was created and exit.
 //
-// The use of Messenger::ScheduleOnReactor() is merely for convenience;
-// PeriodicTimer could also be built on libev, a hashed wheel timer, o
-// something equivalent.
+// By default, the callback loop runs on the messenger's TimerWheel instead:
+// each callback is scheduled for exactly the next task time, and Snooze()
+// moves it in O(1) rather than leaving it to fire early and reschedule
+// itself. This keeps reactor wakeups down to one per wheel tick no matter how
+// many timers there are, and lifts the restriction on the delta passed into
+// Snooze(). Stop() cancels the pending callback.
 //
 // PeriodicTimers have shared ownership, but that's largely an implementation
 // detail to support asynchronous stopping. Users can treat them as exclusively
 // owned (though care must be taken when writing the task functor; see Stop()
 // for more details).
 //
-// TODO(adar): eventually we should build directly on libev as it supports
-// timer cancelation, which would allow us to implement synchronous Stop(), use
-// exclusive ownership, and remove the restriction that the delta passed
-// into Snooze() be greater than GetMinimumPeriod().
+// TODO(adar): eventually we should implement synchronous Stop() and use
+// exclusive ownership.
 class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
                       public enable_make_shared<PeriodicTimer> {
  public:
@@ -87,6 +89,12 @@ class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
     //
     // If not set, defaults to false.
     bool one_shot;
+
+    // Whether the timer runs off the messenger's TimerWheel rather than
+    // scheduling its own callbacks on the reactors.
+    //
+    // If not set, defaults to true.
+    bool use_timer_wheel;
   };
 
   // Creates a new PeriodicTimer.
@@ -123,9 +131,10 @@ class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
   // Snoozes the timer for one period.
   //
   // If 'next_task_delta' is set, it is used verbatim as the delay for the next
-  // task. Subsequent tasks will revert to the timer's regular period. The
-  // value of 'next_task_delta' must be greater than GetMinimumPeriod();
-  // otherwise the task is not guaranteed to run in a timely manner.
+  // task. Subsequent tasks will revert to the timer's regular period. Unless
+  // the timer uses the timer wheel, the value of 'next_task_delta' must be
+  // greater than GetMinimumPeriod(); otherwise the task is not guaranteed to
+  // run in a timely manner.
   //
   // Note: Snooze() is not additive. That is, if called at time X and again at
   // time X + P/2, the timer is snoozed until X+P/2+P, not X+2P.
@@ -162,6 +171,11 @@ class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
   // when it was constructed.
   void Callback(int64_t my_callback_generation);
 
+  // Schedules the next invocation of Callback() for the callback loop
+  // 'my_callback_generation', 'delay' from now. With the timer wheel, the
+  // delay is taken from 'next_task_time_' instead.
+  void ScheduleCallback(int64_t my_callback_generation, MonoDelta delay);
+
   // Like Stop() but must be called with 'lock_' held.
   void StopUnlocked();
 
@@ -176,6 +190,9 @@ class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
   // Schedules invocations of Callback() in the future.
   std::shared_ptr<Messenger> messenger_;
 
+  // The messenger's timer wheel, or null if the timer doesn't use it.
+  TimerWheel* const wheel_;
+
   // User-defined task functor.
   RunTaskFunctor functor_;
 
@@ -202,6 +219,9 @@ class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer>,
   // the (now old) loop should exit.
   int64_t current_callback_generation_;
 
+  // The wheel timer of the pending callback, if 'wheel_' is set.
+  TimerWheel::TimerId wheel_timer_id_;
+
   // The number of times that Callback() has been invoked.
   int64_t num_callbacks_for_tests_;
 
@@ -0,0 +1,223 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/rpc/timer_wheel.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/rpc/messenger.h"
+#include "kudu/rpc/periodic.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/scoped_cleanup.h"
+#include "kudu/util/stopwatch.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+using std::atomic;
+using std::shared_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+namespace rpc {
+
+class TimerWheelTest : public KuduTest {
+ public:
+  TimerWheelTest()
+      : wheel_(TimerWheel::Create(nullptr, MonoDelta::FromMilliseconds(1))) {
+  }
+
+ protected:
+  // Schedules a timer which appends 'tag' to 'fired_' when it runs.
+  TimerWheel::TimerId ScheduleTagged(int64_t delay_ms, int tag) {
+    return wheel_->Schedule(MonoDelta::FromMilliseconds(delay_ms),
+                            [this, tag]() { fired_.push_back(tag); });
+  }
+
+  shared_ptr<TimerWheel> wheel_;
+  vector<int> fired_;
+};
+
+TEST_F(TimerWheelTest, TestRunsInExpirationOrder) {
+  const MonoTime start = MonoTime::Now();
+  ScheduleTagged(30, 3);
+  ScheduleTagged(10, 1);
+  ScheduleTagged(20, 2);
+  ASSERT_EQ(3, wheel_->num_timers());
+
+  // Nothing expires early.
+  ASSERT_EQ(0, wheel_->RunExpired(start + MonoDelta::FromMilliseconds(9)));
+  ASSERT_EQ(3, wheel_->RunExpired(start + MonoDelta::FromMilliseconds(100)));
+  ASSERT_EQ(vector<int>({ 1, 2, 3 }), fired_);
+  ASSERT_EQ(0, wheel_->num_timers());
+}
+
+TEST_F(TimerWheelTest, TestRescheduleAndCancel) {
+  const MonoTime start = MonoTime::Now();
+  TimerWheel::TimerId a = ScheduleTagged(10, 1);
+  TimerWheel::TimerId b = ScheduleTagged(20, 2);
+  ScheduleTagged(30, 3);
+
+  ASSERT_TRUE(wheel_->Reschedule(a, MonoDelta::FromMilliseconds(50)));
+  ASSERT_TRUE(wheel_->Cancel(b));
+  ASSERT_FALSE(wheel_->Cancel(b));
+  ASSERT_EQ(2, wheel_->num_timers());
+
+  ASSERT_EQ(1, wheel_->RunExpired(start + MonoDelta::FromMilliseconds(40)));
+  ASSERT_EQ(vector<int>({ 3 }), fired_);
+  ASSERT_EQ(1, wheel_->RunExpired(start + MonoDelta::FromMilliseconds(100)));
+  ASSERT_EQ(vector<int>({ 3, 1 }), fired_);
+}
+
+// Ids of timers which ran or were canceled don't refer to the timers which
+// reuse their entries.
+TEST_F(TimerWheelTest, TestStaleIds) {
+  const MonoTime start = MonoTime::Now();
+  TimerWheel::TimerId a = ScheduleTagged(10, 1);
+  ASSERT_EQ(1, wheel_->RunExpired(start + MonoDelta::FromMilliseconds(20)));
+  ASSERT_FALSE(wheel_->Reschedule(a, MonoDelta::FromMilliseconds(10)));
+  ASSERT_FALSE(wheel_->Cancel(a));
+
+  TimerWheel::TimerId b = ScheduleTagged(10, 2);
+  ASSERT_NE(a, b);
+  ASSERT_FALSE(wheel_->Cancel(a));
+  ASSERT_FALSE(wheel_->Cancel(TimerWheel::kInvalidTimerId));
+  ASSERT_EQ(1, wheel_->num_timers());
+  ASSERT_TRUE(wheel_->Cancel(b));
+  ASSERT_EQ(0, wheel_->num_timers());
+}
+
+// Timers far enough in the future to land in the higher levels of the wheel
+// are cascaded down and run on time.
+TEST_F(TimerWheelTest, TestLongDelays) {
+  const vector<int64_t> kDelaysMs = { 10, 250, 300, 65000, 66000, 70000, 1 << 20 };
+  const int kNumTimers = kDelaysMs.size();
+  const MonoTime before = MonoTime::Now();
+  for (int i = 0; i < kNumTimers; i++) {
+    ScheduleTagged(kDelaysMs[i], i);
+  }
+  const MonoTime after = MonoTime::Now();
+
+  for (int i = 0; i < kNumTimers; i++) {
+    SCOPED_TRACE(Substitute("delay: $0 ms", kDelaysMs[i]));
+    wheel_->RunExpired(before + MonoDelta::FromMilliseconds(kDelaysMs[i] - 1));
+    ASSERT_EQ(i, static_cast<int>(fired_.size()));
+    wheel_->RunExpired(after + MonoDelta::FromMilliseconds(kDelaysMs[i] + 1));
+    ASSERT_EQ(i + 1, static_cast<int>(fired_.size()));
+    ASSERT_EQ(i, fired_.back());
+  }
+}
+
+// Delays beyond the span of the wheel are capped rather than wrapping around.
+TEST_F(TimerWheelTest, TestDelaysAreCapped) {
+  const MonoTime start = MonoTime::Now();
+  ScheduleTagged(MonoDelta::FromSeconds(365 * 24 * 3600).ToMilliseconds(), 1);
+  ASSERT_EQ(0, wheel_->RunExpired(start + MonoDelta::FromSeconds(10)));
+  ASSERT_EQ(1, wheel_->num_timers());
+}
+
+// With a messenger, the wheel ticks itself on the reactors.
+TEST_F(TimerWheelTest, TestTicksOnReactor) {
+  shared_ptr<Messenger> messenger;
+  ASSERT_OK(MessengerBuilder("test").Build(&messenger));
+  atomic<int> counter(0);
+  SCOPED_CLEANUP({ messenger->Shutdown(); });
+
+  TimerWheel* wheel = messenger->timer_wheel();
+  for (int i = 0; i < 10; i++) {
+    wheel->Schedule(MonoDelta::FromMilliseconds(i * 10), [&]() { counter++; });
+  }
+  TimerWheel::TimerId canceled = wheel->Schedule(MonoDelta::FromMilliseconds(50),
+                                                 [&]() { counter += 100; });
+  ASSERT_TRUE(wheel->Cancel(canceled));
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_EQ(10, counter);
+  });
+  ASSERT_EQ(0, wheel->num_timers());
+
+  // Once idle, the wheel starts ticking again when timers are added.
+  wheel->Schedule(MonoDelta::FromMilliseconds(10), [&]() { counter++; });
+  ASSERT_EVENTUALLY([&]() {
+    ASSERT_EQ(11, counter);
+  });
+}
+
+// Compares the reactor CPU used by many periodic timers, e.g. the heartbeat
+// timers of the peers of many tablets, with and without the timer wheel, and
+// the cost of snoozing them all.
+TEST_F(TimerWheelTest, BenchmarkPeriodicTimers) {
+  vector<int> num_timers = { 10000 };
+  if (AllowSlowTests()) {
+    num_timers.push_back(100000);
+  }
+  for (int n : num_timers) {
+    for (bool use_timer_wheel : { false, true }) {
+      shared_ptr<Messenger> messenger;
+      ASSERT_OK(MessengerBuilder("test")
+                .set_num_reactors(1)
+                .Build(&messenger));
+      SCOPED_CLEANUP({ messenger->Shutdown(); });
+
+      PeriodicTimer::Options opts;
+      opts.use_timer_wheel = use_timer_wheel;
+      vector<shared_ptr<PeriodicTimer>> timers;
+      for (int i = 0; i < n; i++) {
+        timers.emplace_back(PeriodicTimer::Create(
+            messenger,
+            [&] {}, // No-op.
+            MonoDelta::FromMilliseconds(500),
+            opts));
+        timers.back()->Start();
+      }
+
+      // Only the reactor is busy while the test thread sleeps.
+      Stopwatch sw(Stopwatch::ALL_THREADS);
+      sw.start();
+      SleepFor(MonoDelta::FromSeconds(2));
+      sw.stop();
+      LOG(INFO) << Substitute("Reactor CPU for $0 timers $1 the timer wheel over 2 seconds: "
+                              "$2s user, $3s system",
+                              n, use_timer_wheel ? "with" : "without",
+                              sw.elapsed().user_cpu_seconds(),
+                              sw.elapsed().system_cpu_seconds());
+
+      LOG_TIMING(INFO, Substitute("snoozing $0 timers 10 times $1 the timer wheel",
+                                  n, use_timer_wheel ? "with" : "without")) {
+        for (int round = 0; round < 10; round++) {
+          for (auto& t : timers) {
+            t->Snooze();
+          }
+        }
+      }
+
+      for (auto& t : timers) {
+        t->Stop();
+      }
+    }
+  }
+}
+
+} // namespace rpc
+} // namespace kudu
@@ -0,0 +1,289 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/rpc/timer_wheel.h"
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+#include <boost/function.hpp>
+#include <glog/logging.h>
+
+#include "kudu/rpc/messenger.h"
+#include "kudu/util/status.h"
+
+using std::shared_ptr;
+using std::vector;
+using std::weak_ptr;
+
+namespace kudu {
+namespace rpc {
+
+const TimerWheel::TimerId TimerWheel::kInvalidTimerId;
+const int TimerWheel::kSlotBits;
+const int TimerWheel::kNumSlots;
+const int TimerWheel::kNumLevels;
+
+shared_ptr<TimerWheel> TimerWheel::Create(Messenger* messenger, MonoDelta tick) {
+  return shared_ptr<TimerWheel>(new TimerWheel(messenger, tick));
+}
+
+TimerWheel::TimerWheel(Messenger* messenger, MonoDelta tick)
+    : messenger_(messenger),
+      tick_(tick),
+      start_time_(MonoTime::Now()),
+      free_head_(-1),
+      current_tick_(0),
+      num_timers_(0),
+      tick_scheduled_(false) {
+  CHECK_GT(tick_.ToNanoseconds(), 0);
+  std::fill(slots_, slots_ + kNumLevels * kNumSlots, -1);
+}
+
+TimerWheel::~TimerWheel() {
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(MonoDelta delay, Callback cb) {
+  const MonoTime now = MonoTime::Now();
+  TimerId id;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    int32_t idx = free_head_;
+    if (idx >= 0) {
+      free_head_ = entries_[idx].next;
+    } else {
+      idx = entries_.size();
+      entries_.emplace_back();
+    }
+    Entry& e = entries_[idx];
+    e.prev = -1;
+    e.next = -1;
+    e.expiry_tick = ExpiryTickUnlocked(now, delay);
+    e.cb = std::move(cb);
+    LinkUnlocked(idx);
+    num_timers_++;
+    id = (static_cast<TimerId>(e.generation) << 32) | static_cast<uint32_t>(idx);
+  }
+  MaybeScheduleTick();
+  return id;
+}
+
+bool TimerWheel::Reschedule(TimerId id, MonoDelta delay) {
+  const MonoTime now = MonoTime::Now();
+  std::lock_guard<simple_spinlock> l(lock_);
+  int32_t idx = FindEntryUnlocked(id);
+  if (idx < 0) {
+    return false;
+  }
+  UnlinkUnlocked(idx);
+  entries_[idx].expiry_tick = ExpiryTickUnlocked(now, delay);
+  LinkUnlocked(idx);
+  return true;
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+  Callback cb;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    int32_t idx = FindEntryUnlocked(id);
+    if (idx < 0) {
+      return false;
+    }
+    // Destroy the callback outside the lock: it may hold the last reference
+    // to an object which cancels other timers when destroyed.
+    cb = std::move(entries_[idx].cb);
+    FreeUnlocked(idx);
+  }
+  return true;
+}
+
+int TimerWheel::RunExpired(MonoTime now) {
+  const int64_t now_tick = (now - start_time_).ToNanoseconds() / tick_.ToNanoseconds();
+  vector<Callback> expired;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    while (current_tick_ < now_tick) {
+      if (num_timers_ == 0) {
+        // Nothing to cascade or expire: skip ahead.
+        current_tick_ = now_tick;
+        break;
+      }
+      AdvanceOneTickUnlocked(&expired);
+    }
+  }
+  for (Callback& cb : expired) {
+    cb();
+  }
+  return expired.size();
+}
+
+int64_t TimerWheel::num_timers() const {
+  std::lock_guard<simple_spinlock> l(lock_);
+  return num_timers_;
+}
+
+int64_t TimerWheel::ExpiryTickUnlocked(MonoTime now, MonoDelta delay) const {
+  DCHECK(lock_.is_locked());
+  const int64_t tick_nanos = tick_.ToNanoseconds();
+  const int64_t nanos = (now - start_time_).ToNanoseconds() + std::max<int64_t>(
+      0, delay.ToNanoseconds());
+  // Round up, so that timers never expire early.
+  int64_t expiry_tick = (nanos + tick_nanos - 1) / tick_nanos;
+  const int64_t max_ticks = (1LL << (kSlotBits * kNumLevels)) - 1;
+  return std::min(std::max(expiry_tick, current_tick_ + 1), current_tick_ + max_ticks);
+}
+
+int32_t TimerWheel::FindEntryUnlocked(TimerId id) const {
+  DCHECK(lock_.is_locked());
+  const uint32_t idx = static_cast<uint32_t>(id);
+  if (idx >= entries_.size()) {
+    return -1;
+  }
+  const Entry& e = entries_[idx];
+  if (e.slot < 0 || e.generation != static_cast<uint32_t>(id >> 32)) {
+    return -1;
+  }
+  return idx;
+}
+
+void TimerWheel::LinkUnlocked(int32_t idx) {
+  DCHECK(lock_.is_locked());
+  Entry& e = entries_[idx];
+  DCHECK_GT(e.expiry_tick, current_tick_);
+  // Pick the lowest level whose turn covers the expiry. Entries of higher
+  // levels are cascaded down as lower levels turn over.
+  const int64_t delta = e.expiry_tick - current_tick_ - 1;
+  int level = 0;
+  while (level < kNumLevels - 1 && delta >= (1LL << (kSlotBits * (level + 1)))) {
+    level++;
+  }
+  const int32_t slot = level * kNumSlots +
+      ((e.expiry_tick >> (kSlotBits * level)) & (kNumSlots - 1));
+  e.slot = slot;
+  e.prev = -1;
+  e.next = slots_[slot];
+  if (e.next >= 0) {
+    entries_[e.next].prev = idx;
+  }
+  slots_[slot] = idx;
+}
+
+void TimerWheel::UnlinkUnlocked(int32_t idx) {
+  DCHECK(lock_.is_locked());
+  Entry& e = entries_[idx];
+  DCHECK_GE(e.slot, 0);
+  if (e.prev >= 0) {
+    entries_[e.prev].next = e.next;
+  } else {
+    slots_[e.slot] = e.next;
+  }
+  if (e.next >= 0) {
+    entries_[e.next].prev = e.prev;
+  }
+  e.prev = -1;
+  e.next = -1;
+  e.slot = -1;
+}
+
+void TimerWheel::FreeUnlocked(int32_t idx) {
+  DCHECK(lock_.is_locked());
+  UnlinkUnlocked(idx);
+  Entry& e = entries_[idx];
+  if (++e.generation == 0) {
+    e.generation = 1;
+  }
+  e.cb = nullptr;
+  e.next = free_head_;
+  free_head_ = idx;
+  num_timers_--;
+}
+
+void TimerWheel::AdvanceOneTickUnlocked(vector<Callback>* expired) {
+  DCHECK(lock_.is_locked());
+  const int64_t tick = current_tick_ + 1;
+
+  // When a level turns over, the slot of the level above it which covers the
+  // new turn is spread over the levels below. This is done before moving to
+  // 'tick', since some of its entries may expire right away.
+  for (int level = 1; level < kNumLevels; level++) {
+    if ((tick & ((1LL << (kSlotBits * level)) - 1)) != 0) {
+      break;
+    }
+    CascadeUnlocked(level * kNumSlots + ((tick >> (kSlotBits * level)) & (kNumSlots - 1)));
+  }
+  current_tick_ = tick;
+
+  // Everything in the current slot of the lowest level expires now.
+  const int32_t slot = tick & (kNumSlots - 1);
+  while (slots_[slot] >= 0) {
+    const int32_t idx = slots_[slot];
+    DCHECK_EQ(tick, entries_[idx].expiry_tick);
+    expired->emplace_back(std::move(entries_[idx].cb));
+    FreeUnlocked(idx);
+  }
+}
+
+void TimerWheel::CascadeUnlocked(int32_t slot) {
+  DCHECK(lock_.is_locked());
+  int32_t idx = slots_[slot];
+  slots_[slot] = -1;
+  while (idx >= 0) {
+    const int32_t next = entries_[idx].next;
+    LinkUnlocked(idx);
+    idx = next;
+  }
+}
+
+void TimerWheel::MaybeScheduleTick() {
+  if (messenger_ == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    if (tick_scheduled_ || num_timers_ == 0) {
+      return;
+    }
+    tick_scheduled_ = true;
+  }
+  // Not under 'lock_': the task is aborted inline if the messenger is
+  // shutting down.
+  weak_ptr<TimerWheel> w = shared_from_this();
+  messenger_->ScheduleOnReactor([w](const Status& s) {
+    if (auto wheel = w.lock()) {
+      if (!s.ok()) {
+        // The reactor was shut down: the wheel stops ticking.
+        std::lock_guard<simple_spinlock> l(wheel->lock_);
+        wheel->tick_scheduled_ = false;
+        return;
+      }
+      wheel->Tick();
+    }
+  }, tick_);
+}
+
+void TimerWheel::Tick() {
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    tick_scheduled_ = false;
+  }
+  RunExpired(MonoTime::Now());
+  MaybeScheduleTick();
+}
+
+} // namespace rpc
+} // namespace kudu
@@ -0,0 +1,162 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "kudu/gutil/macros.h"
+#include "kudu/util/locks.h"
+#include "kudu/util/monotime.h"
+
+namespace kudu {
+namespace rpc {
+
+class Messenger;
+
+// A hierarchical timing wheel, which runs many timers off a single periodic
+// tick rather than scheduling each of them on the reactors individually.
+//
+// Scheduling, rescheduling and canceling a timer are all O(1): timers are
+// kept in intrusive lists, one per slot of the wheel, and moving a timer only
+// relinks it. Each level of the wheel has 256 slots, a slot of a level
+// spanning a full turn of the level below it. Timers land in the lowest level
+// which covers their expiration, and are cascaded down a level whenever the
+// level below turns over. Expirations are rounded up to the next tick, and
+// delays are capped to the span of the wheel (2^32 ticks).
+//
+// When created with a messenger, the wheel ticks itself on the messenger's
+// reactors for as long as it has timers scheduled, and timer callbacks run on
+// a reactor thread. They should do very little work (i.e. no I/O). Without a
+// messenger, the wheel only advances when RunExpired() is called.
+//
+// This class is thread-safe.
+class TimerWheel : public std::enable_shared_from_this<TimerWheel> {
+ public:
+  typedef std::function<void()> Callback;
+
+  // Identifies a scheduled timer. Ids aren't reused, so a stale id is safe to
+  // pass to Reschedule() or Cancel().
+  typedef uint64_t TimerId;
+
+  // An id which no timer ever has.
+  static const TimerId kInvalidTimerId = 0;
+
+  // Creates a wheel advancing by 'tick' at a time. 'messenger', if set, is
+  // used to tick the wheel and must outlive it.
+  static std::shared_ptr<TimerWheel> Create(Messenger* messenger, MonoDelta tick);
+
+  ~TimerWheel();
+
+  // Schedules 'cb' to run once, 'delay' from now.
+  TimerId Schedule(MonoDelta delay, Callback cb);
+
+  // Moves the timer 'id' to run 'delay' from now. Returns false if the timer
+  // has already run or been canceled.
+  bool Reschedule(TimerId id, MonoDelta delay);
+
+  // Cancels the timer 'id'. Returns false if the timer has already run or
+  // been canceled. A timer whose callback is running can't be canceled.
+  bool Cancel(TimerId id);
+
+  // Runs the callbacks of the timers which expired by 'now', in expiration
+  // order. Returns the number of callbacks run.
+  int RunExpired(MonoTime now);
+
+  // Returns the number of timers scheduled.
+  int64_t num_timers() const;
+
+ private:
+  static const int kSlotBits = 8;
+  static const int kNumSlots = 1 << kSlotBits;
+  static const int kNumLevels = 4;
+
+  // A timer, linked into the list of its slot, or into the free list.
+  struct Entry {
+    // Incremented whenever the entry is freed, to tell stale ids apart.
+    // Starts at 1 so that no id is kInvalidTimerId.
+    uint32_t generation = 1;
+    int32_t prev = -1;
+    int32_t next = -1;
+    // The slot the entry is linked into, or -1 if it's free.
+    int32_t slot = -1;
+    int64_t expiry_tick = 0;
+    Callback cb;
+  };
+
+  TimerWheel(Messenger* messenger, MonoDelta tick);
+
+  // Returns the tick at which a timer scheduled 'delay' from 'now' expires.
+  int64_t ExpiryTickUnlocked(MonoTime now, MonoDelta delay) const;
+
+  // Returns the index of the scheduled entry 'id', or -1 if there's none.
+  int32_t FindEntryUnlocked(TimerId id) const;
+
+  // Links entry 'idx' into the slot of its expiry tick.
+  void LinkUnlocked(int32_t idx);
+
+  // Unlinks entry 'idx' from its slot.
+  void UnlinkUnlocked(int32_t idx);
+
+  // Unlinks and frees entry 'idx'.
+  void FreeUnlocked(int32_t idx);
+
+  // Advances the wheel by one tick, cascading higher levels as needed, and
+  // moves the callbacks of the timers which expire into 'expired'.
+  void AdvanceOneTickUnlocked(std::vector<Callback>* expired);
+
+  // Re-links all the entries of 'slot', which belongs to a higher level.
+  void CascadeUnlocked(int32_t slot);
+
+  // Schedules the next tick on the messenger's reactors, unless there's no
+  // messenger or one is already scheduled.
+  void MaybeScheduleTick();
+
+  // Runs on a reactor to advance the wheel.
+  void Tick();
+
+  Messenger* const messenger_;
+  const MonoDelta tick_;
+  const MonoTime start_time_;
+
+  mutable simple_spinlock lock_;
+
+  // All entries, scheduled or free.
+  std::vector<Entry> entries_;
+
+  // The head of the free list of 'entries_', or -1 if empty.
+  int32_t free_head_;
+
+  // The head entry of each slot, level by level, or -1 if empty.
+  int32_t slots_[kNumLevels * kNumSlots];
+
+  // The last tick processed. Timers expire on later ticks.
+  int64_t current_tick_;
+
+  int64_t num_timers_;
+
+  // Whether a Tick() is scheduled on the reactors.
+  bool tick_scheduled_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+} // namespace rpc
+} // namespace kudu
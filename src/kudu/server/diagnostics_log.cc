@@ -17,6 +17,7 @@
 
 #include "kudu/server/diagnostics_log.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <memory>
@@ -30,17 +31,25 @@
 #include <glog/logging.h>
 #include <sparsehash/dense_hash_set>
 
+#include "kudu/gutil/hash/builtin_type_hash.h"
 #include "kudu/gutil/map-util.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/gutil/stringprintf.h"
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/gutil/walltime.h"
 #include "kudu/util/array_view.h"
+#include "kudu/util/coding.h"
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/compression/compression_codec.h"
 #include "kudu/util/condition_variable.h"
 #include "kudu/util/debug-util.h"
 #include "kudu/util/env.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/flag_tags.h"
+#include "kudu/util/group_varint-inl.h"
+#include "kudu/util/hdr_histogram.h"
 #include "kudu/util/jsonwriter.h"
+#include "kudu/util/lock_profiling.h"
 #include "kudu/util/logging.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
@@ -49,6 +58,7 @@
 #include "kudu/util/random_util.h"
 #include "kudu/util/rolling_log.h"
 #include "kudu/util/scoped_cleanup.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 #include "kudu/util/thread.h"
 
@@ -79,9 +89,193 @@ DEFINE_int32(diagnostics_log_stack_traces_interval_ms, 60000,
 TAG_FLAG(diagnostics_log_stack_traces_interval_ms, runtime);
 TAG_FLAG(diagnostics_log_stack_traces_interval_ms, experimental);
 
+DEFINE_int32(diagnostics_log_lock_contention_interval_ms, 60000,
+             "The interval at which the server writes the contention report of its "
+             "profiled locks to the diagnostics log. If this is set to 0 or a negative "
+             "value, the report isn't logged.");
+TAG_FLAG(diagnostics_log_lock_contention_interval_ms, runtime);
+TAG_FLAG(diagnostics_log_lock_contention_interval_ms, experimental);
+
+DEFINE_string(diagnostics_log_metrics_format, "json",
+              "The format of the metrics periodically logged by the server. With 'json', "
+              "the metrics which changed since the last time are dumped as JSON into the "
+              "diagnostics log. With 'binary', the numeric metrics are delta-encoded into "
+              "a compact binary 'metrics' log, which is cheap enough to sample every second. "
+              "Binary metrics logs can be read with 'kudu diagnose parse_metrics'.");
+TAG_FLAG(diagnostics_log_metrics_format, experimental);
+
+DEFINE_string(diagnostics_log_metrics_compression, "lz4",
+              "The codec used to compress the samples of the binary metrics log: one of "
+              "'none', 'snappy', 'lz4', 'zlib' or 'zstd'.");
+TAG_FLAG(diagnostics_log_metrics_compression, experimental);
+
+static bool ValidateMetricsFormat(const char* flag_name, const string& flag_value) {
+  if (flag_value == "json" || flag_value == "binary") {
+    return true;
+  }
+  LOG(ERROR) << Substitute("--$0 must be 'json' or 'binary', not '$1'", flag_name, flag_value);
+  return false;
+}
+DEFINE_validator(diagnostics_log_metrics_format, &ValidateMetricsFormat);
+
 namespace kudu {
 namespace server {
 
+//
+// MetricsLogEncoder
+//
+
+// "KMLF": Kudu metrics log frame.
+const uint32_t MetricsLogEncoder::kFrameMagic = 0x464c4d4b;
+const uint8_t MetricsLogEncoder::kResetFlag;
+const uint8_t MetricsLogEncoder::kInt64Series;
+const uint8_t MetricsLogEncoder::kDoubleSeries;
+const char* const MetricsLogEncoder::kHistogramSuffixes[] = {
+  "_count", "_sum", "_p50", "_p95", "_p99", "_p999", "_max"
+};
+const int MetricsLogEncoder::kNumHistogramSuffixes = arraysize(kHistogramSuffixes);
+
+size_t MetricsLogEncoder::SeriesKeyHash::operator()(const SeriesKey& key) const {
+  return Hash64NumWithSeed(
+      reinterpret_cast<uintptr_t>(key.entity),
+      Hash64NumWithSeed(reinterpret_cast<uintptr_t>(key.prototype), key.part));
+}
+
+MetricsLogEncoder::MetricsLogEncoder(const CompressionCodec* codec)
+    : codec_(codec),
+      reset_(true),
+      epoch_(0),
+      num_new_series_(0) {
+}
+
+MetricsLogEncoder::~MetricsLogEncoder() {
+}
+
+void MetricsLogEncoder::Reset() {
+  series_numbers_.clear();
+  series_.clear();
+  reset_ = true;
+}
+
+void MetricsLogEncoder::RecordValue(const MetricEntity& entity, const MetricPrototype* prototype,
+                                    int part, const char* suffix, bool is_double,
+                                    int64_t value) {
+  SeriesKey key = { &entity, prototype, part };
+  auto it = series_numbers_.find(key);
+  if (it == series_numbers_.end() || series_[it->second].entity_id != entity.id()) {
+    // Zeros don't need a series yet: that's what new series start from.
+    if (value == 0) {
+      return;
+    }
+    uint32_t number = series_.size();
+    series_.push_back({ entity.id(), 0 });
+    series_numbers_[key] = number;
+
+    PutLengthPrefixedSlice(&new_series_, Slice(entity.prototype()->name()));
+    PutLengthPrefixedSlice(&new_series_, Slice(entity.id()));
+    size_t name_len = strlen(prototype->name());
+    size_t suffix_len = strlen(suffix);
+    PutVarint32(&new_series_, name_len + suffix_len);
+    new_series_.append(prototype->name(), name_len);
+    new_series_.append(suffix, suffix_len);
+    new_series_.push_back(is_double ? kDoubleSeries : kInt64Series);
+    num_new_series_++;
+    it = series_numbers_.find(key);
+  }
+
+  Series& series = series_[it->second];
+  if (value != series.value) {
+    // Differences are taken modulo 2^64, so that they never overflow.
+    changes_.emplace_back(it->second, static_cast<int64_t>(
+        static_cast<uint64_t>(value) - static_cast<uint64_t>(series.value)));
+    series.value = value;
+  }
+}
+
+Status MetricsLogEncoder::EncodeSample(const MetricRegistry& registry, int64_t time_us,
+                                       faststring* out) {
+  new_series_.clear();
+  num_new_series_ = 0;
+  changes_.clear();
+
+  // Like the JSON metrics, only the metrics modified since the previous sample
+  // are looked at.
+  const bool reset = reset_;
+  const int64_t this_epoch = Metric::current_epoch();
+  Metric::IncrementEpoch();
+  registry.VisitMetrics([&](const MetricEntity& entity, Metric* metric) {
+      if (!reset && !metric->ModifiedInOrAfterEpoch(epoch_)) {
+        return;
+      }
+      const MetricPrototype* prototype = metric->prototype();
+      if (prototype->type() == MetricType::kHistogram) {
+        const HdrHistogram* hist = down_cast<Histogram*>(metric)->histogram();
+        static const double kPercentiles[] = { 50, 95, 99, 99.9 };
+        uint64_t values[kNumHistogramSuffixes];
+        values[0] = hist->ScanPercentiles(kPercentiles, arraysize(kPercentiles),
+                                          &values[2], nullptr);
+        values[1] = hist->TotalSum();
+        values[kNumHistogramSuffixes - 1] = hist->MaxValue();
+        for (int i = 0; i < kNumHistogramSuffixes; i++) {
+          RecordValue(entity, prototype, i, kHistogramSuffixes[i], false, values[i]);
+        }
+        return;
+      }
+      // Gauges may be exposed as counters, so it takes the metric itself
+      // rather than its prototype to tell them apart.
+      if (const Counter* counter = dynamic_cast<const Counter*>(metric)) {
+        RecordValue(entity, prototype, 0, "", false, counter->value());
+        return;
+      }
+      int64_t value;
+      bool is_double;
+      if (down_cast<Gauge*>(metric)->GetRawValue(&value, &is_double)) {
+        RecordValue(entity, prototype, 0, "", is_double, value);
+      }
+    });
+
+  payload_.clear();
+  PutVarint64(&payload_, time_us);
+  payload_.push_back(reset ? kResetFlag : 0);
+  PutVarint32(&payload_, num_new_series_);
+  payload_.append(new_series_.data(), new_series_.size());
+
+  std::sort(changes_.begin(), changes_.end());
+  PutVarint32(&payload_, changes_.size());
+  gaps_.clear();
+  int64_t prev_number = -1;
+  for (const auto& change : changes_) {
+    gaps_.push_back(change.first - prev_number - 1);
+    prev_number = change.first;
+  }
+  coding::AppendGroupVarInt32Sequence(&payload_, 0, gaps_.data(), gaps_.size());
+  for (const auto& change : changes_) {
+    // Zigzag-encode the difference, so that small negative ones are short too.
+    PutVarint64(&payload_, (static_cast<uint64_t>(change.second) << 1) ^
+                           static_cast<uint64_t>(change.second >> 63));
+  }
+
+  Slice frame_payload(payload_);
+  CompressionType compression = NO_COMPRESSION;
+  if (codec_) {
+    compressed_.resize(codec_->MaxCompressedLength(payload_.size()));
+    size_t compressed_len;
+    RETURN_NOT_OK(codec_->Compress(Slice(payload_), compressed_.data(), &compressed_len));
+    compressed_.resize(compressed_len);
+    frame_payload = Slice(compressed_);
+    compression = codec_->type();
+  }
+  PutFixed32(out, kFrameMagic);
+  out->push_back(static_cast<uint8_t>(compression));
+  PutVarint32(out, payload_.size());
+  PutVarint32(out, frame_payload.size());
+  out->append(frame_payload.data(), frame_payload.size());
+
+  reset_ = false;
+  epoch_ = this_epoch + 1;
+  return Status::OK();
+}
+
 // Track which symbols have been emitted to the log already.
 class DiagnosticsLog::SymbolSet {
  public:
@@ -139,12 +333,25 @@ Status DiagnosticsLog::Start() {
   unique_ptr<RollingLog> l(new RollingLog(Env::Default(), log_dir_, "diagnostics"));
   RETURN_NOT_OK_PREPEND(l->Open(), "unable to open diagnostics log");
   log_ = std::move(l);
+  if (FLAGS_diagnostics_log_metrics_format == "binary") {
+    const CompressionCodec* codec;
+    RETURN_NOT_OK(GetCompressionCodec(
+        GetCompressionCodecType(FLAGS_diagnostics_log_metrics_compression), &codec));
+    unique_ptr<RollingLog> ml(new RollingLog(Env::Default(), log_dir_, "metrics"));
+    // The frames are compressed already.
+    ml->SetCompressionEnabled(false);
+    RETURN_NOT_OK_PREPEND(ml->Open(), "unable to open metrics log");
+    metrics_log_ = std::move(ml);
+    metrics_encoder_.reset(new MetricsLogEncoder(codec));
+    metrics_log_roll_count_ = metrics_log_->roll_count();
+  }
   Status s = Thread::Create("server", "diag-logger",
                             &DiagnosticsLog::RunThread,
                             this, &thread_);
   if (!s.ok()) {
-    // Don't leave the log open if we failed to start our thread.
+    // Don't leave the logs open if we failed to start our thread.
     log_.reset();
+    metrics_log_.reset();
   }
   return s;
 }
@@ -161,6 +368,9 @@ void DiagnosticsLog::Stop() {
   thread_.reset();
   stop_ = false;
   WARN_NOT_OK(log_->Close(), "Unable to close diagnostics log");
+  if (metrics_log_) {
+    WARN_NOT_OK(metrics_log_->Close(), "Unable to close metrics log");
+  }
 }
 
 MonoTime DiagnosticsLog::ComputeNextWakeup(DiagnosticsLog::WakeupType type) const {
@@ -185,6 +395,11 @@ MonoTime DiagnosticsLog::ComputeNextWakeup(DiagnosticsLog::WakeupType type) cons
       break;
     case WakeupType::METRICS:
       return MonoTime::Now() + metrics_log_interval_;
+    case WakeupType::LOCK_CONTENTION:
+      // As for stacks, keep waking up while disabled to notice flag changes.
+      return MonoTime::Now() + MonoDelta::FromMilliseconds(
+          FLAGS_diagnostics_log_lock_contention_interval_ms > 0 ?
+          FLAGS_diagnostics_log_lock_contention_interval_ms : 5000);
   }
   __builtin_unreachable();
 }
@@ -196,6 +411,8 @@ void DiagnosticsLog::RunThread() {
   typedef pair<MonoTime, WakeupType> QueueElem;
   priority_queue<QueueElem, vector<QueueElem>, std::greater<QueueElem>> wakeups;
   wakeups.emplace(ComputeNextWakeup(WakeupType::METRICS), WakeupType::METRICS);
+  wakeups.emplace(ComputeNextWakeup(WakeupType::LOCK_CONTENTION),
+                  WakeupType::LOCK_CONTENTION);
 #ifdef FB_DO_NOT_REMOVE
   wakeups.emplace(ComputeNextWakeup(WakeupType::STACKS), WakeupType::STACKS);
 #endif
@@ -233,6 +450,11 @@ void DiagnosticsLog::RunThread() {
     if (what == WakeupType::METRICS) {
       WARN_NOT_OK(LogMetrics(), "Unable to collect metrics to diagnostics log");
     }
+    if (what == WakeupType::LOCK_CONTENTION &&
+        FLAGS_diagnostics_log_lock_contention_interval_ms > 0) {
+      WARN_NOT_OK(LogLockContention(),
+                  "Unable to write lock contention report to diagnostics log");
+    }
 
 #ifdef FB_DO_NOT_REMOVE
     if (what == WakeupType::STACKS && FLAGS_diagnostics_log_stack_traces_interval_ms >= 0) {
@@ -334,7 +556,27 @@ Status DiagnosticsLog::LogStacks(const string& reason) {
 }
 #endif
 
+Status DiagnosticsLog::LogLockContention() {
+  std::ostringstream report;
+  DumpLockContentionReport(&report);
+
+  std::ostringstream buf;
+  MicrosecondsInt64 now = GetCurrentTimeMicros();
+  buf << "I" << FormatTimestampForLog(now) << " lock_contention " << now << " ";
+  JsonWriter jw(&buf, JsonWriter::COMPACT);
+  jw.StartObject();
+  jw.String("report");
+  jw.String(report.str());
+  jw.EndObject();
+  buf << "\n";
+
+  return log_->Append(buf.str());
+}
+
 Status DiagnosticsLog::LogMetrics() {
+  if (metrics_encoder_) {
+    return LogBinaryMetrics();
+  }
   MetricJsonOptions opts;
   opts.include_raw_histograms = true;
 
@@ -372,6 +614,28 @@ Status DiagnosticsLog::LogMetrics() {
   return Status::OK();
 }
 
+Status DiagnosticsLog::LogBinaryMetrics() {
+  // Each file of the log starts over from a full sample, so that it can be
+  // read on its own.
+  if (metrics_log_->roll_count() != metrics_log_roll_count_) {
+    metrics_log_roll_count_ = metrics_log_->roll_count();
+    metrics_encoder_->Reset();
+  }
+  metrics_buf_.clear();
+  Status s = metrics_encoder_->EncodeSample(*metric_registry_, GetCurrentTimeMicros(),
+                                            &metrics_buf_);
+  if (s.ok()) {
+    s = metrics_log_->Append(StringPiece(reinterpret_cast<const char*>(metrics_buf_.data()),
+                                         metrics_buf_.size()));
+  }
+  if (!s.ok()) {
+    // The reader will never see this sample, so the next one must not be
+    // relative to it.
+    metrics_encoder_->Reset();
+  }
+  return s;
+}
+
 
 } // namespace server
 } // namespace kudu
@@ -16,20 +16,28 @@
 // under the License.
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <boost/optional/optional.hpp>
 
 #include "kudu/gutil/macros.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/util/condition_variable.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/monotime.h"
 #include "kudu/util/mutex.h"
 
 namespace kudu {
 
+class CompressionCodec;
+class MetricEntity;
+class MetricPrototype;
 class MetricRegistry;
 class RollingLog;
 class Thread;
@@ -37,6 +45,111 @@ class Status;
 
 namespace server {
 
+// Encodes samples of the numeric metrics of a registry into the compact
+// binary format of the metrics log, written by DiagnosticsLog when
+// --diagnostics_log_metrics_format=binary. See tools::MetricsLogReader for the
+// reader.
+//
+// Each metric is a series, identified by its entity's type and id and its
+// name. Histograms make several series, named after the histogram with the
+// suffixes in kHistogramSuffixes. Series are numbered in the order they are
+// first defined, and each sample only carries the series whose values changed
+// since the previous sample, delta-encoded against it:
+//
+//   frame:
+//     fixed32   kFrameMagic
+//     uint8     CompressionType of the payload
+//     varint32  uncompressed payload length
+//     varint32  payload length
+//     payload
+//   payload:
+//     varint64  sample time, in microseconds since the epoch
+//     uint8     flags: kResetFlag if the reader must forget all the series
+//               first. The first frame of each file has it.
+//     varint32  number of new series, defined as:
+//                 length-prefixed entity type, entity id and series name
+//                 uint8 kInt64Series or kDoubleSeries
+//     varint32  number of changed values
+//     group varints: for each changed series, in increasing order, the gap
+//                    from the previous changed series' number, minus one
+//     varint64s: for each changed series, the zigzag-encoded difference of
+//                its value (the bit pattern for doubles) from the previous one.
+//                The previous value of a new series is 0.
+//
+// Series aren't defined until their value is first non-zero.
+//
+// This class is not thread-safe.
+class MetricsLogEncoder {
+ public:
+  static const uint32_t kFrameMagic;
+  static const uint8_t kResetFlag = 1;
+  static const uint8_t kInt64Series = 0;
+  static const uint8_t kDoubleSeries = 1;
+  static const char* const kHistogramSuffixes[];
+  static const int kNumHistogramSuffixes;
+
+  // 'codec' compresses the payload of each frame; it may be null.
+  explicit MetricsLogEncoder(const CompressionCodec* codec);
+  ~MetricsLogEncoder();
+
+  // Forgets all the series, so that the next frame is self-contained.
+  void Reset();
+
+  // Appends a frame with a sample of the metrics in 'registry', taken at
+  // 'time_us', to 'out'. If the frame isn't written out, Reset() must be
+  // called before encoding the next one.
+  Status EncodeSample(const MetricRegistry& registry, int64_t time_us, faststring* out);
+
+ private:
+  // Identifies a series while its entity is alive. The entity's id is kept in
+  // the series, in case the entity is destroyed and another one reuses its
+  // address.
+  struct SeriesKey {
+    const MetricEntity* entity;
+    const MetricPrototype* prototype;
+    int part;
+
+    bool operator==(const SeriesKey& other) const {
+      return entity == other.entity && prototype == other.prototype && part == other.part;
+    }
+  };
+  struct SeriesKeyHash {
+    size_t operator()(const SeriesKey& key) const;
+  };
+  struct Series {
+    std::string entity_id;
+    int64_t value;
+  };
+
+  // Records that the value of a series is 'value' in the current sample.
+  // 'suffix' is appended to the name of the metric to name the series.
+  void RecordValue(const MetricEntity& entity, const MetricPrototype* prototype,
+                   int part, const char* suffix, bool is_double, int64_t value);
+
+  const CompressionCodec* const codec_;
+
+  // The series defined since the last reset, and their numbers.
+  std::unordered_map<SeriesKey, uint32_t, SeriesKeyHash> series_numbers_;
+  std::vector<Series> series_;
+
+  // Whether the next frame resets the series.
+  bool reset_;
+
+  // Only metrics modified in or after this epoch are sampled, unless the
+  // series were reset.
+  int64_t epoch_;
+
+  // Buffers for encoding a frame, kept across frames.
+  faststring new_series_;
+  uint32_t num_new_series_;
+  std::vector<std::pair<uint32_t, int64_t>> changes_;
+  std::vector<uint32_t> gaps_;
+  faststring payload_;
+  faststring compressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricsLogEncoder);
+};
+
 class DiagnosticsLog {
  public:
   DiagnosticsLog(std::string log_dir, MetricRegistry* metric_registry);
@@ -60,11 +173,15 @@ class DiagnosticsLog {
 
   enum class WakeupType {
     METRICS,
-    STACKS
+    STACKS,
+    LOCK_CONTENTION
   };
 
   void RunThread();
   Status LogMetrics();
+  Status LogBinaryMetrics();
+  // Writes DumpLockContentionReport() to the log.
+  Status LogLockContention();
 #ifdef FB_DO_NOT_REMOVE
   Status LogStacks(const std::string& reason);
 #endif
@@ -77,6 +194,13 @@ class DiagnosticsLog {
   scoped_refptr<Thread> thread_;
   std::unique_ptr<RollingLog> log_;
 
+  // With --diagnostics_log_metrics_format=binary, the metrics go to their own
+  // log, and are encoded with 'metrics_encoder_'.
+  std::unique_ptr<RollingLog> metrics_log_;
+  std::unique_ptr<MetricsLogEncoder> metrics_encoder_;
+  int metrics_log_roll_count_ = 0;
+  faststring metrics_buf_;
+
   Mutex lock_;
   ConditionVariable wake_;
   bool stop_ = false;
@@ -376,6 +376,8 @@ ServerBase::ServerBase(string name, const ServerBaseOptions& options,
   fs_opts.parent_mem_tracker = mem_tracker_;
   fs_opts.block_manager_type = options.fs_opts.block_manager_type;
   fs_opts.wal_root = options.fs_opts.wal_root;
+  fs_opts.extra_wal_roots = options.fs_opts.extra_wal_roots;
+  fs_opts.wal_placement = options.fs_opts.wal_placement;
   fs_opts.data_roots = options.fs_opts.data_roots;
   fs_manager_.reset(new FsManager(options.env, std::move(fs_opts)));
 
@@ -17,24 +17,50 @@
 
 #include "kudu/tools/diagnostics_log_parser.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <ostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <rapidjson/document.h>
 
+#include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/server/diagnostics_log.h"
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/faststring.h"
+#include "kudu/util/jsonwriter.h"
+#include "kudu/util/metrics.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 #include "kudu/util/test_macros.h"
 
+METRIC_DEFINE_entity(test_entity);
+METRIC_DEFINE_counter(test_entity, test_counter, "Test Counter", kudu::MetricUnit::kRequests,
+                      "Description of test counter");
+METRIC_DEFINE_gauge_int64(test_entity, test_gauge, "Test Gauge", kudu::MetricUnit::kBytes,
+                          "Description of test gauge");
+METRIC_DEFINE_gauge_double(test_entity, test_double_gauge, "Test Double Gauge",
+                           kudu::MetricUnit::kUnits, "Description of test double gauge");
+METRIC_DEFINE_histogram(test_entity, test_hist, "Test Histogram",
+                        kudu::MetricUnit::kMicroseconds, "Description of test histogram",
+                        1000000, 3);
+
 namespace kudu {
 namespace tools {
 
+using kudu::server::MetricsLogEncoder;
 using std::string;
 using std::stringstream;
 using std::unique_ptr;
 using std::vector;
+using strings::Substitute;
 
 TEST(DiagLogParserTest, TestParseLine) {
   // Lines have the following format:
@@ -232,5 +258,173 @@ TEST(DiagLogParserTest, TestParseStacks) {
   ASSERT_OK(lp.ParseLine(line));
 }
 
+class MetricsLogTest : public ::testing::TestWithParam<CompressionType> {
+ public:
+  void SetUp() override {
+    entity_ = METRIC_ENTITY_test_entity.Instantiate(&registry_, "my-entity");
+    counter_ = METRIC_test_counter.Instantiate(entity_);
+    gauge_ = METRIC_test_gauge.Instantiate(entity_, 0);
+    double_gauge_ = METRIC_test_double_gauge.Instantiate(entity_, 0);
+    hist_ = METRIC_test_hist.Instantiate(entity_);
+
+    const CompressionCodec* codec = nullptr;
+    if (GetParam() != NO_COMPRESSION) {
+      ASSERT_OK(GetCompressionCodec(GetParam(), &codec));
+    }
+    encoder_.reset(new MetricsLogEncoder(codec));
+  }
+
+ protected:
+  // Encodes a sample, decodes it and returns the names of the changed series
+  // and their values in 'changed', sorted, and the size of the frame.
+  void EncodeAndDecode(int64_t time_us, vector<string>* changed, size_t* frame_size) {
+    faststring buf;
+    ASSERT_OK(encoder_->EncodeSample(registry_, time_us, &buf));
+    Slice data(buf);
+    MetricsLogSample sample;
+    ASSERT_OK(reader_.ReadFrame(&data, &sample));
+    ASSERT_TRUE(data.empty());
+    ASSERT_EQ(time_us, sample.time_us);
+    changed->clear();
+    for (uint32_t n : sample.changed) {
+      changed->push_back(reader_.series()[n].name + "=" + reader_.ValueToString(n));
+    }
+    std::sort(changed->begin(), changed->end());
+    *frame_size = buf.size();
+  }
+
+  MetricRegistry registry_;
+  scoped_refptr<MetricEntity> entity_;
+  scoped_refptr<Counter> counter_;
+  scoped_refptr<AtomicGauge<int64_t>> gauge_;
+  scoped_refptr<AtomicGauge<double>> double_gauge_;
+  scoped_refptr<Histogram> hist_;
+  std::unique_ptr<MetricsLogEncoder> encoder_;
+  MetricsLogReader reader_;
+};
+
+INSTANTIATE_TEST_CASE_P(Compression, MetricsLogTest,
+                        ::testing::Values(NO_COMPRESSION, LZ4, ZLIB));
+
+TEST_P(MetricsLogTest, TestRoundTrip) {
+  counter_->IncrementBy(10);
+  gauge_->set_value(-5);
+  double_gauge_->set_value(1.5);
+  hist_->Increment(100);
+  hist_->Increment(200);
+
+  vector<string> changed;
+  size_t first_frame_size;
+  NO_FATALS(EncodeAndDecode(1000, &changed, &first_frame_size));
+  ASSERT_EQ(vector<string>({ "test_counter=10", "test_double_gauge=1.5", "test_gauge=-5",
+                             "test_hist_count=2", "test_hist_max=200", "test_hist_p50=100",
+                             "test_hist_p95=200", "test_hist_p99=200", "test_hist_p999=200",
+                             "test_hist_sum=300" }),
+            changed);
+  ASSERT_EQ(10, reader_.series().size());
+  for (const auto& s : reader_.series()) {
+    ASSERT_EQ("test_entity", s.entity_type);
+    ASSERT_EQ("my-entity", s.entity_id);
+    ASSERT_EQ(s.name == "test_double_gauge", s.is_double);
+  }
+
+  // Untouched metrics aren't written out at all.
+  size_t frame_size;
+  NO_FATALS(EncodeAndDecode(2000, &changed, &frame_size));
+  ASSERT_TRUE(changed.empty());
+
+  // Only the changed values are written out, without their names.
+  counter_->Increment();
+  gauge_->set_value(7);
+  NO_FATALS(EncodeAndDecode(3000, &changed, &frame_size));
+  ASSERT_EQ(vector<string>({ "test_counter=11", "test_gauge=7" }), changed);
+  ASSERT_LT(frame_size, first_frame_size);
+  ASSERT_EQ(10, reader_.series().size());
+
+  // Metrics which are touched but keep their value aren't written out either.
+  double_gauge_->set_value(1.5);
+  NO_FATALS(EncodeAndDecode(4000, &changed, &frame_size));
+  ASSERT_TRUE(changed.empty());
+
+  // A new metric defines its series in the frame which first carries it.
+  scoped_refptr<MetricEntity> other = METRIC_ENTITY_test_entity.Instantiate(&registry_, "other");
+  scoped_refptr<Counter> other_counter = METRIC_test_counter.Instantiate(other);
+  other_counter->IncrementBy(3);
+  NO_FATALS(EncodeAndDecode(5000, &changed, &frame_size));
+  ASSERT_EQ(vector<string>({ "test_counter=3" }), changed);
+  ASSERT_EQ(11, reader_.series().size());
+  ASSERT_EQ("other", reader_.series().back().entity_id);
+
+  // After a reset, the frame is self-contained and has all the values.
+  encoder_->Reset();
+  MetricsLogReader fresh_reader;
+  faststring buf;
+  ASSERT_OK(encoder_->EncodeSample(registry_, 6000, &buf));
+  Slice data(buf);
+  MetricsLogSample sample;
+  ASSERT_OK(fresh_reader.ReadFrame(&data, &sample));
+  ASSERT_EQ(11, sample.changed.size());
+  ASSERT_EQ(11, fresh_reader.series().size());
+}
+
+TEST_P(MetricsLogTest, TestCorruption) {
+  counter_->Increment();
+  faststring buf;
+  ASSERT_OK(encoder_->EncodeSample(registry_, 1000, &buf));
+
+  // Truncated frames.
+  for (int len = 0; len < buf.size(); len++) {
+    SCOPED_TRACE(len);
+    MetricsLogReader reader;
+    Slice data(buf.data(), len);
+    MetricsLogSample sample;
+    ASSERT_FALSE(reader.ReadFrame(&data, &sample).ok());
+  }
+
+  // A frame which isn't one.
+  buf.data()[0] ^= 0xff;
+  Slice data(buf);
+  MetricsLogSample sample;
+  Status s = reader_.ReadFrame(&data, &sample);
+  ASSERT_TRUE(s.IsCorruption()) << s.ToString();
+}
+
+// Compares the size of the binary samples of many metrics with that of the
+// JSON ones, which are also limited to the metrics modified since the
+// previous sample.
+TEST_P(MetricsLogTest, TestSizeComparedToJson) {
+  const int kNumEntities = 100;
+  vector<scoped_refptr<Counter>> counters;
+  for (int i = 0; i < kNumEntities; i++) {
+    scoped_refptr<MetricEntity> e = METRIC_ENTITY_test_entity.Instantiate(
+        &registry_, Substitute("entity-$0", i));
+    counters.emplace_back(METRIC_test_counter.Instantiate(e));
+    METRIC_test_gauge.Instantiate(e, i);
+  }
+  size_t binary_size = 0;
+  size_t json_size = 0;
+  int64_t json_epoch = 0;
+  for (int sample = 1; sample <= 10; sample++) {
+    for (int i = 0; i < counters.size(); i += 2) {
+      counters[i]->IncrementBy(sample);
+    }
+    const int64_t this_epoch = Metric::current_epoch();
+    std::ostringstream json;
+    JsonWriter w(&json, JsonWriter::COMPACT);
+    MetricJsonOptions opts;
+    opts.only_modified_in_or_after_epoch = json_epoch;
+    ASSERT_OK(registry_.WriteAsJson(&w, { "*" }, opts));
+    json_size += json.str().size();
+    json_epoch = this_epoch + 1;
+
+    faststring buf;
+    ASSERT_OK(encoder_->EncodeSample(registry_, sample * 60000000L, &buf));
+    binary_size += buf.size();
+  }
+  LOG(INFO) << Substitute("10 samples of $0 entities: $1 bytes as binary, $2 bytes as JSON",
+                          kNumEntities, binary_size, json_size);
+  ASSERT_LT(binary_size * 4, json_size);
+}
+
 } // namespace tools
 } // namespace kudu
@@ -19,6 +19,7 @@
 
 #include <array>
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <string>
@@ -35,7 +36,13 @@
 #include "kudu/gutil/strings/split.h"
 #include "kudu/gutil/strings/stringpiece.h"
 #include "kudu/gutil/strings/substitute.h"
+#include "kudu/server/diagnostics_log.h"
+#include "kudu/util/coding.h"
+#include "kudu/util/compression/compression.pb.h"
+#include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/group_varint-inl.h"
 #include "kudu/util/jsonreader.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 
 using std::array;
@@ -43,6 +50,7 @@ using std::cout;
 using std::endl;
 using std::ifstream;
 using std::string;
+using kudu::server::MetricsLogEncoder;
 using strings::Substitute;
 
 namespace kudu {
@@ -248,6 +256,130 @@ Status LogParser::ParseStacks(const ParsedLine& pl) {
   return Status::OK();
 }
 
+Status MetricsLogReader::ReadFrame(Slice* data, MetricsLogSample* sample) {
+  // The magic number and the compression type.
+  static const int kFixedHeaderLength = 5;
+  if (data->size() < kFixedHeaderLength) {
+    return Status::Corruption("truncated metrics log frame header");
+  }
+  if (DecodeFixed32(data->data()) != MetricsLogEncoder::kFrameMagic) {
+    return Status::Corruption("bad metrics log frame magic number");
+  }
+  CompressionType compression = static_cast<CompressionType>((*data)[4]);
+  data->remove_prefix(kFixedHeaderLength);
+  uint32_t uncompressed_len;
+  uint32_t len;
+  if (!GetVarint32(data, &uncompressed_len) || !GetVarint32(data, &len) ||
+      data->size() < len) {
+    return Status::Corruption("truncated metrics log frame");
+  }
+  Slice payload(data->data(), len);
+  data->remove_prefix(len);
+
+  const CompressionCodec* codec = nullptr;
+  if (compression != NO_COMPRESSION) {
+    RETURN_NOT_OK_PREPEND(GetCompressionCodec(compression, &codec),
+                          "bad metrics log frame compression");
+  }
+  // The group varint decoder may read up to 3 bytes past the last integer.
+  payload_.resize(uncompressed_len + 3);
+  if (codec) {
+    RETURN_NOT_OK_PREPEND(codec->Uncompress(payload, payload_.data(), uncompressed_len),
+                          "unable to uncompress metrics log frame");
+  } else {
+    if (len != uncompressed_len) {
+      return Status::Corruption("bad metrics log frame length");
+    }
+    memcpy(payload_.data(), payload.data(), len);
+  }
+  return ReadPayload(Slice(payload_.data(), uncompressed_len), sample);
+}
+
+Status MetricsLogReader::ReadPayload(Slice payload, MetricsLogSample* sample) {
+  uint64_t time_us;
+  if (!GetVarint64(&payload, &time_us) || payload.empty()) {
+    return Status::Corruption("truncated metrics log sample");
+  }
+  uint8_t flags = payload[0];
+  payload.remove_prefix(1);
+  if (flags & MetricsLogEncoder::kResetFlag) {
+    series_.clear();
+    values_.clear();
+  }
+
+  uint32_t num_new_series;
+  if (!GetVarint32(&payload, &num_new_series)) {
+    return Status::Corruption("truncated metrics log series");
+  }
+  for (uint32_t i = 0; i < num_new_series; i++) {
+    Slice entity_type;
+    Slice entity_id;
+    Slice name;
+    if (!GetLengthPrefixedSlice(&payload, &entity_type) ||
+        !GetLengthPrefixedSlice(&payload, &entity_id) ||
+        !GetLengthPrefixedSlice(&payload, &name) ||
+        payload.empty()) {
+      return Status::Corruption("truncated metrics log series");
+    }
+    series_.push_back({ entity_type.ToString(), entity_id.ToString(), name.ToString(),
+                        payload[0] == MetricsLogEncoder::kDoubleSeries });
+    values_.push_back(0);
+    payload.remove_prefix(1);
+  }
+
+  uint32_t num_changed;
+  if (!GetVarint32(&payload, &num_changed)) {
+    return Status::Corruption("truncated metrics log values");
+  }
+  sample->time_us = time_us;
+  sample->changed.clear();
+  sample->changed.reserve(num_changed);
+  int64_t number = -1;
+  for (uint32_t i = 0; i < num_changed; i += 4) {
+    // Each group of four gaps is prefixed by a selector of their lengths.
+    if (payload.empty()) {
+      return Status::Corruption("truncated metrics log values");
+    }
+    const uint8_t selector = payload[0];
+    size_t group_len = 1;
+    for (int shift = 0; shift < 8; shift += 2) {
+      group_len += ((selector >> shift) & 3) + 1;
+    }
+    if (payload.size() < group_len) {
+      return Status::Corruption("truncated metrics log values");
+    }
+    uint32_t gaps[4];
+    coding::DecodeGroupVarInt32(payload.data(), &gaps[0], &gaps[1], &gaps[2], &gaps[3]);
+    payload.remove_prefix(group_len);
+    for (int j = 0; j < 4 && i + j < num_changed; j++) {
+      number += static_cast<int64_t>(gaps[j]) + 1;
+      if (number >= series_.size()) {
+        return Status::Corruption(Substitute("undefined metrics log series $0", number));
+      }
+      sample->changed.push_back(number);
+    }
+  }
+  for (uint32_t n : sample->changed) {
+    uint64_t zigzag;
+    if (!GetVarint64(&payload, &zigzag)) {
+      return Status::Corruption("truncated metrics log values");
+    }
+    uint64_t delta = (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+    values_[n] = static_cast<int64_t>(static_cast<uint64_t>(values_[n]) + delta);
+  }
+  return Status::OK();
+}
+
+string MetricsLogReader::ValueToString(uint32_t number) const {
+  DCHECK_LT(number, values_.size());
+  if (series_[number].is_double) {
+    double d;
+    memcpy(&d, &values_[number], sizeof(d));
+    return SimpleDtoa(d);
+  }
+  return std::to_string(values_[number]);
+}
+
 } // namespace tools
 } // namespace kudu
 
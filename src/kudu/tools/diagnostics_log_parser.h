@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <unordered_map>
@@ -27,10 +28,14 @@
 #include <rapidjson/document.h>
 
 #include "kudu/gutil/strings/stringpiece.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/jsonreader.h"
 #include "kudu/util/status.h"
 
 namespace kudu {
+
+class Slice;
+
 namespace tools {
 
 // One of the record types from the log.
@@ -144,5 +149,55 @@ class LogParser {
   LogVisitor* visitor_;
 };
 
+// A metric series from a binary metrics log.
+struct MetricsLogSeries {
+  std::string entity_type;
+  std::string entity_id;
+  std::string name;
+  bool is_double;
+};
+
+// A sample from a binary metrics log.
+struct MetricsLogSample {
+  // The time the sample was taken, in microseconds since the epoch.
+  int64_t time_us;
+
+  // The numbers of the series whose values changed since the previous
+  // sample, in increasing order.
+  std::vector<uint32_t> changed;
+};
+
+// Reader of the binary metrics log written by the diagnostics log with
+// --diagnostics_log_metrics_format=binary. See server::MetricsLogEncoder for
+// the format.
+//
+// Frames must be read in the order they were written. Each file of the log
+// starts with a frame which resets the series, so the files may be read one
+// after the other, or on their own.
+class MetricsLogReader {
+ public:
+  // Decodes the frame at the start of 'data' into 'sample', and advances
+  // 'data' past it. The values of the series are updated accordingly.
+  Status ReadFrame(Slice* data, MetricsLogSample* sample);
+
+  // The series defined so far, by number.
+  const std::vector<MetricsLogSeries>& series() const { return series_; }
+
+  // Returns the value of series 'number' as of the last frame read, as a
+  // string.
+  std::string ValueToString(uint32_t number) const;
+
+ private:
+  Status ReadPayload(Slice payload, MetricsLogSample* sample);
+
+  std::vector<MetricsLogSeries> series_;
+
+  // The value of each series, or their bit patterns for doubles.
+  std::vector<int64_t> values_;
+
+  // The uncompressed payload of the current frame.
+  faststring payload_;
+};
+
 } // namespace tools
 } // namespace kudu
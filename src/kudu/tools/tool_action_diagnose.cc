@@ -19,6 +19,7 @@
 #include <array>
 #include <cerrno>
 #include <fstream> // IWYU pragma: keep
+#include <iostream>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -27,13 +28,18 @@
 #include "kudu/gutil/strings/substitute.h"
 #include "kudu/tools/diagnostics_log_parser.h"
 #include "kudu/tools/tool_action.h"
+#include "kudu/util/env.h"
 #include "kudu/util/errno.h"
+#include "kudu/util/faststring.h"
+#include "kudu/util/slice.h"
 #include "kudu/util/status.h"
 
 namespace kudu {
 namespace tools {
 
 using std::array;
+using std::cout;
+using std::endl;
 using std::ifstream;
 using std::string;
 using std::unique_ptr;
@@ -76,6 +82,36 @@ Status ParseStacks(const RunnerContext& context) {
   return Status::OK();
 }
 
+Status ParseMetricsFromPath(const string& path, MetricsLogReader* reader) {
+  faststring data;
+  RETURN_NOT_OK(ReadFileToString(Env::Default(), path, &data));
+  Slice remaining(data);
+  MetricsLogSample sample;
+  while (!remaining.empty()) {
+    RETURN_NOT_OK_PREPEND(reader->ReadFrame(&remaining, &sample),
+                          Substitute("at offset $0", data.size() - remaining.size()));
+    for (uint32_t n : sample.changed) {
+      const MetricsLogSeries& s = reader->series()[n];
+      cout << sample.time_us << " " << s.entity_type << " " << s.entity_id << " "
+           << s.name << " " << reader->ValueToString(n) << endl;
+    }
+  }
+  return Status::OK();
+}
+
+Status ParseMetrics(const RunnerContext& context) {
+  vector<string> paths = context.variadic_args;
+  std::sort(paths.begin(), paths.end());
+  // Each file starts with a reset sample, so the series carry over only
+  // within a file.
+  for (const auto& path : paths) {
+    MetricsLogReader reader;
+    RETURN_NOT_OK_PREPEND(ParseMetricsFromPath(path, &reader),
+                          Substitute("failed to parse metrics from $0", path));
+  }
+  return Status::OK();
+}
+
 } // anonymous namespace
 
 unique_ptr<Mode> BuildDiagnoseMode() {
@@ -85,8 +121,16 @@ unique_ptr<Mode> BuildDiagnoseMode() {
       .AddRequiredVariadicParameter({ kLogPathArg, "path to log file(s) to parse" })
       .Build();
 
+  unique_ptr<Action> parse_metrics =
+      ActionBuilder("parse_metrics", &ParseMetrics)
+      .Description("Parse the metrics out of a binary metrics log, printing one "
+                   "line per changed value")
+      .AddRequiredVariadicParameter({ kLogPathArg, "path to log file(s) to parse" })
+      .Build();
+
   return ModeBuilder("diagnose")
       .Description("Diagnostic tools for Kudu servers and clusters")
+      .AddAction(std::move(parse_metrics))
       .AddAction(std::move(parse_stacks))
       .Build();
 }
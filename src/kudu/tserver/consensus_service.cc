@@ -85,6 +85,8 @@ using kudu::consensus::ConsensusResponsePB;
 using kudu::consensus::GetLastOpIdRequestPB;
 using kudu::consensus::GetNodeInstanceRequestPB;
 using kudu::consensus::GetNodeInstanceResponsePB;
+using kudu::consensus::InstallSnapshotRequestPB;
+using kudu::consensus::InstallSnapshotResponsePB;
 using kudu::consensus::LeaderStepDownRequestPB;
 using kudu::consensus::LeaderStepDownResponsePB;
 using kudu::consensus::OpId;
@@ -240,6 +242,16 @@ bool ConsensusServiceImpl::AuthorizeServiceUser(const google::protobuf::Message*
   return server_->Authorize(rpc, ServerBase::SUPER_USER | ServerBase::SERVICE_USER);
 }
 
+bool ConsensusServiceImpl::SupportsFeature(uint32_t feature) const {
+  switch (feature) {
+    case consensus::COMPRESSED_OPS:
+    case consensus::RELAY_UPDATES:
+      return true;
+    default:
+      return false;
+  }
+}
+
 void ConsensusServiceImpl::UpdateConsensus(const ConsensusRequestPB* req,
                                            ConsensusResponsePB* resp,
                                            rpc::RpcContext* context) {
@@ -251,6 +263,21 @@ void ConsensusServiceImpl::UpdateConsensus(const ConsensusRequestPB* req,
   // Submit the update directly to the TabletReplica's RaftConsensus instance.
   shared_ptr<RaftConsensus> consensus;
   if (!GetConsensusOrRespond(tablet_manager_, resp, context, &consensus)) return;
+  if (req->has_relay_dest_uuid()) {
+    // The leader sent the request through this server for another peer of
+    // its region.
+    consensus->RelayUpdateAsync(req, resp, [resp, context](const Status& s) {
+        if (PREDICT_FALSE(!s.ok())) {
+          resp->Clear();
+          SetupErrorAndRespond(resp->mutable_error(), s,
+                               ServerErrorPB::UNKNOWN_ERROR,
+                               context);
+          return;
+        }
+        context->RespondSuccess();
+      });
+    return;
+  }
   Status s = consensus->Update(req, resp);
   if (PREDICT_FALSE(!s.ok())) {
     // Clear the response first, since a partially-filled response could
@@ -404,6 +431,38 @@ void ConsensusServiceImpl::LeaderStepDown(const LeaderStepDownRequestPB* req,
   context->RespondSuccess();
 }
 
+void ConsensusServiceImpl::InstallSnapshot(const InstallSnapshotRequestPB* req,
+                                           InstallSnapshotResponsePB* resp,
+                                           rpc::RpcContext* context) {
+  DVLOG(3) << "Received Install Snapshot RPC: " << SecureShortDebugString(*req);
+  if (!CheckUuidMatchOrRespond(tablet_manager_, "InstallSnapshot", req, resp, context)) {
+    return;
+  }
+  shared_ptr<RaftConsensus> consensus;
+  if (!GetConsensusOrRespond(tablet_manager_, resp, context, &consensus)) return;
+
+  Slice chunk;
+  if (req->has_chunk_sidecar()) {
+    Status s = context->GetInboundSidecar(req->chunk_sidecar(), &chunk);
+    if (PREDICT_FALSE(!s.ok())) {
+      SetupErrorAndRespond(resp->mutable_error(), s,
+                           ServerErrorPB::UNKNOWN_ERROR,
+                           context);
+      return;
+    }
+  }
+  Status s = consensus->InstallSnapshot(*req, chunk, resp);
+  if (PREDICT_FALSE(!s.ok())) {
+    // As in UpdateConsensus, don't send back a partially-filled response.
+    resp->Clear();
+    SetupErrorAndRespond(resp->mutable_error(), s,
+                         ServerErrorPB::UNKNOWN_ERROR,
+                         context);
+    return;
+  }
+  context->RespondSuccess();
+}
+
 void ConsensusServiceImpl::GetLastOpId(const consensus::GetLastOpIdRequestPB *req,
                                        consensus::GetLastOpIdResponsePB *resp,
                                        rpc::RpcContext *context) {
@@ -51,6 +51,8 @@ class GetLastOpIdRequestPB;
 class GetLastOpIdResponsePB;
 class GetNodeInstanceRequestPB;
 class GetNodeInstanceResponsePB;
+class InstallSnapshotRequestPB;
+class InstallSnapshotResponsePB;
 class LeaderStepDownRequestPB;
 class LeaderStepDownResponsePB;
 class RunLeaderElectionRequestPB;
@@ -83,6 +85,8 @@ class ConsensusServiceImpl : public consensus::ConsensusServiceIf {
                             google::protobuf::Message* resp,
                             rpc::RpcContext* context) override;
 
+  bool SupportsFeature(uint32_t feature) const override;
+
   virtual void UpdateConsensus(const consensus::ConsensusRequestPB* req,
                                consensus::ConsensusResponsePB* resp,
                                rpc::RpcContext* context) OVERRIDE;
@@ -119,6 +123,10 @@ class ConsensusServiceImpl : public consensus::ConsensusServiceIf {
                            consensus::GetLastOpIdResponsePB* resp,
                            rpc::RpcContext* context) OVERRIDE;
 
+  virtual void InstallSnapshot(const consensus::InstallSnapshotRequestPB* req,
+                               consensus::InstallSnapshotResponsePB* resp,
+                               rpc::RpcContext* context) OVERRIDE;
+
   virtual void GetConsensusState(const consensus::GetConsensusStateRequestPB* req,
                                  consensus::GetConsensusStateResponsePB* resp,
                                  rpc::RpcContext* context) OVERRIDE;
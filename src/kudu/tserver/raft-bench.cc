@@ -0,0 +1,370 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Measures the throughput and the commit latency of replicating operations
+// through a Raft config of in-process tablet servers, optionally over
+// simulated links with latency, jitter, bandwidth caps and losses.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <gflags/gflags_declare.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "kudu/clock/clock.h"
+#include "kudu/common/timestamp.h"
+#include "kudu/common/wire_protocol.pb.h"
+#include "kudu/consensus/consensus.pb.h"
+#include "kudu/consensus/consensus_peers.h"
+#include "kudu/consensus/metadata.pb.h"
+#include "kudu/consensus/raft_consensus.h"
+#include "kudu/consensus/shaped_peer_proxy.h"
+#include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/strings/human_readable.h"
+#include "kudu/gutil/strings/numbers.h"
+#include "kudu/gutil/strings/split.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/tserver/simple_tablet_manager.h"
+#include "kudu/tserver/tablet_server.h"
+#include "kudu/tserver/tablet_server_options.h"
+#include "kudu/util/hdr_histogram.h"
+#include "kudu/util/mem_tracker.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/net/net_util.h"
+#include "kudu/util/net/sockaddr.h"
+#include "kudu/util/net/socket.h"
+#include "kudu/util/random.h"
+#include "kudu/util/random_util.h"
+#include "kudu/util/semaphore.h"
+#include "kudu/util/status.h"
+#include "kudu/util/stopwatch.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+DEFINE_int32(num_servers, 3, "Number of voters in the Raft config");
+DEFINE_int32(payload_bytes, 1024, "Size of the payload of each replicated operation");
+DEFINE_int32(client_threads, 4, "Number of threads submitting operations to the leader");
+DEFINE_int32(max_ops_in_flight, 256,
+             "Maximum number of operations submitted to the leader and not yet "
+             "committed, across all the client threads");
+DEFINE_int32(run_seconds, 1, "Seconds to run the benchmark");
+DEFINE_string(fsync_mode, "default",
+              "How the WALs are synced: 'none' never syncs, 'default' syncs as "
+              "configured by the other flags, and 'all' syncs every append");
+DEFINE_string(link_shape, "",
+              "The shape of every link between two servers, e.g. "
+              "'latency_ms=20,jitter_ms=2,bandwidth_mbps=1000,loss=0.001'. "
+              "See ParseLinkShape() for all the keys. Latencies are one-way.");
+DEFINE_string(link_shapes, "",
+              "Semicolon-separated shapes of single links, overriding "
+              "--link_shape, as 'i-j:shape' where i and j are indexes of servers, "
+              "e.g. '0-2:latency_ms=40;1-2:latency_ms=40' for two close servers "
+              "and one remote server");
+DEFINE_bool(heap_replicate_msgs, false,
+            "Allocate the operations on the heap instead of on the leader's "
+            "arenas, to compare the two");
+
+DECLARE_bool(log_force_fsync_all);
+DECLARE_bool(never_fsync);
+DECLARE_int32(raft_replicate_arena_size_kb);
+
+using kudu::consensus::ConsensusRound;
+using kudu::consensus::LinkShape;
+using kudu::consensus::ParseLinkShape;
+using kudu::consensus::PeerProxyFactory;
+using kudu::consensus::RaftConsensus;
+using kudu::consensus::RaftPeerPB;
+using kudu::consensus::ReplicateMsg;
+using kudu::consensus::ReplicateRefPtr;
+using kudu::consensus::ShapedPeerProxyFactory;
+using kudu::consensus::ShapedPeerProxyOptions;
+using std::atomic;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+namespace tserver {
+
+namespace {
+
+// Picks 'n' distinct free ports on the loopback interface.
+Status PickFreePorts(int n, vector<uint16_t>* ports) {
+  // Keep the sockets open until all the ports are picked, so that no port is
+  // picked twice.
+  vector<unique_ptr<Socket>> socks;
+  for (int i = 0; i < n; i++) {
+    unique_ptr<Socket> sock(new Socket());
+    RETURN_NOT_OK(sock->Init(0));
+    Sockaddr addr;
+    RETURN_NOT_OK(addr.ParseString("127.0.0.1", 0));
+    RETURN_NOT_OK(sock->Bind(addr));
+    RETURN_NOT_OK(sock->GetSocketAddress(&addr));
+    ports->push_back(addr.port());
+    socks.emplace_back(std::move(sock));
+  }
+  return Status::OK();
+}
+
+} // anonymous namespace
+
+class RaftBench : public KuduTest {
+ public:
+  RaftBench()
+      : latency_us_(MonoDelta::FromSeconds(60).ToMicroseconds(), 2),
+        num_committed_(0),
+        num_failed_(0) {
+  }
+
+  void SetUp() override {
+    KuduTest::SetUp();
+    OverrideFlagForSlowTests("run_seconds", "10");
+
+    if (FLAGS_fsync_mode == "none") {
+      FLAGS_never_fsync = true;
+    } else if (FLAGS_fsync_mode == "all") {
+      FLAGS_log_force_fsync_all = true;
+    } else {
+      ASSERT_EQ("default", FLAGS_fsync_mode) << "unknown --fsync_mode";
+    }
+    ASSERT_OK(ParseLinkShapes());
+    NO_FATALS(StartServers());
+  }
+
+  void TearDown() override {
+    for (auto& server : servers_) {
+      server->Shutdown();
+    }
+    KuduTest::TearDown();
+  }
+
+ protected:
+  // Fills 'shapes_' from --link_shape and --link_shapes.
+  Status ParseLinkShapes() {
+    const int n = FLAGS_num_servers;
+    LinkShape default_shape;
+    RETURN_NOT_OK_PREPEND(ParseLinkShape(FLAGS_link_shape, &default_shape),
+                          "invalid --link_shape");
+    shapes_.assign(n, vector<LinkShape>(n, default_shape));
+    vector<string> links = strings::Split(FLAGS_link_shapes, ";", strings::SkipEmpty());
+    for (const string& link : links) {
+      vector<string> parts = strings::Split(link, strings::delimiter::Limit(":", 1));
+      vector<string> ends = strings::Split(parts[0], "-");
+      int32_t i, j;
+      if (parts.size() != 2 || ends.size() != 2 ||
+          !safe_strto32(ends[0], &i) || !safe_strto32(ends[1], &j) ||
+          i < 0 || i >= n || j < 0 || j >= n || i == j) {
+        return Status::InvalidArgument("invalid link in --link_shapes", link);
+      }
+      LinkShape shape = default_shape;
+      RETURN_NOT_OK_PREPEND(ParseLinkShape(parts[1], &shape),
+                            Substitute("invalid shape of link $0-$1", i, j));
+      shapes_[i][j] = shape;
+      shapes_[j][i] = shape;
+    }
+    return Status::OK();
+  }
+
+  void StartServers() {
+    const int n = FLAGS_num_servers;
+    vector<uint16_t> ports;
+    ASSERT_OK(PickFreePorts(n, &ports));
+    vector<HostPort> addrs;
+    for (uint16_t port : ports) {
+      addrs.emplace_back("127.0.0.1", port);
+    }
+
+    for (int i = 0; i < n; i++) {
+      TabletServerOptions opts;
+      opts.fs_opts.wal_root = GetTestPath(Substitute("ts-$0", i));
+      opts.fs_opts.data_roots = { opts.fs_opts.wal_root };
+      opts.rpc_opts.rpc_bind_addresses = addrs[i].ToString();
+      opts.tserver_addresses = addrs;
+      ShapedPeerProxyOptions shaping;
+      for (int j = 0; j < n; j++) {
+        shaping.shapes[addrs[j].ToString()] = shapes_[i][j];
+      }
+      opts.wrap_peer_proxy_factory = [shaping](gscoped_ptr<PeerProxyFactory>* factory) {
+        factory->reset(new ShapedPeerProxyFactory(
+            gscoped_ptr<PeerProxyFactory>(factory->release()), shaping));
+      };
+      servers_.emplace_back(new TabletServer(opts));
+    }
+
+    // Each server looks up the others while initializing, so they're
+    // initialized together.
+    vector<Status> init_statuses(n);
+    vector<thread> init_threads;
+    for (int i = 0; i < n; i++) {
+      init_threads.emplace_back([this, i, &init_statuses]() {
+          init_statuses[i] = servers_[i]->Init();
+        });
+    }
+    for (auto& t : init_threads) {
+      t.join();
+    }
+    for (int i = 0; i < n; i++) {
+      ASSERT_OK(init_statuses[i]);
+    }
+    for (auto& server : servers_) {
+      ASSERT_OK(server->Start());
+    }
+
+    ASSERT_EVENTUALLY([&]() {
+        for (int i = 0; i < n; i++) {
+          shared_ptr<RaftConsensus> consensus =
+              servers_[i]->tablet_manager()->shared_consensus();
+          if (consensus && consensus->role() == RaftPeerPB::LEADER) {
+            leader_idx_ = i;
+            leader_ = std::move(consensus);
+            return;
+          }
+        }
+        FAIL() << "no leader yet";
+      });
+    LOG(INFO) << "Leader is server " << leader_idx_;
+  }
+
+  // Submits operations to the leader until 'stop' is set.
+  void RunClient(const string& payload, Semaphore* in_flight, const atomic<bool>* stop) {
+    clock::Clock* clock = servers_[leader_idx_]->clock();
+    while (!*stop) {
+      in_flight->Acquire();
+      const MonoTime start = MonoTime::Now();
+      auto cb = [this, start, in_flight](const Status& s) {
+        if (s.ok()) {
+          latency_us_.Increment((MonoTime::Now() - start).ToMicroseconds());
+          num_committed_++;
+        } else {
+          num_failed_++;
+        }
+        in_flight->Release();
+      };
+      scoped_refptr<ConsensusRound> round;
+      if (FLAGS_heap_replicate_msgs) {
+        gscoped_ptr<ReplicateMsg> msg(new ReplicateMsg);
+        FillReplicateMsg(clock, payload, msg.get());
+        round = leader_->NewRound(std::move(msg), std::move(cb));
+      } else {
+        ReplicateRefPtr msg = leader_->NewReplicateMsg();
+        FillReplicateMsg(clock, payload, msg->get());
+        round = leader_->NewRound(std::move(msg), std::move(cb));
+      }
+      Status s = leader_->Replicate(round);
+      if (!s.ok()) {
+        LOG(WARNING) << "failed to replicate: " << s.ToString();
+        num_failed_++;
+        in_flight->Release();
+      }
+    }
+  }
+
+  static void FillReplicateMsg(clock::Clock* clock, const string& payload, ReplicateMsg* msg) {
+    msg->set_op_type(consensus::WRITE_OP_EXT);
+    msg->set_timestamp(clock->Now().ToUint64());
+    msg->mutable_write_payload()->set_payload(payload);
+  }
+
+  void SummarizePerf(double elapsed_seconds, int64_t num_committed) {
+    const double ops_per_sec = num_committed / elapsed_seconds;
+    LOG(INFO) << "Servers:             " << FLAGS_num_servers;
+    LOG(INFO) << "Payload bytes:       " << FLAGS_payload_bytes;
+    LOG(INFO) << "Client threads:      " << FLAGS_client_threads;
+    LOG(INFO) << "Max ops in flight:   " << FLAGS_max_ops_in_flight;
+    LOG(INFO) << "Fsync mode:          " << FLAGS_fsync_mode;
+    LOG(INFO) << "Op allocation:       " << (FLAGS_heap_replicate_msgs ? "heap" : Substitute(
+        "arenas of $0 KB", FLAGS_raft_replicate_arena_size_kb));
+    for (int i = 0; i < FLAGS_num_servers; i++) {
+      for (int j = i + 1; j < FLAGS_num_servers; j++) {
+        LOG(INFO) << Substitute("Link $0-$1:            $2", i, j, shapes_[i][j].ToString());
+      }
+    }
+    LOG(INFO) << "----------------------------------";
+    LOG(INFO) << "Committed ops:       " << num_committed;
+    LOG(INFO) << "Failed ops:          " << num_failed_;
+    LOG(INFO) << "Ops/sec:             " << ops_per_sec;
+    LOG(INFO) << "Payload MB/sec:      " << ops_per_sec * FLAGS_payload_bytes / (1024 * 1024);
+    LOG(INFO) << "Commit latency (us): p50 " << latency_us_.ValueAtPercentile(50)
+              << ", p99 " << latency_us_.ValueAtPercentile(99)
+              << ", p99.9 " << latency_us_.ValueAtPercentile(99.9)
+              << ", max " << latency_us_.MaxValue();
+    // The leader's arenas, which the log cache keeps alive.
+    shared_ptr<MemTracker> log_cache_tracker;
+    shared_ptr<MemTracker> arena_tracker;
+    if (MemTracker::FindTracker("log_cache", &log_cache_tracker) &&
+        MemTracker::FindTracker(Substitute("log_cache:$0:$1:arenas",
+                                           leader_->peer_uuid(), leader_->tablet_id()),
+                                &arena_tracker, log_cache_tracker)) {
+      LOG(INFO) << "Leader arenas peak:  "
+                << HumanReadableNumBytes::ToString(arena_tracker->peak_consumption());
+    }
+  }
+
+  vector<unique_ptr<TabletServer>> servers_;
+  // The shapes of the links between each two servers, by server index.
+  vector<vector<LinkShape>> shapes_;
+  int leader_idx_ = -1;
+  shared_ptr<RaftConsensus> leader_;
+
+  HdrHistogram latency_us_;
+  atomic<int64_t> num_committed_;
+  atomic<int64_t> num_failed_;
+};
+
+TEST_F(RaftBench, BenchmarkReplicate) {
+  // Random, so that compression of the WAL doesn't make it look cheaper.
+  Random rng(SeedRandom());
+  const string payload = RandomString(FLAGS_payload_bytes, &rng);
+
+  Semaphore in_flight(FLAGS_max_ops_in_flight);
+  atomic<bool> stop(false);
+  vector<thread> clients;
+  Stopwatch sw;
+  sw.start();
+  for (int i = 0; i < FLAGS_client_threads; i++) {
+    clients.emplace_back([&]() { RunClient(payload, &in_flight, &stop); });
+  }
+  SleepFor(MonoDelta::FromSeconds(FLAGS_run_seconds));
+  stop = true;
+  const int64_t num_committed = num_committed_;
+  sw.stop();
+  for (auto& t : clients) {
+    t.join();
+  }
+
+  // Wait for the operations still in flight, which reference 'in_flight'.
+  for (int i = 0; i < FLAGS_max_ops_in_flight; i++) {
+    in_flight.Acquire();
+  }
+  SummarizePerf(sw.elapsed().wall_seconds(), num_committed);
+  ASSERT_GT(num_committed, 0);
+}
+
+} // namespace tserver
+} // namespace kudu
@@ -333,6 +333,9 @@ Status TSTabletManager::Start() {
   scoped_refptr<TimeManager> time_manager;
 
   peer_proxy_factory.reset(new RpcPeerProxyFactory(server_->messenger()));
+  if (server_->opts().wrap_peer_proxy_factory) {
+    server_->opts().wrap_peer_proxy_factory(&peer_proxy_factory);
+  }
   // THIS IS OBVIOUSLY NOT CORRECT.
   // ONLY TO MAKE CODE COMPILE [ Anirban ]
   time_manager.reset(new TimeManager(server_->clock(), Timestamp::kInitialTimestamp));
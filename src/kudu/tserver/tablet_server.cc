@@ -27,6 +27,7 @@
 #ifdef FB_DO_NOT_REMOVE
 #include "kudu/cfile/block_cache.h"
 #endif
+#include "kudu/consensus/replication_trace.h"
 #include "kudu/fs/error_manager.h"
 #include "kudu/fs/fs_manager.h"
 #include "kudu/gutil/bind.h"
@@ -114,7 +115,16 @@ Status TabletServer::Init() {
   if (web_server_) {
     RETURN_NOT_OK(path_handlers_->Register(web_server_.get()));
   }
+  RETURN_NOT_OK(consensus::ReplicationTrace::GetSingleton()->StartInstrumentation(
+      metric_entity(), web_server_.get()));
+#else
+  // There is no embedded webserver to serve /replication-trace, so only the
+  // stage latency histograms are exported.
+  RETURN_NOT_OK(consensus::ReplicationTrace::GetSingleton()->StartInstrumentation(
+      metric_entity(), nullptr));
+#endif
 
+#ifdef FB_DO_NOT_REMOVE
   maintenance_manager_.reset(new MaintenanceManager(
       MaintenanceManager::kDefaultOptions, fs_manager_->uuid()));
 
@@ -17,9 +17,11 @@
 #ifndef KUDU_TSERVER_TABLET_SERVER_OPTIONS_H
 #define KUDU_TSERVER_TABLET_SERVER_OPTIONS_H
 
+#include <functional>
 #include <vector>
 #include <memory>
 
+#include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/server/server_base_options.h"
 #include "kudu/util/net/net_util.h"
 
@@ -30,6 +32,7 @@ class LogFactory;
 namespace consensus {
 class ConsensusRoundHandler;
 class OpId;
+class PeerProxyFactory;
 struct ElectionResult;
 }
 
@@ -64,6 +67,10 @@ struct TabletServerOptions : public kudu::server::ServerBaseOptions {
   std::function<void()> ldcb;
   bool disable_noop = false;
 
+  // If set, called with the factory of the proxies to the other peers before
+  // Raft starts, to wrap or replace it, e.g. to inject network delays.
+  std::function<void(gscoped_ptr<consensus::PeerProxyFactory>*)> wrap_peer_proxy_factory;
+
   bool IsDistributed() const;
 };
 
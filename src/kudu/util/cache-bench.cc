@@ -41,7 +41,8 @@
 #include "kudu/util/slice.h"
 #include "kudu/util/test_util.h"
 
-DEFINE_int32(num_threads, 16, "The number of threads to access the cache concurrently.");
+DEFINE_int32(num_threads, 0, "The number of threads to access the cache concurrently. "
+             "If 0, every workload is run with 16 and with 64 threads.");
 DEFINE_int32(run_seconds, 1, "The number of seconds to run the benchmark");
 
 using std::atomic;
@@ -65,21 +66,34 @@ struct BenchSetup {
     // vast majority of lookups.
     ZIPFIAN,
     // Every item is equally likely to be looked up.
-    UNIFORM
+    UNIFORM,
+    // Like ZIPFIAN, but every fourth lookup is part of a scan, i.e. of an
+    // item which is never looked up again.
+    ZIPFIAN_SCAN
   };
   Pattern pattern;
 
+  CachePolicy policy;
+
   // The ratio between the size of the dataset and the cache.
   //
   // A value smaller than 1 will ensure that the whole dataset fits
   // in the cache.
   double dataset_cache_ratio;
 
+  // The number of threads looking up the cache concurrently.
+  int num_threads;
+
   string ToString() const {
     string ret;
+    switch (policy) {
+      case LRU_CACHE_POLICY: ret += "LRU "; break;
+      case S3FIFO_CACHE_POLICY: ret += "S3FIFO "; break;
+    }
     switch (pattern) {
       case Pattern::ZIPFIAN: ret += "ZIPFIAN"; break;
       case Pattern::UNIFORM: ret += "UNIFORM"; break;
+      case Pattern::ZIPFIAN_SCAN: ret += "ZIPFIAN_SCAN"; break;
     }
     ret += StringPrintf(" ratio=%.2fx n_unique=%d", dataset_cache_ratio, max_key());
     return ret;
@@ -91,25 +105,45 @@ struct BenchSetup {
   }
 };
 
+// The counts of the queries of the benchmark threads.
+struct QueryCounts {
+  // Lookups of the dataset, and how many of them hit.
+  atomic<int64_t> hits { 0 };
+  atomic<int64_t> lookups { 0 };
+
+  // Lookups made by scans, which always miss.
+  atomic<int64_t> scan_lookups { 0 };
+};
+
 class CacheBench : public KuduTest,
                    public testing::WithParamInterface<BenchSetup>{
  public:
   void SetUp() override {
     KuduTest::SetUp();
 
-    cache_.reset(NewLRUCache(DRAM_CACHE, kCacheCapacity, "test-cache"));
+    cache_.reset(NewCache(DRAM_CACHE, GetParam().policy, kCacheCapacity, "test-cache"));
   }
 
-  // Run queries against the cache until '*done' becomes true.
-  // Returns a pair of the number of cache hits and lookups.
-  pair<int64_t, int64_t> DoQueries(const atomic<bool>* done) {
+  // Run queries against the cache until '*done' becomes true, adding up
+  // their counts into 'counts'. 'thread_idx' identifies the calling thread
+  // among 'n_threads'.
+  void DoQueries(const atomic<bool>* done, int thread_idx, int n_threads,
+                 QueryCounts* counts) {
     const BenchSetup& setup = GetParam();
     Random r(GetRandomSeed32());
     int64_t lookups = 0;
+    int64_t scan_lookups = 0;
     int64_t hits = 0;
+    // Each thread scans its own keys, past those of the dataset.
+    uint32_t next_scan_key = setup.max_key() + thread_idx;
     while (!*done) {
       uint32_t int_key;
-      if (setup.pattern == BenchSetup::Pattern::ZIPFIAN) {
+      bool scan = false;
+      if (setup.pattern == BenchSetup::Pattern::ZIPFIAN_SCAN && (lookups & 3) == 3) {
+        int_key = next_scan_key;
+        next_scan_key += n_threads;
+        scan = true;
+      } else if (setup.pattern != BenchSetup::Pattern::UNIFORM) {
         int_key = r.Skewed(Bits::Log2Floor(setup.max_key()));
       } else {
         int_key = r.Uniform(setup.max_key());
@@ -127,23 +161,25 @@ class CacheBench : public KuduTest,
       }
 
       cache_->Release(h);
-      lookups++;
+      if (scan) {
+        scan_lookups++;
+      } else {
+        lookups++;
+      }
     }
-    return {hits, lookups};
+    counts->hits += hits;
+    counts->lookups += lookups;
+    counts->scan_lookups += scan_lookups;
   }
 
   // Starts the given number of threads to concurrently call DoQueries.
-  // Returns the aggregated number of cache hits and lookups.
-  pair<int64_t, int64_t> RunQueryThreads(int n_threads, int n_seconds) {
+  // Sets 'counts' to the aggregated counts of their queries.
+  void RunQueryThreads(int n_threads, int n_seconds, QueryCounts* counts) {
     vector<thread> threads(n_threads);
     atomic<bool> done(false);
-    atomic<int64_t> total_lookups(0);
-    atomic<int64_t> total_hits(0);
     for (int i = 0; i < n_threads; i++) {
-      threads[i] = thread([&]() {
-          pair<int64_t, int64_t> hits_lookups = DoQueries(&done);
-          total_hits += hits_lookups.first;
-          total_lookups += hits_lookups.second;
+      threads[i] = thread([&, i]() {
+          DoQueries(&done, i, n_threads, counts);
         });
     }
     SleepFor(MonoDelta::FromSeconds(n_seconds));
@@ -151,39 +187,58 @@ class CacheBench : public KuduTest,
     for (auto& t : threads) {
       t.join();
     }
-    return {total_hits, total_lookups};
   }
 
  protected:
   unique_ptr<Cache> cache_;
 };
 
-// Test both distributions, and for each, test both the case where the data
-// fits in the cache and where it is a bit larger.
-INSTANTIATE_TEST_CASE_P(Patterns, CacheBench, testing::ValuesIn(std::vector<BenchSetup>{
-      {BenchSetup::Pattern::ZIPFIAN, 1.0},
-      {BenchSetup::Pattern::ZIPFIAN, 3.0},
-      {BenchSetup::Pattern::UNIFORM, 1.0},
-      {BenchSetup::Pattern::UNIFORM, 3.0}
-    }));
+// Returns the workloads to run with each policy: both distributions, and for
+// each, both the case where the data fits in the cache and where it is a bit
+// larger, as well as Zipfian lookups mixed with scans.
+static vector<BenchSetup> BenchSetups() {
+  vector<BenchSetup> setups;
+  for (CachePolicy policy : { LRU_CACHE_POLICY, S3FIFO_CACHE_POLICY }) {
+    for (int num_threads : { 16, 64 }) {
+      for (const auto& pattern_ratio : vector<pair<BenchSetup::Pattern, double>>{
+          {BenchSetup::Pattern::ZIPFIAN, 1.0},
+          {BenchSetup::Pattern::ZIPFIAN, 3.0},
+          {BenchSetup::Pattern::UNIFORM, 1.0},
+          {BenchSetup::Pattern::UNIFORM, 3.0},
+          {BenchSetup::Pattern::ZIPFIAN_SCAN, 1.0},
+          {BenchSetup::Pattern::ZIPFIAN_SCAN, 3.0} }) {
+        setups.push_back({ pattern_ratio.first, policy, pattern_ratio.second, num_threads });
+      }
+    }
+  }
+  return setups;
+}
+
+INSTANTIATE_TEST_CASE_P(Patterns, CacheBench, testing::ValuesIn(BenchSetups()));
 
 TEST_P(CacheBench, RunBench) {
   const BenchSetup& setup = GetParam();
+  // With --num_threads, each workload runs once, with that many threads.
+  if (FLAGS_num_threads > 0 && setup.num_threads != 16) {
+    return;
+  }
+  const int num_threads = FLAGS_num_threads > 0 ? FLAGS_num_threads : setup.num_threads;
 
   // Run a short warmup phase to try to populate the cache. Otherwise even if the
   // dataset is smaller than the cache capacity, we would count a bunch of misses
   // during the warm-up phase.
   LOG(INFO) << "Warming up...";
-  RunQueryThreads(FLAGS_num_threads, 1);
+  QueryCounts warmup_counts;
+  RunQueryThreads(num_threads, 1, &warmup_counts);
 
   LOG(INFO) << "Running benchmark...";
-  pair<int64_t, int64_t> hits_lookups = RunQueryThreads(FLAGS_num_threads, FLAGS_run_seconds);
-  int64_t hits = hits_lookups.first;
-  int64_t lookups = hits_lookups.second;
+  QueryCounts counts;
+  RunQueryThreads(num_threads, FLAGS_run_seconds, &counts);
 
-  int64_t l_per_sec = lookups / FLAGS_run_seconds;
-  double hit_rate = static_cast<double>(hits) / lookups;
-  string test_case = setup.ToString();
+  // Scans always miss: the hit rate is that of the other lookups.
+  int64_t l_per_sec = (counts.lookups + counts.scan_lookups) / FLAGS_run_seconds;
+  double hit_rate = static_cast<double>(counts.hits) / counts.lookups;
+  string test_case = StringPrintf("%s threads=%d", setup.ToString().c_str(), num_threads);
   LOG(INFO) << test_case << ": " << HumanReadableNum::ToString(l_per_sec) << " lookups/sec";
   LOG(INFO) << test_case << ": " << StringPrintf("%.1f", hit_rate * 100.0) << "% hit rate";
 }
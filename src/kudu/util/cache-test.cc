@@ -6,6 +6,7 @@
 #include <cstring>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <glog/logging.h>
@@ -46,7 +47,7 @@ static int DecodeInt(const Slice& k) {
 }
 
 class CacheTest : public KuduTest,
-                  public ::testing::WithParamInterface<CacheType>,
+                  public ::testing::WithParamInterface<std::pair<CacheType, CachePolicy>>,
                   public Cache::EvictionCallback {
  public:
 
@@ -76,12 +77,14 @@ class CacheTest : public KuduTest,
     // assertions on the MemTracker in this test.
     FLAGS_cache_memtracker_approximation_ratio = 0;
 
-    cache_.reset(NewLRUCache(GetParam(), kCacheSize, "cache_test"));
+    cache_.reset(NewCache(GetParam().first, GetParam().second, kCacheSize, "cache_test"));
 
-    MemTracker::FindTracker("cache_test-sharded_lru_cache", &mem_tracker_);
+    MemTracker::FindTracker(GetParam().second == S3FIFO_CACHE_POLICY ?
+                            "cache_test-sharded_s3fifo_cache" :
+                            "cache_test-sharded_lru_cache", &mem_tracker_);
     // Since nvm cache does not have memtracker due to the use of
     // tcmalloc for this we only check for it in the DRAM case.
-    if (GetParam() == DRAM_CACHE) {
+    if (GetParam().first == DRAM_CACHE) {
       ASSERT_TRUE(mem_tracker_.get());
     }
 
@@ -114,9 +117,14 @@ class CacheTest : public KuduTest,
 };
 
 #if defined(__linux__)
-INSTANTIATE_TEST_CASE_P(CacheTypes, CacheTest, ::testing::Values(DRAM_CACHE, NVM_CACHE));
+INSTANTIATE_TEST_CASE_P(CacheTypes, CacheTest, ::testing::Values(
+    std::make_pair(DRAM_CACHE, LRU_CACHE_POLICY),
+    std::make_pair(DRAM_CACHE, S3FIFO_CACHE_POLICY),
+    std::make_pair(NVM_CACHE, LRU_CACHE_POLICY)));
 #else
-INSTANTIATE_TEST_CASE_P(CacheTypes, CacheTest, ::testing::Values(DRAM_CACHE));
+INSTANTIATE_TEST_CASE_P(CacheTypes, CacheTest, ::testing::Values(
+    std::make_pair(DRAM_CACHE, LRU_CACHE_POLICY),
+    std::make_pair(DRAM_CACHE, S3FIFO_CACHE_POLICY)));
 #endif // defined(__linux__)
 
 TEST_P(CacheTest, TrackMemory) {
@@ -216,6 +224,34 @@ TEST_P(CacheTest, EvictionPolicy) {
   ASSERT_EQ(-1, Lookup(200));
 }
 
+// With the S3-FIFO policy, entries which were hit survive a scan of entries
+// which are read once, even if the scan is larger than the cache.
+TEST_P(CacheTest, ScanResistance) {
+  if (GetParam().second != S3FIFO_CACHE_POLICY) {
+    LOG(INFO) << "A scan evicts all entries of an LRU cache";
+    return;
+  }
+  const int kNumElems = 1000;
+  const int kSizePerElem = kCacheSize / kNumElems;
+
+  // A hot set of a twentieth of the cache, hit once. It's small enough to fit
+  // in every shard even if the hot keys are spread unevenly.
+  const int kNumHot = kNumElems / 20;
+  for (int i = 0; i < kNumHot; i++) {
+    Insert(i, 1000 + i, kSizePerElem);
+    ASSERT_EQ(1000 + i, Lookup(i));
+  }
+
+  // A scan twice as large as the cache.
+  for (int i = 0; i < 2 * kNumElems; i++) {
+    Insert(10000 + i, i, kSizePerElem);
+  }
+
+  for (int i = 0; i < kNumHot; i++) {
+    ASSERT_EQ(1000 + i, Lookup(i));
+  }
+}
+
 TEST_P(CacheTest, HeavyEntries) {
   // Add a bunch of light and heavy entries and then count the combined
   // size of items still in the cache, which must be approximately the
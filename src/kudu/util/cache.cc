@@ -4,13 +4,16 @@
 
 #include "kudu/util/cache.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -20,6 +23,7 @@
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/hash/city.h"
 #include "kudu/gutil/macros.h"
+#include "kudu/gutil/map-util.h"
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/gutil/stl_util.h"
@@ -78,6 +82,12 @@ struct LRUHandle {
   std::atomic<int32_t> refs;
   uint32_t hash;      // Hash of key(); used for fast sharding and comparisons
 
+  // Used by the S3-FIFO policy only: the number of hits since the entry was
+  // inserted or last considered for eviction, and whether it's in the main
+  // queue rather than the small one.
+  std::atomic<uint8_t> freq;
+  bool in_main;
+
   // The storage for the key/value pair itself. The data is stored as:
   //   [key bytes ...] [padding up to 8-byte boundary] [value bytes ...]
   uint8_t kv_data[1];   // Beginning of key/value pair
@@ -186,13 +196,12 @@ class HandleTable {
   }
 };
 
-// A single shard of sharded cache.
-class LRUCache {
+// The state and accounting shared by the shards of all of the cache policies.
+class CacheShard {
  public:
-  explicit LRUCache(MemTracker* tracker);
-  ~LRUCache();
+  explicit CacheShard(MemTracker* tracker);
 
-  // Separate from constructor so caller can easily make an array of LRUCache
+  // Separate from constructor so caller can easily make an array of shards.
   void SetCapacity(size_t capacity) {
     capacity_ = capacity;
     max_deferred_consumption_ = capacity * FLAGS_cache_memtracker_approximation_ratio;
@@ -200,20 +209,25 @@ class LRUCache {
 
   void SetMetrics(CacheMetrics* metrics) { metrics_ = metrics; }
 
-  Cache::Handle* Insert(LRUHandle* handle, Cache::EvictionCallback* eviction_callback);
-  // Like Cache::Lookup, but with an extra "hash" parameter.
-  Cache::Handle* Lookup(const Slice& key, uint32_t hash, bool caching);
   void Release(Cache::Handle* handle);
-  void Erase(const Slice& key, uint32_t hash);
 
- private:
-  void LRU_Remove(LRUHandle* e);
-  void LRU_Append(LRUHandle* e);
+ protected:
+  ~CacheShard();
+
   // Just reduce the reference count by 1.
   // Return true if last reference
   bool Unref(LRUHandle* e);
   // Call the user's eviction callback, if it exists, and free the entry.
   void FreeEntry(LRUHandle* e);
+  // Like FreeEntry(), for a list of entries linked through 'next'.
+  void FreeEntries(LRUHandle* head);
+
+  // Sets the members of 'e' which were not set by Allocate(), and accounts
+  // for its insertion.
+  void PrepareInsert(LRUHandle* e, Cache::EvictionCallback* eviction_callback);
+
+  // Updates the lookup metrics, if any.
+  void RecordLookup(bool hit, bool caching);
 
   // Update the memtracker's consumption by the given amount.
   //
@@ -238,16 +252,6 @@ class LRUCache {
   // Initialized before use.
   size_t capacity_;
 
-  // mutex_ protects the following state.
-  MutexType mutex_;
-  size_t usage_;
-
-  // Dummy head of LRU list.
-  // lru.prev is newest entry, lru.next is oldest entry.
-  LRUHandle lru_;
-
-  HandleTable table_;
-
   MemTracker* mem_tracker_;
   atomic<int64_t> deferred_consumption_ { 0 };
 
@@ -258,34 +262,21 @@ class LRUCache {
   CacheMetrics* metrics_;
 };
 
-LRUCache::LRUCache(MemTracker* tracker)
- : usage_(0),
-   mem_tracker_(tracker),
-   metrics_(nullptr) {
-  // Make empty circular linked list
-  lru_.next = &lru_;
-  lru_.prev = &lru_;
+CacheShard::CacheShard(MemTracker* tracker)
+    : mem_tracker_(tracker),
+      metrics_(nullptr) {
 }
 
-LRUCache::~LRUCache() {
-  for (LRUHandle* e = lru_.next; e != &lru_; ) {
-    LRUHandle* next = e->next;
-    DCHECK_EQ(e->refs.load(std::memory_order_relaxed), 1)
-        << "caller has an unreleased handle";
-    if (Unref(e)) {
-      FreeEntry(e);
-    }
-    e = next;
-  }
+CacheShard::~CacheShard() {
   mem_tracker_->Consume(deferred_consumption_);
 }
 
-bool LRUCache::Unref(LRUHandle* e) {
+bool CacheShard::Unref(LRUHandle* e) {
   DCHECK_GT(e->refs.load(std::memory_order_relaxed), 0);
   return e->refs.fetch_sub(1) == 1;
 }
 
-void LRUCache::FreeEntry(LRUHandle* e) {
+void CacheShard::FreeEntry(LRUHandle* e) {
   DCHECK_EQ(e->refs.load(std::memory_order_relaxed), 0);
   if (e->eviction_callback) {
     e->eviction_callback->EvictedEntry(e->key(), e->value());
@@ -298,7 +289,48 @@ void LRUCache::FreeEntry(LRUHandle* e) {
   delete [] e;
 }
 
-void LRUCache::UpdateMemTracker(int64_t delta) {
+void CacheShard::FreeEntries(LRUHandle* head) {
+  while (head != nullptr) {
+    LRUHandle* next = head->next;
+    FreeEntry(head);
+    head = next;
+  }
+}
+
+void CacheShard::PrepareInsert(LRUHandle* e, Cache::EvictionCallback* eviction_callback) {
+  // Set the remaining LRUHandle members which were not already allocated during
+  // Allocate().
+  e->eviction_callback = eviction_callback;
+  e->refs.store(2, std::memory_order_relaxed);  // One from the cache, one for the returned handle
+  e->freq.store(0, std::memory_order_relaxed);
+  e->in_main = false;
+  UpdateMemTracker(e->charge);
+  if (PREDICT_TRUE(metrics_)) {
+    metrics_->cache_usage->IncrementBy(e->charge);
+    metrics_->inserts->Increment();
+  }
+}
+
+void CacheShard::RecordLookup(bool hit, bool caching) {
+  if (metrics_) {
+    metrics_->lookups->Increment();
+    if (hit) {
+      if (caching) {
+        metrics_->cache_hits_caching->Increment();
+      } else {
+        metrics_->cache_hits->Increment();
+      }
+    } else {
+      if (caching) {
+        metrics_->cache_misses_caching->Increment();
+      } else {
+        metrics_->cache_misses->Increment();
+      }
+    }
+  }
+}
+
+void CacheShard::UpdateMemTracker(int64_t delta) {
   int64_t old_deferred = deferred_consumption_.fetch_add(delta);
   int64_t new_deferred = old_deferred + delta;
 
@@ -309,6 +341,60 @@ void LRUCache::UpdateMemTracker(int64_t delta) {
   }
 }
 
+void CacheShard::Release(Cache::Handle* handle) {
+  LRUHandle* e = reinterpret_cast<LRUHandle*>(handle);
+  bool last_reference = Unref(e);
+  if (last_reference) {
+    FreeEntry(e);
+  }
+}
+
+// A single shard of sharded cache.
+class LRUCache : public CacheShard {
+ public:
+  explicit LRUCache(MemTracker* tracker);
+  ~LRUCache();
+
+  Cache::Handle* Insert(LRUHandle* handle, Cache::EvictionCallback* eviction_callback);
+  // Like Cache::Lookup, but with an extra "hash" parameter.
+  Cache::Handle* Lookup(const Slice& key, uint32_t hash, bool caching);
+  void Erase(const Slice& key, uint32_t hash);
+
+ private:
+  void LRU_Remove(LRUHandle* e);
+  void LRU_Append(LRUHandle* e);
+
+  // mutex_ protects the following state.
+  MutexType mutex_;
+  size_t usage_;
+
+  // Dummy head of LRU list.
+  // lru.prev is newest entry, lru.next is oldest entry.
+  LRUHandle lru_;
+
+  HandleTable table_;
+};
+
+LRUCache::LRUCache(MemTracker* tracker)
+ : CacheShard(tracker),
+   usage_(0) {
+  // Make empty circular linked list
+  lru_.next = &lru_;
+  lru_.prev = &lru_;
+}
+
+LRUCache::~LRUCache() {
+  for (LRUHandle* e = lru_.next; e != &lru_; ) {
+    LRUHandle* next = e->next;
+    DCHECK_EQ(e->refs.load(std::memory_order_relaxed), 1)
+        << "caller has an unreleased handle";
+    if (Unref(e)) {
+      FreeEntry(e);
+    }
+    e = next;
+  }
+}
+
 void LRUCache::LRU_Remove(LRUHandle* e) {
   e->next->prev = e->prev;
   e->prev->next = e->next;
@@ -337,46 +423,13 @@ Cache::Handle* LRUCache::Lookup(const Slice& key, uint32_t hash, bool caching) {
   }
 
   // Do the metrics outside of the lock.
-  if (metrics_) {
-    metrics_->lookups->Increment();
-    bool was_hit = (e != nullptr);
-    if (was_hit) {
-      if (caching) {
-        metrics_->cache_hits_caching->Increment();
-      } else {
-        metrics_->cache_hits->Increment();
-      }
-    } else {
-      if (caching) {
-        metrics_->cache_misses_caching->Increment();
-      } else {
-        metrics_->cache_misses->Increment();
-      }
-    }
-  }
+  RecordLookup(e != nullptr, caching);
 
   return reinterpret_cast<Cache::Handle*>(e);
 }
 
-void LRUCache::Release(Cache::Handle* handle) {
-  LRUHandle* e = reinterpret_cast<LRUHandle*>(handle);
-  bool last_reference = Unref(e);
-  if (last_reference) {
-    FreeEntry(e);
-  }
-}
-
 Cache::Handle* LRUCache::Insert(LRUHandle* e, Cache::EvictionCallback *eviction_callback) {
-
-  // Set the remaining LRUHandle members which were not already allocated during
-  // Allocate().
-  e->eviction_callback = eviction_callback;
-  e->refs.store(2, std::memory_order_relaxed);  // One from LRUCache, one for the returned handle
-  UpdateMemTracker(e->charge);
-  if (PREDICT_TRUE(metrics_)) {
-    metrics_->cache_usage->IncrementBy(e->charge);
-    metrics_->inserts->Increment();
-  }
+  PrepareInsert(e, eviction_callback);
 
   LRUHandle* to_remove_head = nullptr;
   {
@@ -406,11 +459,7 @@ Cache::Handle* LRUCache::Insert(LRUHandle* e, Cache::EvictionCallback *eviction_
 
   // we free the entries here outside of mutex for
   // performance reasons
-  while (to_remove_head != nullptr) {
-    LRUHandle* next = to_remove_head->next;
-    FreeEntry(to_remove_head);
-    to_remove_head = next;
-  }
+  FreeEntries(to_remove_head);
 
   return reinterpret_cast<Cache::Handle*>(e);
 }
@@ -433,6 +482,246 @@ void LRUCache::Erase(const Slice& key, uint32_t hash) {
   }
 }
 
+// A single shard of a cache with the S3-FIFO eviction policy. See "FIFO
+// Queues are All You Need for Cache Eviction" (Yang et al., SOSP 2023).
+//
+// Entries are admitted to the 'small' queue, which takes about 10% of the
+// capacity, unless their key was recently evicted from it, in which case
+// they go straight to the 'main' queue. Both queues are FIFOs: a hit only
+// bumps the entry's frequency counter. On eviction:
+// - The oldest entry of 'small' moves to 'main' if it was hit since it was
+//   inserted. Otherwise it's evicted, and the hash of its key is remembered
+//   in the 'ghost' queue.
+// - The oldest entry of 'main' is reinserted at its head, with its counter
+//   decremented, if it was hit since it was last considered. Otherwise it's
+//   evicted.
+//
+// Entries only hit once, e.g. by a large scan, are thus evicted from 'small'
+// without displacing the entries of 'main'.
+class S3FifoCache : public CacheShard {
+ public:
+  explicit S3FifoCache(MemTracker* tracker);
+  ~S3FifoCache();
+
+  Cache::Handle* Insert(LRUHandle* handle, Cache::EvictionCallback* eviction_callback);
+  // Like Cache::Lookup, but with an extra "hash" parameter.
+  Cache::Handle* Lookup(const Slice& key, uint32_t hash, bool caching);
+  void Erase(const Slice& key, uint32_t hash);
+
+ private:
+  // The frequency counters of the entries saturate at this value.
+  static constexpr uint8_t kMaxFreq = 3;
+
+  // Removes 'e' from its queue.
+  void QueueRemove(LRUHandle* e);
+  // Makes 'e' the newest entry of the main queue if 'main' is true, or of
+  // the small queue otherwise.
+  void QueueAppend(LRUHandle* e, bool main);
+
+  // Evicts the oldest entry of the small queue, or moves it to the main queue.
+  // An evicted entry is pushed onto 'to_remove_head' if it was the last
+  // reference to it.
+  void EvictFromSmall(LRUHandle** to_remove_head);
+  // Evicts the oldest entry of the main queue, or reinserts it.
+  void EvictFromMain(LRUHandle** to_remove_head);
+
+  // Remembers that an entry whose key hashes to 'hash' was evicted from the
+  // small queue.
+  void AddGhost(uint32_t hash);
+
+  // mutex_ protects the following state. Lookups only need shared access.
+  rw_spinlock mutex_;
+  size_t usage_;
+  size_t small_usage_;
+  size_t num_entries_;
+
+  // Dummy heads of the queues.
+  // prev is the newest entry, next is the oldest entry.
+  LRUHandle small_;
+  LRUHandle main_;
+
+  HandleTable table_;
+
+  // The hashes of the keys of the entries last evicted from the small queue,
+  // oldest first, and how many times each is in 'ghost_'. There are at most
+  // as many as there are entries in the shard.
+  std::deque<uint32_t> ghost_;
+  std::unordered_map<uint32_t, int> ghost_counts_;
+};
+
+S3FifoCache::S3FifoCache(MemTracker* tracker)
+    : CacheShard(tracker),
+      usage_(0),
+      small_usage_(0),
+      num_entries_(0) {
+  small_.next = &small_;
+  small_.prev = &small_;
+  main_.next = &main_;
+  main_.prev = &main_;
+}
+
+S3FifoCache::~S3FifoCache() {
+  for (LRUHandle* head : { &small_, &main_ }) {
+    for (LRUHandle* e = head->next; e != head; ) {
+      LRUHandle* next = e->next;
+      DCHECK_EQ(e->refs.load(std::memory_order_relaxed), 1)
+          << "caller has an unreleased handle";
+      if (Unref(e)) {
+        FreeEntry(e);
+      }
+      e = next;
+    }
+  }
+}
+
+void S3FifoCache::QueueRemove(LRUHandle* e) {
+  e->next->prev = e->prev;
+  e->prev->next = e->next;
+  usage_ -= e->charge;
+  if (!e->in_main) {
+    small_usage_ -= e->charge;
+  }
+  num_entries_--;
+}
+
+void S3FifoCache::QueueAppend(LRUHandle* e, bool main) {
+  LRUHandle* head = main ? &main_ : &small_;
+  e->in_main = main;
+  e->next = head;
+  e->prev = head->prev;
+  e->prev->next = e;
+  e->next->prev = e;
+  usage_ += e->charge;
+  if (!main) {
+    small_usage_ += e->charge;
+  }
+  num_entries_++;
+}
+
+Cache::Handle* S3FifoCache::Lookup(const Slice& key, uint32_t hash, bool caching) {
+  LRUHandle* e;
+  {
+    shared_lock<rw_spinlock> l(mutex_);
+    e = table_.Lookup(key, hash);
+    if (e != nullptr) {
+      e->refs.fetch_add(1, std::memory_order_relaxed);
+      // Concurrent hits may race to bump the counter; losing one of the
+      // increments is harmless.
+      uint8_t freq = e->freq.load(std::memory_order_relaxed);
+      if (freq < kMaxFreq) {
+        e->freq.store(freq + 1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Do the metrics outside of the lock.
+  RecordLookup(e != nullptr, caching);
+
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+void S3FifoCache::AddGhost(uint32_t hash) {
+  ghost_.push_back(hash);
+  ghost_counts_[hash]++;
+  while (ghost_.size() > std::max<size_t>(num_entries_, 1)) {
+    auto it = ghost_counts_.find(ghost_.front());
+    DCHECK(it != ghost_counts_.end());
+    if (--it->second == 0) {
+      ghost_counts_.erase(it);
+    }
+    ghost_.pop_front();
+  }
+}
+
+void S3FifoCache::EvictFromSmall(LRUHandle** to_remove_head) {
+  LRUHandle* e = small_.next;
+  QueueRemove(e);
+  if (e->freq.load(std::memory_order_relaxed) > 0) {
+    e->freq.store(0, std::memory_order_relaxed);
+    QueueAppend(e, true);
+    return;
+  }
+  table_.Remove(e->key(), e->hash);
+  AddGhost(e->hash);
+  if (Unref(e)) {
+    e->next = *to_remove_head;
+    *to_remove_head = e;
+  }
+}
+
+void S3FifoCache::EvictFromMain(LRUHandle** to_remove_head) {
+  LRUHandle* e = main_.next;
+  QueueRemove(e);
+  uint8_t freq = e->freq.load(std::memory_order_relaxed);
+  if (freq > 0) {
+    e->freq.store(freq - 1, std::memory_order_relaxed);
+    QueueAppend(e, true);
+    return;
+  }
+  table_.Remove(e->key(), e->hash);
+  if (Unref(e)) {
+    e->next = *to_remove_head;
+    *to_remove_head = e;
+  }
+}
+
+Cache::Handle* S3FifoCache::Insert(LRUHandle* e, Cache::EvictionCallback* eviction_callback) {
+  PrepareInsert(e, eviction_callback);
+
+  LRUHandle* to_remove_head = nullptr;
+  {
+    std::lock_guard<rw_spinlock> l(mutex_);
+
+    LRUHandle* old = table_.Insert(e);
+    if (old != nullptr) {
+      QueueRemove(old);
+      if (Unref(old)) {
+        old->next = to_remove_head;
+        to_remove_head = old;
+      }
+    }
+    QueueAppend(e, ContainsKey(ghost_counts_, e->hash));
+
+    // Every pass either evicts an entry, moves one from the small queue to the
+    // main queue, or decrements the counter of one in the main queue, so this
+    // terminates.
+    while (usage_ > capacity_) {
+      if (small_.next != &small_ &&
+          (small_usage_ > capacity_ / 10 || main_.next == &main_)) {
+        EvictFromSmall(&to_remove_head);
+      } else if (main_.next != &main_) {
+        EvictFromMain(&to_remove_head);
+      } else {
+        break;
+      }
+    }
+  }
+
+  // we free the entries here outside of mutex for
+  // performance reasons
+  FreeEntries(to_remove_head);
+
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+void S3FifoCache::Erase(const Slice& key, uint32_t hash) {
+  LRUHandle* e;
+  bool last_reference = false;
+  {
+    std::lock_guard<rw_spinlock> l(mutex_);
+    e = table_.Remove(key, hash);
+    if (e != nullptr) {
+      QueueRemove(e);
+      last_reference = Unref(e);
+    }
+  }
+  // mutex not held here
+  // last_reference will only be true if e != NULL
+  if (last_reference) {
+    FreeEntry(e);
+  }
+}
+
 // Determine the number of bits of the hash that should be used to determine
 // the cache shard. This, in turn, determines the number of shards.
 int DetermineShardBits() {
@@ -442,11 +731,14 @@ int DetermineShardBits() {
   return bits;
 }
 
-class ShardedLRUCache : public Cache {
+// A cache whose entries are spread over shards of type 'ShardType' by the
+// hash of their keys, which implement its eviction policy.
+template <class ShardType>
+class ShardedCache : public Cache {
  private:
   shared_ptr<MemTracker> mem_tracker_;
   gscoped_ptr<CacheMetrics> metrics_;
-  vector<LRUCache*> shards_;
+  vector<ShardType*> shards_;
 
   // Number of bits of hash used to determine the shard.
   const int shard_bits_;
@@ -467,24 +759,26 @@ class ShardedLRUCache : public Cache {
   }
 
  public:
-  explicit ShardedLRUCache(size_t capacity, const string& id)
+  // 'policy_name' distinguishes the MemTrackers of caches with the same 'id'
+  // but different policies.
+  ShardedCache(size_t capacity, const string& id, const char* policy_name)
       : shard_bits_(DetermineShardBits()) {
     // A cache is often a singleton, so:
     // 1. We reuse its MemTracker if one already exists, and
     // 2. It is directly parented to the root MemTracker.
     mem_tracker_ = MemTracker::FindOrCreateGlobalTracker(
-        -1, strings::Substitute("$0-sharded_lru_cache", id));
+        -1, strings::Substitute("$0-sharded_$1_cache", id, policy_name));
 
     int num_shards = 1 << shard_bits_;
     const size_t per_shard = (capacity + (num_shards - 1)) / num_shards;
     for (int s = 0; s < num_shards; s++) {
-      gscoped_ptr<LRUCache> shard(new LRUCache(mem_tracker_.get()));
+      gscoped_ptr<ShardType> shard(new ShardType(mem_tracker_.get()));
       shard->SetCapacity(per_shard);
       shards_.push_back(shard.release());
     }
   }
 
-  virtual ~ShardedLRUCache() {
+  virtual ~ShardedCache() {
     STLDeleteElements(&shards_);
   }
 
@@ -519,7 +813,7 @@ class ShardedLRUCache : public Cache {
       return;
     }
     metrics_.reset(new CacheMetrics(entity));
-    for (LRUCache* cache : shards_) {
+    for (ShardType* cache : shards_) {
       cache->SetMetrics(metrics_.get());
     }
   }
@@ -556,17 +850,25 @@ class ShardedLRUCache : public Cache {
 
 }  // end anonymous namespace
 
-Cache* NewLRUCache(CacheType type, size_t capacity, const string& id) {
+Cache* NewCache(CacheType type, CachePolicy policy, size_t capacity, const string& id) {
   switch (type) {
     case DRAM_CACHE:
-      return new ShardedLRUCache(capacity, id);
+      if (policy == S3FIFO_CACHE_POLICY) {
+        return new ShardedCache<S3FifoCache>(capacity, id, "s3fifo");
+      }
+      return new ShardedCache<LRUCache>(capacity, id, "lru");
 #if defined(HAVE_LIB_VMEM)
     case NVM_CACHE:
+      CHECK_EQ(LRU_CACHE_POLICY, policy) << "NVM caches only support the LRU policy";
       return NewLRUNvmCache(capacity, id);
 #endif
     default:
-      LOG(FATAL) << "Unsupported LRU cache type: " << type;
+      LOG(FATAL) << "Unsupported cache type: " << type;
   }
 }
 
+Cache* NewLRUCache(CacheType type, size_t capacity, const string& id) {
+  return NewCache(type, LRU_CACHE_POLICY, capacity, id);
+}
+
 }  // namespace kudu
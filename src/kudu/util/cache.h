@@ -37,6 +37,25 @@ enum CacheType {
   NVM_CACHE
 };
 
+// The policy used by a cache to pick the entries to evict.
+enum CachePolicy {
+  // Least-recently-used. Every hit moves the entry to the head of a list,
+  // which requires exclusive access to the cache shard.
+  LRU_CACHE_POLICY,
+
+  // S3-FIFO: new entries are admitted to a small FIFO queue, and only those
+  // hit again before they reach its tail are moved to a main FIFO queue,
+  // where entries which were hit since they were last considered get another
+  // chance. A hit only bumps a per-entry counter, so lookups share access
+  // to the cache shard, and a large scan of entries read once doesn't evict
+  // the ones which are frequently hit. Only supported by DRAM_CACHE.
+  S3FIFO_CACHE_POLICY
+};
+
+// Create a new cache with a fixed size capacity, which evicts entries
+// according to 'policy'.
+Cache* NewCache(CacheType type, CachePolicy policy, size_t capacity, const std::string& id);
+
 // Create a new cache with a fixed size capacity.  This implementation
 // of Cache uses a least-recently-used eviction policy.
 Cache* NewLRUCache(CacheType type, size_t capacity, const std::string& id);
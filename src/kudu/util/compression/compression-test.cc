@@ -18,20 +18,42 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "kudu/gutil/gscoped_ptr.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/util/coding.h"
 #include "kudu/util/compression/compression.pb.h"
 #include "kudu/util/compression/compression_codec.h"
+#include "kudu/util/env.h"
+#include "kudu/util/faststring.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/random.h"
 #include "kudu/util/slice.h"
+#include "kudu/util/status.h"
 #include "kudu/util/test_macros.h"
 #include "kudu/util/test_util.h"
 
+DEFINE_string(compression_bench_samples_file, "",
+              "File of recorded payload samples for the dictionary compression "
+              "benchmark, each prefixed by its length as a little-endian fixed32. "
+              "If not set, synthetic row images are used.");
+DEFINE_int32(compression_bench_iterations, 10,
+             "Number of passes the dictionary compression benchmark makes over the samples.");
+
 namespace kudu {
 
+using std::string;
+using std::unique_ptr;
 using std::vector;
+using strings::Substitute;
 
 class TestCompression : public KuduTest {};
 
@@ -87,4 +109,134 @@ TEST_F(TestCompression, TestZlibCompressionCodec) {
   TestCompressionCodec(ZLIB);
 }
 
+TEST_F(TestCompression, TestZstdCompressionCodec) {
+  TestCompressionCodec(ZSTD);
+}
+
+// Returns 'n' small payloads resembling serialized row images, which share
+// most of their structure but compress poorly on their own.
+static vector<string> MakeRowImages(Random* rng, int n) {
+  static const char* const kStatuses[] = { "PENDING", "SHIPPED", "DELIVERED", "RETURNED" };
+  vector<string> rows;
+  for (int i = 0; i < n; i++) {
+    rows.push_back(Substitute(
+        "{\"table\":\"orders\",\"order_id\":$0,\"customer\":\"customer-$1\","
+        "\"status\":\"$2\",\"amount_cents\":$3,\"warehouse\":\"wh-$4\","
+        "\"updated_at\":$5}",
+        rng->Next64(), rng->Uniform(100000), kStatuses[rng->Uniform(4)],
+        rng->Uniform(1000000), rng->Uniform(32), 1500000000000L + rng->Uniform(1000000000)));
+  }
+  return rows;
+}
+
+// Compresses each sample on its own with 'codec', checks that it round-trips,
+// and returns the total compressed size.
+static size_t CompressEach(const CompressionCodec* codec, const vector<Slice>& samples) {
+  size_t total = 0;
+  faststring cbuf;
+  faststring ubuf;
+  for (const Slice& sample : samples) {
+    cbuf.resize(codec->MaxCompressedLength(sample.size()));
+    size_t compressed;
+    CHECK_OK(codec->Compress(sample, cbuf.data(), &compressed));
+    ubuf.resize(sample.size());
+    CHECK_OK(codec->Uncompress(Slice(cbuf.data(), compressed), ubuf.data(), sample.size()));
+    CHECK_EQ(0, memcmp(sample.data(), ubuf.data(), sample.size()));
+    total += compressed;
+  }
+  return total;
+}
+
+TEST_F(TestCompression, TestZstdDictionary) {
+  Random rng(SeedRandom());
+  vector<string> rows = MakeRowImages(&rng, 2000);
+  vector<Slice> train(rows.begin(), rows.begin() + 1000);
+  vector<Slice> test(rows.begin() + 1000, rows.end());
+
+  string dict;
+  ASSERT_OK(TrainCompressionDictionary(ZSTD, train, 4096, &dict));
+  ASSERT_GT(dict.size(), 0);
+  ASSERT_LE(dict.size(), 4096);
+  unique_ptr<CompressionCodec> dict_codec;
+  ASSERT_OK(NewCompressionCodecWithDictionary(ZSTD, dict, &dict_codec));
+  ASSERT_EQ(ZSTD, dict_codec->type());
+
+  // Small inputs compress much better with the dictionary.
+  const CompressionCodec* plain_codec;
+  ASSERT_OK(GetCompressionCodec(ZSTD, &plain_codec));
+  size_t with_dict = CompressEach(dict_codec.get(), test);
+  size_t without_dict = CompressEach(plain_codec, test);
+  ASSERT_LT(with_dict * 2, without_dict);
+
+  // Data compressed with a dictionary can't be uncompressed without it.
+  faststring cbuf(dict_codec->MaxCompressedLength(test[0].size()));
+  size_t compressed;
+  ASSERT_OK(dict_codec->Compress(test[0], cbuf.data(), &compressed));
+  faststring ubuf(test[0].size());
+  Status s = plain_codec->Uncompress(Slice(cbuf.data(), compressed), ubuf.data(), ubuf.size());
+  ASSERT_TRUE(s.IsCorruption()) << s.ToString();
+
+  // Other codecs don't support dictionaries.
+  s = TrainCompressionDictionary(LZ4, train, 4096, &dict);
+  ASSERT_TRUE(s.IsNotSupported()) << s.ToString();
+  s = NewCompressionCodecWithDictionary(SNAPPY, dict, &dict_codec);
+  ASSERT_TRUE(s.IsNotSupported()) << s.ToString();
+}
+
+// Compares the codecs, with and without a dictionary, on payloads compressed
+// one at a time, as the WAL compresses small batches. The dictionary is
+// trained on the first half of the samples and measured on the second half.
+TEST_F(TestCompression, BenchmarkDictionaryCompression) {
+  vector<string> payloads;
+  if (!FLAGS_compression_bench_samples_file.empty()) {
+    faststring data;
+    ASSERT_OK(ReadFileToString(env_, FLAGS_compression_bench_samples_file, &data));
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= data.size()) {
+      uint32_t len = DecodeFixed32(&data[pos]);
+      pos += sizeof(uint32_t);
+      ASSERT_LE(pos + len, data.size()) << "truncated sample file";
+      payloads.emplace_back(reinterpret_cast<const char*>(&data[pos]), len);
+      pos += len;
+    }
+  } else {
+    Random rng(SeedRandom());
+    payloads = MakeRowImages(&rng, AllowSlowTests() ? 20000 : 2000);
+  }
+  ASSERT_GE(payloads.size(), 100);
+  size_t half = payloads.size() / 2;
+  vector<Slice> train(payloads.begin(), payloads.begin() + half);
+  vector<Slice> test(payloads.begin() + half, payloads.end());
+  size_t raw_bytes = 0;
+  for (const Slice& s : test) {
+    raw_bytes += s.size();
+  }
+
+  string dict;
+  ASSERT_OK(TrainCompressionDictionary(ZSTD, train, 16 * 1024, &dict));
+  unique_ptr<CompressionCodec> dict_codec;
+  ASSERT_OK(NewCompressionCodecWithDictionary(ZSTD, dict, &dict_codec));
+
+  vector<std::pair<string, const CompressionCodec*>> codecs;
+  for (CompressionType type : { SNAPPY, LZ4, ZLIB, ZSTD }) {
+    const CompressionCodec* codec;
+    ASSERT_OK(GetCompressionCodec(type, &codec));
+    codecs.emplace_back(CompressionType_Name(type), codec);
+  }
+  codecs.emplace_back("ZSTD+dictionary", dict_codec.get());
+
+  LOG(INFO) << Substitute("$0 samples, $1 bytes", test.size(), raw_bytes);
+  for (const auto& c : codecs) {
+    size_t compressed = 0;
+    MonoTime start = MonoTime::Now();
+    for (int i = 0; i < FLAGS_compression_bench_iterations; i++) {
+      compressed = CompressEach(c.second, test);
+    }
+    double secs = (MonoTime::Now() - start).ToSeconds();
+    LOG(INFO) << Substitute("$0: ratio $1, $2 MB/s (compress + uncompress)",
+                            c.first, static_cast<double>(raw_bytes) / compressed,
+                            raw_bytes * FLAGS_compression_bench_iterations / secs / 1e6);
+  }
+}
+
 } // namespace kudu
@@ -19,6 +19,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -74,5 +75,26 @@ Status GetCompressionCodec(CompressionType compression,
 // Returns the compression codec type given the name
 CompressionType GetCompressionCodecType(const std::string& name);
 
+// Trains a dictionary of at most 'max_dict_size' bytes from 'samples' of
+// typical input, for use with NewCompressionCodecWithDictionary(). Small
+// inputs which share structure with the samples compress much better with a
+// dictionary than on their own.
+//
+// Only ZSTD supports dictionaries; other codecs return NotSupported.
+Status TrainCompressionDictionary(CompressionType compression,
+                                  const std::vector<Slice>& samples,
+                                  size_t max_dict_size,
+                                  std::string* dict);
+
+// Creates a codec of the given type which compresses and uncompresses using
+// 'dict', as returned by TrainCompressionDictionary(). Data compressed with a
+// dictionary can only be uncompressed with the same dictionary.
+//
+// Unlike the codecs returned by GetCompressionCodec(), the new codec is owned
+// by the caller.
+Status NewCompressionCodecWithDictionary(CompressionType compression,
+                                         const Slice& dict,
+                                         std::unique_ptr<CompressionCodec>* codec);
+
 } // namespace kudu
 #endif
@@ -654,6 +654,40 @@ TEST_F(TestEnv, TestReopen) {
   ASSERT_EQ(first + second, s.ToString());
 }
 
+TEST_F(TestEnv, TestReopenForOverwrite) {
+  string test_path = GetTestPath("test_env_wf");
+  string first = "The quick brown fox jumps over the lazy dog";
+  string second = "The lazy dog";
+
+  shared_ptr<WritableFile> writer;
+  ASSERT_OK(env_util::OpenFileForWrite(WritableFileOptions(),
+                                       env_, test_path, &writer));
+  ASSERT_OK(writer->Append(first));
+  ASSERT_OK(writer->Close());
+
+  // Reopen it and write from the start. The rest of the old contents are
+  // truncated on close.
+  WritableFileOptions reopen_opts;
+  reopen_opts.mode = Env::OPEN_EXISTING;
+  reopen_opts.overwrite_existing = true;
+  ASSERT_OK(env_util::OpenFileForWrite(reopen_opts,
+                                       env_, test_path, &writer));
+  ASSERT_EQ(0, writer->Size());
+  ASSERT_OK(writer->Append(second));
+  ASSERT_EQ(second.length(), writer->Size());
+  ASSERT_OK(writer->Close());
+
+  shared_ptr<RandomAccessFile> reader;
+  ASSERT_OK(env_util::OpenFileForRandom(env_, test_path, &reader));
+  uint64_t size;
+  ASSERT_OK(reader->Size(&size));
+  ASSERT_EQ(second.length(), size);
+  uint8_t scratch[size];
+  Slice s(scratch, size);
+  ASSERT_OK(reader->Read(0, s));
+  ASSERT_EQ(second, s.ToString());
+}
+
 TEST_F(TestEnv, TestIsDirectory) {
   string dir = GetTestPath("a_directory");
   ASSERT_OK(env_->CreateDir(dir));
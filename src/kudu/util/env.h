@@ -454,9 +454,16 @@ struct WritableFileOptions {
   // See CreateMode for details.
   Env::CreateMode mode;
 
+  // If opening an existing file, write from its start instead of appending
+  // to it. The existing contents are treated like preallocated space: they
+  // are overwritten, and whatever is left past the written data is truncated
+  // on Close().
+  bool overwrite_existing;
+
   WritableFileOptions()
     : sync_on_close(false),
-      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE) { }
+      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE),
+      overwrite_existing(false) { }
 };
 
 // Options specified when a file is opened for random access.
@@ -641,12 +641,12 @@ class PosixRandomAccessFile: public RandomAccessFile {
 class PosixWritableFile : public WritableFile {
  public:
   PosixWritableFile(string fname, int fd, uint64_t file_size,
-                    bool sync_on_close)
+                    uint64_t pre_allocated_size, bool sync_on_close)
       : filename_(std::move(fname)),
         fd_(fd),
         sync_on_close_(sync_on_close),
         filesize_(file_size),
-        pre_allocated_size_(0),
+        pre_allocated_size_(pre_allocated_size),
         pending_sync_(false),
         closed_(false) {}
 
@@ -1790,7 +1790,13 @@ class PosixEnv : public Env {
     if (opts.mode == OPEN_EXISTING) {
       RETURN_NOT_OK(GetFileSize(fname, &file_size));
     }
-    result->reset(new PosixWritableFile(fname, fd, file_size, opts.sync_on_close));
+    uint64_t pre_allocated_size = 0;
+    if (opts.overwrite_existing) {
+      pre_allocated_size = file_size;
+      file_size = 0;
+    }
+    result->reset(new PosixWritableFile(fname, fd, file_size, pre_allocated_size,
+                                        opts.sync_on_close));
     return Status::OK();
   }
 
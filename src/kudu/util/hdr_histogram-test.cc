@@ -19,6 +19,7 @@
 
 #include <gtest/gtest.h>
 
+#include "kudu/gutil/macros.h"
 #include "kudu/util/hdr_histogram.h"
 #include "kudu/util/test_util.h"
 #include "kudu/util/test_macros.h"
@@ -113,4 +114,41 @@ TEST_F(HdrHistogramTest, PercentileAndCopyTest) {
   ASSERT_EQ(hist.TotalSum(), copy.TotalSum());
 }
 
+TEST_F(HdrHistogramTest, ScanPercentilesTest) {
+  uint64_t specified_max = 1000000;
+  HdrHistogram hist(specified_max, kSigDigits);
+
+  const double kPercentiles[] = { 0, 50, 80, 90, 99, 99.99, 100 };
+  const int kNumPercentiles = arraysize(kPercentiles);
+  uint64_t values[kNumPercentiles];
+  uint64_t counts[HdrHistogram::kNumBitLengths] = { 0 };
+  ASSERT_EQ(0, hist.ScanPercentiles(kPercentiles, kNumPercentiles, values, counts));
+  for (int i = 0; i < kNumPercentiles; i++) {
+    ASSERT_EQ(0, values[i]);
+  }
+
+  load_percentiles(&hist);
+  hist.Increment(0);
+  ASSERT_EQ(kExpectedCount + 1,
+            hist.ScanPercentiles(kPercentiles, kNumPercentiles, values, counts));
+  for (int i = 0; i < kNumPercentiles; i++) {
+    SCOPED_TRACE(kPercentiles[i]);
+    ASSERT_EQ(hist.ValueAtPercentile(kPercentiles[i]), values[i]);
+  }
+
+  // Each of the loaded values is counted by its bit length.
+  uint64_t expected_counts[HdrHistogram::kNumBitLengths] = { 0 };
+  expected_counts[0] = 1;   // 0
+  expected_counts[4] = 80;  // 10
+  expected_counts[7] = 10;  // 100
+  expected_counts[10] = 5;  // 1000
+  expected_counts[14] = 3;  // 10000
+  expected_counts[17] = 1;  // 100000
+  expected_counts[20] = 1;  // 1000000
+  for (int i = 0; i < HdrHistogram::kNumBitLengths; i++) {
+    SCOPED_TRACE(i);
+    ASSERT_EQ(expected_counts[i], counts[i]);
+  }
+}
+
 } // namespace kudu
@@ -324,6 +324,53 @@ uint64_t HdrHistogram::ValueAtPercentile(double percentile) const {
   return 0;
 }
 
+const int HdrHistogram::kNumBitLengths;
+
+uint64_t HdrHistogram::ScanPercentiles(const double* percentiles, int num_percentiles,
+                                       uint64_t* values,
+                                       uint64_t* counts_by_bit_length) const {
+  // Counts are incremented before the total count, so the counts scanned
+  // normally add up to at least 'count', and all the percentiles are reached.
+  const uint64_t count = TotalCount();
+  int p = 0;
+  uint64_t count_at_percentile = 0;
+  auto next_percentile = [&]() {
+    double requested_percentile = std::min(percentiles[p], 100.0);
+    count_at_percentile = std::max<uint64_t>(1, static_cast<uint64_t>(
+        ((requested_percentile / 100.0) * count) + 0.5)); // NOLINT(misc-incorrect-roundings)
+  };
+  if (num_percentiles > 0) {
+    next_percentile();
+  }
+
+  uint64_t total_to_current_iJ = 0;
+  uint64_t last_value = 0;
+  for (int i = 0; i < bucket_count_; i++) {
+    int j = (i == 0) ? 0 : (sub_bucket_count_ / 2);
+    for (; j < sub_bucket_count_; j++) {
+      uint64_t count_at_iJ = CountAt(i, j);
+      if (count_at_iJ == 0) continue;
+      total_to_current_iJ += count_at_iJ;
+      last_value = ValueFromIndex(i, j);
+      if (counts_by_bit_length != nullptr) {
+        int bit_length = last_value == 0 ? 0 : Bits::Log2Floor64(last_value) + 1;
+        counts_by_bit_length[bit_length] += count_at_iJ;
+      }
+      while (p < num_percentiles && total_to_current_iJ >= count_at_percentile) {
+        values[p++] = last_value;
+        if (p < num_percentiles) {
+          next_percentile();
+        }
+      }
+    }
+  }
+  // Only if the histogram is empty, or if the counts weren't all visible yet.
+  for (; p < num_percentiles; p++) {
+    values[p] = last_value;
+  }
+  return total_to_current_iJ;
+}
+
 ///////////////////////////////////////////////////////////////////////
 // AbstractHistogramIterator
 ///////////////////////////////////////////////////////////////////////
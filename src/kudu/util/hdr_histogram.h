@@ -158,6 +158,22 @@ class HdrHistogram {
   // This is a percentile in percents, i.e. 99.99 percentile.
   uint64_t ValueAtPercentile(double percentile) const;
 
+  // The number of elements of the 'counts_by_bit_length' array passed to
+  // ScanPercentiles(): one per bit length of a uint64_t, plus one for zero.
+  static const int kNumBitLengths = 65;
+
+  // Gets the values at each of the 'num_percentiles' 'percentiles', which must
+  // be ascending, into 'values', in a single pass over the histogram. If
+  // 'counts_by_bit_length' isn't null, also adds the number of recorded values
+  // of each bit length to it: zeros at index 0, and values in [2^(k-1), 2^k)
+  // at index k.
+  //
+  // Unlike ValueAtPercentile(), this is safe to call while the histogram is
+  // being modified, in which case it reflects only some of the concurrent
+  // modifications. Returns the number of values counted.
+  uint64_t ScanPercentiles(const double* percentiles, int num_percentiles,
+                           uint64_t* values, uint64_t* counts_by_bit_length) const;
+
   // Get the percentile at a given value
   // TODO: implement
   // double PercentileAtOrBelowValue(uint64_t value) const;
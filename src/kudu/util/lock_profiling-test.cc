@@ -0,0 +1,186 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/util/lock_profiling.h"
+
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <gflags/gflags_declare.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/util/countdown_latch.h"
+#include "kudu/util/hdr_histogram.h"
+#include "kudu/util/locks.h"
+#include "kudu/util/monotime.h"
+#include "kudu/util/stopwatch.h"
+#include "kudu/util/test_macros.h"
+#include "kudu/util/test_util.h"
+
+DECLARE_int32(lock_profiling_hold_sample_interval);
+
+using std::string;
+using std::thread;
+using strings::Substitute;
+
+namespace kudu {
+
+class LockProfilingTest : public KuduTest {
+ protected:
+  // Sets the hold sample interval, making sure that the next acquisition of
+  // a profiled lock by this thread is sampled.
+  static void SetHoldSampleInterval(int32_t interval) {
+    static LockSite scratch_site("Scratch");
+    profiled_spinlock scratch_lock(&scratch_site);
+    FLAGS_lock_profiling_hold_sample_interval = 1;
+    // Enough to run down whatever the thread's countdown was at.
+    for (int i = 0; i < 1001; i++) {
+      std::lock_guard<profiled_spinlock> l(scratch_lock);
+    }
+    FLAGS_lock_profiling_hold_sample_interval = interval;
+  }
+
+  // Holds 'lock' for 'hold' on another thread, while this thread acquires it.
+  template<class LockType>
+  static void Contend(LockType* lock, MonoDelta hold) {
+    CountDownLatch locked(1);
+    thread holder([&]() {
+        std::lock_guard<LockType> l(*lock);
+        locked.CountDown();
+        SleepFor(hold);
+      });
+    locked.Wait();
+    {
+      std::lock_guard<LockType> l(*lock);
+    }
+    holder.join();
+  }
+};
+
+static const int64_t kMillisToNanos = 1000 * 1000;
+
+TEST_F(LockProfilingTest, TestSpinlockWait) {
+  static LockSite site("TestSpinlockWait");
+  profiled_spinlock lock(&site);
+
+  // Uncontended acquisitions don't record waits.
+  for (int i = 0; i < 100; i++) {
+    std::lock_guard<profiled_spinlock> l(lock);
+  }
+  ASSERT_EQ(0, site.wait_histogram().TotalCount());
+
+  NO_FATALS(Contend(&lock, MonoDelta::FromMilliseconds(50)));
+  ASSERT_EQ(1, site.wait_histogram().TotalCount());
+  ASSERT_GT(site.wait_histogram().MaxValue(), 10 * kMillisToNanos);
+}
+
+TEST_F(LockProfilingTest, TestPerCpuLockWait) {
+  static LockSite site("TestPerCpuLock");
+  profiled_percpu_rwlock lock(&site);
+  NO_FATALS(Contend(&lock, MonoDelta::FromMilliseconds(50)));
+  ASSERT_EQ(1, site.wait_histogram().TotalCount());
+  ASSERT_GT(site.wait_histogram().MaxValue(), 10 * kMillisToNanos);
+
+  // Shared acquisitions aren't profiled.
+  for (int i = 0; i < 100; i++) {
+    shared_lock<rw_spinlock> l(lock.get_lock());
+  }
+  ASSERT_EQ(1, site.wait_histogram().TotalCount());
+}
+
+TEST_F(LockProfilingTest, TestHoldSampling) {
+  static LockSite site("TestHoldSampling");
+  profiled_spinlock lock(&site);
+
+  SetHoldSampleInterval(1);
+  {
+    std::lock_guard<profiled_spinlock> l(lock);
+    SleepFor(MonoDelta::FromMilliseconds(20));
+  }
+  ASSERT_EQ(1, site.hold_histogram().TotalCount());
+  ASSERT_GT(site.hold_histogram().MaxValue(), 10 * kMillisToNanos);
+
+  FLAGS_lock_profiling_hold_sample_interval = 10;
+  for (int i = 0; i < 1000; i++) {
+    std::lock_guard<profiled_spinlock> l(lock);
+  }
+  ASSERT_EQ(101, site.hold_histogram().TotalCount());
+
+  // Sampling can be turned off.
+  FLAGS_lock_profiling_hold_sample_interval = 0;
+  const uint64_t num_holds = site.hold_histogram().TotalCount();
+  for (int i = 0; i < 1000; i++) {
+    std::lock_guard<profiled_spinlock> l(lock);
+  }
+  ASSERT_EQ(num_holds, site.hold_histogram().TotalCount());
+}
+
+TEST_F(LockProfilingTest, TestReport) {
+  static LockSite quiet_site("QuietLock");
+  static LockSite busy_site("BusyLock");
+  static LockSite busier_site("BusierLock");
+  profiled_spinlock quiet_lock(&quiet_site);
+  profiled_spinlock busy_lock(&busy_site);
+  profiled_spinlock busier_lock(&busier_site);
+
+  FLAGS_lock_profiling_hold_sample_interval = 0;
+  {
+    std::lock_guard<profiled_spinlock> l(quiet_lock);
+  }
+  NO_FATALS(Contend(&busy_lock, MonoDelta::FromMilliseconds(10)));
+  NO_FATALS(Contend(&busier_lock, MonoDelta::FromMilliseconds(100)));
+
+  std::ostringstream out;
+  DumpLockContentionReport(&out);
+  const string report = out.str();
+  LOG(INFO) << report;
+  ASSERT_STR_NOT_CONTAINS(report, "QuietLock");
+  ASSERT_STR_CONTAINS(report, "BusyLock: total wait");
+  ASSERT_STR_CONTAINS(report, "over 1 contended acquisitions");
+  ASSERT_LT(report.find("BusierLock"), report.find("BusyLock"));
+}
+
+// Measures the cost of uncontended acquisitions of profiled locks, compared to
+// plain ones.
+template<class LockType>
+static void BenchmarkUncontendedAcquisitions(LockType* lock, const char* kind) {
+  const int kNumIters = AllowSlowTests() ? 100000000 : 1000000;
+  Stopwatch sw;
+  sw.start();
+  for (int i = 0; i < kNumIters; i++) {
+    std::lock_guard<LockType> l(*lock);
+  }
+  sw.stop();
+  LOG(INFO) << Substitute("$0 uncontended acquisitions of a $1: $2 ns each",
+                          kNumIters, kind, sw.elapsed().wall_seconds() * 1e9 / kNumIters);
+}
+
+TEST_F(LockProfilingTest, BenchmarkUncontended) {
+  simple_spinlock lock;
+  BenchmarkUncontendedAcquisitions(&lock, "simple_spinlock");
+
+  static LockSite site("BenchmarkUncontended");
+  profiled_spinlock profiled(&site);
+  BenchmarkUncontendedAcquisitions(&profiled, "profiled_spinlock");
+}
+
+} // namespace kudu
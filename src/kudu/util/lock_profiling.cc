@@ -0,0 +1,144 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "kudu/util/lock_profiling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "kudu/gutil/macros.h"
+#include "kudu/gutil/port.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/gutil/sysinfo.h"
+#include "kudu/gutil/walltime.h"
+#include "kudu/util/flag_tags.h"
+
+DEFINE_int32(lock_profiling_hold_sample_interval, 100,
+             "One in this many acquisitions of a profiled lock by a thread has "
+             "the time the lock is held sampled. Waits for profiled locks are "
+             "always recorded. If 0, hold times aren't sampled.");
+TAG_FLAG(lock_profiling_hold_sample_interval, advanced);
+TAG_FLAG(lock_profiling_hold_sample_interval, runtime);
+
+static bool ValidateHoldSampleInterval(const char* flagname, int32_t value) {
+  return value >= 0;
+}
+DEFINE_validator(lock_profiling_hold_sample_interval, &ValidateHoldSampleInterval);
+
+using std::vector;
+using strings::Substitute;
+
+namespace kudu {
+
+namespace {
+
+// Waits and holds longer than this are recorded as this.
+const uint64_t kMaxNanos = 100LL * 1000 * 1000 * 1000;
+
+// Constant-initialized, so that sites may be registered during static
+// initialization.
+std::atomic<LockSite*> g_first_site(nullptr);
+
+// The number of acquisitions left before this thread samples a hold.
+__thread int32_t t_hold_sample_countdown = 0;
+
+int64_t CyclesToNanos(int64_t cycles) {
+  static const double kNanosPerCycle = 1e9 / base::CyclesPerSecond();
+  return std::min<uint64_t>(std::max<int64_t>(cycles, 0) * kNanosPerCycle, kMaxNanos);
+}
+
+} // anonymous namespace
+
+LockSite::LockSite(const char* name)
+    : name_(name),
+      wait_nanos_(kMaxNanos, 2),
+      hold_nanos_(kMaxNanos, 2),
+      next_(g_first_site.load()) {
+  while (!g_first_site.compare_exchange_weak(next_, this)) {
+  }
+}
+
+void LockSite::RecordWait(int64_t cycles) {
+  wait_nanos_.Increment(CyclesToNanos(cycles));
+}
+
+int64_t LockSite::MaybeStartHold() {
+  if (PREDICT_TRUE(--t_hold_sample_countdown > 0)) {
+    return 0;
+  }
+  const int32_t interval = FLAGS_lock_profiling_hold_sample_interval;
+  if (interval == 0) {
+    // Check the flag again in a while.
+    t_hold_sample_countdown = 1000;
+    return 0;
+  }
+  t_hold_sample_countdown = interval;
+  // Never 0, so that it can't be mistaken for an unsampled hold.
+  return std::max<int64_t>(CycleClock::Now(), 1);
+}
+
+void LockSite::RecordHold(int64_t start_cycles) {
+  hold_nanos_.Increment(CyclesToNanos(CycleClock::Now() - start_cycles));
+}
+
+const LockSite* GetFirstLockSite() {
+  return g_first_site.load();
+}
+
+void DumpLockContentionReport(std::ostream* out) {
+  struct SiteProfile {
+    const LockSite* site;
+    uint64_t num_waits;
+    uint64_t total_wait_nanos;
+  };
+  vector<SiteProfile> profiles;
+  for (const LockSite* site = GetFirstLockSite(); site != nullptr; site = site->next()) {
+    const HdrHistogram& waits = site->wait_histogram();
+    if (waits.TotalCount() == 0 && site->hold_histogram().TotalCount() == 0) {
+      continue;
+    }
+    profiles.push_back({ site, waits.TotalCount(), waits.TotalSum() });
+  }
+  std::sort(profiles.begin(), profiles.end(),
+            [](const SiteProfile& a, const SiteProfile& b) {
+              return a.total_wait_nanos > b.total_wait_nanos;
+            });
+
+  static const double kPercentiles[] = { 50, 99 };
+  *out << "Lock contention by site, by total wait (times in nanoseconds):\n";
+  for (const SiteProfile& p : profiles) {
+    uint64_t wait_values[arraysize(kPercentiles)];
+    p.site->wait_histogram().ScanPercentiles(kPercentiles, arraysize(kPercentiles),
+                                            wait_values, nullptr);
+    uint64_t hold_values[arraysize(kPercentiles)];
+    const uint64_t num_holds = p.site->hold_histogram().ScanPercentiles(
+        kPercentiles, arraysize(kPercentiles), hold_values, nullptr);
+    *out << Substitute("$0: total wait $1 over $2 contended acquisitions "
+                       "(p50 $3, p99 $4, max $5); hold p50 $6, p99 $7, max $8 "
+                       "over $9 sampled acquisitions\n",
+                       p.site->name(), p.total_wait_nanos, p.num_waits,
+                       wait_values[0], wait_values[1], p.site->wait_histogram().MaxValue(),
+                       hold_values[0], hold_values[1], p.site->hold_histogram().MaxValue(),
+                       num_holds);
+  }
+}
+
+} // namespace kudu
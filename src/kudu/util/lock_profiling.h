@@ -0,0 +1,168 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#ifndef KUDU_UTIL_LOCK_PROFILING_H
+#define KUDU_UTIL_LOCK_PROFILING_H
+
+#include <cstdint>
+#include <iosfwd>
+
+#include <glog/logging.h>
+
+#include "kudu/gutil/macros.h"
+#include "kudu/gutil/port.h"
+#include "kudu/gutil/walltime.h"
+#include "kudu/util/hdr_histogram.h"
+#include "kudu/util/locks.h"
+
+namespace kudu {
+
+// A named place in the code whose locks are profiled, e.g. a lock member of
+// a class. All the locks of a site share its profile.
+//
+// A lock is profiled by declaring it as a profiled_spinlock or a
+// profiled_percpu_rwlock and passing the site to its constructor. Every
+// contended acquisition of a profiled lock records how long it waited, and one in
+// --lock_profiling_hold_sample_interval acquisitions by a thread records how
+// long the lock was then held. Uncontended acquisitions which aren't sampled
+// only pay for a thread-local countdown.
+//
+// Sites must have static storage duration, since they are never unregistered:
+//
+//   static LockSite g_foo_lock_site("Foo::lock_");
+//   Foo::Foo() : lock_(&g_foo_lock_site) {}
+//
+// where Foo::lock_ is a profiled_spinlock.
+//
+// This class is thread-safe.
+class LockSite {
+ public:
+  explicit LockSite(const char* name);
+
+  const char* name() const { return name_; }
+
+  // Records that acquiring a lock of the site waited for 'cycles'.
+  void RecordWait(int64_t cycles);
+
+  // Returns the current cycle count if the hold time of the acquisition which
+  // was just made should be sampled, or 0 otherwise. The lock passes the
+  // returned value to RecordHold() when released.
+  int64_t MaybeStartHold();
+
+  // Records a lock of the site held since 'start_cycles'.
+  void RecordHold(int64_t start_cycles);
+
+  // The wait times of the contended acquisitions, in nanoseconds.
+  const HdrHistogram& wait_histogram() const { return wait_nanos_; }
+
+  // The sampled hold times, in nanoseconds.
+  const HdrHistogram& hold_histogram() const { return hold_nanos_; }
+
+  // The next site in the list of all sites, or null for the last one.
+  const LockSite* next() const { return next_; }
+
+ private:
+  const char* const name_;
+  HdrHistogram wait_nanos_;
+  HdrHistogram hold_nanos_;
+  LockSite* next_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockSite);
+};
+
+// A lock of type 'LockType' whose contention is profiled under a LockSite.
+// Use profiled_spinlock or profiled_percpu_rwlock rather than this directly.
+template<class LockType>
+class profiled_lock {
+ public:
+  void lock() {
+    if (PREDICT_FALSE(!lock_.try_lock())) {
+      const int64_t start_cycles = CycleClock::Now();
+      lock_.lock();
+      site_->RecordWait(CycleClock::Now() - start_cycles);
+    }
+    hold_start_cycles_ = site_->MaybeStartHold();
+  }
+
+  void unlock() {
+    if (PREDICT_FALSE(hold_start_cycles_ != 0)) {
+      site_->RecordHold(hold_start_cycles_);
+      hold_start_cycles_ = 0;
+    }
+    lock_.unlock();
+  }
+
+  bool try_lock() {
+    if (!lock_.try_lock()) {
+      return false;
+    }
+    hold_start_cycles_ = site_->MaybeStartHold();
+    return true;
+  }
+
+  bool is_locked() {
+    return lock_.is_locked();
+  }
+
+ protected:
+  explicit profiled_lock(LockSite* site)
+      : site_(DCHECK_NOTNULL(site)) {
+  }
+
+  LockType lock_;
+
+ private:
+  LockSite* const site_;
+
+  // When the hold time of the current acquisition is sampled, the cycle
+  // count at which it was acquired, and otherwise 0.
+  int64_t hold_start_cycles_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(profiled_lock);
+};
+
+// A simple_spinlock whose contention is profiled under a LockSite.
+class profiled_spinlock : public profiled_lock<simple_spinlock> {
+ public:
+  explicit profiled_spinlock(LockSite* site)
+      : profiled_lock<simple_spinlock>(site) {
+  }
+};
+
+// A percpu_rwlock whose contention in exclusive mode is profiled under a
+// LockSite. Shared acquisitions take one of the per-CPU locks directly, and
+// aren't profiled.
+class profiled_percpu_rwlock : public profiled_lock<percpu_rwlock> {
+ public:
+  explicit profiled_percpu_rwlock(LockSite* site)
+      : profiled_lock<percpu_rwlock>(site) {
+  }
+
+  rw_spinlock& get_lock() {
+    return lock_.get_lock();
+  }
+};
+
+// Returns the first of all the lock sites, which are linked through
+// LockSite::next(), or null if there are none.
+const LockSite* GetFirstLockSite();
+
+// Writes a report of the profiles of all the lock sites with any contention
+// or sampled holds to 'out', ranking the sites by their total wait time.
+void DumpLockContentionReport(std::ostream* out);
+
+} // namespace kudu
+#endif /* KUDU_UTIL_LOCK_PROFILING_H */
@@ -31,18 +31,23 @@
 #include "kudu/gutil/gscoped_ptr.h"
 #include "kudu/gutil/map-util.h"
 #include "kudu/gutil/ref_counted.h"
+#include "kudu/gutil/strings/substitute.h"
+#include "kudu/gutil/strings/util.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/hdr_histogram.h"
 #include "kudu/util/jsonreader.h"
 #include "kudu/util/jsonwriter.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
 #include "kudu/util/status.h"
+#include "kudu/util/stopwatch.h"
 #include "kudu/util/test_macros.h"
 #include "kudu/util/test_util.h"
 
 using std::string;
 using std::unordered_set;
 using std::vector;
+using strings::Substitute;
 
 DECLARE_int32(metrics_retirement_age_ms);
 
@@ -385,4 +390,169 @@ TEST_F(MetricsTest, TestDontDumpUntouched) {
   ASSERT_STR_CONTAINS(out.str(), "test_gauge");
 }
 
+METRIC_DEFINE_gauge_string(test_entity, test_string_gauge, "Test string Gauge",
+                           MetricUnit::kState, "Description of Test string Gauge");
+
+static int CountOccurrences(const string& s, const string& needle) {
+  int n = 0;
+  for (size_t pos = s.find(needle); pos != string::npos; pos = s.find(needle, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+TEST_F(MetricsTest, OpenMetricsTest) {
+  scoped_refptr<Counter> test_counter = METRIC_test_counter.Instantiate(entity_);
+  test_counter->Increment();
+  scoped_refptr<AtomicGauge<uint64_t> > gauge = METRIC_test_gauge.Instantiate(entity_, 5);
+  scoped_refptr<AtomicGauge<uint64_t> > counter_gauge =
+    METRIC_counter_as_gauge.Instantiate(entity_, 3);
+  scoped_refptr<Histogram> hist = METRIC_test_hist.Instantiate(entity_);
+  hist->Increment(2);
+  hist->Increment(4);
+  entity_->SetAttribute("test_attr", "attr \"val\"");
+
+  scoped_refptr<MetricEntity> other = METRIC_ENTITY_test_entity.Instantiate(&registry_, "other");
+  scoped_refptr<Counter> other_counter = METRIC_test_counter.Instantiate(other);
+
+  faststring buf;
+  ASSERT_OK(registry_.WriteAsOpenMetrics({ "*" }, MetricOpenMetricsOptions(), &buf));
+  string out = buf.ToString();
+  const string kLabels = "entity_type=\"test_entity\",entity_id=\"my-test\"";
+  const string kOtherLabels = "entity_type=\"test_entity\",entity_id=\"other\"";
+
+  // Each metric is a family with a sample per entity, the entities in order.
+  ASSERT_STR_CONTAINS(out,
+      "# TYPE kudu_test_counter counter\n"
+      "# HELP kudu_test_counter Description of test counter\n"
+      "kudu_test_counter_total{" + kLabels + "} 1\n"
+      "kudu_test_counter_total{" + kOtherLabels + "} 0\n");
+  ASSERT_EQ(1, CountOccurrences(out, "# TYPE kudu_test_counter "));
+  ASSERT_STR_CONTAINS(out,
+      "# TYPE kudu_test_gauge gauge\n"
+      "# HELP kudu_test_gauge Description of Test Gauge\n"
+      "kudu_test_gauge{" + kLabels + "} 5\n");
+  ASSERT_STR_CONTAINS(out,
+      "# TYPE kudu_counter_as_gauge counter\n"
+      "# HELP kudu_counter_as_gauge Gauge exposed as Counter\n"
+      "kudu_counter_as_gauge_total{" + kLabels + "} 3\n");
+
+  // Histograms are summaries of their quantiles, and histograms with
+  // power-of-two buckets.
+  ASSERT_STR_CONTAINS(out,
+      "# TYPE kudu_test_hist summary\n"
+      "# HELP kudu_test_hist foo\n"
+      "kudu_test_hist{" + kLabels + ",quantile=\"0\"} 2\n"
+      "kudu_test_hist{" + kLabels + ",quantile=\"0.5\"} 2\n"
+      "kudu_test_hist{" + kLabels + ",quantile=\"0.75\"} 4\n");
+  ASSERT_STR_CONTAINS(out,
+      "kudu_test_hist{" + kLabels + ",quantile=\"1\"} 4\n"
+      "kudu_test_hist_count{" + kLabels + "} 2\n"
+      "kudu_test_hist_sum{" + kLabels + "} 6\n"
+      "# TYPE kudu_test_hist_histogram histogram\n"
+      "# HELP kudu_test_hist_histogram foo\n"
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"0\"} 0\n"
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"1\"} 0\n"
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"3\"} 1\n"
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"7\"} 2\n");
+  // Buckets go up to the histogram's highest trackable value, 1000000.
+  ASSERT_STR_CONTAINS(out,
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"1048575\"} 2\n"
+      "kudu_test_hist_histogram_bucket{" + kLabels + ",le=\"+Inf\"} 2\n"
+      "kudu_test_hist_histogram_count{" + kLabels + "} 2\n"
+      "kudu_test_hist_histogram_sum{" + kLabels + "} 6\n");
+  ASSERT_STR_NOT_CONTAINS(out, "le=\"2097151\"");
+  ASSERT_STR_NOT_CONTAINS(out, "test_attr");
+  ASSERT_TRUE(HasSuffixString(out, "\n# EOF\n")) << out;
+
+  // Options change the names, labels and histogram families.
+  MetricOpenMetricsOptions opts;
+  opts.name_prefix = "";
+  opts.include_entity_attributes = true;
+  opts.include_histogram_buckets = false;
+  opts.include_untouched_metrics = false;
+  buf.clear();
+  ASSERT_OK(registry_.WriteAsOpenMetrics({ "*" }, opts, &buf));
+  out = buf.ToString();
+  ASSERT_STR_CONTAINS(out, "\ntest_counter_total{" + kLabels +
+                      ",test_attr=\"attr \\\"val\\\"\"} 1\n");
+  ASSERT_STR_NOT_CONTAINS(out, kOtherLabels);
+  ASSERT_STR_NOT_CONTAINS(out, "_histogram");
+
+  // Metrics are selected by entity id or metric name, as for JSON.
+  buf.clear();
+  ASSERT_OK(registry_.WriteAsOpenMetrics({ "TEST_count" }, MetricOpenMetricsOptions(), &buf));
+  out = buf.ToString();
+  ASSERT_EQ(1, CountOccurrences(out, "# TYPE"));
+  ASSERT_STR_CONTAINS(out, kOtherLabels);
+  buf.clear();
+  ASSERT_OK(registry_.WriteAsOpenMetrics({ "other" }, MetricOpenMetricsOptions(), &buf));
+  out = buf.ToString();
+  ASSERT_EQ(1, CountOccurrences(out, "# TYPE"));
+  ASSERT_STR_NOT_CONTAINS(out, kLabels);
+  buf.clear();
+  ASSERT_OK(registry_.WriteAsOpenMetrics({ "not_a_matching_metric" },
+                                         MetricOpenMetricsOptions(), &buf));
+  ASSERT_EQ("# EOF\n", buf.ToString());
+
+  // String gauges are info metrics, with the value as a label.
+  scoped_refptr<StringGauge> string_gauge =
+    new StringGauge(&METRIC_test_string_gauge, "a \"quoted\"\nvalue");
+  ASSERT_STREQ("info", string_gauge->open_metrics_type());
+  buf.clear();
+  string_gauge->WriteAsOpenMetrics("kudu_test_string_gauge", kLabels, &buf);
+  ASSERT_EQ("kudu_test_string_gauge_info{" + kLabels +
+            ",value=\"a \\\"quoted\\\"\\nvalue\"} 1\n", buf.ToString());
+}
+
+// Compares the time to scrape 100k metrics as JSON and in the OpenMetrics format.
+TEST_F(MetricsTest, BenchmarkScrape) {
+  const int kNumEntities = 25000;
+  const int kNumHistograms = 100;
+  const int kNumScrapes = 5;
+  int metric_val = 0;
+  vector<scoped_refptr<MetricEntity>> entities;
+  vector<scoped_refptr<Metric>> metrics;
+  for (int i = 0; i < kNumEntities; i++) {
+    scoped_refptr<MetricEntity> entity =
+      METRIC_ENTITY_test_entity.Instantiate(&registry_, Substitute("entity-$0", i));
+    scoped_refptr<Counter> counter = METRIC_test_counter.Instantiate(entity);
+    counter->IncrementBy(i);
+    metrics.emplace_back(counter);
+    metrics.emplace_back(METRIC_test_gauge.Instantiate(entity, i));
+    metrics.emplace_back(METRIC_counter_as_gauge.Instantiate(entity, i));
+    metrics.emplace_back(METRIC_test_func_gauge.InstantiateFunctionGauge(
+        entity, Bind(&MyFunction, Unretained(&metric_val))));
+    if (i < kNumHistograms) {
+      scoped_refptr<Histogram> hist = METRIC_test_hist.Instantiate(entity);
+      for (int j = 0; j < 1000; j++) {
+        hist->Increment(j * j);
+      }
+      metrics.emplace_back(hist);
+    }
+    entities.emplace_back(std::move(entity));
+  }
+
+  std::ostringstream json;
+  LOG_TIMING(INFO, Substitute("$0 JSON scrapes of $1 metrics", kNumScrapes, metrics.size())) {
+    for (int i = 0; i < kNumScrapes; i++) {
+      json.str("");
+      JsonWriter writer(&json, JsonWriter::COMPACT);
+      ASSERT_OK(registry_.WriteAsJson(&writer, { "*" }, MetricJsonOptions()));
+    }
+  }
+  faststring open_metrics;
+  LOG_TIMING(INFO, Substitute("$0 OpenMetrics scrapes of $1 metrics",
+                              kNumScrapes, metrics.size())) {
+    for (int i = 0; i < kNumScrapes; i++) {
+      open_metrics.clear();
+      ASSERT_OK(registry_.WriteAsOpenMetrics({ "*" }, MetricOpenMetricsOptions(),
+                                             &open_metrics));
+    }
+  }
+  LOG(INFO) << Substitute("JSON: $0 bytes, OpenMetrics: $1 bytes",
+                          json.str().size(), open_metrics.size());
+  ASSERT_EQ(kNumEntities, CountOccurrences(open_metrics.ToString(), "kudu_test_gauge{"));
+}
+
 } // namespace kudu
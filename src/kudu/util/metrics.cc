@@ -16,6 +16,9 @@
 // under the License.
 #include "kudu/util/metrics.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <utility>
@@ -23,14 +26,18 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "kudu/gutil/bits.h"
 #include "kudu/gutil/map-util.h"
 #include "kudu/gutil/singleton.h"
+#include "kudu/gutil/strings/ascii_ctype.h"
+#include "kudu/gutil/strings/numbers.h"
+#include "kudu/gutil/strings/stringpiece.h"
 #include "kudu/gutil/strings/substitute.h"
+#include "kudu/util/faststring.h"
 #include "kudu/util/flag_tags.h"
 #include "kudu/util/hdr_histogram.h"
 #include "kudu/util/histogram.pb.h"
 #include "kudu/util/status.h"
-#include "kudu/util/string_case.h"
 
 DEFINE_int32(metrics_retirement_age_ms, 120 * 1000,
              "The minimum number of milliseconds a metric will be kept for after it is "
@@ -185,26 +192,124 @@ scoped_refptr<Metric> MetricEntity::FindOrNull(const MetricPrototype& prototype)
 
 namespace {
 
-bool MatchMetricInList(const string& metric_name,
+bool MatchMetricInList(StringPiece metric_name,
                        const vector<string>& match_params) {
-  string metric_name_uc;
-  ToUpperCase(metric_name, &metric_name_uc);
-
   for (const string& param : match_params) {
     // Handle wildcard.
     if (param == "*") return true;
     // The parameter is a case-insensitive substring match of the metric name.
-    string param_uc;
-    ToUpperCase(param, &param_uc);
-    if (metric_name_uc.find(param_uc) != std::string::npos) {
+    // This is matched in place, since it's done for every metric of a scrape.
+    auto it = std::search(metric_name.begin(), metric_name.end(),
+                          param.begin(), param.end(),
+                          [](char a, char b) { return ascii_toupper(a) == ascii_toupper(b); });
+    if (it != metric_name.end() || param.empty()) {
       return true;
     }
   }
   return false;
 }
 
+void AppendOpenMetricsLiteral(const char* s, faststring* out) {
+  out->append(s, strlen(s));
+}
+
+// Appends 'value' to 'out', escaped as an OpenMetrics label value or help text.
+void AppendOpenMetricsEscaped(StringPiece value, faststring* out) {
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        out->append("\\\\", 2);
+        break;
+      case '"':
+        out->append("\\\"", 2);
+        break;
+      case '\n':
+        out->append("\\n", 2);
+        break;
+      default:
+        out->push_back(c);
+        break;
+    }
+  }
+}
+
+// Appends the metadata of the metric family 'name'.
+void AppendOpenMetricsFamily(const string& name, const char* type,
+                             const char* help, faststring* out) {
+  AppendOpenMetricsLiteral("# TYPE ", out);
+  out->append(name);
+  out->push_back(' ');
+  AppendOpenMetricsLiteral(type, out);
+  AppendOpenMetricsLiteral("\n# HELP ", out);
+  out->append(name);
+  out->push_back(' ');
+  AppendOpenMetricsEscaped(help, out);
+  out->push_back('\n');
+}
+
+// Starts a sample of the metric family 'name', whose name has 'suffix', by
+// appending its name and its labels 'labels'. More labels may be appended with
+// AppendOpenMetricsLabel() before calling EndOpenMetricsLabels().
+void StartOpenMetricsSample(const string& name, const char* suffix,
+                            const string& labels, faststring* out) {
+  out->append(name);
+  AppendOpenMetricsLiteral(suffix, out);
+  out->push_back('{');
+  out->append(labels);
+}
+
+void StartOpenMetricsLabel(const char* key, faststring* out) {
+  if (out->size() > 0 && out->data()[out->size() - 1] != '{') {
+    out->push_back(',');
+  }
+  AppendOpenMetricsLiteral(key, out);
+  out->append("=\"", 2);
+}
+
+void AppendOpenMetricsLabel(const char* key, const char* value, faststring* out) {
+  StartOpenMetricsLabel(key, out);
+  AppendOpenMetricsEscaped(value, out);
+  out->push_back('"');
+}
+
+// Ends the labels of a sample, whose value comes next.
+void EndOpenMetricsLabels(faststring* out) {
+  out->append("} ", 2);
+}
+
+// A metric collected by MetricRegistry::WriteAsOpenMetrics().
+struct OpenMetricsEntry {
+  const MetricPrototype* prototype;
+  // The index of the metric's entity in the sorted entities.
+  int entity_index;
+  scoped_refptr<Metric> metric;
+};
+
 } // anonymous namespace
 
+void AppendOpenMetricsInt64(int64_t value, faststring* out) {
+  char buf[kFastToBufferSize];
+  char* end = FastInt64ToBufferLeft(value, buf);
+  out->append(buf, end - buf);
+}
+
+void AppendOpenMetricsUInt64(uint64_t value, faststring* out) {
+  char buf[kFastToBufferSize];
+  char* end = FastUInt64ToBufferLeft(value, buf);
+  out->append(buf, end - buf);
+}
+
+void AppendOpenMetricsDouble(double value, faststring* out) {
+  if (std::isnan(value)) {
+    AppendOpenMetricsLiteral("NaN", out);
+  } else if (std::isinf(value)) {
+    AppendOpenMetricsLiteral(value > 0 ? "+Inf" : "-Inf", out);
+  } else {
+    char buf[kFastToBufferSize];
+    AppendOpenMetricsLiteral(DoubleToBuffer(value, buf), out);
+  }
+}
+
 
 Status MetricEntity::WriteAsJson(JsonWriter* writer,
                                  const vector<string>& requested_metrics,
@@ -368,6 +473,139 @@ Status MetricRegistry::WriteAsJson(JsonWriter* writer,
   return Status::OK();
 }
 
+Status MetricRegistry::WriteAsOpenMetrics(const vector<string>& requested_metrics,
+                                          const MetricOpenMetricsOptions& opts,
+                                          faststring* out) const {
+  vector<scoped_refptr<MetricEntity>> entities;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    entities.reserve(entities_.size());
+    for (const auto& e : entities_) {
+      entities.push_back(e.second);
+    }
+  }
+  // The entities and the metrics are sorted so that the output is stable.
+  std::sort(entities.begin(), entities.end(),
+            [](const scoped_refptr<MetricEntity>& a, const scoped_refptr<MetricEntity>& b) {
+              int cmp = strcmp(a->prototype_->name(), b->prototype_->name());
+              return cmp < 0 || (cmp == 0 && a->id() < b->id());
+            });
+
+  // The labels of the samples of each entity, built once per entity.
+  vector<string> entity_labels(entities.size());
+  vector<OpenMetricsEntry> metrics;
+  vector<const MetricEntity::AttributeMap::value_type*> attrs;
+  for (int i = 0; i < entities.size(); i++) {
+    const MetricEntity* entity = entities[i].get();
+    bool select_all = MatchMetricInList(entity->id(), requested_metrics);
+    size_t num_collected = metrics.size();
+
+    std::lock_guard<simple_spinlock> l(entity->lock_);
+    for (const auto& val : entity->metric_map_) {
+      const MetricPrototype* prototype = val.first;
+      const scoped_refptr<Metric>& metric = val.second;
+      if ((select_all || MatchMetricInList(prototype->name(), requested_metrics)) &&
+          metric->ModifiedInOrAfterEpoch(opts.only_modified_in_or_after_epoch) &&
+          (opts.include_untouched_metrics || !metric->IsUntouched())) {
+        metrics.push_back({ prototype, i, metric });
+      }
+    }
+    if (metrics.size() == num_collected) {
+      continue;
+    }
+
+    faststring labels;
+    AppendOpenMetricsLabel("entity_type", entity->prototype_->name(), &labels);
+    AppendOpenMetricsLabel("entity_id", entity->id().c_str(), &labels);
+    if (opts.include_entity_attributes) {
+      attrs.clear();
+      for (const auto& attr : entity->attributes_) {
+        attrs.push_back(&attr);
+      }
+      std::sort(attrs.begin(), attrs.end(),
+                [](const MetricEntity::AttributeMap::value_type* a,
+                   const MetricEntity::AttributeMap::value_type* b) {
+                  return a->first < b->first;
+                });
+      for (const auto* attr : attrs) {
+        AppendOpenMetricsLabel(attr->first.c_str(), attr->second.c_str(), &labels);
+      }
+    }
+    entity_labels[i] = labels.ToString();
+  }
+
+  std::sort(metrics.begin(), metrics.end(),
+            [](const OpenMetricsEntry& a, const OpenMetricsEntry& b) {
+              int cmp = strcmp(a.prototype->name(), b.prototype->name());
+              return cmp < 0 || (cmp == 0 && a.entity_index < b.entity_index);
+            });
+
+  // Each metric family is written in one go, with a sample per entity.
+  string name;
+  for (auto begin = metrics.begin(); begin != metrics.end();) {
+    const MetricPrototype* prototype = begin->prototype;
+    auto end = begin;
+    while (end != metrics.end() &&
+           (end->prototype == prototype ||
+            strcmp(end->prototype->name(), prototype->name()) == 0)) {
+      ++end;
+    }
+
+    name.assign(opts.name_prefix);
+    name.append(prototype->name());
+    AppendOpenMetricsFamily(name, begin->metric->open_metrics_type(),
+                            prototype->description(), out);
+    for (auto it = begin; it != end; ++it) {
+      it->metric->WriteAsOpenMetrics(name, entity_labels[it->entity_index], out);
+    }
+
+    if (opts.include_histogram_buckets && prototype->type() == MetricType::kHistogram) {
+      name.append("_histogram");
+      AppendOpenMetricsFamily(name, "histogram", prototype->description(), out);
+      for (auto it = begin; it != end; ++it) {
+        if (it->prototype->type() == MetricType::kHistogram) {
+          down_cast<Histogram*>(it->metric.get())->WriteBucketsAsOpenMetrics(
+              name, entity_labels[it->entity_index], out);
+        }
+      }
+    }
+    begin = end;
+  }
+  AppendOpenMetricsLiteral("# EOF\n", out);
+
+  // Retire old metrics, as WriteAsJson() does.
+  metrics.clear();
+  entities.clear();
+  const_cast<MetricRegistry*>(this)->RetireOldMetrics();
+  return Status::OK();
+}
+
+void MetricRegistry::VisitMetrics(
+    const std::function<void(const MetricEntity& entity, Metric* metric)>& visitor) const {
+  vector<scoped_refptr<MetricEntity>> entities;
+  {
+    std::lock_guard<simple_spinlock> l(lock_);
+    entities.reserve(entities_.size());
+    for (const auto& e : entities_) {
+      entities.push_back(e.second);
+    }
+  }
+  vector<scoped_refptr<Metric>> metrics;
+  for (const auto& entity : entities) {
+    metrics.clear();
+    {
+      std::lock_guard<simple_spinlock> l(entity->lock_);
+      metrics.reserve(entity->metric_map_.size());
+      for (const auto& val : entity->metric_map_) {
+        metrics.push_back(val.second);
+      }
+    }
+    for (const auto& metric : metrics) {
+      visitor(*entity.get(), metric.get());
+    }
+  }
+}
+
 void MetricRegistry::RetireOldMetrics() {
   std::lock_guard<simple_spinlock> l(lock_);
   for (auto it = entities_.begin(); it != entities_.end();) {
@@ -547,6 +785,21 @@ Status Gauge::WriteAsJson(JsonWriter* writer,
   return Status::OK();
 }
 
+void Gauge::WriteAsOpenMetrics(const string& name,
+                               const string& labels,
+                               faststring* out) const {
+  StartOpenMetricsSample(name, prototype_->type() == MetricType::kCounter ? "_total" : "",
+                         labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsValue(out);
+  out->push_back('\n');
+}
+
+const char* Gauge::open_metrics_type() const {
+  // Gauges may be exposed as counters, see EXPOSE_AS_COUNTER.
+  return prototype_->type() == MetricType::kCounter ? "counter" : "gauge";
+}
+
 //
 // StringGauge
 //
@@ -570,6 +823,23 @@ void StringGauge::WriteValue(JsonWriter* writer) const {
   writer->String(value());
 }
 
+void StringGauge::WriteAsOpenMetrics(const string& name,
+                                     const string& labels,
+                                     faststring* out) const {
+  StartOpenMetricsSample(name, "_info", labels, out);
+  StartOpenMetricsLabel("value", out);
+  AppendOpenMetricsValue(out);
+  out->push_back('"');
+  EndOpenMetricsLabels(out);
+  out->append("1\n", 2);
+}
+
+void StringGauge::AppendOpenMetricsValue(faststring* out) const {
+  // Escaped in place rather than copying the value.
+  std::lock_guard<simple_spinlock> l(lock_);
+  AppendOpenMetricsEscaped(value_, out);
+}
+
 //
 // Counter
 //
@@ -608,6 +878,15 @@ Status Counter::WriteAsJson(JsonWriter* writer,
   return Status::OK();
 }
 
+void Counter::WriteAsOpenMetrics(const string& name,
+                                 const string& labels,
+                                 faststring* out) const {
+  StartOpenMetricsSample(name, "_total", labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsInt64(value(), out);
+  out->push_back('\n');
+}
+
 /////////////////////////////////////////////////
 // HistogramPrototype
 /////////////////////////////////////////////////
@@ -659,6 +938,79 @@ Status Histogram::WriteAsJson(JsonWriter* writer,
   return Status::OK();
 }
 
+void Histogram::WriteAsOpenMetrics(const string& name,
+                                   const string& labels,
+                                   faststring* out) const {
+  // The quantiles are read from the live histogram rather than a snapshot of
+  // it. The extremes are exact.
+  static const double kPercentiles[] = { 50, 75, 95, 99, 99.9, 99.99 };
+  static const char* const kQuantiles[] = {
+    "0", "0.5", "0.75", "0.95", "0.99", "0.999", "0.9999", "1"
+  };
+  static_assert(arraysize(kQuantiles) == arraysize(kPercentiles) + 2,
+                "a quantile label for each percentile and the extremes");
+  uint64_t values[arraysize(kQuantiles)];
+  uint64_t count = histogram_->ScanPercentiles(kPercentiles, arraysize(kPercentiles),
+                                               &values[1], nullptr);
+  const uint64_t min = histogram_->MinValue();
+  const uint64_t max = std::max(min, histogram_->MaxValue());
+  values[0] = min;
+  values[arraysize(kQuantiles) - 1] = max;
+  for (int i = 1; i < arraysize(kQuantiles) - 1; i++) {
+    values[i] = std::min(std::max(values[i], min), max);
+  }
+
+  for (int i = 0; i < arraysize(kQuantiles); i++) {
+    StartOpenMetricsSample(name, "", labels, out);
+    AppendOpenMetricsLabel("quantile", kQuantiles[i], out);
+    EndOpenMetricsLabels(out);
+    AppendOpenMetricsUInt64(values[i], out);
+    out->push_back('\n');
+  }
+  StartOpenMetricsSample(name, "_count", labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsUInt64(count, out);
+  out->push_back('\n');
+  StartOpenMetricsSample(name, "_sum", labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsUInt64(histogram_->TotalSum(), out);
+  out->push_back('\n');
+}
+
+void Histogram::WriteBucketsAsOpenMetrics(const string& name,
+                                          const string& labels,
+                                          faststring* out) const {
+  uint64_t counts_by_bit_length[HdrHistogram::kNumBitLengths] = { 0 };
+  uint64_t count = histogram_->ScanPercentiles(nullptr, 0, nullptr, counts_by_bit_length);
+  const int max_bit_length = Bits::Log2Floor64(histogram_->highest_trackable_value()) + 1;
+
+  // The upper bound of the bucket of each bit length k is 2^k - 1.
+  char le[kFastToBufferSize];
+  uint64_t cumulative_count = 0;
+  for (int k = 0; k <= max_bit_length; k++) {
+    cumulative_count += counts_by_bit_length[k];
+    FastUInt64ToBufferLeft(k == 64 ? kuint64max : (1ULL << k) - 1, le);
+    StartOpenMetricsSample(name, "_bucket", labels, out);
+    AppendOpenMetricsLabel("le", le, out);
+    EndOpenMetricsLabels(out);
+    AppendOpenMetricsUInt64(cumulative_count, out);
+    out->push_back('\n');
+  }
+  StartOpenMetricsSample(name, "_bucket", labels, out);
+  AppendOpenMetricsLabel("le", "+Inf", out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsUInt64(count, out);
+  out->push_back('\n');
+  StartOpenMetricsSample(name, "_count", labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsUInt64(count, out);
+  out->push_back('\n');
+  StartOpenMetricsSample(name, "_sum", labels, out);
+  EndOpenMetricsLabels(out);
+  AppendOpenMetricsUInt64(histogram_->TotalSum(), out);
+  out->push_back('\n');
+}
+
 Status Histogram::GetHistogramSnapshotPB(HistogramSnapshotPB* snapshot_pb,
                                          const MetricJsonOptions& opts) const {
   snapshot_pb->set_name(prototype_->name());
@@ -226,9 +226,12 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <limits>
 #include <mutex>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -339,6 +342,7 @@ class FunctionGauge;
 template<typename T>
 class GaugePrototype;
 
+class faststring;
 class Metric;
 class MetricEntityPrototype;
 class MetricPrototype;
@@ -440,6 +444,24 @@ struct MetricJsonOptions {
   bool include_entity_attributes = true;
 };
 
+struct MetricOpenMetricsOptions {
+  // The prefix of the name of every metric family.
+  std::string name_prefix = "kudu_";
+
+  // See MetricJsonOptions.
+  int64_t only_modified_in_or_after_epoch = 0;
+  bool include_untouched_metrics = true;
+
+  // Whether to label the samples of each entity with its attributes, in
+  // addition to its type and id.
+  bool include_entity_attributes = false;
+
+  // Whether to also export each histogram as an OpenMetrics histogram named
+  // '<name>_histogram', whose buckets are bounded by powers of two. Histograms
+  // are always exported as summaries of their quantiles.
+  bool include_histogram_buckets = true;
+};
+
 class MetricEntityPrototype {
  public:
   explicit MetricEntityPrototype(const char* name);
@@ -489,6 +511,8 @@ class MetricEntity : public RefCountedThreadSafe<MetricEntity> {
 
   const std::string& id() const { return id_; }
 
+  const MetricEntityPrototype* prototype() const { return prototype_; }
+
   // See MetricRegistry::WriteAsJson()
   Status WriteAsJson(JsonWriter* writer,
                      const std::vector<std::string>& requested_metrics,
@@ -571,6 +595,15 @@ class Metric : public RefCountedThreadSafe<Metric> {
   virtual Status WriteAsJson(JsonWriter* writer,
                              const MetricJsonOptions& opts) const = 0;
 
+  // Appends the samples of this metric to 'out' in the OpenMetrics text
+  // format, as part of the metric family 'name', labeled with 'labels'.
+  virtual void WriteAsOpenMetrics(const std::string& name,
+                                  const std::string& labels,
+                                  faststring* out) const = 0;
+
+  // The OpenMetrics type of the metric family this metric belongs to.
+  virtual const char* open_metrics_type() const = 0;
+
   const MetricPrototype* prototype() const { return prototype_; }
 
   // Return true if this metric has never been touched.
@@ -659,6 +692,25 @@ class MetricRegistry {
                      const std::vector<std::string>& requested_metrics,
                      const MetricJsonOptions& opts) const;
 
+  // Appends the metrics in this registry to 'out' in the OpenMetrics text
+  // format, selecting them with 'requested_metrics' as WriteAsJson() does.
+  //
+  // Each metric becomes a family named after it, with a sample per entity,
+  // labeled with the entity's type and id. Samples are written straight into
+  // 'out' from the live metrics, without building an intermediate document;
+  // the entity locks are only held while collecting each entity's metrics.
+  //
+  // See the MetricOpenMetricsOptions struct definition above for options
+  // changing the output of this function.
+  Status WriteAsOpenMetrics(const std::vector<std::string>& requested_metrics,
+                            const MetricOpenMetricsOptions& opts,
+                            faststring* out) const;
+
+  // Calls 'visitor' with every metric in this registry, along with its entity.
+  // No locks are held while 'visitor' runs.
+  void VisitMetrics(
+      const std::function<void(const MetricEntity& entity, Metric* metric)>& visitor) const;
+
   // For each registered entity, retires orphaned metrics. If an entity has no more
   // metrics and there are no external references, entities are removed as well.
   //
@@ -809,6 +861,36 @@ class GaugePrototype : public MetricPrototype {
   DISALLOW_COPY_AND_ASSIGN(GaugePrototype);
 };
 
+// Append 'value' to 'out' as an OpenMetrics number.
+void AppendOpenMetricsInt64(int64_t value, faststring* out);
+void AppendOpenMetricsUInt64(uint64_t value, faststring* out);
+void AppendOpenMetricsDouble(double value, faststring* out);
+
+// Set 'raw_value' to 'value', or to its bit pattern for floating point values,
+// which are flagged in 'is_floating_point'.
+template<typename T>
+void ToRawMetricValue(T value, int64_t* raw_value, bool* is_floating_point) {
+  if (std::is_floating_point<T>::value) {
+    double d = static_cast<double>(value);
+    memcpy(raw_value, &d, sizeof(d));
+    *is_floating_point = true;
+  } else {
+    *raw_value = static_cast<int64_t>(value);
+    *is_floating_point = false;
+  }
+}
+
+template<typename T>
+void AppendOpenMetricsNumber(T value, faststring* out) {
+  if (std::is_floating_point<T>::value) {
+    AppendOpenMetricsDouble(static_cast<double>(value), out);
+  } else if (std::is_signed<T>::value) {
+    AppendOpenMetricsInt64(static_cast<int64_t>(value), out);
+  } else {
+    AppendOpenMetricsUInt64(static_cast<uint64_t>(value), out);
+  }
+}
+
 // Abstract base class to provide point-in-time metric values.
 class Gauge : public Metric {
  public:
@@ -818,9 +900,18 @@ class Gauge : public Metric {
   virtual ~Gauge() {}
   virtual Status WriteAsJson(JsonWriter* w,
                              const MetricJsonOptions& opts) const OVERRIDE;
+  virtual void WriteAsOpenMetrics(const std::string& name,
+                                  const std::string& labels,
+                                  faststring* out) const OVERRIDE;
+  virtual const char* open_metrics_type() const OVERRIDE;
+
+  // If the gauge is numeric, sets 'raw_value' to its value as converted by
+  // ToRawMetricValue() and returns true. Returns false otherwise.
+  virtual bool GetRawValue(int64_t* raw_value, bool* is_floating_point) const = 0;
 
  protected:
   virtual void WriteValue(JsonWriter* writer) const = 0;
+  virtual void AppendOpenMetricsValue(faststring* out) const = 0;
  private:
   DISALLOW_COPY_AND_ASSIGN(Gauge);
 };
@@ -836,8 +927,21 @@ class StringGauge : public Gauge {
     return false;
   }
 
+  // String gauges are exported as OpenMetrics info metrics, with the value
+  // as a label.
+  virtual void WriteAsOpenMetrics(const std::string& name,
+                                  const std::string& labels,
+                                  faststring* out) const OVERRIDE;
+  virtual const char* open_metrics_type() const OVERRIDE { return "info"; }
+
+  virtual bool GetRawValue(int64_t* /*raw_value*/,
+                           bool* /*is_floating_point*/) const OVERRIDE {
+    return false;
+  }
+
  protected:
   virtual void WriteValue(JsonWriter* writer) const OVERRIDE;
+  virtual void AppendOpenMetricsValue(faststring* out) const OVERRIDE;
  private:
   std::string value_;
   mutable simple_spinlock lock_;  // Guards value_
@@ -875,10 +979,17 @@ class AtomicGauge : public Gauge {
   virtual bool IsUntouched() const override {
     return false;
   }
+  virtual bool GetRawValue(int64_t* raw_value, bool* is_floating_point) const OVERRIDE {
+    ToRawMetricValue(value(), raw_value, is_floating_point);
+    return true;
+  }
  protected:
   virtual void WriteValue(JsonWriter* writer) const OVERRIDE {
     writer->Value(value());
   }
+  virtual void AppendOpenMetricsValue(faststring* out) const OVERRIDE {
+    AppendOpenMetricsNumber(value(), out);
+  }
   AtomicInt<int64_t> value_;
  private:
   DISALLOW_COPY_AND_ASSIGN(AtomicGauge);
@@ -954,6 +1065,15 @@ class FunctionGauge : public Gauge {
     writer->Value(value());
   }
 
+  virtual void AppendOpenMetricsValue(faststring* out) const OVERRIDE {
+    AppendOpenMetricsNumber(value(), out);
+  }
+
+  virtual bool GetRawValue(int64_t* raw_value, bool* is_floating_point) const OVERRIDE {
+    ToRawMetricValue(value(), raw_value, is_floating_point);
+    return true;
+  }
+
   // Reset this FunctionGauge to return a specific value.
   // This should be used during destruction. If you want a settable
   // Gauge, use a normal Gauge instead of a FunctionGauge.
@@ -1040,6 +1160,10 @@ class Counter : public Metric {
   void IncrementBy(int64_t amount);
   virtual Status WriteAsJson(JsonWriter* w,
                              const MetricJsonOptions& opts) const OVERRIDE;
+  virtual void WriteAsOpenMetrics(const std::string& name,
+                                  const std::string& labels,
+                                  faststring* out) const OVERRIDE;
+  virtual const char* open_metrics_type() const OVERRIDE { return "counter"; }
 
   virtual bool IsUntouched() const override {
     return value() == 0;
@@ -1089,6 +1213,19 @@ class Histogram : public Metric {
   virtual Status WriteAsJson(JsonWriter* w,
                              const MetricJsonOptions& opts) const OVERRIDE;
 
+  // Histograms are exported as OpenMetrics summaries of their quantiles.
+  virtual void WriteAsOpenMetrics(const std::string& name,
+                                  const std::string& labels,
+                                  faststring* out) const OVERRIDE;
+  virtual const char* open_metrics_type() const OVERRIDE { return "summary"; }
+
+  // Appends the samples of this histogram to 'out' as part of the OpenMetrics
+  // histogram family 'name', with a bucket for the values of each bit length
+  // up to that of the histogram's highest trackable value.
+  void WriteBucketsAsOpenMetrics(const std::string& name,
+                                 const std::string& labels,
+                                 faststring* out) const;
+
   // Returns a snapshot of this histogram including the bucketed values and counts.
   Status GetHistogramSnapshotPB(HistogramSnapshotPB* snapshot_pb,
                                 const MetricJsonOptions& opts) const;
@@ -773,6 +773,12 @@ const string& WritablePBContainerFile::filename() const {
   return writer_->filename();
 }
 
+uint64_t WritablePBContainerFile::offset() const {
+  DCHECK_EQ(FileState::OPEN, state_);
+  std::lock_guard<Mutex> l(offset_lock_);
+  return offset_;
+}
+
 Status WritablePBContainerFile::AppendMsgToBuffer(const Message& msg, faststring* buf) {
   DCHECK(msg.IsInitialized()) << InitializationErrorMessage("serialize", msg);
   int data_len = msg.ByteSize();
@@ -1019,6 +1025,17 @@ uint64_t ReadablePBContainerFile::offset() const {
   return offset_;
 }
 
+Status ReadablePBContainerFile::SkipTo(uint64_t offset) {
+  DCHECK_EQ(FileState::OPEN, state_);
+  if (offset < offset_ || offset > *cached_file_size_) {
+    return Status::InvalidArgument(Substitute(
+        "cannot skip from offset $0 to offset $1 in $2 of size $3",
+        offset_, offset, reader_->filename(), *cached_file_size_));
+  }
+  offset_ = offset;
+  return Status::OK();
+}
+
 Status ReadPBContainerFromPath(Env* env, const std::string& path, Message* msg) {
   unique_ptr<RandomAccessFile> file;
   RETURN_NOT_OK(env->NewRandomAccessFile(path, &file));
@@ -323,6 +323,11 @@ class WritablePBContainerFile {
   // Returns the path to the container's underlying file handle.
   const std::string& filename() const;
 
+  // Returns the offset at which the next message will be appended, i.e. the
+  // length of the file as far as this writer knows.
+  // The file must be open.
+  uint64_t offset() const;
+
  private:
   friend class TestPBUtil;
   FRIEND_TEST(TestPBUtil, TestPopulateDescriptorSet);
@@ -350,7 +355,7 @@ class WritablePBContainerFile {
   FileState state_;
 
   // Protects offset_.
-  Mutex offset_lock_;
+  mutable Mutex offset_lock_;
 
   // Current write offset into the file.
   uint64_t offset_;
@@ -434,6 +439,12 @@ class ReadablePBContainerFile {
   // File must be open.
   uint64_t offset() const;
 
+  // Moves the read offset forward to 'offset', skipping the records before
+  // it without reading them. 'offset' must be the start of a record or the
+  // end of the file, e.g. an earlier value of offset() for the same file.
+  // File must be open.
+  Status SkipTo(uint64_t offset);
+
  private:
   FileState state_;
   int version_;
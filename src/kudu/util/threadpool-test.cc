@@ -17,8 +17,10 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <functional>
 #include <iterator>
 #include <limits>
 #include <memory>
@@ -677,7 +679,8 @@ TEST_P(ThreadPoolTestTokenTypes, TestTokenWaitForAll) {
   ASSERT_EQ(kNumSubmissions, v);
 }
 
-TEST_F(ThreadPoolTest, TestFuzz) {
+// Runs a random mix of submissions, token operations and waits on 'pool'.
+static void FuzzPool(ThreadPool* pool) {
   const int kNumOperations = 1000;
   Random r(SeedRandom());
   vector<unique_ptr<ThreadPoolToken>> tokens;
@@ -696,7 +699,7 @@ TEST_F(ThreadPoolTest, TestFuzz) {
     if (op < 40) {
       // Submit without a token.
       int sleep_ms = r.Next() % 5;
-      ASSERT_OK(pool_->SubmitFunc([sleep_ms]() {
+      ASSERT_OK(pool->SubmitFunc([sleep_ms]() {
         // Sleep a little first to increase task overlap.
         SleepFor(MonoDelta::FromMilliseconds(sleep_ms));
       }));
@@ -717,7 +720,7 @@ TEST_F(ThreadPoolTest, TestFuzz) {
       ThreadPool::ExecutionMode mode = r.Next() % 2 ?
           ThreadPool::ExecutionMode::SERIAL :
           ThreadPool::ExecutionMode::CONCURRENT;
-      tokens.emplace_back(pool_->NewToken(mode));
+      tokens.emplace_back(pool->NewToken(mode));
     } else if (op < 92) {
       // Wait on a randomly selected token.
       if (tokens.empty()) {
@@ -745,17 +748,21 @@ TEST_F(ThreadPoolTest, TestFuzz) {
       // Wait on everything.
       ASSERT_LT(op, 100);
       ASSERT_GE(op, 98);
-      pool_->Wait();
+      pool->Wait();
     }
   }
 
   // Some test runs will shut down the pool before the tokens, and some won't.
   // Either way should be safe.
   if (r.Next() % 2 == 0) {
-    pool_->Shutdown();
+    pool->Shutdown();
   }
 }
 
+TEST_F(ThreadPoolTest, TestFuzz) {
+  NO_FATALS(FuzzPool(pool_.get()));
+}
+
 TEST_P(ThreadPoolTestTokenTypes, TestTokenSubmissionsAdhereToMaxQueueSize) {
   ASSERT_OK(RebuildPoolWithBuilder(ThreadPoolBuilder(kDefaultPoolName)
                                    .set_min_threads(1)
@@ -938,4 +945,185 @@ TEST_F(ThreadPoolTest, TestLIFOThreadWakeUps) {
   NO_PENDING_FATALS();
 }
 
+class ThreadPoolWorkStealingTest : public ThreadPoolTest {
+ public:
+  void SetUp() override {
+    ThreadPoolTest::SetUp();
+    ASSERT_OK(RebuildPoolWithBuilder(ThreadPoolBuilder(kDefaultPoolName)
+                                     .set_work_stealing(true)));
+  }
+};
+
+TEST_F(ThreadPoolWorkStealingTest, TestSimpleTasks) {
+  Atomic32 counter(0);
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(pool_->SubmitFunc(boost::bind(&SimpleTaskMethod, 10, &counter)));
+  }
+  pool_->Wait();
+  ASSERT_EQ(10000, base::subtle::NoBarrier_Load(&counter));
+}
+
+// Tasks submitted from a worker go to its own queue, and are stolen from
+// there by the other workers.
+TEST_F(ThreadPoolWorkStealingTest, TestTasksSubmittedFromTasks) {
+  const int kDepth = 12;
+  atomic<int> counter(0);
+  std::function<void(int)> fan_out = [&](int depth) {
+    counter++;
+    if (depth > 0) {
+      for (int i = 0; i < 2; i++) {
+        CHECK_OK(pool_->SubmitFunc([&fan_out, depth]() { fan_out(depth - 1); }));
+      }
+    }
+  };
+  ASSERT_OK(pool_->SubmitFunc([&]() { fan_out(kDepth); }));
+  pool_->Wait();
+  ASSERT_EQ((1 << (kDepth + 1)) - 1, counter);
+}
+
+// SERIAL tokens run their tasks one at a time, in submission order, even
+// though they're chained from worker to worker.
+TEST_F(ThreadPoolWorkStealingTest, TestSerialTokens) {
+  const int kNumTokens = 8;
+  const int kNumSubmitters = 4;
+  const int kNumTasks = 200;
+
+  struct TokenState {
+    unique_ptr<ThreadPoolToken> token;
+    atomic<bool> running { false };
+    int last_seq[kNumSubmitters];
+    int num_run = 0;
+  };
+  vector<TokenState> tokens(kNumTokens);
+  for (auto& t : tokens) {
+    t.token = pool_->NewToken(ThreadPool::ExecutionMode::SERIAL);
+    std::fill(t.last_seq, t.last_seq + kNumSubmitters, -1);
+  }
+  atomic<int> num_violations(0);
+
+  vector<thread> submitters;
+  for (int i = 0; i < kNumSubmitters; i++) {
+    submitters.emplace_back([&, i]() {
+      for (int seq = 0; seq < kNumTasks; seq++) {
+        for (auto& t : tokens) {
+          TokenState* ts = &t;
+          CHECK_OK(ts->token->SubmitFunc([ts, i, seq, &num_violations]() {
+            if (ts->running.exchange(true)) {
+              num_violations++;
+            }
+            if (ts->last_seq[i] != seq - 1) {
+              num_violations++;
+            }
+            ts->last_seq[i] = seq;
+            ts->num_run++;
+            ts->running = false;
+          }));
+        }
+      }
+    });
+  }
+  for (auto& t : submitters) {
+    t.join();
+  }
+  pool_->Wait();
+  ASSERT_EQ(0, num_violations);
+  for (auto& t : tokens) {
+    ASSERT_EQ(kNumSubmitters * kNumTasks, t.num_run);
+  }
+}
+
+// Shutting down a token drops its queued tasks, and waits for the running one.
+TEST_F(ThreadPoolWorkStealingTest, TestTokenShutdownDropsQueuedTasks) {
+  ASSERT_OK(RebuildPoolWithBuilder(ThreadPoolBuilder(kDefaultPoolName)
+                                   .set_max_threads(1)
+                                   .set_work_stealing(true)));
+  for (auto mode : { ThreadPool::ExecutionMode::SERIAL,
+                     ThreadPool::ExecutionMode::CONCURRENT }) {
+    unique_ptr<ThreadPoolToken> t = pool_->NewToken(mode);
+    CountDownLatch latch(1);
+    atomic<int> counter(0);
+    ASSERT_OK(t->SubmitFunc([&]() { latch.Wait(); }));
+    for (int i = 0; i < 10; i++) {
+      ASSERT_OK(t->SubmitFunc([&]() { counter++; }));
+    }
+    thread releaser([&]() {
+      SleepFor(MonoDelta::FromMilliseconds(100));
+      latch.CountDown();
+    });
+    t->Shutdown();
+    releaser.join();
+    ASSERT_TRUE(t->SubmitFunc([](){}).IsServiceUnavailable());
+    pool_->Wait();
+    ASSERT_EQ(0, counter);
+  }
+}
+
+// Shutting down the pool drops the queued tasks.
+TEST_F(ThreadPoolWorkStealingTest, TestShutdownDropsQueuedTasks) {
+  ASSERT_OK(RebuildPoolWithBuilder(ThreadPoolBuilder(kDefaultPoolName)
+                                   .set_max_threads(1)
+                                   .set_work_stealing(true)));
+  CountDownLatch latch(1);
+  atomic<int> counter(0);
+  ASSERT_OK(pool_->SubmitFunc([&]() { latch.Wait(); }));
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(pool_->SubmitFunc([&]() { counter++; }));
+  }
+  thread releaser([&]() {
+    SleepFor(MonoDelta::FromMilliseconds(100));
+    latch.CountDown();
+  });
+  pool_->Shutdown();
+  releaser.join();
+  ASSERT_EQ(0, counter);
+  ASSERT_TRUE(pool_->SubmitFunc([](){}).IsServiceUnavailable());
+}
+
+TEST_F(ThreadPoolWorkStealingTest, TestFuzz) {
+  NO_FATALS(FuzzPool(pool_.get()));
+}
+
+// Measures the throughput of no-op tasks submitted by 1, 8 and 64 threads,
+// with a shared queue and with work stealing, both without tokens and with a
+// SERIAL token per submitter (like the peers sharing the Raft pool).
+TEST_F(ThreadPoolTest, BenchmarkSubmitThroughput) {
+  const int kNumTasks = AllowSlowTests() ? 1000000 : 100000;
+  for (bool work_stealing : { false, true }) {
+    for (bool use_tokens : { false, true }) {
+      for (int num_submitters : { 1, 8, 64 }) {
+        ASSERT_OK(RebuildPoolWithBuilder(ThreadPoolBuilder(kDefaultPoolName)
+                                         .set_work_stealing(work_stealing)));
+        vector<unique_ptr<ThreadPoolToken>> tokens;
+        for (int i = 0; use_tokens && i < num_submitters; i++) {
+          tokens.emplace_back(pool_->NewToken(ThreadPool::ExecutionMode::SERIAL));
+        }
+        atomic<int64_t> num_run(0);
+        Barrier barrier(num_submitters + 1);
+        vector<thread> submitters;
+        for (int i = 0; i < num_submitters; i++) {
+          submitters.emplace_back([&, i]() {
+            barrier.Wait();
+            for (int j = 0; j < kNumTasks / num_submitters; j++) {
+              auto task = [&num_run]() { num_run++; };
+              CHECK_OK(use_tokens ? tokens[i]->SubmitFunc(task) : pool_->SubmitFunc(task));
+            }
+          });
+        }
+        barrier.Wait();
+        MonoTime start = MonoTime::Now();
+        for (auto& t : submitters) {
+          t.join();
+        }
+        pool_->Wait();
+        double elapsed_s = (MonoTime::Now() - start).ToSeconds();
+        LOG(INFO) << Substitute("$0 submitters, $1, $2: $3 tasks/s",
+                                num_submitters,
+                                work_stealing ? "work stealing" : "shared queue",
+                                use_tokens ? "serial tokens" : "no tokens",
+                                static_cast<int64_t>(num_run / elapsed_s));
+      }
+    }
+  }
+}
+
 } // namespace kudu
@@ -17,12 +17,15 @@
 
 #include "kudu/util/threadpool.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <deque>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include <boost/function.hpp> // IWYU pragma: keep
@@ -48,6 +51,15 @@ using std::string;
 using std::unique_ptr;
 using strings::Substitute;
 
+namespace {
+
+// The work-stealing pool which the current thread is a worker of, and the
+// worker's work queue.
+__thread ThreadPool* tls_work_stealing_pool = nullptr;
+__thread int tls_work_queue = -1;
+
+} // anonymous namespace
+
 ////////////////////////////////////////////////////////
 // FunctionRunnable
 ////////////////////////////////////////////////////////
@@ -89,7 +101,8 @@ ThreadPoolBuilder::ThreadPoolBuilder(string name)
       min_threads_(0),
       max_threads_(base::NumCPUs()),
       max_queue_size_(std::numeric_limits<int>::max()),
-      idle_timeout_(MonoDelta::FromMilliseconds(500)) {}
+      idle_timeout_(MonoDelta::FromMilliseconds(500)),
+      work_stealing_(false) {}
 
 ThreadPoolBuilder& ThreadPoolBuilder::set_trace_metric_prefix(const string& prefix) {
   trace_metric_prefix_ = prefix;
@@ -123,6 +136,11 @@ ThreadPoolBuilder& ThreadPoolBuilder::set_metrics(ThreadPoolMetrics metrics) {
   return *this;
 }
 
+ThreadPoolBuilder& ThreadPoolBuilder::set_work_stealing(bool work_stealing) {
+  work_stealing_ = work_stealing;
+  return *this;
+}
+
 Status ThreadPoolBuilder::Build(gscoped_ptr<ThreadPool>* pool) const {
   pool->reset(new ThreadPool(*this));
   RETURN_NOT_OK((*pool)->Init());
@@ -139,8 +157,10 @@ ThreadPoolToken::ThreadPoolToken(ThreadPool* pool,
     : mode_(mode),
       metrics_(std::move(metrics)),
       pool_(pool),
+      lock_(pool->work_stealing_ ? &own_lock_ : &pool->lock_),
       state_(State::IDLE),
-      not_running_cond_(&pool->lock_),
+      num_queued_in_pool_(0),
+      not_running_cond_(lock_),
       active_threads_(0) {
 }
 
@@ -162,7 +182,7 @@ Status ThreadPoolToken::Submit(shared_ptr<Runnable> r) {
 }
 
 void ThreadPoolToken::Shutdown() {
-  MutexLock unique_lock(pool_->lock_);
+  MutexLock unique_lock(*lock_);
   pool_->CheckNotPoolThreadUnlocked();
 
   // Clear the queue under the lock, but defer the releasing of the tasks
@@ -170,7 +190,9 @@ void ThreadPoolToken::Shutdown() {
   // the ThreadPool. The task's destructors may acquire locks, etc, so this
   // also prevents lock inversions.
   std::deque<ThreadPool::Task> to_release = std::move(entries_);
-  pool_->total_queued_tasks_ -= to_release.size();
+  if (!pool_->work_stealing_) {
+    pool_->total_queued_tasks_ -= to_release.size();
+  }
 
   switch (state()) {
     case State::IDLE:
@@ -187,15 +209,21 @@ void ThreadPoolToken::Shutdown() {
       // Plus doing it this way (rather than switching to QUIESCING and waiting
       // for a worker thread to process the queue entry) helps retain state
       // transition symmetry with ThreadPool::Shutdown.
-      for (auto it = pool_->queue_.begin(); it != pool_->queue_.end();) {
-        if (*it == this) {
-          it = pool_->queue_.erase(it);
-        } else {
-          it++;
+      if (pool_->work_stealing_) {
+        num_queued_in_pool_ -= pool_->RemoveWorkItems(this, &to_release);
+      } else {
+        for (auto it = pool_->queue_.begin(); it != pool_->queue_.end();) {
+          if (*it == this) {
+            it = pool_->queue_.erase(it);
+          } else {
+            it++;
+          }
         }
       }
 
-      if (active_threads_ == 0) {
+      // In work-stealing mode, a worker may have dequeued a task without
+      // starting it yet. It drops the task once it sees the token quiescing.
+      if (active_threads_ == 0 && num_queued_in_pool_ == 0) {
         Transition(State::QUIESCED);
         break;
       }
@@ -214,6 +242,9 @@ void ThreadPoolToken::Shutdown() {
 
   // Finally release the queued tasks, outside the lock.
   unique_lock.Unlock();
+  if (pool_->work_stealing_) {
+    pool_->DecrementOutstandingTasks(to_release.size());
+  }
   for (auto& t : to_release) {
     if (t.trace) {
       t.trace->Release();
@@ -222,7 +253,7 @@ void ThreadPoolToken::Shutdown() {
 }
 
 void ThreadPoolToken::Wait() {
-  MutexLock unique_lock(pool_->lock_);
+  MutexLock unique_lock(*lock_);
   pool_->CheckNotPoolThreadUnlocked();
   while (IsActive()) {
     not_running_cond_.Wait();
@@ -230,7 +261,7 @@ void ThreadPoolToken::Wait() {
 }
 
 bool ThreadPoolToken::WaitUntil(const MonoTime& until) {
-  MutexLock unique_lock(pool_->lock_);
+  MutexLock unique_lock(*lock_);
   pool_->CheckNotPoolThreadUnlocked();
   while (IsActive()) {
     if (!not_running_cond_.WaitUntil(until)) {
@@ -253,7 +284,8 @@ void ThreadPoolToken::Transition(State new_state) {
       CHECK(new_state == State::RUNNING ||
             new_state == State::QUIESCED);
       if (new_state == State::RUNNING) {
-        CHECK(!entries_.empty());
+        // In work-stealing mode, the task went straight to the pool.
+        CHECK(!entries_.empty() || pool_->work_stealing_);
       } else {
         CHECK(entries_.empty());
         CHECK_EQ(active_threads_, 0);
@@ -265,7 +297,7 @@ void ThreadPoolToken::Transition(State new_state) {
             new_state == State::QUIESCED);
       CHECK(entries_.empty());
       if (new_state == State::QUIESCING) {
-        CHECK_GT(active_threads_, 0);
+        CHECK(active_threads_ > 0 || num_queued_in_pool_ > 0);
       }
       break;
     case State::QUIESCING:
@@ -313,6 +345,7 @@ ThreadPool::ThreadPool(const ThreadPoolBuilder& builder)
     max_threads_(builder.max_threads_),
     max_queue_size_(builder.max_queue_size_),
     idle_timeout_(builder.idle_timeout_),
+    work_stealing_(builder.work_stealing_),
     pool_status_(Status::Uninitialized("The pool was not initialized.")),
     idle_cond_(&lock_),
     no_threads_cond_(&lock_),
@@ -321,7 +354,23 @@ ThreadPool::ThreadPool(const ThreadPoolBuilder& builder)
     active_threads_(0),
     total_queued_tasks_(0),
     tokenless_(NewToken(ExecutionMode::CONCURRENT)),
+    num_threads_total_(0),
+    next_worker_queue_(0),
+    next_submit_queue_(0),
+    num_queued_(0),
+    num_outstanding_(0),
+    num_active_(0),
+    num_idle_(0),
+    num_waiters_(0),
+    num_submitters_(0),
+    shut_down_(false),
     metrics_(builder.metrics_) {
+  if (work_stealing_) {
+    int num_queues = std::min(max_threads_, base::NumCPUs());
+    for (int i = 0; i < num_queues; i++) {
+      work_queues_.emplace_back(new WorkQueue());
+    }
+  }
   string prefix = !builder.trace_metric_prefix_.empty() ?
       builder.trace_metric_prefix_ : builder.name_;
 
@@ -347,6 +396,7 @@ Status ThreadPool::Init() {
   }
   pool_status_ = Status::OK();
   num_threads_pending_start_ = min_threads_;
+  num_threads_total_ = min_threads_;
   for (int i = 0; i < min_threads_; i++) {
     Status status = CreateThread();
     if (!status.ok()) {
@@ -373,7 +423,37 @@ void ThreadPool::Shutdown() {
   // locks, etc, so this also prevents lock inversions.
   queue_.clear();
   std::deque<std::deque<Task>> to_release;
+  if (work_stealing_) {
+    // Submitters don't take 'lock_'. Let those which didn't see the pool shut
+    // down finish queueing their tasks before emptying the queues.
+    shut_down_ = true;
+    while (num_submitters_ > 0) {
+      std::this_thread::yield();
+    }
+    std::deque<Task> tasks;
+    for (auto& q : work_queues_) {
+      std::deque<WorkItem> items;
+      {
+        std::lock_guard<simple_spinlock> l(q->lock);
+        items.swap(q->items);
+      }
+      num_queued_ -= items.size();
+      for (auto& item : items) {
+        if (item.token != tokenless_.get()) {
+          MutexLock token_lock(*item.token->lock_);
+          item.token->num_queued_in_pool_--;
+        }
+        tasks.emplace_back(std::move(item.task));
+      }
+    }
+    to_release.emplace_back(std::move(tasks));
+  }
   for (auto* t : tokens_) {
+    // Otherwise, the token's lock is 'lock_', which is already held.
+    std::unique_lock<Mutex> token_lock(*t->lock_, std::defer_lock);
+    if (work_stealing_) {
+      token_lock.lock();
+    }
     if (!t->entries_.empty()) {
       to_release.emplace_back(std::move(t->entries_));
     }
@@ -387,7 +467,7 @@ void ThreadPool::Shutdown() {
         // (i.e. there are no active threads), the tasks will have been removed
         // above and we can quiesce immediately. Otherwise, we need to wait for
         // the threads to finish.
-        t->Transition(t->active_threads_ > 0 ?
+        t->Transition(t->active_threads_ > 0 || t->num_queued_in_pool_ > 0 ?
             ThreadPoolToken::State::QUIESCING :
             ThreadPoolToken::State::QUIESCED);
         break;
@@ -395,6 +475,15 @@ void ThreadPool::Shutdown() {
         break;
     }
   }
+  if (work_stealing_) {
+    int64_t num_released = 0;
+    for (const auto& tasks : to_release) {
+      num_released += tasks.size();
+    }
+    if (num_released > 0 && num_outstanding_.fetch_sub(num_released) == num_released) {
+      idle_cond_.Broadcast();
+    }
+  }
 
   // The queues are empty. Wake any sleeping worker threads and wait for all
   // of them to exit. Some worker threads will exit immediately upon waking,
@@ -404,6 +493,7 @@ void ThreadPool::Shutdown() {
     idle_threads_.front().not_empty.Signal();
     idle_threads_.pop_front();
   }
+  num_idle_ = 0;
   while (num_threads_ + num_threads_pending_start_ > 0) {
     no_threads_cond_.Wait();
   }
@@ -460,6 +550,9 @@ Status ThreadPool::Submit(shared_ptr<Runnable> r) {
 
 Status ThreadPool::DoSubmit(shared_ptr<Runnable> r, ThreadPoolToken* token) {
   DCHECK(token);
+  if (work_stealing_) {
+    return DoSubmitWorkStealing(std::move(r), token);
+  }
   MonoTime submit_time = MonoTime::Now();
 
   MutexLock guard(lock_);
@@ -507,6 +600,7 @@ Status ThreadPool::DoSubmit(shared_ptr<Runnable> r, ThreadPoolToken* token) {
   if (additional_threads > 0 && num_threads_ + num_threads_pending_start_ < max_threads_) {
     need_a_thread = true;
     num_threads_pending_start_++;
+    num_threads_total_++;
   }
 
   Task task;
@@ -557,6 +651,7 @@ Status ThreadPool::DoSubmit(shared_ptr<Runnable> r, ThreadPoolToken* token) {
     if (!status.ok()) {
       guard.Lock();
       num_threads_pending_start_--;
+      num_threads_total_--;
       if (num_threads_ + num_threads_pending_start_ == 0) {
         // If we have no threads, we can't do any work.
         return status;
@@ -572,10 +667,262 @@ Status ThreadPool::DoSubmit(shared_ptr<Runnable> r, ThreadPoolToken* token) {
   return Status::OK();
 }
 
+Status ThreadPool::DoSubmitWorkStealing(shared_ptr<Runnable> r, ThreadPoolToken* token) {
+  MonoTime submit_time = MonoTime::Now();
+  int64_t length_at_submit;
+  bool token_shut_down = false;
+  bool chained = false;
+  {
+    num_submitters_++;
+    SCOPED_CLEANUP({ num_submitters_--; });
+    if (PREDICT_FALSE(shut_down_)) {
+      return Status::ServiceUnavailable("The pool has been shut down.");
+    }
+
+    // Size limit check. Like in DoSubmit(), up to 'max_threads_' tasks may be
+    // running and 'max_queue_size_' queued.
+    length_at_submit = num_outstanding_++;
+    if (length_at_submit >= static_cast<int64_t>(max_threads_) + max_queue_size_) {
+      num_outstanding_--;
+      return Status::ServiceUnavailable(
+          Substitute("Thread pool is at capacity ($0 tasks running or queued, "
+                     "$1 threads, queue size $2)",
+                     length_at_submit, max_threads_, max_queue_size_));
+    }
+
+    Task task;
+    task.runnable = std::move(r);
+    task.trace = Trace::CurrentTrace();
+    // Need to AddRef, since the thread which submitted the task may go away,
+    // and we don't want the trace to be destructed while waiting in the queue.
+    if (task.trace) {
+      task.trace->AddRef();
+    }
+    task.submit_time = submit_time;
+
+    if (token == tokenless_.get()) {
+      // Tokenless tasks need no bookkeeping, and don't contend on the lock of
+      // the tokenless token.
+      PushWorkItem(ChooseWorkQueue(), { token, std::move(task) });
+    } else {
+      MutexLock l(*token->lock_);
+      if (PREDICT_FALSE(!token->MaySubmitNewTasks())) {
+        l.Unlock();
+        if (task.trace) {
+          task.trace->Release();
+        }
+        token_shut_down = true;
+      } else if (token->mode() == ExecutionMode::SERIAL && token->IsActive()) {
+        // Chain the task behind the token's task in flight. The worker which
+        // finishes that one queues this one.
+        token->entries_.emplace_back(std::move(task));
+        chained = true;
+      } else {
+        token->num_queued_in_pool_++;
+        if (token->state() == ThreadPoolToken::State::IDLE) {
+          token->Transition(ThreadPoolToken::State::RUNNING);
+        }
+        PushWorkItem(ChooseWorkQueue(), { token, std::move(task) });
+      }
+    }
+  }
+
+  if (PREDICT_FALSE(token_shut_down)) {
+    // Not while counted in 'num_submitters_': this may take 'lock_', which
+    // Shutdown() holds while waiting for submitters.
+    DecrementOutstandingTasks(1);
+    return Status::ServiceUnavailable("Thread pool token was shut down");
+  }
+  if (metrics_.queue_length_histogram) {
+    metrics_.queue_length_histogram->Increment(length_at_submit);
+  }
+  if (token->metrics_.queue_length_histogram) {
+    token->metrics_.queue_length_histogram->Increment(length_at_submit);
+  }
+  if (chained) {
+    // The task will be queued by the worker running the token's current one.
+    return Status::OK();
+  }
+
+  // Wake up an idle worker for the task, or start one if they're all busy.
+  if (WakeIdleThread() || num_threads_total_ >= max_threads_) {
+    return Status::OK();
+  }
+  return MaybeCreateWorkStealingThread();
+}
+
+int ThreadPool::ChooseWorkQueue() {
+  if (tls_work_stealing_pool == this) {
+    return tls_work_queue;
+  }
+  return next_submit_queue_.fetch_add(1, std::memory_order_relaxed) % work_queues_.size();
+}
+
+void ThreadPool::PushWorkItem(int idx, WorkItem item) {
+  {
+    std::lock_guard<simple_spinlock> l(work_queues_[idx]->lock);
+    work_queues_[idx]->items.emplace_back(std::move(item));
+  }
+  // Must come after queueing the item: see WorkStealingDispatchLoop().
+  num_queued_++;
+}
+
+bool ThreadPool::PopWorkItem(int idx, WorkItem* item) {
+  const int num_queues = work_queues_.size();
+  for (int i = 0; i < num_queues; i++) {
+    WorkQueue* q = work_queues_[(idx + i) % num_queues].get();
+    std::lock_guard<simple_spinlock> l(q->lock);
+    if (!q->items.empty()) {
+      *item = std::move(q->items.front());
+      q->items.pop_front();
+      num_queued_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+int ThreadPool::RemoveWorkItems(ThreadPoolToken* token, std::deque<Task>* tasks) {
+  int num_removed = 0;
+  for (auto& q : work_queues_) {
+    std::lock_guard<simple_spinlock> l(q->lock);
+    for (auto it = q->items.begin(); it != q->items.end();) {
+      if (it->token == token) {
+        tasks->emplace_back(std::move(it->task));
+        it = q->items.erase(it);
+        num_removed++;
+      } else {
+        it++;
+      }
+    }
+  }
+  num_queued_ -= num_removed;
+  return num_removed;
+}
+
+void ThreadPool::RunWorkItem(int idx, WorkItem* item) {
+  ThreadPoolToken* token = item->token;
+  bool run = true;
+  if (token == tokenless_.get()) {
+    run = !shut_down_;
+  } else {
+    MutexLock l(*token->lock_);
+    token->num_queued_in_pool_--;
+    if (token->state() == ThreadPoolToken::State::QUIESCING) {
+      // The token was shut down after the task was dequeued.
+      run = false;
+      if (token->active_threads_ == 0 && token->num_queued_in_pool_ == 0) {
+        token->Transition(ThreadPoolToken::State::QUIESCED);
+      }
+    } else {
+      DCHECK_EQ(ThreadPoolToken::State::RUNNING, token->state());
+      token->active_threads_++;
+    }
+  }
+
+  if (run) {
+    num_active_++;
+    RunTask(token, &item->task);
+    num_active_--;
+  } else {
+    if (item->task.trace) {
+      item->task.trace->Release();
+    }
+    item->task.runnable.reset();
+  }
+
+  if (run && token != tokenless_.get()) {
+    // Possible states:
+    // 1. The token was shut down while we ran its task. Transition to QUIESCED.
+    // 2. The token has no more tasks in flight. Transition back to IDLE.
+    // 3. The token is SERIAL and has more tasks chained. Queue the next one.
+    MutexLock l(*token->lock_);
+    ThreadPoolToken::State state = token->state();
+    DCHECK(state == ThreadPoolToken::State::RUNNING ||
+           state == ThreadPoolToken::State::QUIESCING);
+    token->active_threads_--;
+    if (state == ThreadPoolToken::State::RUNNING && !token->entries_.empty()) {
+      DCHECK_EQ(ExecutionMode::SERIAL, token->mode());
+      Task next = std::move(token->entries_.front());
+      token->entries_.pop_front();
+      token->num_queued_in_pool_++;
+      // This worker is free, so it'll run the task unless another steals it.
+      PushWorkItem(idx, { token, std::move(next) });
+    } else if (token->active_threads_ == 0 && token->num_queued_in_pool_ == 0) {
+      token->Transition(state == ThreadPoolToken::State::QUIESCING ?
+                        ThreadPoolToken::State::QUIESCED :
+                        ThreadPoolToken::State::IDLE);
+    }
+  }
+  DecrementOutstandingTasks(1);
+}
+
+bool ThreadPool::WakeIdleThread() {
+  // Pairs with the idle worker incrementing 'num_idle_' before checking
+  // 'num_queued_': either it sees the task, or this sees it idling.
+  if (num_idle_ == 0) {
+    return false;
+  }
+  MutexLock l(lock_);
+  if (idle_threads_.empty()) {
+    return false;
+  }
+  idle_threads_.front().not_empty.Signal();
+  idle_threads_.pop_front();
+  num_idle_--;
+  return true;
+}
+
+Status ThreadPool::MaybeCreateWorkStealingThread() {
+  {
+    MutexLock l(lock_);
+    // As in DoSubmit(), assume that each inactive thread grabs a task.
+    int inactive_threads = num_threads_ + num_threads_pending_start_ - num_active_;
+    if (!pool_status_.ok() ||
+        num_queued_ <= inactive_threads ||
+        num_threads_ + num_threads_pending_start_ >= max_threads_) {
+      return Status::OK();
+    }
+    num_threads_pending_start_++;
+    num_threads_total_++;
+  }
+  Status status = CreateThread();
+  if (!status.ok()) {
+    MutexLock l(lock_);
+    num_threads_pending_start_--;
+    num_threads_total_--;
+    if (num_threads_ + num_threads_pending_start_ == 0) {
+      // If we have no threads, we can't do any work.
+      return status;
+    }
+    LOG(ERROR) << "Thread pool failed to create thread: "
+               << status.ToString();
+  }
+  return Status::OK();
+}
+
+void ThreadPool::DecrementOutstandingTasks(int64_t n) {
+  // Pairs with Wait() incrementing 'num_waiters_' before checking
+  // 'num_outstanding_'.
+  if (n > 0 && num_outstanding_.fetch_sub(n) == n && num_waiters_ > 0) {
+    MutexLock l(lock_);
+    idle_cond_.Broadcast();
+  }
+}
+
+bool ThreadPool::IsIdleUnlocked() const {
+  if (work_stealing_) {
+    return num_outstanding_ == 0;
+  }
+  return total_queued_tasks_ == 0 && active_threads_ == 0;
+}
+
 void ThreadPool::Wait() {
   MutexLock unique_lock(lock_);
   CheckNotPoolThreadUnlocked();
-  while (total_queued_tasks_ > 0 || active_threads_ > 0) {
+  num_waiters_++;
+  SCOPED_CLEANUP({ num_waiters_--; });
+  while (!IsIdleUnlocked()) {
     idle_cond_.Wait();
   }
 }
@@ -583,7 +930,9 @@ void ThreadPool::Wait() {
 bool ThreadPool::WaitUntil(const MonoTime& until) {
   MutexLock unique_lock(lock_);
   CheckNotPoolThreadUnlocked();
-  while (total_queued_tasks_ > 0 || active_threads_ > 0) {
+  num_waiters_++;
+  SCOPED_CLEANUP({ num_waiters_--; });
+  while (!IsIdleUnlocked()) {
     if (!idle_cond_.WaitUntil(until)) {
       return false;
     }
@@ -605,6 +954,31 @@ void ThreadPool::DispatchThread() {
   // a "permanent" thread.
   bool permanent = num_threads_ <= min_threads_;
 
+  if (work_stealing_) {
+    WorkStealingDispatchLoop(&unique_lock, permanent);
+  } else {
+    DispatchLoop(&unique_lock, permanent);
+  }
+
+  // It's important that we hold the lock between exiting the loop and dropping
+  // num_threads_. Otherwise it's possible someone else could come along here
+  // and add a new task just as the last running thread is about to exit.
+  CHECK(unique_lock.OwnsLock());
+
+  CHECK_EQ(threads_.erase(Thread::current_thread()), 1);
+  num_threads_--;
+  num_threads_total_--;
+  if (num_threads_ + num_threads_pending_start_ == 0) {
+    no_threads_cond_.Broadcast();
+
+    // Sanity check: if we're the last thread exiting, the queue ought to be
+    // empty. Otherwise it will never get processed.
+    CHECK(queue_.empty());
+    DCHECK_EQ(0, total_queued_tasks_);
+  }
+}
+
+void ThreadPool::DispatchLoop(MutexLock* unique_lock, bool permanent) {
   // Owned by this worker thread and added/removed from idle_threads_ as needed.
   IdleThread me(&lock_);
 
@@ -659,52 +1033,10 @@ void ThreadPool::DispatchThread() {
     --total_queued_tasks_;
     ++active_threads_;
 
-    unique_lock.Unlock();
+    unique_lock->Unlock();
 
-    // Release the reference which was held by the queued item.
-    ADOPT_TRACE(task.trace);
-    if (task.trace) {
-      task.trace->Release();
-    }
-
-    // Update metrics
-    MonoTime now(MonoTime::Now());
-    int64_t queue_time_us = (now - task.submit_time).ToMicroseconds();
-    TRACE_COUNTER_INCREMENT(queue_time_trace_metric_name_, queue_time_us);
-    if (metrics_.queue_time_us_histogram) {
-      metrics_.queue_time_us_histogram->Increment(queue_time_us);
-    }
-    if (token->metrics_.queue_time_us_histogram) {
-      token->metrics_.queue_time_us_histogram->Increment(queue_time_us);
-    }
-
-    // Execute the task
-    {
-      MicrosecondsInt64 start_wall_us = GetMonoTimeMicros();
-      MicrosecondsInt64 start_cpu_us = GetThreadCpuTimeMicros();
-
-      task.runnable->Run();
-
-      int64_t wall_us = GetMonoTimeMicros() - start_wall_us;
-      int64_t cpu_us = GetThreadCpuTimeMicros() - start_cpu_us;
-
-      if (metrics_.run_time_us_histogram) {
-        metrics_.run_time_us_histogram->Increment(wall_us);
-      }
-      if (token->metrics_.run_time_us_histogram) {
-        token->metrics_.run_time_us_histogram->Increment(wall_us);
-      }
-      TRACE_COUNTER_INCREMENT(run_wall_time_trace_metric_name_, wall_us);
-      TRACE_COUNTER_INCREMENT(run_cpu_time_trace_metric_name_, cpu_us);
-    }
-    // Destruct the task while we do not hold the lock.
-    //
-    // The task's destructor may be expensive if it has a lot of bound
-    // objects, and we don't want to block submission of the threadpool.
-    // In the worst case, the destructor might even try to do something
-    // with this threadpool, and produce a deadlock.
-    task.runnable.reset();
-    unique_lock.Lock();
+    RunTask(token, &task);
+    unique_lock->Lock();
 
     // Possible states:
     // 1. The token was shut down while we ran its task. Transition to QUIESCED.
@@ -727,22 +1059,109 @@ void ThreadPool::DispatchThread() {
       idle_cond_.Broadcast();
     }
   }
+}
 
-  // It's important that we hold the lock between exiting the loop and dropping
-  // num_threads_. Otherwise it's possible someone else could come along here
-  // and add a new task just as the last running thread is about to exit.
-  CHECK(unique_lock.OwnsLock());
+void ThreadPool::WorkStealingDispatchLoop(MutexLock* unique_lock, bool permanent) {
+  const int idx = next_worker_queue_++ % work_queues_.size();
+  tls_work_stealing_pool = this;
+  tls_work_queue = idx;
+  SCOPED_CLEANUP({
+    tls_work_stealing_pool = nullptr;
+    tls_work_queue = -1;
+  });
 
-  CHECK_EQ(threads_.erase(Thread::current_thread()), 1);
-  num_threads_--;
-  if (num_threads_ + num_threads_pending_start_ == 0) {
-    no_threads_cond_.Broadcast();
+  // Owned by this worker thread and added/removed from idle_threads_ as needed.
+  IdleThread me(&lock_);
 
-    // Sanity check: if we're the last thread exiting, the queue ought to be
-    // empty. Otherwise it will never get processed.
-    CHECK(queue_.empty());
-    DCHECK_EQ(0, total_queued_tasks_);
+  while (true) {
+    if (!pool_status_.ok()) {
+      VLOG(2) << "DispatchThread exiting: " << pool_status_.ToString();
+      break;
+    }
+    unique_lock->Unlock();
+
+    // Run tasks for as long as there are any, without taking 'lock_'.
+    WorkItem item;
+    while (PopWorkItem(idx, &item)) {
+      RunWorkItem(idx, &item);
+    }
+
+    unique_lock->Lock();
+    if (!pool_status_.ok()) {
+      continue;
+    }
+
+    // Go idle, unless a task was queued meanwhile. Incrementing 'num_idle_'
+    // before checking 'num_queued_' pairs with submitters doing the reverse in
+    // PushWorkItem() and WakeIdleThread(): either this sees the task, or the
+    // submitter sees this thread idle and wakes it up, which it can only do
+    // once this thread waits and releases 'lock_'.
+    idle_threads_.push_front(me);
+    num_idle_++;
+    bool timed_out = false;
+    if (num_queued_ == 0) {
+      if (permanent) {
+        me.not_empty.Wait();
+      } else {
+        timed_out = !me.not_empty.WaitFor(idle_timeout_);
+      }
+    }
+    if (me.is_linked()) {
+      idle_threads_.erase(idle_threads_.iterator_to(me));
+      num_idle_--;
+    }
+    if (timed_out && num_queued_ == 0) {
+      VLOG(3) << "Releasing worker thread from pool " << name_ << " after "
+              << idle_timeout_.ToMilliseconds() << "ms of idle time.";
+      break;
+    }
+  }
+}
+
+void ThreadPool::RunTask(ThreadPoolToken* token, Task* task) {
+  // Release the reference which was held by the queued item.
+  ADOPT_TRACE(task->trace);
+  if (task->trace) {
+    task->trace->Release();
   }
+
+  // Update metrics
+  MonoTime now(MonoTime::Now());
+  int64_t queue_time_us = (now - task->submit_time).ToMicroseconds();
+  TRACE_COUNTER_INCREMENT(queue_time_trace_metric_name_, queue_time_us);
+  if (metrics_.queue_time_us_histogram) {
+    metrics_.queue_time_us_histogram->Increment(queue_time_us);
+  }
+  if (token->metrics_.queue_time_us_histogram) {
+    token->metrics_.queue_time_us_histogram->Increment(queue_time_us);
+  }
+
+  // Execute the task
+  {
+    MicrosecondsInt64 start_wall_us = GetMonoTimeMicros();
+    MicrosecondsInt64 start_cpu_us = GetThreadCpuTimeMicros();
+
+    task->runnable->Run();
+
+    int64_t wall_us = GetMonoTimeMicros() - start_wall_us;
+    int64_t cpu_us = GetThreadCpuTimeMicros() - start_cpu_us;
+
+    if (metrics_.run_time_us_histogram) {
+      metrics_.run_time_us_histogram->Increment(wall_us);
+    }
+    if (token->metrics_.run_time_us_histogram) {
+      token->metrics_.run_time_us_histogram->Increment(wall_us);
+    }
+    TRACE_COUNTER_INCREMENT(run_wall_time_trace_metric_name_, wall_us);
+    TRACE_COUNTER_INCREMENT(run_cpu_time_trace_metric_name_, cpu_us);
+  }
+  // Destruct the task while we do not hold the lock.
+  //
+  // The task's destructor may be expensive if it has a lot of bound
+  // objects, and we don't want to block submission of the threadpool.
+  // In the worst case, the destructor might even try to do something
+  // with this threadpool, and produce a deadlock.
+  task->runnable.reset();
 }
 
 Status ThreadPool::CreateThread() {
@@ -752,7 +1171,8 @@ Status ThreadPool::CreateThread() {
 
 void ThreadPool::CheckNotPoolThreadUnlocked() {
   Thread* current = Thread::current_thread();
-  if (ContainsKey(threads_, current)) {
+  // Tokens of work-stealing pools call this without 'lock_'.
+  if (work_stealing_ ? tls_work_stealing_pool == this : ContainsKey(threads_, current)) {
     LOG(FATAL) << Substitute("Thread belonging to thread pool '$0' with "
         "name '$1' called pool function that would result in deadlock",
         name_, current->name());
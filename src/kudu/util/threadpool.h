@@ -17,11 +17,14 @@
 #ifndef KUDU_UTIL_THREAD_POOL_H
 #define KUDU_UTIL_THREAD_POOL_H
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <iosfwd>
 #include <memory>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive/list_hook.hpp>
@@ -33,6 +36,7 @@
 #include "kudu/gutil/port.h"
 #include "kudu/gutil/ref_counted.h"
 #include "kudu/util/condition_variable.h"
+#include "kudu/util/locks.h"
 #include "kudu/util/metrics.h"
 #include "kudu/util/monotime.h"
 #include "kudu/util/mutex.h"
@@ -114,6 +118,12 @@ struct ThreadPoolMetrics {
 // metrics: Histograms, counters, etc. to update on various threadpool events.
 //    Default: not set.
 //
+// work_stealing: Whether tasks are queued on per-worker queues, which idle
+//    workers steal from, rather than on a single queue. Submitting and
+//    dispatching tasks then no longer goes through the pool-wide lock, which
+//    is taken only to park, wake up, start or stop workers. See ThreadPool.
+//    Default: false.
+//
 class ThreadPoolBuilder {
  public:
   explicit ThreadPoolBuilder(std::string name);
@@ -126,6 +136,7 @@ class ThreadPoolBuilder {
   ThreadPoolBuilder& set_max_queue_size(int max_queue_size);
   ThreadPoolBuilder& set_idle_timeout(const MonoDelta& idle_timeout);
   ThreadPoolBuilder& set_metrics(ThreadPoolMetrics metrics);
+  ThreadPoolBuilder& set_work_stealing(bool work_stealing);
 
   // Instantiate a new ThreadPool with the existing builder arguments.
   Status Build(gscoped_ptr<ThreadPool>* pool) const;
@@ -139,6 +150,7 @@ class ThreadPoolBuilder {
   int max_queue_size_;
   MonoDelta idle_timeout_;
   ThreadPoolMetrics metrics_;
+  bool work_stealing_;
 
   DISALLOW_COPY_AND_ASSIGN(ThreadPoolBuilder);
 };
@@ -164,6 +176,16 @@ class ThreadPoolBuilder {
 // from starving one another. However, tokenless (and CONCURRENT token-based)
 // tasks can starve SERIAL token-based tasks.
 //
+// In work-stealing mode, the pool keeps one FIFO of tasks per CPU (up to
+// max_threads), each with its own spinlock. Each worker owns one of them,
+// and steals from the others when its own runs dry. Tasks submitted from a
+// worker are queued on its FIFO; others are spread round-robin. Tokens are
+// tracked under their own lock rather than the pool's. A SERIAL token has at
+// most one task in the FIFOs at a time: the others are chained behind it, and
+// the worker which finishes a task queues the next one on its own FIFO.
+// Tasks are then only roughly FIFO across the pool, and SERIAL tokens no
+// longer take turns with each other.
+//
 // Usage Example:
 //    static void Func(int n) { ... }
 //    class Task : public Runnable { ... }
@@ -252,6 +274,18 @@ class ThreadPool {
     MonoTime submit_time;
   };
 
+  // A task queued in work-stealing mode, along with its token.
+  struct WorkItem {
+    ThreadPoolToken* token;
+    Task task;
+  };
+
+  // One of the per-worker FIFOs of work-stealing mode.
+  struct WorkQueue {
+    simple_spinlock lock;
+    std::deque<WorkItem> items;
+  };
+
   // Creates a new thread pool using a builder.
   explicit ThreadPool(const ThreadPoolBuilder& builder);
 
@@ -261,6 +295,16 @@ class ThreadPool {
   // Dispatcher responsible for dequeueing and executing the tasks
   void DispatchThread();
 
+  // Dequeues and executes tasks until the thread should exit. Called by
+  // DispatchThread() with 'lock_' held, and returns with it held.
+  void DispatchLoop(MutexLock* unique_lock, bool permanent);
+
+  // Like DispatchLoop(), but for work-stealing mode.
+  void WorkStealingDispatchLoop(MutexLock* unique_lock, bool permanent);
+
+  // Runs 'task' from 'token', updating the metrics.
+  void RunTask(ThreadPoolToken* token, Task* task);
+
   // Create new thread.
   //
   // REQUIRES: caller has incremented 'num_threads_pending_start_' ahead of this call.
@@ -268,11 +312,49 @@ class ThreadPool {
   Status CreateThread();
 
   // Aborts if the current thread is a member of this thread pool.
+  //
+  // In work-stealing mode, 'lock_' need not be held.
   void CheckNotPoolThreadUnlocked();
 
   // Submits a task to be run via token.
   Status DoSubmit(std::shared_ptr<Runnable> r, ThreadPoolToken* token);
 
+  // Like DoSubmit(), but for work-stealing mode.
+  Status DoSubmitWorkStealing(std::shared_ptr<Runnable> r, ThreadPoolToken* token);
+
+  // Returns the work queue that a task submitted from this thread goes to.
+  int ChooseWorkQueue();
+
+  // Queues 'item' on work queue 'idx'.
+  void PushWorkItem(int idx, WorkItem item);
+
+  // Dequeues an item, from work queue 'idx' if possible or else from another
+  // one. Returns false if all the queues are empty.
+  bool PopWorkItem(int idx, WorkItem* item);
+
+  // Removes all the items of 'token' from the work queues, appending their
+  // tasks to 'tasks'. Returns the number of items removed.
+  int RemoveWorkItems(ThreadPoolToken* token, std::deque<Task>* tasks);
+
+  // Runs (or drops, if its token was shut down) 'item', which was dequeued
+  // from work queue 'idx', and updates the token's state afterwards.
+  void RunWorkItem(int idx, WorkItem* item);
+
+  // Wakes up an idle worker, if there's one. Returns true if one was woken.
+  bool WakeIdleThread();
+
+  // Starts another worker if the queued tasks outnumber the idle workers.
+  Status MaybeCreateWorkStealingThread();
+
+  // Marks 'n' tasks as done, waking up Wait() if that's all of them. Must
+  // not be called with 'lock_' held.
+  void DecrementOutstandingTasks(int64_t n);
+
+  // Returns true if no tasks are queued or running.
+  //
+  // Must be called with 'lock_' held.
+  bool IsIdleUnlocked() const;
+
   // Releases token 't' and invalidates it.
   void ReleaseToken(ThreadPoolToken* t);
 
@@ -281,6 +363,7 @@ class ThreadPool {
   const int max_threads_;
   const int max_queue_size_;
   const MonoDelta idle_timeout_;
+  const bool work_stealing_;
 
   // Overall status of the pool. Set to an error when the pool is shut down.
   //
@@ -362,6 +445,44 @@ class ThreadPool {
   // ExecutionMode::CONCURRENT token used by the pool for tokenless submission.
   std::unique_ptr<ThreadPoolToken> tokenless_;
 
+  // Number of threads, including those starting. Mirrors 'num_threads_' and
+  // 'num_threads_pending_start_' for reading without 'lock_'.
+  std::atomic<int> num_threads_total_;
+
+  // The remaining members are only used in work-stealing mode.
+
+  // Per-worker FIFOs of tasks.
+  std::vector<std::unique_ptr<WorkQueue>> work_queues_;
+
+  // The work queue to give the next worker, and the next tasks submitted from
+  // outside the pool. The former is protected by 'lock_'.
+  int next_worker_queue_;
+  std::atomic<uint32_t> next_submit_queue_;
+
+  // Number of tasks in 'work_queues_'.
+  std::atomic<int64_t> num_queued_;
+
+  // Number of tasks submitted and not yet done, whether queued, chained
+  // behind another task of a SERIAL token, or running.
+  std::atomic<int64_t> num_outstanding_;
+
+  // Number of workers running tasks.
+  std::atomic<int> num_active_;
+
+  // Number of workers in 'idle_threads_'. Modified under 'lock_'.
+  std::atomic<int> num_idle_;
+
+  // Number of threads blocked in Wait() and WaitUntil().
+  std::atomic<int> num_waiters_;
+
+  // Number of DoSubmitWorkStealing() calls which may still queue a task.
+  // Shutdown() waits for them before emptying the queues.
+  std::atomic<int> num_submitters_;
+
+  // Set when the pool is shut down, for submitters which can't read
+  // 'pool_status_'.
+  std::atomic<bool> shut_down_;
+
   // Metrics for the entire thread pool.
   const ThreadPoolMetrics metrics_;
 
@@ -376,7 +497,7 @@ class ThreadPool {
 // thread pool. Tokens can only be created via ThreadPool::NewToken().
 //
 // All functions are thread-safe. Mutable members are protected via the
-// ThreadPool's lock.
+// ThreadPool's lock, or by the token's own lock in work-stealing mode.
 class ThreadPoolToken {
  public:
   // Destroys the token.
@@ -484,12 +605,23 @@ class ThreadPoolToken {
   // Pointer to the token's thread pool.
   ThreadPool* pool_;
 
+  // The lock protecting the token's state: the pool's lock, or 'own_lock_'
+  // in work-stealing mode. In the latter case, it must not be held while
+  // acquiring the pool's lock.
+  Mutex own_lock_;
+  Mutex* const lock_;
+
   // Token state machine.
   State state_;
 
-  // Queued client tasks.
+  // Queued client tasks. In work-stealing mode, the tasks of a SERIAL token
+  // chained behind the one in the pool's work queues or running.
   std::deque<ThreadPool::Task> entries_;
 
+  // Number of the token's tasks in the pool's work queues, or dequeued but
+  // not yet started. Only used in work-stealing mode.
+  int num_queued_in_pool_;
+
   // Condition variable for "token is idle". Waiters wake up when the token
   // transitions to IDLE or QUIESCED.
   ConditionVariable not_running_cond_;